@@ -5,10 +5,15 @@
 #include <stdexcept>
 
 #include <spii/auto_diff_term.h>
+#include <spii/batched_auto_diff_term.h>
+#include <spii/residual_term.h>
 #include <spii/solver.h>
+#include <spii/traced_term.h>
 using namespace spii;
 
 #include "hastighet.h"
+#include "snavely_reprojection_error.h"
+#include "snavely_reprojection_error_term.h"
 
 // Read a Bundle Adjustment in the Large dataset.
 class BALProblem {
@@ -95,131 +100,8 @@ private:
 	std::vector<double> original_parameters;
 };
 
-template<typename T> inline
-T dot_product(const T x[3], const T y[3]) {
-	return (x[0] * y[0] + x[1] * y[1] + x[2] * y[2]);
-}
-
-template<typename T> inline
-void cross_product(const T x[3], const T y[3], T x_cross_y[3]) {
-	x_cross_y[0] = x[1] * y[2] - x[2] * y[1];
-	x_cross_y[1] = x[2] * y[0] - x[0] * y[2];
-	x_cross_y[2] = x[0] * y[1] - x[1] * y[0];
-}
-
-//
-// Function from Ceres Solver.
-//
-template<typename T> inline
-void angle_axis_rotate_point(const T angle_axis[3], const T pt[3], T result[3]) {
-	T w[3];
-	T sintheta;
-	T costheta;
-
-	const T theta2 = dot_product(angle_axis, angle_axis);
-	if (theta2 > 0.0) {
-		// Away from zero, use the rodriguez formula
-		//
-		//   result = pt costheta +
-		//            (w x pt) * sintheta +
-		//            w (w . pt) (1 - costheta)
-		//
-		// We want to be careful to only evaluate the square root if the
-		// norm of the angle_axis vector is greater than zero. Otherwise
-		// we get a division by zero.
-		//
-		const T theta = sqrt(theta2);
-		w[0] = angle_axis[0] / theta;
-		w[1] = angle_axis[1] / theta;
-		w[2] = angle_axis[2] / theta;
-		costheta = cos(theta);
-		sintheta = sin(theta);
-		T w_cross_pt[3];
-		cross_product(w, pt, w_cross_pt);
-		T w_dot_pt = dot_product(w, pt);
-		for (int i = 0; i < 3; ++i) {
-			result[i] = pt[i] * costheta +
-			w_cross_pt[i] * sintheta +
-			w[i] * (T(1.0) - costheta) * w_dot_pt;
-		}
-	} else {
-		// Near zero, the first order Taylor approximation of the rotation
-		// matrix R corresponding to a vector w and angle w is
-		//
-		//   R = I + hat(w) * sin(theta)
-		//
-		// But sintheta ~ theta and theta * w = angle_axis, which gives us
-		//
-		//  R = I + hat(w)
-		//
-		// and actually performing multiplication with the point pt, gives us
-		// R * pt = pt + w x pt.
-		//
-		// Switching to the Taylor expansion at zero helps avoid all sorts
-		// of numerical nastiness.
-		T w_cross_pt[3];
-		cross_product(angle_axis, pt, w_cross_pt);
-		for (int i = 0; i < 3; ++i) {
-			result[i] = pt[i] + w_cross_pt[i];
-		}
-	}
-}
-
-//
-// Code from Ceres Solver.
-//
-// Templated pinhole camera model for used with Ceres.  The camera is
-// parameterized using 9 parameters: 3 for rotation, 3 for translation, 1 for
-// focal length and 2 for radial distortion. The principal point is not modeled
-// (i.e. it is assumed be located at the image center).
-class SnavelyReprojectionError {
-public:
-	SnavelyReprojectionError(double observed_x, double observed_y)
-	: observed_x(observed_x), observed_y(observed_y) {}
-
-	template <typename T>
-	T operator()(const T* const camera,
-	             const T* const point) const {
-		// camera[0,1,2] are the angle-axis rotation.
-		T p[3];
-		angle_axis_rotate_point(camera, point, p);
-
-		// camera[3,4,5] are the translation.
-		p[0] += camera[3];
-		p[1] += camera[4];
-		p[2] += camera[5];
-
-		// Compute the center of distortion. The sign change comes from
-		// the camera model that Noah Snavely's Bundler assumes, whereby
-		// the camera coordinate system has a negative z axis.
-		T xp = - p[0] / p[2];
-		T yp = - p[1] / p[2];
-
-		// Apply second and fourth order radial distortion.
-		const T& l1 = camera[7];
-		const T& l2 = camera[8];
-		T r2 = xp*xp + yp*yp;
-		T distortion = T(1.0) + r2  * (l1 + l2  * r2);
-
-		// Compute final projected point position.
-		const T& focal = camera[6];
-		T predicted_x = focal * distortion * xp;
-		T predicted_y = focal * distortion * yp;
-
-		// The error is the difference between the predicted and observed position.
-		T r0 = predicted_x - T(observed_x);
-		T r1 = predicted_y - T(observed_y);
-
-		return 0.5 * (r0*r0 + r1*r1);
-	}
-
-private:
-	double observed_x;
-	double observed_y;
-};
-
-
-template<typename SolverClass>
+template<typename SolverClass,
+         typename TermClass = AutoDiffTerm<SnavelyReprojectionError, 9, 3>>
 class BundleAdjustmentBenchmark :
 	public hastighet::Test
 {
@@ -245,7 +127,7 @@ public:
 				// dimensional residual. Internally, the cost function stores the observed
 				// image location and compares the reprojection against the observation.
 				auto term =
-					std::make_shared<AutoDiffTerm<SnavelyReprojectionError, 9, 3>>(
+					std::make_shared<TermClass>(
 							bal_problem.get_observations()[2 * i + 0],
 							bal_problem.get_observations()[2 * i + 1]);
 
@@ -275,6 +157,38 @@ BENCHMARK_F(BundleAdjustmentBenchmarkNewtonSolver, one_newton_iteration)
 	solver.solve(function, &results);
 }
 
+typedef BundleAdjustmentBenchmark<NewtonSolver, SnavelyReprojectionErrorTerm>
+	BundleAdjustmentBenchmarkNewtonSolverGenerated;
+BENCHMARK_F(BundleAdjustmentBenchmarkNewtonSolverGenerated, one_newton_iteration)
+{
+	bal_problem.reset_parameters();
+	solver.sparsity_mode = NewtonSolver::SPARSE;
+	solver.maximum_iterations = 1;
+	solver.solve(function, &results);
+}
+
+typedef BundleAdjustmentBenchmark<NewtonSolver, BatchedAutoDiffTerm<SnavelyReprojectionError, 9, 3>>
+	BundleAdjustmentBenchmarkNewtonSolverBatched;
+BENCHMARK_F(BundleAdjustmentBenchmarkNewtonSolverBatched, one_newton_iteration)
+{
+	bal_problem.reset_parameters();
+	solver.sparsity_mode = NewtonSolver::SPARSE;
+	solver.maximum_iterations = 1;
+	solver.solve(function, &results);
+}
+
+// The Gauss–Newton Hessian only needs the Jacobians of the residuals.
+typedef BundleAdjustmentBenchmark<LevenbergMarquardtSolver,
+                                  AutoDiffResidualTerm<SnavelyReprojectionResidual, 2, 9, 3>>
+	BundleAdjustmentBenchmarkLevenbergMarquardtSolver;
+BENCHMARK_F(BundleAdjustmentBenchmarkLevenbergMarquardtSolver, one_levenberg_marquardt_iteration)
+{
+	bal_problem.reset_parameters();
+	solver.sparsity_mode = LevenbergMarquardtSolver::SPARSE;
+	solver.maximum_iterations = 1;
+	solver.solve(function, &results);
+}
+
 typedef BundleAdjustmentBenchmark<LBFGSSolver> BundleAdjustmentBenchmarkLBFGSSolver;
 BENCHMARK_F(BundleAdjustmentBenchmarkLBFGSSolver, ten_lbfgs_iterations)
 {
@@ -283,6 +197,24 @@ BENCHMARK_F(BundleAdjustmentBenchmarkLBFGSSolver, ten_lbfgs_iterations)
 	solver.solve(function, &results);
 }
 
+typedef BundleAdjustmentBenchmark<LBFGSSolver, TracedTerm<SnavelyReprojectionError, 9, 3>>
+	BundleAdjustmentBenchmarkLBFGSSolverTraced;
+BENCHMARK_F(BundleAdjustmentBenchmarkLBFGSSolverTraced, ten_lbfgs_iterations)
+{
+	bal_problem.reset_parameters();
+	solver.maximum_iterations = 10;
+	solver.solve(function, &results);
+}
+
+typedef BundleAdjustmentBenchmark<LBFGSSolver, SnavelyReprojectionErrorTerm>
+	BundleAdjustmentBenchmarkLBFGSSolverGenerated;
+BENCHMARK_F(BundleAdjustmentBenchmarkLBFGSSolverGenerated, ten_lbfgs_iterations)
+{
+	bal_problem.reset_parameters();
+	solver.maximum_iterations = 10;
+	solver.solve(function, &results);
+}
+
 int main(int argc, char** argv)
 {
 	try
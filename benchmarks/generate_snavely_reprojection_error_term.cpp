@@ -0,0 +1,48 @@
+//
+// Generates the code of SnavelyReprojectionErrorTerm, which computes
+// the same term as AutoDiffTerm<SnavelyReprojectionError, 9, 3>.
+//
+//		generate_snavely_reprojection_error_term <output file>
+//
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <spii/code_generation.h>
+using namespace spii;
+
+#include "snavely_reprojection_error.h"
+
+int main(int argc, char** argv)
+{
+	if (argc != 2) {
+		std::cerr << "Usage: " << argv[0] << " <output file>\n";
+		return 1;
+	}
+
+	try {
+		// The camera has to be rotated, since angle_axis_rotate_point
+		// has a special case for no rotation.
+		double camera[9] = {0.1, -0.2, 0.3, 0, 0, -5, 500, 0, 0};
+		double point[3] = {0, 0, 1};
+		double x[12];
+		std::copy(camera, camera + 9, x);
+		std::copy(point, point + 3, x + 9);
+
+		std::ofstream out(argv[1]);
+		generate_term_code<9, 3>(out,
+		                         "SnavelyReprojectionErrorTerm",
+		                         SnavelyReprojectionError(0, 0),
+		                         x,
+		                         {"observed_x", "observed_y"});
+		if (!out) {
+			throw std::runtime_error("Could not write the output file.");
+		}
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << '\n';
+		return 1;
+	}
+}
@@ -0,0 +1,159 @@
+#ifndef SPII_BENCHMARK_SNAVELY_REPROJECTION_ERROR_H
+#define SPII_BENCHMARK_SNAVELY_REPROJECTION_ERROR_H
+// The reprojection error used in the bundle adjustment benchmark.
+// It is shared with generate_snavely_reprojection_error_term, which
+// generates the code of SnavelyReprojectionErrorTerm.
+
+#include <cmath>
+
+#include <spii/trace.h>
+
+template<typename T> inline
+T dot_product(const T x[3], const T y[3]) {
+	return (x[0] * y[0] + x[1] * y[1] + x[2] * y[2]);
+}
+
+template<typename T> inline
+void cross_product(const T x[3], const T y[3], T x_cross_y[3]) {
+	x_cross_y[0] = x[1] * y[2] - x[2] * y[1];
+	x_cross_y[1] = x[2] * y[0] - x[0] * y[2];
+	x_cross_y[2] = x[0] * y[1] - x[1] * y[0];
+}
+
+//
+// Function from Ceres Solver.
+//
+template<typename T> inline
+void angle_axis_rotate_point(const T angle_axis[3], const T pt[3], T result[3]) {
+	T w[3];
+	T sintheta;
+	T costheta;
+
+	const T theta2 = dot_product(angle_axis, angle_axis);
+	if (theta2 > 0.0) {
+		// Away from zero, use the rodriguez formula
+		//
+		//   result = pt costheta +
+		//            (w x pt) * sintheta +
+		//            w (w . pt) (1 - costheta)
+		//
+		// We want to be careful to only evaluate the square root if the
+		// norm of the angle_axis vector is greater than zero. Otherwise
+		// we get a division by zero.
+		//
+		const T theta = sqrt(theta2);
+		w[0] = angle_axis[0] / theta;
+		w[1] = angle_axis[1] / theta;
+		w[2] = angle_axis[2] / theta;
+		costheta = cos(theta);
+		sintheta = sin(theta);
+		T w_cross_pt[3];
+		cross_product(w, pt, w_cross_pt);
+		T w_dot_pt = dot_product(w, pt);
+		for (int i = 0; i < 3; ++i) {
+			result[i] = pt[i] * costheta +
+			w_cross_pt[i] * sintheta +
+			w[i] * (T(1.0) - costheta) * w_dot_pt;
+		}
+	} else {
+		// Near zero, the first order Taylor approximation of the rotation
+		// matrix R corresponding to a vector w and angle w is
+		//
+		//   R = I + hat(w) * sin(theta)
+		//
+		// But sintheta ~ theta and theta * w = angle_axis, which gives us
+		//
+		//  R = I + hat(w)
+		//
+		// and actually performing multiplication with the point pt, gives us
+		// R * pt = pt + w x pt.
+		//
+		// Switching to the Taylor expansion at zero helps avoid all sorts
+		// of numerical nastiness.
+		T w_cross_pt[3];
+		cross_product(angle_axis, pt, w_cross_pt);
+		for (int i = 0; i < 3; ++i) {
+			result[i] = pt[i] + w_cross_pt[i];
+		}
+	}
+}
+
+//
+// Code from Ceres Solver.
+//
+// Templated pinhole camera model for used with Ceres.  The camera is
+// parameterized using 9 parameters: 3 for rotation, 3 for translation, 1 for
+// focal length and 2 for radial distortion. The principal point is not modeled
+// (i.e. it is assumed be located at the image center).
+//
+// The two residuals are the differences between the predicted and
+// observed positions, for use with AutoDiffResidualTerm.
+class SnavelyReprojectionResidual {
+public:
+	SnavelyReprojectionResidual(double observed_x, double observed_y)
+	: observed_x(observed_x), observed_y(observed_y) {}
+
+	template <typename T>
+	void operator()(const T* const camera,
+	                const T* const point,
+	                T* residuals) const {
+		// camera[0,1,2] are the angle-axis rotation.
+		T p[3];
+		angle_axis_rotate_point(camera, point, p);
+
+		// camera[3,4,5] are the translation.
+		p[0] += camera[3];
+		p[1] += camera[4];
+		p[2] += camera[5];
+
+		// Compute the center of distortion. The sign change comes from
+		// the camera model that Noah Snavely's Bundler assumes, whereby
+		// the camera coordinate system has a negative z axis.
+		T xp = - p[0] / p[2];
+		T yp = - p[1] / p[2];
+
+		// Apply second and fourth order radial distortion.
+		const T& l1 = camera[7];
+		const T& l2 = camera[8];
+		T r2 = xp*xp + yp*yp;
+		T distortion = T(1.0) + r2  * (l1 + l2  * r2);
+
+		// Compute final projected point position.
+		const T& focal = camera[6];
+		T predicted_x = focal * distortion * xp;
+		T predicted_y = focal * distortion * yp;
+
+		// The error is the difference between the predicted and observed position.
+		residuals[0] = predicted_x - SPII_PARAMETER(T, observed_x);
+		residuals[1] = predicted_y - SPII_PARAMETER(T, observed_y);
+	}
+
+private:
+	double observed_x;
+	double observed_y;
+};
+
+// The squared reprojection error, 0.5 * ||r||^2, for use with
+// AutoDiffTerm.
+class SnavelyReprojectionError {
+public:
+	// The observations are read with SPII_PARAMETER, so terms can be
+	// evaluated in batches (see batched_auto_diff_term.h).
+	static const bool batchable = true;
+
+	SnavelyReprojectionError(double observed_x, double observed_y)
+	: residual(observed_x, observed_y) {}
+
+	template <typename T>
+	T operator()(const T* const camera,
+	             const T* const point) const {
+		T r[2];
+		residual(camera, point, r);
+		return 0.5 * (r[0]*r[0] + r[1]*r[1]);
+	}
+
+private:
+	SnavelyReprojectionResidual residual;
+};
+
+#endif
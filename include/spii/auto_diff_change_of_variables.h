@@ -2,12 +2,46 @@
 #ifndef SPII_AUTO_DIFF_CHANGE_OF_VARIABLES_H
 #define SPII_AUTO_DIFF_CHANGE_OF_VARIABLES_H
 
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 #include <spii-thirdparty/fadiff.h>
 
 #include <spii/change_of_variables.h>
 
 namespace spii {
 
+// has_jacobian<T>::value == true iff
+// "void T::jacobian(double*, const double*) const" exists.
+template<class T>
+static auto test_jacobian(int) -> decltype(std::declval<const T>().jacobian(std::declval<double*>(),
+                                                                             std::declval<const double*>()),
+                                           void());
+template<class>
+static char test_jacobian(long);
+template<class T>
+struct has_jacobian : std::is_void<decltype(test_jacobian<T>(0))>{};
+
+// Same thing, but for "void T::second_derivatives(double*, const double*) const".
+template<class T>
+static auto test_second_derivatives(int) -> decltype(std::declval<const T>().second_derivatives(std::declval<double*>(),
+                                                                                               std::declval<const double*>()),
+                                                     void());
+template<class>
+static char test_second_derivatives(long);
+template<class T>
+struct has_second_derivatives : std::is_void<decltype(test_second_derivatives<T>(0))>{};
+
+// Same thing, but for "void T::recenter(double*) const".
+template<class T>
+static auto test_recenter(int) -> decltype(std::declval<const T>().recenter(std::declval<double*>()),
+                                           void());
+template<class>
+static char test_recenter(long);
+template<class T>
+struct has_recenter : std::is_void<decltype(test_recenter<T>(0))>{};
+
 template<typename Change>
 class AutoDiffChangeOfVariables :
 	public ChangeOfVariables
@@ -82,8 +116,91 @@ public:
 		}
 	}
 
-	void update_hessian() const;
+	// Uses the jacobian member function of Change if it has one
+	// (e.g. the transformations in transformations.h), and otherwise
+	// differentiates t_to_x.
+	virtual void jacobian(double* dx_dt, const double* t) const
+	{
+		compute_jacobian(dx_dt, t, has_jacobian<Change>());
+	}
+
+	virtual void second_derivatives(double* d2x_dt2, const double* t) const
+	{
+		compute_second_derivatives(d2x_dt2, t, has_second_derivatives<Change>());
+	}
+
+	virtual bool recenter(double* t) const
+	{
+		return recenter(t, has_recenter<Change>());
+	}
+
 private:
+	void compute_jacobian(double* dx_dt, const double* t, std::true_type) const
+	{
+		change->jacobian(dx_dt, t);
+	}
+
+	void compute_jacobian(double* dx_dt, const double* t_input, std::false_type) const
+	{
+		int n_x = x_dimension();
+		int n_t = t_dimension();
+
+		std::vector<fadbad::F<double> > x(n_x);
+		std::vector<fadbad::F<double> > t(n_t);
+		for (int j = 0; j < n_t; ++j) {
+			t[j] = t_input[j];
+			t[j].diff(j, n_t);
+		}
+		change->t_to_x(&x[0], &t[0]);
+
+		for (int i = 0; i < n_x; ++i) {
+			for (int j = 0; j < n_t; ++j) {
+				dx_dt[i * n_t + j] = x[i].d(j);
+			}
+		}
+	}
+
+	void compute_second_derivatives(double* d2x_dt2, const double* t, std::true_type) const
+	{
+		change->second_derivatives(d2x_dt2, t);
+	}
+
+	void compute_second_derivatives(double* d2x_dt2, const double* t_input, std::false_type) const
+	{
+		int n_x = x_dimension();
+		int n_t = t_dimension();
+
+		// Nested forward mode; x[i].d(j).d(k) is the second
+		// derivative.
+		std::vector<fadbad::F<fadbad::F<double>> > x(n_x);
+		std::vector<fadbad::F<fadbad::F<double>> > t(n_t);
+		for (int j = 0; j < n_t; ++j) {
+			t[j] = t_input[j];
+			t[j].x().diff(j, n_t);
+			t[j].diff(j, n_t);
+		}
+		change->t_to_x(&x[0], &t[0]);
+
+		for (int i = 0; i < n_x; ++i) {
+			for (int j = 0; j < n_t; ++j) {
+				for (int k = 0; k < n_t; ++k) {
+					d2x_dt2[(i * n_t + j) * n_t + k] = x[i].d(j).d(k);
+				}
+			}
+		}
+	}
+
+	bool recenter(double* t, std::true_type) const
+	{
+		change->recenter(t);
+		return true;
+	}
+
+	bool recenter(double* t, std::false_type) const
+	{
+		return false;
+	}
+
 	Change* change;
 };
 
@@ -2,14 +2,19 @@
 #ifndef SPII_AUTO_DIFF_TERM_H
 #define SPII_AUTO_DIFF_TERM_H
 
+#include <atomic>
 #include <memory>
+#include <stdexcept>
 #include <type_traits>
 #include <typeinfo>
 #include <utility>
 
-#include <spii-thirdparty/badiff.h>
 #include <spii-thirdparty/fadiff.h>
 
+#include <spii/dual.h>
+#include <spii/hyper_dual.h>
+#include <spii/reverse.h>
+#include <spii/sparse_dual.h>
 #include <spii/term.h>
 
 namespace spii {
@@ -122,817 +127,88 @@ typename std::enable_if< ! has_write<Functor, std::ostream&>::value, void>::type
 {
 }
 
-template<typename Functor>
-typename std::enable_if<has_read<Functor, std::istream&>::value, void>::type 
-    call_read_if_exists(std::istream& in, Functor& functor)
-{
-	functor.read(in);
-}
-template<typename Functor>
-typename std::enable_if< ! has_read<Functor, std::istream&>::value, void>::type 
-    call_read_if_exists(std::istream& in, const Functor& functor)
-{
-}
- 
-
-
-// to_double(x) returns the real part of x, disregarding
-// any derivatives.
-inline double to_double(double x)
-{
-	return x;
-}
-inline float to_double(float x)
-{
-	return x;
-}
-template<typename R>
-inline double to_double(R& x)
-{
-	return to_double(x.x());
-}
-
-// Function differentiating a functor taking D variables.
-template<typename Functor, typename T, int D>
-T differentiate_functor(
-	const Functor& functor,
-	const T* x_in,
-	T* df)
-{
-	using namespace fadbad;
-
-	F<T, D> x[D];
-	for (int i=0; i<D; ++i) {
-		x[i] = x_in[i];
-		x[i].diff(i);
-	}
-	F<T, D> f(functor(x));
-
-	for (int i=0; i<D; ++i) {
-		df[i] = f.d(i);
-	}
-
-	return f.x();
-}
-
-//
-// 1-variable specialization
-//
-template<typename Functor, int D0>
-class AutoDiffTerm<Functor, D0> :
-	public SizedTerm<D0>
-{
-public:
-
-	template<typename... Args>
-	AutoDiffTerm(Args&&... args)
-		: functor(std::forward<Args>(args)...)
-	{
-	}
-
-	virtual void read(std::istream& in) override
-	{
-		call_read_if_exists(in, functor);
-	}
-
-	virtual void write(std::ostream& out) const override
-	{
-		call_write_if_exists(out, functor);
-	}
-
-	virtual double evaluate(double * const * const variables) const override
-	{
-		return functor(variables[0]);
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient) const override
-	{
-		using namespace fadbad;
-
-		F<double, D0> vars[D0];
-		for (int i = 0; i < D0; ++i) {
-			vars[i] = variables[0][i];
-			vars[i].diff(i);
-		}
-
-		F<double, D0> f(functor(vars));
-
-		for (int i = 0; i < D0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		return f.x();
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient,
-	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
-	{
-		using namespace fadbad;
-		#ifdef USE_BF_DIFFERENTIATION
-			typedef B< F<double, D0> > BF;
-
-			BF vars[D0];
-			for (int i = 0; i < D0; ++i) {
-				vars[i] = variables[0][i];
-				vars[i].x().diff(i);
-			}
-
-			BF f = (*functor)(vars);
-			f.diff(0, 1);
-
-			for (int i = 0; i < D0; ++i) {
-				(*gradient)[0](i) = vars[i].d(0).x();
-				for (int j = 0; j < D0; ++j) {
-					(*hessian)[0][0](i, j) = vars[i].d(0).d(j);
-				}
-			}
-
-			return f.x().x();
-		#else
-			F<double, D0> vars[D0];
-			for (int i = 0; i < D0; ++i) {
-				vars[i] = variables[0][i];
-				vars[i].diff(i);
-			}
-
-			F<double, D0> df[D0];
-
-			F<double, D0> f(
-				differentiate_functor<Functor, F<double, D0>, D0>(
-					functor,
-					vars,
-					df)
-				);
-
-			for (int i = 0; i < D0; ++i) {
-				(*gradient)[0](i) = df[i].x();
-				for (int j = 0; j < D0; ++j) {
-					(*hessian)[0][0](i, j) = df[i].d(j);
-				}
-			}
-
-			return f.x();
-		#endif
-	}
-
-protected:
-	Functor functor;
-};
-
-
-template<typename Functor, int D0, int D1>
-class Functor2_to_1
-{
-public:
-	Functor2_to_1(const Functor& functor_in)
-		: functor(functor_in)
-	{
-	}
-
-	template<typename R>
-	R operator()(const R* const x) const
-	{
-		const R* const x0 = &x[0];
-		const R* const x1 = &x[D0];
-		return functor(x0, x1);
-	}
-
-private:
-	const Functor& functor;
-};
-
-//
-// 2-variable specialization
-//
-template<typename Functor, int D0, int D1>
-class AutoDiffTerm<Functor, D0, D1> :
-	public SizedTerm<D0, D1>
-{
-public:
-
-	template<typename... Args>
-	AutoDiffTerm(Args&&... args)
-		: functor(std::forward<Args>(args)...)
-	{
-	}
-
-	virtual void read(std::istream& in)
-	{
-		call_read_if_exists(in, functor);
-	}
-
-	virtual void write(std::ostream& out) const
-	{
-		call_write_if_exists(out, functor);
-	}
-
-	virtual double evaluate(double * const * const variables) const override
-	{
-		return functor(variables[0], variables[1]);
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient) const override
-	{
-		using namespace fadbad;
-
-		F<double, D0 + D1> vars0[D0];
-		for (int i = 0; i < D0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].diff(i);
-		}
-
-		F<double, D0 + D1> vars1[D1];
-		int offset1 = D0;
-		for (int i = 0; i < D1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].diff(i + offset1);
-		}
-
-		F<double, D0 + D1> f(functor(vars0, vars1));
-
-		for (int i = 0; i < D0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		for (int i = 0; i < D1; ++i) {
-			(*gradient)[1](i) = f.d(i + offset1);
-		}
-
-		return f.x();
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient,
-	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
-	{
-		using namespace fadbad;
-		#ifdef USE_BF_DIFFERENTIATION
-			typedef B< F<double, D0 + D1> > BF;
-
-			BF vars0[D0];
-			for (int i = 0; i < D0; ++i) {
-				vars0[i] = variables[0][i];
-				vars0[i].x().diff(i);
-			}
-
-			BF vars1[D1];
-			int offset1 = D0;
-			for (int i = 0; i < D1; ++i) {
-				vars1[i] = variables[1][i];
-				vars1[i].x().diff(offset1 + i);
-			}
-
-			BF f = (*functor)(vars0, vars1);
-			f.diff(0, 1);
-
-			for (int i = 0; i < D0; ++i) {
-				(*gradient)[0](i) = vars0[i].d(0).x();
-
-				// D0 and D0
-				for (int j = 0; j < D0; ++j) {
-					(*hessian)[0][0](i, j) = vars0[i].d(0).d(j);
-				}
-
-				// D0 and D1
-				for (int j = 0; j < D1; ++j) {
-					(*hessian)[0][1](i, j) = vars0[i].d(0).d(offset1 + j);
-				}
-			}
-
-			for (int i = 0; i < D1; ++i) {
-				(*gradient)[1](i) = vars1[i].d(0).x();
-
-				// D1 and D0
-				for (int j = 0; j < D0; ++j) {
-					(*hessian)[1][0](i, j) = vars1[i].d(0).d(j);
-				}
-
-				// D1 and D1
-				for (int j = 0; j < D1; ++j) {
-					(*hessian)[1][1](i, j) = vars1[i].d(0).d(offset1 + j);
-				}
-			}
-
-			return f.x().x();
-		#else
-			F<double, D0 + D1> vars[D0 + D1];
-			F<double, D0 + D1>   df[D0 + D1];
-
-			// Initialize variables
-			for (int i = 0; i < D0; ++i) {
-				vars[i] = variables[0][i];
-				vars[i].diff(i);
-			}
-			int offset1 = D0;
-			for (int i = 0; i < D1; ++i) {
-				vars[offset1 + i] = variables[1][i];
-				vars[offset1 + i].diff(offset1 + i);
-			}
-
-			// Evaluate function
-			typedef Functor2_to_1<Functor, D0, D1> Functor21;
-			Functor21 functor21(functor);
-			F<double, D0 + D1> f(
-				differentiate_functor<Functor21, F<double, D0 + D1>, D0 + D1>(
-					functor21,
-					vars,
-					df)
-				);
-
-			for (int i = 0; i < D0; ++i) {
-				(*gradient)[0](i) = df[i].x();
-
-				// D0 and D0
-				for (int j = 0; j < D0; ++j) {
-					(*hessian)[0][0](i, j) = df[i].d(j);
-				}
-
-				// D0 and D1
-				for (int j = 0; j < D1; ++j) {
-					(*hessian)[0][1](i, j) = df[i].d(offset1 + j);
-				}
-			}
-
-			for (int i = 0; i < D1; ++i) {
-				(*gradient)[1](i) = df[i + offset1].x();;
-
-				// D1 and D0
-				for (int j = 0; j < D0; ++j) {
-					(*hessian)[1][0](i, j) = df[i + offset1].d(j);;
-				}
-
-				// D1 and D1
-				for (int j = 0; j < D1; ++j) {
-					(*hessian)[1][1](i, j) = df[i + offset1].d(j + offset1);
-				}
-			}
-
-			return f.x();
-		#endif
-	}
-
-protected:
-	Functor functor;
-};
-
-
-
-template<typename Functor, int D0, int D1, int D2>
-class Functor3_to_1
-{
-public:
-	Functor3_to_1(const Functor& functor_in)
-		: functor(functor_in)
-	{
-	}
-
-	template<typename R>
-	R operator()(const R* const x) const
-	{
-		const R* const x0 = &x[0];
-		const R* const x1 = &x[D0];
-		const R* const x2 = &x[D0 + D1];
-		return functor(x0, x1, x2);
-	}
-
-private:
-	const Functor& functor;
-};
-
-//
-// 3-variable specialization
-//
-template<typename Functor, int D0, int D1, int D2>
-class AutoDiffTerm<Functor, D0, D1, D2> :
-	public SizedTerm<D0, D1, D2>
-{
-public:
-
-	template<typename... Args>
-	AutoDiffTerm(Args&&... args)
-		: functor(std::forward<Args>(args)...)
-	{
-	}
-
-	virtual void read(std::istream& in) override
-	{
-		call_read_if_exists(in, this->functor);
-	}
-
-	virtual void write(std::ostream& out) const override
-	{
-		call_write_if_exists(out, this->functor);
-	}
-
-	virtual double evaluate(double * const * const variables) const override
-	{
-		return functor(variables[0], variables[1], variables[2]);
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient) const override
-	{
-		using namespace fadbad;
-		typedef F<double, D0 + D1 + D2> Dual;
-
-		Dual vars0[D0];
-		for (int i = 0; i < D0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].diff(i);
-		}
-
-		Dual vars1[D1];
-		int offset1 = D0;
-		for (int i = 0; i < D1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].diff(i + offset1);
-		}
-
-		Dual vars2[D2];
-		int offset2 = D0 + D1;
-		for (int i = 0; i < D2; ++i) {
-			vars2[i] = variables[2][i];
-			vars2[i].diff(i + offset2);
-		}
-
-		Dual f(functor(vars0, vars1, vars2));
-
-		for (int i = 0; i < D0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		for (int i = 0; i < D1; ++i) {
-			(*gradient)[1](i) = f.d(i + offset1);
-		}
-
-		for (int i = 0; i < D2; ++i) {
-			(*gradient)[2](i) = f.d(i + offset2);
-		}
-
-		return f.x();
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient,
-	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
-	{
-		using namespace fadbad;
-		typedef F<double, D0 + D1 + D2> Dual;
-
-		Dual vars[D0 + D1 + D2];
-		Dual   df[D0 + D1 + D2];
-
-		// Initialize variables
-		for (int i = 0; i < D0; ++i) {
-			vars[i] = variables[0][i];
-			vars[i].diff(i);
-		}
-		int offset1 = D0;
-		for (int i = 0; i < D1; ++i) {
-			vars[offset1 + i] = variables[1][i];
-			vars[offset1 + i].diff(offset1 + i);
-		}
-		int offset2 = D0 + D1;
-		for (int i = 0; i < D2; ++i) {
-			vars[offset2 + i] = variables[2][i];
-			vars[offset2 + i].diff(offset2 + i);
-		}
-
-		// Evaluate function
-		typedef Functor3_to_1<Functor, D0, D1, D2> Functor31;
-		Functor31 functor31(functor);
-		F<double, D0 + D1 + D2> f(
-			differentiate_functor<Functor31, F<double, D0 + D1 + D2>, D0 + D1 + D2>(
-				functor31,
-				vars,
-				df)
-			);
-
-		for (int i = 0; i < D0; ++i) {
-			(*gradient)[0](i) = df[i].x();
-
-			// D0 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[0][0](i, j) = df[i].d(j);
-			}
-
-			// D0 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[0][1](i, j) = df[i].d(offset1 + j);
-			}
-
-			// D0 and D2
-			for (int j = 0; j < D2; ++j) {
-				(*hessian)[0][2](i, j) = df[i].d(offset2 + j);
-			}
-		}
-
-		for (int i = 0; i < D1; ++i) {
-			(*gradient)[1](i) = df[i + offset1].x();;
-
-			// D1 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[1][0](i, j) = df[i + offset1].d(j);;
-			}
-
-			// D1 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[1][1](i, j) = df[i + offset1].d(j + offset1);
-			}
-
-			// D1 and D2
-			for (int j = 0; j < D2; ++j) {
-				(*hessian)[1][2](i, j) = df[i + offset1].d(j + offset2);
-			}
-		}
-
-		for (int i = 0; i < D2; ++i) {
-			(*gradient)[2](i) = df[i + offset2].x();;
-
-			// D2 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[2][0](i, j) = df[i + offset2].d(j);
-			}
-
-			// D2 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[2][1](i, j) = df[i + offset2].d(j + offset1);
-			}
-
-			// D2 and D2
-			for (int j = 0; j < D2; ++j) {
-				(*hessian)[2][2](i, j) = df[i + offset2].d(j + offset2);
-			}
-		}
-
-		return f.x();
-	}
-
-protected:
-	Functor functor;
-};
-
-//
-// 4-variable specialization
-//
-template<typename Functor, int D0, int D1, int D2, int D3>
-class Functor4_to_1
-{
-public:
-	Functor4_to_1(const Functor& functor_in)
-		: functor(functor_in)
-	{
-	}
-
-	template<typename R>
-	R operator()(const R* const x) const
-	{
-		const R* const x0 = &x[0];
-		const R* const x1 = &x[D0];
-		const R* const x2 = &x[D0 + D1];
-		const R* const x3 = &x[D0 + D1 + D2];
-
-		return functor(x0, x1, x2, x3);
-	}
-
-private:
-	const Functor& functor;
-};
-
-template<typename Functor, int D0, int D1, int D2, int D3>
-class AutoDiffTerm<Functor, D0, D1, D2, D3> :
-	public SizedTerm<D0, D1, D2, D3>
-{
-public:
-
-	template<typename... Args>
-	AutoDiffTerm(Args&&... args)
-		: functor(std::forward<Args>(args)...)
-	{
-	}
-
-	virtual void read(std::istream& in) override
-	{
-		call_read_if_exists(in, this->functor);
-	}
-
-	virtual void write(std::ostream& out) const override
-	{
-		call_write_if_exists(out, this->functor);
-	}
-
-	virtual double evaluate(double * const * const variables) const override
-	{
-		return functor(variables[0], variables[1], variables[2], variables[3]);
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient) const override
-	{
-		using namespace fadbad;
-		typedef F<double, D0 + D1 + D2 + D3> Dual;
-
-		Dual vars0[D0];
-		for (int i = 0; i < D0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].diff(i);
-		}
-
-		Dual vars1[D1];
-		int offset1 = D0;
-		for (int i = 0; i < D1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].diff(i + offset1);
-		}
-
-		Dual vars2[D2];
-		int offset2 = D0 + D1;
-		for (int i = 0; i < D2; ++i) {
-			vars2[i] = variables[2][i];
-			vars2[i].diff(i + offset2);
-		}
-
-		Dual vars3[D3];
-		int offset3 = D0 + D1 + D2;
-		for (int i = 0; i < D3; ++i) {
-			vars3[i] = variables[3][i];
-			vars3[i].diff(i + offset3);
-		}
-
-		Dual f(functor(vars0, vars1, vars2, vars3));
-
-		for (int i = 0; i < D0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		for (int i = 0; i < D1; ++i) {
-			(*gradient)[1](i) = f.d(i + offset1);
-		}
-
-		for (int i = 0; i < D2; ++i) {
-			(*gradient)[2](i) = f.d(i + offset2);
-		}
-
-		for (int i = 0; i < D3; ++i) {
-			(*gradient)[3](i) = f.d(i + offset3);
-		}
-
-		return f.x();
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient,
-	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
-	{
-		using namespace fadbad;
-		typedef F<double, D0 + D1 + D2 + D3> Dual;
-
-		Dual vars[D0 + D1 + D2 + D3];
-		Dual   df[D0 + D1 + D2 + D3];
-
-		// Initialize variables
-		for (int i = 0; i < D0; ++i) {
-			vars[i] = variables[0][i];
-			vars[i].diff(i);
-		}
-		int offset1 = D0;
-		for (int i = 0; i < D1; ++i) {
-			vars[offset1 + i] = variables[1][i];
-			vars[offset1 + i].diff(offset1 + i);
-		}
-		int offset2 = D0 + D1;
-		for (int i = 0; i < D2; ++i) {
-			vars[offset2 + i] = variables[2][i];
-			vars[offset2 + i].diff(offset2 + i);
-		}
-		int offset3 = D0 + D1 + D2;
-		for (int i = 0; i < D3; ++i) {
-			vars[offset3 + i] = variables[3][i];
-			vars[offset3 + i].diff(offset3 + i);
-		}
-
-		// Evaluate function
-		typedef Functor4_to_1<Functor, D0, D1, D2, D3> Functor41;
-		Functor41 functor41(functor);
-		F<double, D0 + D1 + D2 + D3> f(
-			differentiate_functor<Functor41, F<double, D0 + D1 + D2 + D3>, D0 + D1 + D2 + D3>(
-				functor41,
-				vars,
-				df)
-			);
-
-		for (int i = 0; i < D0; ++i) {
-			(*gradient)[0](i) = df[i].x();
-
-			// D0 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[0][0](i, j) = df[i].d(j);
-			}
-
-			// D0 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[0][1](i, j) = df[i].d(offset1 + j);
-			}
-
-			// D0 and D2
-			for (int j = 0; j < D2; ++j) {
-				(*hessian)[0][2](i, j) = df[i].d(offset2 + j);
-			}
-
-			// D0 and D2
-			for (int j = 0; j < D3; ++j) {
-				(*hessian)[0][3](i, j) = df[i].d(offset3 + j);
-			}
-		}
-
-		for (int i = 0; i < D1; ++i) {
-			(*gradient)[1](i) = df[i + offset1].x();;
-
-			// D1 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[1][0](i, j) = df[i + offset1].d(j);;
-			}
-
-			// D1 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[1][1](i, j) = df[i + offset1].d(j + offset1);
-			}
-
-			// D1 and D2
-			for (int j = 0; j < D2; ++j) {
-				(*hessian)[1][2](i, j) = df[i + offset1].d(j + offset2);
-			}
-
-			// D1 and D3
-			for (int j = 0; j < D3; ++j) {
-				(*hessian)[1][3](i, j) = df[i + offset1].d(j + offset3);
-			}
-		}
-
-		for (int i = 0; i < D2; ++i) {
-			(*gradient)[2](i) = df[i + offset2].x();;
-
-			// D2 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[2][0](i, j) = df[i + offset2].d(j);
-			}
-
-			// D2 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[2][1](i, j) = df[i + offset2].d(j + offset1);
-			}
-
-			// D2 and D2
-			for (int j = 0; j < D2; ++j) {
-				(*hessian)[2][2](i, j) = df[i + offset2].d(j + offset2);
-			}
-
-			// D2 and D3
-			for (int j = 0; j < D3; ++j) {
-				(*hessian)[2][3](i, j) = df[i + offset2].d(j + offset3);
-			}
-		}
-
-		for (int i = 0; i < D3; ++i) {
-			(*gradient)[3](i) = df[i + offset3].x();;
+//
+// Functors are only evaluated in single precision if they declare
+//
+//		static const bool single_precision = true;
+//
+// Functors written for double do not always compile with float, e.g.
+// if they call std::max(x[0], 1.0), so the single-precision code is
+// only instantiated for functors that ask for it.
+//
+// supports_single_precision<T>::value == true iff T::single_precision
+// is true.
+//
+template<class T, class = void>
+struct supports_single_precision : std::false_type {};
+template<class T>
+struct supports_single_precision<T, decltype(void(T::single_precision))>
+	: std::integral_constant<bool, T::single_precision> {};
+// Test supports_single_precision.
+struct SupportsSinglePrecisionTest1{ static const bool single_precision = true; };
+struct SupportsSinglePrecisionTest2{ static const bool single_precision = false; };
+struct SupportsSinglePrecisionTest3{};
+static_assert(supports_single_precision<SupportsSinglePrecisionTest1>::value == true,
+              "SupportsSinglePrecisionTest1 failed.");
+static_assert(supports_single_precision<SupportsSinglePrecisionTest2>::value == false,
+              "SupportsSinglePrecisionTest2 failed.");
+static_assert(supports_single_precision<SupportsSinglePrecisionTest3>::value == false,
+              "SupportsSinglePrecisionTest3 failed.");
 
-			// D3 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[3][0](i, j) = df[i + offset3].d(j);
-			}
+template<typename Functor>
+typename std::enable_if<has_read<Functor, std::istream&>::value, void>::type 
+    call_read_if_exists(std::istream& in, Functor& functor)
+{
+	functor.read(in);
+}
+template<typename Functor>
+typename std::enable_if< ! has_read<Functor, std::istream&>::value, void>::type 
+    call_read_if_exists(std::istream& in, const Functor& functor)
+{
+}
+ 
 
-			// D3 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[3][1](i, j) = df[i + offset3].d(j + offset1);
-			}
 
-			// D3 and D2
-			for (int j = 0; j < D2; ++j) {
-				(*hessian)[3][2](i, j) = df[i + offset3].d(j + offset2);
-			}
+// to_double(x) returns the real part of x, disregarding
+// any derivatives.
+inline double to_double(double x)
+{
+	return x;
+}
+inline float to_double(float x)
+{
+	return x;
+}
+template<typename R>
+inline double to_double(R& x)
+{
+	return to_double(x.x());
+}
 
-			// D3 and D3
-			for (int j = 0; j < D3; ++j) {
-				(*hessian)[3][3](i, j) = df[i + offset3].d(j + offset3);
-			}
-		}
+// Function differentiating a functor taking D variables.
+template<typename Functor, typename T, int D>
+T differentiate_functor(
+	const Functor& functor,
+	const T* x_in,
+	T* df)
+{
+	using namespace fadbad;
 
-		return f.x();
+	F<T, D> x[D];
+	for (int i=0; i<D; ++i) {
+		x[i] = x_in[i];
+		x[i].diff(i);
 	}
+	F<T, D> f(functor(x));
 
-protected:
-	Functor functor;
-};
-
+	for (int i=0; i<D; ++i) {
+		df[i] = f.d(i);
+	}
 
-//
-// General (N variable) version.
-//
+	return f.x();
+}
 
-// Takes a double** variables and calls
+// Takes a double** (or float**) variables and calls
 //
 //   functor(variables[0], variables[1], ..., variables[N])
 //
@@ -942,9 +218,9 @@ struct DoubleFunctorCaller;
 template <typename Functor, int D0, int... DN>
 struct DoubleFunctorCaller<Functor, D0, DN...>
 {
-	template <typename... T>
+	template <typename Scalar, typename... T>
 	double call(const Functor& functor,
-	            double * const * const variables,
+	            Scalar * const * const variables,
 				T... previous_arguments)
 	{
 		DoubleFunctorCaller<Functor, DN...> next_caller;
@@ -955,9 +231,9 @@ struct DoubleFunctorCaller<Functor, D0, DN...>
 template <typename Functor>
 struct DoubleFunctorCaller<Functor>
 {
-	template <typename... T>
+	template <typename Scalar, typename... T>
 	double call(const Functor& functor,
-	            double * const * const variables,
+	            Scalar * const * const variables,
 	            T... arguments)
 	{
 		return functor(arguments...);
@@ -993,22 +269,22 @@ struct DualFunctorCaller;
 template <typename Functor, typename R, int D0, int... DN>
 struct DualFunctorCaller<Functor, R, D0, DN...>
 {
+	template <typename Scalar>
 	R call(const Functor& functor,
-	       double * const * const variables)
+	       Scalar * const * const variables)
 	{
 		return call_internal(functor, variables, 0);
 	}
 
-	template <typename... T>
+	template <typename Scalar, typename... T>
 	R call_internal(const Functor& functor,
-	                double * const * const variables,
+	                Scalar * const * const variables,
 		            int offset,
 	                T&... previous_arguments)
 	{
 		R x[D0];
 		for (int i = 0; i < D0; ++i) {
-			x[i] = (*variables)[i];
-			x[i].diff(i + offset);
+			x[i] = R((*variables)[i], i + offset);
 		}
 
 		DualFunctorCaller<Functor, R, DN...> next_caller;
@@ -1019,9 +295,9 @@ struct DualFunctorCaller<Functor, R, D0, DN...>
 template <typename Functor, typename R>
 struct DualFunctorCaller<Functor, R>
 {
-	template <typename... T>
+	template <typename Scalar, typename... T>
 	R call_internal(const Functor& functor,
-	                double * const * const variables,
+	                Scalar * const * const variables,
 		            int offset,
 	                T&... arguments)
 	{
@@ -1038,8 +314,9 @@ struct DualGradientExtractor;
 template <typename R, int D0, int... DN>
 struct DualGradientExtractor<R, D0, DN...>
 {
+	template <typename Vector>
 	void extract(R& dual,
-	             Eigen::VectorXd* gradient,
+	             Vector* gradient,
 				 int offset = 0)
 	{
 		for (int i = 0; i < D0; ++i) {
@@ -1054,15 +331,391 @@ struct DualGradientExtractor<R, D0, DN...>
 template <typename R>
 struct DualGradientExtractor<R>
 {
+	template <typename Vector>
 	void extract(R& dual,
-	             Eigen::VectorXd* gradient,
+	             Vector* gradient,
 	             int offset)
 	{
 		// We are done.
 	}
 };
 
+// Terms with more variables than this compute their gradients in
+// reverse mode. Forward mode costs O(number of variables) times an
+// evaluation of the function, while reverse mode costs a constant
+// times an evaluation but records every operation on a tape.
+static const int reverse_mode_dimension = 32;
+
+// Evaluates a functor and its gradient with forward-mode dual
+// numbers.
+template<typename Functor, int... D, typename Scalar>
+double evaluate_functor_gradient(const Functor& functor,
+                                 Scalar * const * const variables,
+                                 std::vector<Eigen::Matrix<Scalar, Eigen::Dynamic, 1>>* gradient,
+                                 std::false_type use_reverse_mode)
+{
+	typedef Dual<Scalar, IntSum<D...>::value> DualType;
+	DualFunctorCaller<Functor, DualType, D...> caller;
+	auto f = caller.call(functor, variables);
+
+	DualGradientExtractor<DualType, D...> extractor;
+	extractor.extract(f, &((*gradient)[0]));
+
+	return f.x();
+}
+
+// Evaluates a functor and its gradient in reverse mode.
+template<typename Functor, int... D, typename Scalar>
+double evaluate_functor_gradient(const Functor& functor,
+                                 Scalar * const * const variables,
+                                 std::vector<Eigen::Matrix<Scalar, Eigen::Dynamic, 1>>* gradient,
+                                 std::true_type use_reverse_mode)
+{
+	ReverseTapeScope<Scalar> scope;
+	// The variables are the first nodes recorded on the tape.
+	DualFunctorCaller<Functor, Reverse<Scalar>, D...> caller;
+	auto f = caller.call(functor, variables);
+	const auto& adjoints = scope.tape.sweep(scope.begin, f.tape_index());
+
+	const int dimensions[] = {D...};
+	int offset = 0;
+	for (int var = 0; var < int(sizeof...(D)); ++var) {
+		for (int i = 0; i < dimensions[var]; ++i) {
+			(*gradient)[var](i) = adjoints[offset + i];
+		}
+		offset += dimensions[var];
+	}
+
+	return f.x();
+}
+
+// Evaluates a functor and its gradient, in double or single
+// precision.
+template<typename Functor, int... D, typename Scalar>
+double evaluate_functor_gradient(const Functor& functor,
+                                 Scalar * const * const variables,
+                                 std::vector<Eigen::Matrix<Scalar, Eigen::Dynamic, 1>>* gradient)
+{
+	typedef std::integral_constant<bool, (IntSum<D...>::value > reverse_mode_dimension)> UseReverseMode;
+	return evaluate_functor_gradient<Functor, D...>(functor, variables, gradient, UseReverseMode());
+}
+
+// Evaluates a functor and, if gradient is not null, its gradient in
+// single precision.
+template<typename Functor, int... D>
+double evaluate_functor_float(const Functor& functor,
+                              float * const * const variables,
+                              std::vector<Eigen::VectorXf>* gradient,
+                              std::true_type supports_single_precision)
+{
+	if (gradient) {
+		return evaluate_functor_gradient<Functor, D...>(functor, variables, gradient);
+	}
+	DoubleFunctorCaller<Functor, D...> caller;
+	return caller.call(functor, variables);
+}
+
+// Functors without single-precision support are never called with
+// float.
+template<typename Functor, int... D>
+double evaluate_functor_float(const Functor& functor,
+                              float * const * const variables,
+                              std::vector<Eigen::VectorXf>* gradient,
+                              std::false_type supports_single_precision)
+{
+	throw std::runtime_error("evaluate_float: The functor does not support single precision.");
+}
+
+
+// Evaluates a functor, its gradient and its Hessian with hyper-dual
+// numbers. Only the upper triangle of the Hessian is computed; the
+// lower blocks are filled in by symmetry.
+template<typename Functor, int... D>
+double evaluate_functor_hessian(const Functor& functor,
+                                double * const * const variables,
+                                std::vector<Eigen::VectorXd>* gradient,
+                                std::vector< std::vector<Eigen::MatrixXd> >* hessian)
+{
+	typedef HyperDual<double, IntSum<D...>::value> HyperDualType;
+	DualFunctorCaller<Functor, HyperDualType, D...> caller;
+	auto f = caller.call(functor, variables);
+
+	const int dimensions[] = {D...};
+	const int number_of_variables = sizeof...(D);
+	int offset0 = 0;
+	for (int var0 = 0; var0 < number_of_variables; ++var0) {
+		for (int i = 0; i < dimensions[var0]; ++i) {
+			(*gradient)[var0](i) = f.d(offset0 + i);
+		}
+
+		int offset1 = 0;
+		for (int var1 = 0; var1 < number_of_variables; ++var1) {
+			auto& block = (*hessian)[var0][var1];
+			for (int i = 0; i < dimensions[var0]; ++i) {
+				for (int j = 0; j < dimensions[var1]; ++j) {
+					block(i, j) = f.h(offset0 + i, offset1 + j);
+				}
+			}
+			offset1 += dimensions[var1];
+		}
+		offset0 += dimensions[var0];
+	}
+
+	return f.x();
+}
+
+// Calls functor with nested numbers. The outer numbers (Dual or
+// Reverse) differentiate with respect to every scalar and the inner
+// numbers in the direction of direction.
+template <typename Functor, typename R, int... D>
+struct DirectionalFunctorCaller;
+
+template <typename Functor, typename R, int D0, int... DN>
+struct DirectionalFunctorCaller<Functor, R, D0, DN...>
+{
+	template <typename... T>
+	R call(const Functor& functor,
+	       double * const * const variables,
+	       const double * const * const direction,
+	       int offset,
+	       T&... previous_arguments)
+	{
+		R x[D0];
+		for (int i = 0; i < D0; ++i) {
+			x[i] = R((*variables)[i], i + offset);
+			x[i].x().d(0) = (*direction)[i];
+		}
+
+		DirectionalFunctorCaller<Functor, R, DN...> next_caller;
+		return next_caller.call(functor, variables + 1, direction + 1, offset + D0,
+		                        previous_arguments..., x);
+	}
+};
+
+template <typename Functor, typename R>
+struct DirectionalFunctorCaller<Functor, R>
+{
+	template <typename... T>
+	R call(const Functor& functor,
+	       double * const * const variables,
+	       const double * const * const direction,
+	       int offset,
+	       T&... arguments)
+	{
+		return functor(arguments...);
+	}
+};
+
+// Evaluates a functor, its gradient and the product of its Hessian
+// with a direction (forward over forward). Every number carries one
+// extra derivative in the direction, so the Hessian is never formed
+// and the cost is a small multiple of that of the gradient in
+// forward mode, i.e. O(number of variables) times an evaluation.
+template<typename Functor, int... D>
+double evaluate_functor_hessian_vector(const Functor& functor,
+                                       double * const * const variables,
+                                       const double * const * const direction,
+                                       std::vector<Eigen::VectorXd>* gradient,
+                                       std::vector<Eigen::VectorXd>* hessian_vector,
+                                       std::false_type use_reverse_mode)
+{
+	typedef Dual<Dual<double, 1>, IntSum<D...>::value> DualType;
+	DirectionalFunctorCaller<Functor, DualType, D...> caller;
+	const DualType f = caller.call(functor, variables, direction, 0);
+
+	const int dimensions[] = {D...};
+	int offset = 0;
+	for (int var = 0; var < int(sizeof...(D)); ++var) {
+		for (int i = 0; i < dimensions[var]; ++i) {
+			(*gradient)[var](i) = f.d(offset + i).x();
+			(*hessian_vector)[var](i) = f.d(offset + i).d(0);
+		}
+		offset += dimensions[var];
+	}
+
+	return f.x().x();
+}
+
+// Evaluates a functor, its gradient and the product of its Hessian
+// with a direction in reverse mode (forward over reverse). The tape
+// records numbers carrying their derivative in the direction, and
+// sweeping it gives the gradient and, in the inner derivatives, its
+// directional derivative. As for the gradient, the cost is a constant
+// times an evaluation, regardless of the number of variables.
+template<typename Functor, int... D>
+double evaluate_functor_hessian_vector(const Functor& functor,
+                                       double * const * const variables,
+                                       const double * const * const direction,
+                                       std::vector<Eigen::VectorXd>* gradient,
+                                       std::vector<Eigen::VectorXd>* hessian_vector,
+                                       std::true_type use_reverse_mode)
+{
+	typedef Dual<double, 1> DirectionalType;
+	typedef Reverse<DirectionalType> ReverseType;
+	ReverseTapeScope<DirectionalType> scope;
+	// The variables are the first nodes recorded on the tape.
+	DirectionalFunctorCaller<Functor, ReverseType, D...> caller;
+	const ReverseType f = caller.call(functor, variables, direction, 0);
+	const auto& adjoints = scope.tape.sweep(scope.begin, f.tape_index());
+
+	const int dimensions[] = {D...};
+	int offset = 0;
+	for (int var = 0; var < int(sizeof...(D)); ++var) {
+		for (int i = 0; i < dimensions[var]; ++i) {
+			(*gradient)[var](i) = adjoints[offset + i].x();
+			(*hessian_vector)[var](i) = adjoints[offset + i].d(0);
+		}
+		offset += dimensions[var];
+	}
+
+	return f.x().x();
+}
+
+// Evaluates a functor, its gradient and the product of its Hessian
+// with a direction, in reverse mode for functors with many variables
+// (see reverse_mode_dimension).
+template<typename Functor, int... D>
+double evaluate_functor_hessian_vector(const Functor& functor,
+                                       double * const * const variables,
+                                       const double * const * const direction,
+                                       std::vector<Eigen::VectorXd>* gradient,
+                                       std::vector<Eigen::VectorXd>* hessian_vector)
+{
+	typedef std::integral_constant<bool, (IntSum<D...>::value > reverse_mode_dimension)> UseReverseMode;
+	return evaluate_functor_hessian_vector<Functor, D...>(functor, variables, direction,
+	                                                      gradient, hessian_vector,
+	                                                      UseReverseMode());
+}
+
+// Terms with at least this many variables are probed at the first
+// evaluation of their Hessian. If the intermediate numbers of the
+// functor depend on at most sparse_mode_density of the variables on
+// average, the Hessian is computed with sparse hyper-dual numbers.
+// This is 2-4 times faster for e.g. sums of functions of neighbouring
+// variables, whose Hessians are mostly zero, and as much slower for
+// functors where every number depends on every variable. Gradients
+// are always computed with Dual, which was faster for every
+// functor tried.
+static const int sparse_mode_dimension = 16;
+static const double sparse_mode_density = 0.5;
+
+// Returns whether the functor is sparse enough at the given
+// variables for sparse dual numbers.
+template<typename Functor, int... D>
+bool probe_functor_sparsity(const Functor& functor,
+                            double * const * const variables)
+{
+	DynamicArenaScope scope;
+	SparsityProbe probe;
+	DualFunctorCaller<Functor, SparseDual<double>, D...> caller;
+	caller.call(functor, variables);
+	return probe.density(IntSum<D...>::value) <= sparse_mode_density;
+}
+
+// Maps the index of every scalar of the variables with dimensions D
+// to its variable and its index within the variable.
+template<int... D>
+struct ScalarIndices
+{
+	ScalarIndices()
+	{
+		const int dimensions[] = {D...};
+		int offset = 0;
+		for (int var = 0; var < int(sizeof...(D)); ++var) {
+			for (int i = 0; i < dimensions[var]; ++i) {
+				variable[offset + i] = var;
+				index[offset + i] = i;
+			}
+			offset += dimensions[var];
+		}
+	}
+
+	int variable[IntSum<D...>::value];
+	int index[IntSum<D...>::value];
+};
+
+// Evaluates a functor, its gradient and its Hessian with sparse
+// hyper-dual numbers.
+template<typename Functor, int... D>
+double evaluate_functor_hessian_sparse(const Functor& functor,
+                                       double * const * const variables,
+                                       std::vector<Eigen::VectorXd>* gradient,
+                                       std::vector< std::vector<Eigen::MatrixXd> >* hessian)
+{
+	DynamicArenaScope scope;
+	DualFunctorCaller<Functor, SparseHyperDual<double>, D...> caller;
+	auto f = caller.call(functor, variables);
+
+	const int number_of_variables = sizeof...(D);
+	for (int var0 = 0; var0 < number_of_variables; ++var0) {
+		(*gradient)[var0].setZero();
+		for (int var1 = 0; var1 < number_of_variables; ++var1) {
+			(*hessian)[var0][var1].setZero();
+		}
+	}
+	const ScalarIndices<D...> scalars;
+	for (int k = 0; k < f.nonzeros(); ++k) {
+		const int i = f.nonzero_index(k);
+		(*gradient)[scalars.variable[i]](scalars.index[i]) = f.nonzero_derivative(k);
+	}
+	for (int k = 0; k < f.hessian_nonzeros(); ++k) {
+		const int i = f.hessian_row(k);
+		const int j = f.hessian_column(k);
+		const double value = f.hessian_derivative(k);
+		(*hessian)[scalars.variable[i]][scalars.variable[j]](scalars.index[i], scalars.index[j]) = value;
+		(*hessian)[scalars.variable[j]][scalars.variable[i]](scalars.index[j], scalars.index[i]) = value;
+	}
+
+	return f.x();
+}
+
+// Remembers whether a term uses sparse dual numbers, which is decided
+// by a probe at the first evaluation. Copies keep the decision.
+class SparseModeChoice
+{
+public:
+	SparseModeChoice()
+		: state(undecided)
+	{ }
+
+	SparseModeChoice(const SparseModeChoice& other)
+		: state(other.state.load())
+	{ }
+
+	SparseModeChoice& operator = (const SparseModeChoice& other)
+	{
+		state = other.state.load();
+		return *this;
+	}
+
+	// Returns whether to use sparse dual numbers, calling probe if
+	// not yet decided. Threads evaluating the term concurrently may
+	// all probe it, which is harmless.
+	template<typename Probe>
+	bool use_sparse_mode(const Probe& probe)
+	{
+		int current = state.load(std::memory_order_relaxed);
+		if (current == undecided) {
+			current = probe() ? sparse : dense;
+			state.store(current, std::memory_order_relaxed);
+		}
+		return current == sparse;
+	}
+
+	void reset()
+	{
+		state = undecided;
+	}
+
+private:
+	enum {undecided, dense, sparse};
+	std::atomic<int> state;
+};
+
 
+//
+// Definition for any number of variables.
+//
 template<typename Functor, int... D>
 class AutoDiffTerm
 	: public SizedTerm<D...>
@@ -1076,6 +729,7 @@ public:
 	virtual void read(std::istream& in) override
 	{
 		call_read_if_exists(in, this->functor);
+		sparse_mode.reset();
 	}
 
 	virtual void write(std::ostream& out) const override
@@ -1093,14 +747,7 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient) const override
 	{
-		typedef fadbad::F<double, IntSum<D...>::value> Dual;
-		DualFunctorCaller<Functor, Dual, D...> caller;
-		auto f = caller.call(this->functor, variables);
-
-		DualGradientExtractor<Dual, D...> extractor;
-		extractor.extract(f, &((*gradient)[0]));
-
-		return f.x();
+		return evaluate_functor_gradient<Functor, D...>(this->functor, variables, gradient);
 	}
 
 
@@ -1108,12 +755,75 @@ public:
 	                        std::vector<Eigen::VectorXd>* gradient,
 	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
 	{
-		check(false, to_string(typeid(*this).name(), ": hessian not implemented."));
-		return 0;
+		return evaluate_hessian(variables, gradient, hessian, MaybeSparse());
+	}
+
+	virtual double evaluate_hessian_vector(double * const * const variables,
+	                                       const double * const * const direction,
+	                                       std::vector<Eigen::VectorXd>* gradient,
+	                                       std::vector<Eigen::VectorXd>* hessian_vector) const override
+	{
+		return evaluate_functor_hessian_vector<Functor, D...>(this->functor, variables, direction,
+		                                                      gradient, hessian_vector);
+	}
+
+	// Only functors declaring single_precision (see
+	// supports_single_precision) are evaluated in single precision.
+	virtual bool has_single_precision() const override
+	{
+		return SinglePrecision::value;
+	}
+
+	virtual double evaluate_float(float * const * const variables) const override
+	{
+		return evaluate_functor_float<Functor, D...>(this->functor, variables, nullptr,
+		                                             SinglePrecision());
+	}
+
+	virtual double evaluate_float(float * const * const variables,
+	                              std::vector<Eigen::VectorXf>* gradient) const override
+	{
+		return evaluate_functor_float<Functor, D...>(this->functor, variables, gradient,
+		                                             SinglePrecision());
 	}
 
 protected:
 	Functor functor;
+
+private:
+	static const int number_of_scalars = IntSum<D...>::value;
+	typedef std::integral_constant<bool, supports_single_precision<Functor>::value> SinglePrecision;
+	// The sparse code is only instantiated for terms that may use it.
+	typedef std::integral_constant<bool, (number_of_scalars >= sparse_mode_dimension)> MaybeSparse;
+
+	bool use_sparse_mode(double * const * const variables) const
+	{
+		return sparse_mode.use_sparse_mode([this, variables]()
+		{
+			return probe_functor_sparsity<Functor, D...>(this->functor, variables);
+		});
+	}
+
+	double evaluate_hessian(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian,
+	                        std::false_type) const
+	{
+		return evaluate_functor_hessian<Functor, D...>(this->functor, variables, gradient, hessian);
+	}
+
+	double evaluate_hessian(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian,
+	                        std::true_type) const
+	{
+		if (use_sparse_mode(variables)) {
+			return evaluate_functor_hessian_sparse<Functor, D...>(this->functor, variables, gradient, hessian);
+		}
+		return evaluate_functor_hessian<Functor, D...>(this->functor, variables, gradient, hessian);
+	}
+
+	mutable SparseModeChoice sparse_mode;
 };
 
 }  // namespace spii
@@ -0,0 +1,172 @@
+#ifndef SPII_BATCHED_AUTO_DIFF_TERM_H
+#define SPII_BATCHED_AUTO_DIFF_TERM_H
+// This header defines BatchedAutoDiffTerm, an AutoDiffTerm that is
+// evaluated together with other terms of the same type:
+//
+//		auto term = std::make_shared<BatchedAutoDiffTerm<Functor, 9, 3>>(arg1, arg2, ...);
+//
+// Function evaluates the Hessians of batch_width consecutive terms of
+// the same type with one call to the functor (see
+// Term::evaluate_batch). The functor is called with hyper-dual
+// packets (see packet.h) holding the variables of every term in a
+// separate lane, so the derivatives of all terms are computed by the
+// same vectorized operations. This pays off for problems with many
+// terms sharing a functor, e.g. the reprojection errors of bundle
+// adjustment.
+//
+// Values and gradients are computed one term at a time, as by
+// AutoDiffTerm. Dual numbers already vectorize the gradient of a
+// single term, and batching them was slower for bundle adjustment.
+//
+// Every data member of the functor that differs between terms has to
+// be converted with SPII_PARAMETER; other members are taken from the
+// first term of a batch. Since this can not be checked, functors are
+// only batched if they declare
+//
+//		static const bool batchable = true;
+//
+// In debug builds, the values of all terms in a batch are compared
+// with their values evaluated one at a time. If the terms of a batch
+// take different branches in the functor, they are evaluated one at
+// a time.
+//
+
+#include <cmath>
+#include <type_traits>
+#include <utility>
+
+#include <spii/auto_diff_term.h>
+#include <spii/packet.h>
+#include <spii/spii.h>
+
+namespace spii {
+
+// Number of terms evaluated at once; four doubles fill an AVX
+// register.
+static const int batch_width = 4;
+
+// Terms with more variables than this are not batched, since the
+// hyper-dual packets for their Hessians would need too much stack.
+static const int batch_dimension = 16;
+
+// is_batchable<T>::value == true iff T::batchable is true.
+template<class T, class = void>
+struct is_batchable : std::false_type {};
+template<class T>
+struct is_batchable<T, decltype(void(T::batchable))>
+	: std::integral_constant<bool, T::batchable> {};
+// Test is_batchable.
+struct IsBatchableTest1{ static const bool batchable = true; };
+struct IsBatchableTest2{ static const bool batchable = false; };
+struct IsBatchableTest3{};
+static_assert(is_batchable<IsBatchableTest1>::value == true, "IsBatchableTest1 failed.");
+static_assert(is_batchable<IsBatchableTest2>::value == false, "IsBatchableTest2 failed.");
+static_assert(is_batchable<IsBatchableTest3>::value == false, "IsBatchableTest3 failed.");
+
+template<typename Functor, int... D>
+class BatchedAutoDiffTerm
+	: public AutoDiffTerm<Functor, D...>
+{
+	static const int number_of_scalars = IntSum<D...>::value;
+	typedef Packet<double, batch_width> PacketType;
+
+public:
+	template<typename... Args>
+	BatchedAutoDiffTerm(Args&&... args)
+		: AutoDiffTerm<Functor, D...>(std::forward<Args>(args)...)
+	{ }
+
+	virtual int batch_size() const override
+	{
+		return is_batchable<Functor>::value && number_of_scalars <= batch_dimension ? batch_width : 1;
+	}
+
+	virtual void evaluate_batch(const Term* const* terms,
+	                            double * const * const * variables,
+	                            double* values,
+	                            std::vector<Eigen::VectorXd>* gradients,
+	                            std::vector< std::vector<Eigen::MatrixXd> >* hessians) const override
+	{
+		if (! hessians || batch_size() == 1) {
+			Term::evaluate_batch(terms, variables, values, gradients, hessians);
+			return;
+		}
+
+		const Functor* functors[batch_width];
+		for (int l = 0; l < batch_width; ++l) {
+			functors[l] = &static_cast<const BatchedAutoDiffTerm*>(terms[l])->functor;
+		}
+
+		const int dimensions[] = {D...};
+		PacketType x[number_of_scalars];
+		PacketType* arguments[sizeof...(D)];
+		int offset = 0;
+		for (int var = 0; var < int(sizeof...(D)); ++var) {
+			arguments[var] = x + offset;
+			for (int i = 0; i < dimensions[var]; ++i) {
+				for (int l = 0; l < batch_width; ++l) {
+					x[offset + i][l] = variables[l][var][i];
+				}
+			}
+			offset += dimensions[var];
+		}
+
+		try {
+			PacketLanes<batch_width> lanes(functors);
+			evaluate_hessians(arguments, values, gradients, hessians);
+		}
+		catch (PacketDivergence&) {
+			Term::evaluate_batch(terms, variables, values, gradients, hessians);
+			return;
+		}
+
+		#ifndef NDEBUG
+			// Data members not read with SPII_PARAMETER were taken
+			// from the first term.
+			for (int l = 1; l < batch_width; ++l) {
+				double value = terms[l]->evaluate(variables[l]);
+				spii_assert(value != value || std::abs(values[l] - value) <= 1e-10 * (1.0 + std::abs(value)),
+				            "BatchedAutoDiffTerm: The functor reads a data member without SPII_PARAMETER.");
+			}
+		#endif
+	}
+
+private:
+	void evaluate_hessians(PacketType* const* arguments,
+	                       double* values,
+	                       std::vector<Eigen::VectorXd>* gradients,
+	                       std::vector< std::vector<Eigen::MatrixXd> >* hessians) const
+	{
+		typedef HyperDual<PacketType, number_of_scalars> HyperDualType;
+		DualFunctorCaller<Functor, HyperDualType, D...> caller;
+		auto f = caller.call(this->functor, arguments);
+
+		const int dimensions[] = {D...};
+		const int number_of_variables = sizeof...(D);
+		for (int l = 0; l < batch_width; ++l) {
+			values[l] = f.x()[l];
+			int offset0 = 0;
+			for (int var0 = 0; var0 < number_of_variables; ++var0) {
+				for (int i = 0; i < dimensions[var0]; ++i) {
+					gradients[l][var0](i) = f.d(offset0 + i)[l];
+				}
+
+				int offset1 = 0;
+				for (int var1 = 0; var1 < number_of_variables; ++var1) {
+					auto& block = hessians[l][var0][var1];
+					for (int i = 0; i < dimensions[var0]; ++i) {
+						for (int j = 0; j < dimensions[var1]; ++j) {
+							block(i, j) = f.h(offset0 + i, offset1 + j)[l];
+						}
+					}
+					offset1 += dimensions[var1];
+				}
+				offset0 += dimensions[var0];
+			}
+		}
+	}
+};
+
+}  // namespace spii
+
+#endif
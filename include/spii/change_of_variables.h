@@ -2,7 +2,10 @@
 #ifndef SPII_CHANGE_OF_VARIABLES_H
 #define SPII_CHANGE_OF_VARIABLES_H
 
+#include <algorithm>
 #include <cstring>
+#include <stdexcept>
+#include <vector>
 using std::size_t;
 
 namespace spii {
@@ -28,7 +31,43 @@ public:
 	virtual void update_gradient(double* t_gradient,
 	                             const double* t_input,
 	                             const double* x_gradient) const = 0;
-	void update_hessian() const;
+
+	// Computes the Jacobian dx/dt at t, stored row by row in an
+	// x_dimension() by t_dimension() array. Function computes it once
+	// per variable and evaluation, so that the gradient of every term
+	// is transformed by a small matrix-vector product.
+	//
+	// The default implementation calls update_gradient once for every
+	// row.
+	virtual void jacobian(double* dx_dt, const double* t) const
+	{
+		const int n_x = x_dimension();
+		const int n_t = t_dimension();
+		std::vector<double> unit(n_x, 0.0);
+		for (int i = 0; i < n_x; ++i) {
+			unit[i] = 1.0;
+			std::fill(dx_dt + i * n_t, dx_dt + (i + 1) * n_t, 0.0);
+			update_gradient(dx_dt + i * n_t, t, unit.data());
+			unit[i] = 0.0;
+		}
+	}
+
+	// Computes the second derivatives d^2 x_i / dt_j dt_k at t,
+	// stored at (i * t_dimension() + j) * t_dimension() + k. They are
+	// needed for Hessians with respect to t.
+	virtual void second_derivatives(double* d2x_dt2, const double* t) const
+	{
+		throw std::runtime_error("ChangeOfVariables: second derivatives are not implemented.");
+	}
+
+	// Changes of variables relative to a base point (e.g. manifolds)
+	// can move the base point to t, which is then updated to the same
+	// point in the new coordinates. Returns false if the change of
+	// variables has no base point.
+	virtual bool recenter(double* t) const
+	{
+		return false;
+	}
 };
 
 }  // namespace spii
@@ -0,0 +1,63 @@
+#ifndef SPII_CODE_GENERATION_H
+#define SPII_CODE_GENERATION_H
+// This header generates C++ code for a term from a functor, so that
+// no automatic differentiation is needed when the term is evaluated.
+//
+//		std::ofstream out("my_term.h");
+//		generate_term_code<9, 3>(out, "MyTerm", MyFunctor(0, 0), x);
+//
+// writes a class MyTerm derived from SizedTerm<9, 3>, computing the
+// value, gradient and Hessian of the functor with straight-line code.
+// The functor is traced at x (see trace.h) and the derivatives are
+// traced from the result, so the code is simplified in the same way
+// as a trace. Only the upper triangle of the Hessian is computed.
+//
+// Data members of the functor converted with SPII_PARAMETER become
+// members of the generated class. The generated class is constructed
+// from their values, in the order given to generate_term_code or else
+// in the order they are first used. It reads and writes them, so it
+// can be serialized and taught to TermFactory like any other term.
+// Other data members become constants in the code.
+//
+// The code is only valid for the branches taken at x. Evaluating
+// the generated term where a comparison in the functor has another
+// outcome throws an exception.
+//
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <spii/spii.h>
+#include <spii/trace.h>
+#include <spii/traced_term.h>
+
+namespace spii {
+
+// Writes a term computing the function recorded by record, which
+// records a function of variables with the given dimensions in a
+// trace and returns the operation computing the result.
+SPII_API void generate_term_code(std::ostream& out,
+                                 const std::string& class_name,
+                                 const std::vector<int>& dimensions,
+                                 const std::function<int(Trace*)>& record,
+                                 const std::vector<std::string>& parameters = {});
+
+template<int... D, typename Functor>
+void generate_term_code(std::ostream& out,
+                        const std::string& class_name,
+                        const Functor& functor,
+                        const double* x,
+                        const std::vector<std::string>& parameters = {})
+{
+	auto record = [&functor, x](Trace* trace)
+	{
+		return record_functor<D...>(trace, functor, x);
+	};
+	generate_term_code(out, class_name, {D...}, record, parameters);
+}
+
+}  // namespace spii
+
+#endif
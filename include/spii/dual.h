@@ -0,0 +1,517 @@
+#ifndef SPII_DUAL_H
+#define SPII_DUAL_H
+// This header defines Dual, a forward-mode dual number with a fixed
+// number of derivatives. It is used by AutoDiffTerm to compute
+// gradients.
+//
+// The derivatives are stored in an aligned array and every operation
+// updates all of them in a single loop of fixed length. The compiler
+// unrolls and vectorizes these loops for the instruction set it is
+// targeting (e.g. -march=native for AVX2 or AVX-512); no intrinsics
+// are used, so the same code is a scalar fallback everywhere else.
+//
+// Every operation, including the elementary functions, evaluates
+// the function and its derivative once and then applies the chain
+// rule to all derivatives, e.g. sin(x).d(i) = cos(x.x()) * x.d(i).
+//
+// Dual numbers may be nested. Dual<Dual<double, 1>, N> computes the
+// gradient and, in the inner derivative, its directional derivative
+// (see evaluate_functor_hessian_vector).
+//
+
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+
+namespace spii {
+
+template<typename T, int N>
+class Dual
+{
+	static_assert(N > 0, "Dual: Need at least one derivative.");
+
+	// Arithmetic constants of another type than T. For nested numbers,
+	// they convert to both T and Dual, so the functions taking T
+	// would be ambiguous without overloads for them.
+	template<typename S>
+	using EnableIfConstant = typename std::enable_if<std::is_arithmetic<S>::value &&
+	                                                 ! std::is_same<S, T>::value, int>::type;
+public:
+	// Alignment of the derivative storage. Arrays large enough to fill
+	// a SIMD register are aligned to its size.
+	static const std::size_t alignment = N * sizeof(T) >= 16 ? 16 : alignof(T);
+
+	Dual()
+		: value(0), derivatives()
+	{ }
+
+	Dual(const T& value_)
+		: value(value_), derivatives()
+	{ }
+
+	// Allows e.g. R r = 0.0 for R = Dual<Dual<double, 1>, N>, which
+	// would otherwise need two implicit conversions.
+	template<typename S, EnableIfConstant<S> = 0>
+	Dual(const S& value_)
+		: value(value_), derivatives()
+	{ }
+
+	// Creates the dual number for a variable; its derivative with
+	// respect to itself is 1.
+	Dual(const T& value_, int index)
+		: value(value_)
+	{
+		diff(index);
+	}
+
+	T& x()
+	{
+		return value;
+	}
+
+	const T& x() const
+	{
+		return value;
+	}
+
+	T& d(int i)
+	{
+		return derivatives[i];
+	}
+
+	const T& d(int i) const
+	{
+		return derivatives[i];
+	}
+
+	int size() const
+	{
+		return N;
+	}
+
+	// Marks this number as variable number index.
+	void diff(int index)
+	{
+		set_derivatives(0);
+		derivatives[index] = 1;
+	}
+
+	Dual& operator += (const Dual& rhs)
+	{
+		value += rhs.value;
+		for (int i = 0; i < N; ++i) {
+			derivatives[i] += rhs.derivatives[i];
+		}
+		return *this;
+	}
+
+	Dual& operator -= (const Dual& rhs)
+	{
+		value -= rhs.value;
+		for (int i = 0; i < N; ++i) {
+			derivatives[i] -= rhs.derivatives[i];
+		}
+		return *this;
+	}
+
+	Dual& operator *= (const Dual& rhs)
+	{
+		for (int i = 0; i < N; ++i) {
+			derivatives[i] = rhs.value * derivatives[i] + value * rhs.derivatives[i];
+		}
+		value *= rhs.value;
+		return *this;
+	}
+
+	Dual& operator /= (const Dual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		value *= inverse;
+		for (int i = 0; i < N; ++i) {
+			derivatives[i] = (derivatives[i] - value * rhs.derivatives[i]) * inverse;
+		}
+		return *this;
+	}
+
+	Dual& operator += (const T& rhs)
+	{
+		value += rhs;
+		return *this;
+	}
+
+	Dual& operator -= (const T& rhs)
+	{
+		value -= rhs;
+		return *this;
+	}
+
+	Dual& operator *= (const T& rhs)
+	{
+		value *= rhs;
+		scale_derivatives(rhs);
+		return *this;
+	}
+
+	Dual& operator /= (const T& rhs)
+	{
+		T inverse = T(1) / rhs;
+		value *= inverse;
+		scale_derivatives(inverse);
+		return *this;
+	}
+
+	#define SPII_DUAL_CONSTANT_ASSIGNMENT(op)                            \
+		template<typename S, EnableIfConstant<S> = 0>                    \
+		Dual& operator op (const S& rhs)                                 \
+		{                                                                \
+			return *this op T(rhs);                                      \
+		}
+	SPII_DUAL_CONSTANT_ASSIGNMENT(+=)
+	SPII_DUAL_CONSTANT_ASSIGNMENT(-=)
+	SPII_DUAL_CONSTANT_ASSIGNMENT(*=)
+	SPII_DUAL_CONSTANT_ASSIGNMENT(/=)
+	#undef SPII_DUAL_CONSTANT_ASSIGNMENT
+
+	//
+	// The operators and functions below are friends defined in the
+	// class. They are found through argument-dependent lookup and,
+	// since they are not templates, allow implicit conversions of
+	// the other argument, e.g. pow(x, 2) or 2 * x.
+	//
+
+	friend Dual operator + (const Dual& arg)
+	{
+		return arg;
+	}
+
+	friend Dual operator - (const Dual& arg)
+	{
+		return chain(arg, -arg.value, T(-1));
+	}
+
+	friend Dual operator + (const Dual& lhs, const Dual& rhs)
+	{
+		Dual result(lhs.value + rhs.value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.derivatives[i] = lhs.derivatives[i] + rhs.derivatives[i];
+		}
+		return result;
+	}
+
+	friend Dual operator - (const Dual& lhs, const Dual& rhs)
+	{
+		Dual result(lhs.value - rhs.value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.derivatives[i] = lhs.derivatives[i] - rhs.derivatives[i];
+		}
+		return result;
+	}
+
+	friend Dual operator * (const Dual& lhs, const Dual& rhs)
+	{
+		Dual result(lhs.value * rhs.value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.derivatives[i] = rhs.value * lhs.derivatives[i] + lhs.value * rhs.derivatives[i];
+		}
+		return result;
+	}
+
+	friend Dual operator / (const Dual& lhs, const Dual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		Dual result(lhs.value * inverse, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.derivatives[i] = (lhs.derivatives[i] - result.value * rhs.derivatives[i]) * inverse;
+		}
+		return result;
+	}
+
+	friend Dual operator + (const Dual& lhs, const T& rhs)
+	{
+		Dual result(lhs);
+		result.value += rhs;
+		return result;
+	}
+
+	friend Dual operator + (const T& lhs, const Dual& rhs)
+	{
+		return rhs + lhs;
+	}
+
+	friend Dual operator - (const Dual& lhs, const T& rhs)
+	{
+		Dual result(lhs);
+		result.value -= rhs;
+		return result;
+	}
+
+	friend Dual operator - (const T& lhs, const Dual& rhs)
+	{
+		return chain(rhs, lhs - rhs.value, T(-1));
+	}
+
+	friend Dual operator * (const Dual& lhs, const T& rhs)
+	{
+		return chain(lhs, lhs.value * rhs, rhs);
+	}
+
+	friend Dual operator * (const T& lhs, const Dual& rhs)
+	{
+		return chain(rhs, lhs * rhs.value, lhs);
+	}
+
+	friend Dual operator / (const Dual& lhs, const T& rhs)
+	{
+		T inverse = T(1) / rhs;
+		return chain(lhs, lhs.value * inverse, inverse);
+	}
+
+	friend Dual operator / (const T& lhs, const Dual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs * inverse;
+		return chain(rhs, value, -value * inverse);
+	}
+
+	#define SPII_DUAL_COMPARISON(op)                                     \
+		friend bool operator op (const Dual& lhs, const Dual& rhs)       \
+		{                                                                \
+			return lhs.value op rhs.value;                               \
+		}                                                                \
+		friend bool operator op (const Dual& lhs, const T& rhs)          \
+		{                                                                \
+			return lhs.value op rhs;                                     \
+		}                                                                \
+		friend bool operator op (const T& lhs, const Dual& rhs)          \
+		{                                                                \
+			return lhs op rhs.value;                                     \
+		}
+	SPII_DUAL_COMPARISON(==)
+	SPII_DUAL_COMPARISON(!=)
+	SPII_DUAL_COMPARISON(<)
+	SPII_DUAL_COMPARISON(<=)
+	SPII_DUAL_COMPARISON(>)
+	SPII_DUAL_COMPARISON(>=)
+	#undef SPII_DUAL_COMPARISON
+
+	#define SPII_DUAL_CONSTANT_FUNCTION(result, name)                    \
+		template<typename S, EnableIfConstant<S> = 0>                    \
+		friend result name (const Dual& lhs, const S& rhs)               \
+		{                                                                \
+			return name(lhs, T(rhs));                                    \
+		}                                                                \
+		template<typename S, EnableIfConstant<S> = 0>                    \
+		friend result name (const S& lhs, const Dual& rhs)               \
+		{                                                                \
+			return name(T(lhs), rhs);                                    \
+		}
+	SPII_DUAL_CONSTANT_FUNCTION(Dual, operator +)
+	SPII_DUAL_CONSTANT_FUNCTION(Dual, operator -)
+	SPII_DUAL_CONSTANT_FUNCTION(Dual, operator *)
+	SPII_DUAL_CONSTANT_FUNCTION(Dual, operator /)
+	SPII_DUAL_CONSTANT_FUNCTION(bool, operator ==)
+	SPII_DUAL_CONSTANT_FUNCTION(bool, operator !=)
+	SPII_DUAL_CONSTANT_FUNCTION(bool, operator <)
+	SPII_DUAL_CONSTANT_FUNCTION(bool, operator <=)
+	SPII_DUAL_CONSTANT_FUNCTION(bool, operator >)
+	SPII_DUAL_CONSTANT_FUNCTION(bool, operator >=)
+	SPII_DUAL_CONSTANT_FUNCTION(Dual, pow)
+	SPII_DUAL_CONSTANT_FUNCTION(Dual, atan2)
+	#undef SPII_DUAL_CONSTANT_FUNCTION
+
+	friend Dual abs(const Dual& arg)
+	{
+		return arg.value < 0 ? -arg : arg;
+	}
+
+	friend Dual fabs(const Dual& arg)
+	{
+		return abs(arg);
+	}
+
+	friend Dual sqr(const Dual& arg)
+	{
+		return chain(arg, arg.value * arg.value, 2 * arg.value);
+	}
+
+	friend Dual sqrt(const Dual& arg)
+	{
+		using std::sqrt;
+		T value = sqrt(arg.value);
+		return chain(arg, value, T(0.5) / value);
+	}
+
+	friend Dual exp(const Dual& arg)
+	{
+		using std::exp;
+		T value = exp(arg.value);
+		return chain(arg, value, value);
+	}
+
+	friend Dual log(const Dual& arg)
+	{
+		using std::log;
+		return chain(arg, log(arg.value), T(1) / arg.value);
+	}
+
+	friend Dual log10(const Dual& arg)
+	{
+		using std::log;
+		using std::log10;
+		return chain(arg, log10(arg.value), T(1) / (arg.value * log(T(10))));
+	}
+
+	friend Dual sin(const Dual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		return chain(arg, sin(arg.value), cos(arg.value));
+	}
+
+	friend Dual cos(const Dual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		return chain(arg, cos(arg.value), -sin(arg.value));
+	}
+
+	friend Dual tan(const Dual& arg)
+	{
+		using std::tan;
+		T value = tan(arg.value);
+		return chain(arg, value, 1 + value * value);
+	}
+
+	friend Dual asin(const Dual& arg)
+	{
+		using std::asin;
+		using std::sqrt;
+		return chain(arg, asin(arg.value), T(1) / sqrt(1 - arg.value * arg.value));
+	}
+
+	friend Dual acos(const Dual& arg)
+	{
+		using std::acos;
+		using std::sqrt;
+		return chain(arg, acos(arg.value), T(-1) / sqrt(1 - arg.value * arg.value));
+	}
+
+	friend Dual atan(const Dual& arg)
+	{
+		using std::atan;
+		return chain(arg, atan(arg.value), T(1) / (1 + arg.value * arg.value));
+	}
+
+	friend Dual sinh(const Dual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		return chain(arg, sinh(arg.value), cosh(arg.value));
+	}
+
+	friend Dual cosh(const Dual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		return chain(arg, cosh(arg.value), sinh(arg.value));
+	}
+
+	friend Dual tanh(const Dual& arg)
+	{
+		using std::tanh;
+		T value = tanh(arg.value);
+		return chain(arg, value, 1 - value * value);
+	}
+
+	friend Dual pow(const Dual& base, const T& exponent)
+	{
+		using std::pow;
+		return chain(base, pow(base.value, exponent), exponent * pow(base.value, exponent - 1));
+	}
+
+	friend Dual pow(const T& base, const Dual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base, exponent.value);
+		return chain(exponent, value, value * log(base));
+	}
+
+	friend Dual pow(const Dual& base, const Dual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base.value, exponent.value);
+		T d_base = exponent.value * pow(base.value, exponent.value - 1);
+		T d_exponent = value * log(base.value);
+		Dual result(value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.derivatives[i] = d_base * base.derivatives[i] + d_exponent * exponent.derivatives[i];
+		}
+		return result;
+	}
+
+	friend Dual atan2(const Dual& y, const Dual& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y.value * y.value);
+		T d_y = x.value * inverse;
+		T d_x = -y.value * inverse;
+		Dual result(atan2(y.value, x.value), no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.derivatives[i] = d_y * y.derivatives[i] + d_x * x.derivatives[i];
+		}
+		return result;
+	}
+
+	friend Dual atan2(const Dual& y, const T& x)
+	{
+		using std::atan2;
+		return chain(y, atan2(y.value, x), x / (x * x + y.value * y.value));
+	}
+
+	friend Dual atan2(const T& y, const Dual& x)
+	{
+		using std::atan2;
+		return chain(x, atan2(y, x.value), -y / (x.value * x.value + y * y));
+	}
+
+private:
+	// Tag for constructing a number whose derivatives are set later.
+	struct no_derivatives { };
+
+	Dual(const T& value_, no_derivatives)
+		: value(value_)
+	{ }
+
+	// Returns f(arg), given f(arg.x()) and f'(arg.x()).
+	static Dual chain(const Dual& arg, const T& value, const T& derivative)
+	{
+		Dual result(value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.derivatives[i] = derivative * arg.derivatives[i];
+		}
+		return result;
+	}
+
+	void set_derivatives(const T& constant)
+	{
+		for (int i = 0; i < N; ++i) {
+			derivatives[i] = constant;
+		}
+	}
+
+	void scale_derivatives(const T& factor)
+	{
+		for (int i = 0; i < N; ++i) {
+			derivatives[i] *= factor;
+		}
+	}
+
+	T value;
+	alignas(alignment) T derivatives[N];
+};
+
+}  // namespace spii
+
+#endif
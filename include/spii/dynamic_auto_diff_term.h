@@ -12,14 +12,16 @@
 //
 //    AutoDiffTerm<Functor, Dynamic, Dynamic, Dynamic> my_term(2, 3, 5, arg);
 //
-// Note that the dynamic versions of AutoDiffTerm are slower
-// than the equivalent static ones.
+// Any number of variables is supported. Gradients are computed with
+// DynamicDual and Hessians with DynamicHyperDual, whose derivatives
+// are stored in a per-thread arena, so evaluating a dynamic term
+// does not allocate memory.
 //
 
 // The make_differentiable function also supports dynamic
 // differentiation.
 //
-// Examples 
+// Examples
 // --------
 //
 // class Functor1_2
@@ -34,696 +36,244 @@
 //  auto term_1_2 = make_differentiable<Dynamic, Dynamic>(Functor{}, 1, 2);
 //
 
+#include <new>
+#include <tuple>
 #include <type_traits>
 #include <typeinfo>
-
-#include <spii-thirdparty/badiff.h>
-#include <spii-thirdparty/fadiff.h>
+#include <utility>
 
 #include <spii/auto_diff_term.h>
+#include <spii/dynamic_dual.h>
+#include <spii/dynamic_hyper_dual.h>
 
 namespace spii {
 
 static const int Dynamic = -1;
 
-//
-// 1-variable specialization
-//
+template<int... D>
+struct AllDynamic;
 
-// Function differentiating a functor taking D variables.
-template<typename Functor, typename T>
-T dynamic_differentiate_functor(
-	const Functor& functor,
-	int d,
-	const T* x_in,
-	T* df)
+template<int D0, int... DN>
+struct AllDynamic<D0, DN...>
 {
-	using namespace fadbad;
-	typedef fadbad::F<T> Dual;
-
-	std::vector<Dual> x(d);
-	for (int i = 0; i < d; ++i) {
-		x[i] = x_in[i];
-		x[i].diff(i, d);
-	}
-	Dual f{functor(x.data())};
-
-	for (int i = 0; i < d; ++i) {
-		df[i] = f.d(i);
-	}
+	static const bool value = D0 == Dynamic && AllDynamic<DN...>::value;
+};
 
-	return f.x();
-}
+template<>
+struct AllDynamic<>
+{
+	static const bool value = true;
+};
 
-template<typename Functor>
-class AutoDiffTerm<Functor, Dynamic> :
-	public Term
+//
+// The variables of a dynamic term as dual numbers (DynamicDual or
+// DynamicHyperDual). The numbers are stored in the arena of the
+// calling thread.
+//
+template<typename T, int number_of_variables, typename Number = DynamicDual<T>>
+class DynamicDualVariables
 {
 public:
-
-	template<typename... Args>
-	AutoDiffTerm(int d0_, Args&&... args)
-		: d0(d0_), functor(std::forward<Args>(args)...)
-	{
-	}
-
-	virtual int number_of_variables() const override
+	DynamicDualVariables(DynamicArena& arena_,
+	                     T * const * const variables,
+	                     const int* dimensions)
+		: arena(arena_), size(0)
 	{
-		return 1;
-	}
-
-	virtual int variable_dimension(int var) const override
-	{
-		return d0;
-	}
-
-	virtual void read(std::istream& in) override
-	{
-		call_read_if_exists(in, functor);
-	}
-
-	virtual void write(std::ostream& out) const override
-	{
-		call_write_if_exists(out, functor);
-	}
-
-	virtual double evaluate(double * const * const variables) const override
-	{
-		return functor(variables[0]);
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient) const override
-	{
-		typedef fadbad::F<double> Dual;
-		std::vector<Dual> vars(d0);
-
-		for (int i = 0; i < d0; ++i) {
-			vars[i] = variables[0][i];
-			vars[i].diff(i, d0);
+		for (int var = 0; var < number_of_variables; ++var) {
+			size += dimensions[var];
 		}
 
-		Dual f{functor(vars.data())};
+		void* chunk = arena.allocate(size * sizeof(Number));
+		data = static_cast<Number*>(chunk);
 
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = f.d(i);
+		int offset = 0;
+		for (int var = 0; var < number_of_variables; ++var) {
+			arguments[var] = data + offset;
+			for (int i = 0; i < dimensions[var]; ++i) {
+				new (data + offset + i) Number(variables[var][i], offset + i, size);
+			}
+			offset += dimensions[var];
 		}
-
-		return f.x();
 	}
 
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient,
-	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	~DynamicDualVariables()
 	{
-		typedef fadbad::F<double> Dual;
-
-		std::vector<Dual> vars(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars[i] = variables[0][i];
-			vars[i].diff(i, d0);
-		}
-
-		std::vector<Dual> df(d0);
-
-		Dual f =
-			dynamic_differentiate_functor<Functor, Dual>(
-				functor,
-				d0,
-				vars.data(),
-				df.data());
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = df[i].x();
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[0][0](i, j) = df[i].d(j);
-			}
+		for (int i = size - 1; i >= 0; --i) {
+			data[i].~Number();
 		}
-
-		return f.x();
+		arena.deallocate(data, size * sizeof(Number));
 	}
 
-protected:
-	const int d0;
-	Functor functor;
-};
+	// Pointers to the first number of each variable.
+	Number* arguments[number_of_variables];
 
+private:
+	DynamicDualVariables(const DynamicDualVariables&);
+	DynamicDualVariables& operator = (const DynamicDualVariables&);
 
+	DynamicArena& arena;
+	Number* data;
+	int size;
+};
 
 //
-// 2-variable specialization
+// Definition for any number of variables of dynamic size.
 //
-template<typename Functor>
-class AutoDiffTerm<Functor, Dynamic, Dynamic>
+template<typename Functor, int... D>
+class AutoDiffTerm<Functor, Dynamic, D...>
 	: public Term
 {
-public:
+	static_assert(AllDynamic<D...>::value,
+	              "AutoDiffTerm: Either all or no sizes must be Dynamic.");
+	static const int arity = 1 + sizeof...(D);
+	typedef std::make_index_sequence<arity> ArgumentIndices;
 
+public:
+	// The first arguments are the sizes of the variables. The rest
+	// are passed to the constructor of Functor.
 	template<typename... Args>
-	AutoDiffTerm(int d0_, int d1_, Args&&... args)
-		: d0{d0_}, d1{d1_}, functor(std::forward<Args>(args)...)
+	AutoDiffTerm(Args&&... args)
+		: AutoDiffTerm(ArgumentIndices(),
+		               std::make_index_sequence<sizeof...(Args) - arity>(),
+		               std::forward_as_tuple(std::forward<Args>(args)...))
 	{ }
 
 	virtual int number_of_variables() const override
 	{
-		return 2;
+		return arity;
 	}
 
 	virtual int variable_dimension(int var) const override
 	{
-		switch (var) {
-			default:
-			case 0: return d0;
-			case 1: return d1;
-		}
+		return dimensions[var];
 	}
 
-	virtual void read(std::istream& in)
+	virtual void read(std::istream& in) override
 	{
 		call_read_if_exists(in, functor);
 	}
 
-	virtual void write(std::ostream& out) const
+	virtual void write(std::ostream& out) const override
 	{
 		call_write_if_exists(out, functor);
 	}
 
 	virtual double evaluate(double * const * const variables) const override
 	{
-		return functor(variables[0], variables[1]);
+		return call(variables, ArgumentIndices());
 	}
 
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient) const override
 	{
-		typedef fadbad::F<double> Dual;
-
-		std::vector<Dual> vars0(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].diff(i, d0 + d1);
-		}
-
-		std::vector<Dual> vars1(d1);
-		int offset1 = d0;
-		for (int i = 0; i < d1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].diff(i + offset1, d0 + d1);
-		}
-
-		Dual f{functor(vars0.data(), vars1.data())};
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		for (int i = 0; i < d1; ++i) {
-			(*gradient)[1](i) = f.d(i + offset1);
-		}
-
-		return f.x();
+		return evaluate_gradient(variables, gradient);
 	}
 
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient,
 	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
 	{
-		typedef fadbad::B<fadbad::F<double>> BF;
-
-		std::vector<BF> vars0(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].x().diff(i, d0 + d1);
-		}
-
-		std::vector<BF> vars1(d1);
-		int offset1 = d0;
-		for (int i = 0; i < d1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].x().diff(offset1 + i, d0 + d1);
-		}
-
-		BF f = functor(vars0.data(), vars1.data());
-		f.diff(0, 1);
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = vars0[i].d(0).x();
-
-			// D0 and D0
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[0][0](i, j) = vars0[i].d(0).d(j);
-			}
-
-			// D0 and D1
-			for (int j = 0; j < d1; ++j) {
-				(*hessian)[0][1](i, j) = vars0[i].d(0).d(offset1 + j);
-			}
-		}
-
-		for (int i = 0; i < d1; ++i) {
-			(*gradient)[1](i) = vars1[i].d(0).x();
-
-			// D1 and Ds0
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[1][0](i, j) = vars1[i].d(0).d(j);
-			}
-
-			// D1 and D1
-			for (int j = 0; j < d1; ++j) {
-				(*hessian)[1][1](i, j) = vars1[i].d(0).d(offset1 + j);
+		// The scope has to outlive all dual numbers.
+		DynamicArenaScope scope;
+		DynamicDualVariables<double, arity, DynamicHyperDual<double>> vars(scope.arena,
+		                                                                   variables,
+		                                                                   dimensions);
+		DynamicHyperDual<double> f = call(vars.arguments, ArgumentIndices());
+
+		int offset0 = 0;
+		for (int var0 = 0; var0 < arity; ++var0) {
+			for (int i = 0; i < dimensions[var0]; ++i) {
+				(*gradient)[var0](i) = f.d(offset0 + i);
+				int offset1 = 0;
+				for (int var1 = 0; var1 < arity; ++var1) {
+					for (int j = 0; j < dimensions[var1]; ++j) {
+						(*hessian)[var0][var1](i, j) = f.h(offset0 + i, offset1 + j);
+					}
+					offset1 += dimensions[var1];
+				}
 			}
+			offset0 += dimensions[var0];
 		}
 
-		return f.x().x();
-	}
-
-protected:
-	const int d0, d1;
-	Functor functor;
-};
-
-
-//
-// 3-variable specialization
-//
-template<typename Functor>
-class AutoDiffTerm<Functor, Dynamic, Dynamic, Dynamic>
-	: public Term
-{
-public:
-
-	template<typename... Args>
-	AutoDiffTerm(int d0_, int d1_, int d2_, Args&&... args)
-		: d0{d0_}, d1{d1_}, d2{d2_}, functor(std::forward<Args>(args)...)
-	{ }
-
-	virtual int number_of_variables() const override
-	{
-		return 3;
-	}
-
-	virtual int variable_dimension(int var) const override
-	{
-		switch (var) {
-		default:
-		case 0: return d0;
-		case 1: return d1;
-		case 2: return d2;
-		}
+		return f.x();
 	}
 
-	virtual void read(std::istream& in) override
+	// As for AutoDiffTerm, the functor has to declare
+	// single_precision (see supports_single_precision).
+	virtual bool has_single_precision() const override
 	{
-		call_read_if_exists(in, this->functor);
+		return SinglePrecision::value;
 	}
 
-	virtual void write(std::ostream& out) const override
+	virtual double evaluate_float(float * const * const variables) const override
 	{
-		call_write_if_exists(out, this->functor);
+		return evaluate_float(variables, nullptr, SinglePrecision());
 	}
 
-	virtual double evaluate(double * const * const variables) const override
+	virtual double evaluate_float(float * const * const variables,
+	                              std::vector<Eigen::VectorXf>* gradient) const override
 	{
-		return functor(variables[0], variables[1], variables[2]);
-	}
-
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient) const override
-	{
-		typedef fadbad::F<double> Dual;
-		const int number_of_vars = d0 + d1 + d2;
-
-		std::vector<Dual> vars0(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].diff(i, number_of_vars);
-		}
-
-		std::vector<Dual> vars1(d1);
-		int offset1 = d0;
-		for (int i = 0; i < d1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].diff(i + offset1, number_of_vars);
-		}
-
-		std::vector<Dual> vars2(d2);
-		int offset2 = d0 + d1;
-		for (int i = 0; i < d2; ++i) {
-			vars2[i] = variables[2][i];
-			vars2[i].diff(i + offset2, number_of_vars);
-		}
-
-		Dual f(functor(vars0.data(), vars1.data(), vars2.data()));
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		for (int i = 0; i < d1; ++i) {
-			(*gradient)[1](i) = f.d(i + offset1);
-		}
-
-		for (int i = 0; i < d2; ++i) {
-			(*gradient)[2](i) = f.d(i + offset2);
-		}
-
-		return f.x();
-	}
-
-	virtual double evaluate(double * const * const variables,
-		std::vector<Eigen::VectorXd>* gradient,
-		std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
-	{
-		typedef fadbad::B<fadbad::F<double>> BF;
-		const int number_of_vars = d0 + d1 + d2;
-
-		std::vector<BF> vars0(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].x().diff(i, number_of_vars);
-		}
-
-		std::vector<BF> vars1(d1);
-		int offset1 = d0;
-		for (int i = 0; i < d1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].x().diff(offset1 + i, number_of_vars);
-		}
-
-		std::vector<BF> vars2(d2);
-		int offset2 = d0 + d1;
-		for (int i = 0; i < d2; ++i) {
-			vars2[i] = variables[2][i];
-			vars2[i].x().diff(offset2 + i, number_of_vars);
-		}
-
-		BF f = functor(vars0.data(), vars1.data(), vars2.data());
-		f.diff(0, 1);
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = vars0[i].d(0).x();
-
-			// D0 and D0
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[0][0](i, j) = vars0[i].d(0).d(j);
-			}
-
-			// D0 and D1
-			for (int j = 0; j < d1; ++j) {
-				(*hessian)[0][1](i, j) = vars0[i].d(0).d(offset1 + j);
-			}
-
-			// D0 and D2
-			for (int j = 0; j < d2; ++j) {
-				(*hessian)[0][2](i, j) = vars0[i].d(0).d(offset2 + j);
-			}
-		}
-
-		for (int i = 0; i < d1; ++i) {
-			(*gradient)[1](i) = vars1[i].d(0).x();
-
-			// D1 and D0
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[1][0](i, j) = vars1[i].d(0).d(j);
-			}
-
-			// D1 and D1
-			for (int j = 0; j < d1; ++j) {
-				(*hessian)[1][1](i, j) = vars1[i].d(0).d(offset1 + j);
-			}
-
-			// D1 and D2
-			for (int j = 0; j < d2; ++j) {
-				(*hessian)[1][2](i, j) = vars1[i].d(0).d(offset2 + j);
-			}
-		}
-
-		for (int i = 0; i < d2; ++i) {
-			(*gradient)[2](i) = vars2[i].d(0).x();
-
-			// D2 and D0
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[2][0](i, j) = vars2[i].d(0).d(j);
-			}
-
-			// D2 and D1
-			for (int j = 0; j < d1; ++j) {
-				(*hessian)[2][1](i, j) = vars2[i].d(0).d(offset1 + j);
-			}
-
-			// D2 and D2
-			for (int j = 0; j < d2; ++j) {
-				(*hessian)[2][2](i, j) = vars2[i].d(0).d(offset2 + j);
-			}
-		}
-
-		return f.x().x();
+		return evaluate_float(variables, gradient, SinglePrecision());
 	}
 
 protected:
-	const int d0, d1, d2;
+	const int dimensions[arity];
 	Functor functor;
-};
-
 
-//
-// 4-variable specialization
-//
-template<typename Functor>
-class AutoDiffTerm<Functor, Dynamic, Dynamic, Dynamic, Dynamic>
-	: public Term
-{
-public:
-
-	template<typename... Args>
-	AutoDiffTerm(int d0_, int d1_, int d2_, int d3_, Args&&... args)
-		: d0{d0_}, d1{d1_}, d2{d2_}, d3{d3_}, functor(std::forward<Args>(args)...)
+private:
+	template<std::size_t... I, std::size_t... J, typename Arguments>
+	AutoDiffTerm(std::index_sequence<I...>,
+	             std::index_sequence<J...>,
+	             Arguments&& arguments)
+		: dimensions{static_cast<int>(std::get<I>(arguments))...},
+		  functor(std::get<arity + J>(std::move(arguments))...)
 	{ }
 
-	virtual int number_of_variables() const override
+	// Calls functor(arguments[0], arguments[1], ...).
+	template<typename R, std::size_t... I>
+	R call(R * const * const arguments, std::index_sequence<I...>) const
 	{
-		return 4;
+		return functor(arguments[I]...);
 	}
 
-	virtual int variable_dimension(int var) const override
+	template<typename Scalar>
+	double evaluate_gradient(Scalar * const * const variables,
+	                         std::vector<Eigen::Matrix<Scalar, Eigen::Dynamic, 1>>* gradient) const
 	{
-		switch (var) {
-		default:
-		case 0: return d0;
-		case 1: return d1;
-		case 2: return d2;
-		case 3: return d3;
+		// The scope has to outlive all dual numbers.
+		DynamicArenaScope scope;
+		DynamicDualVariables<Scalar, arity> vars(scope.arena, variables, dimensions);
+		DynamicDual<Scalar> f = call(vars.arguments, ArgumentIndices());
+
+		int offset = 0;
+		for (int var = 0; var < arity; ++var) {
+			for (int i = 0; i < dimensions[var]; ++i) {
+				(*gradient)[var](i) = f.d(offset + i);
+			}
+			offset += dimensions[var];
 		}
-	}
-
-	virtual void read(std::istream& in) override
-	{
-		call_read_if_exists(in, this->functor);
-	}
 
-	virtual void write(std::ostream& out) const override
-	{
-		call_write_if_exists(out, this->functor);
+		return f.x();
 	}
 
-	virtual double evaluate(double * const * const variables) const override
-	{
-		return functor(variables[0], variables[1], variables[2], variables[3]);
-	}
+	typedef std::integral_constant<bool, supports_single_precision<Functor>::value> SinglePrecision;
 
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient) const override
+	double evaluate_float(float * const * const variables,
+	                      std::vector<Eigen::VectorXf>* gradient,
+	                      std::true_type) const
 	{
-		typedef fadbad::F<double> Dual;
-		const int number_of_vars = d0 + d1 + d2 + d3;
-
-		std::vector<Dual> vars0(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].diff(i, number_of_vars);
-		}
-
-		std::vector<Dual> vars1(d1);
-		int offset1 = d0;
-		for (int i = 0; i < d1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].diff(i + offset1, number_of_vars);
-		}
-
-		std::vector<Dual> vars2(d2);
-		int offset2 = d0 + d1;
-		for (int i = 0; i < d2; ++i) {
-			vars2[i] = variables[2][i];
-			vars2[i].diff(i + offset2, number_of_vars);
-		}
-
-		std::vector<Dual> vars3(d3);
-		int offset3 = d0 + d1 + d2;
-		for (int i = 0; i < d3; ++i) {
-			vars3[i] = variables[3][i];
-			vars3[i].diff(i + offset3, number_of_vars);
+		if (gradient) {
+			return evaluate_gradient(variables, gradient);
 		}
-
-		Dual f(functor(vars0.data(), vars1.data(), vars2.data(), vars3.data()));
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		for (int i = 0; i < d1; ++i) {
-			(*gradient)[1](i) = f.d(i + offset1);
-		}
-
-		for (int i = 0; i < d2; ++i) {
-			(*gradient)[2](i) = f.d(i + offset2);
-		}
-
-		for (int i = 0; i < d3; ++i) {
-			(*gradient)[3](i) = f.d(i + offset3);
-		}
-
-		return f.x();
+		return call(variables, ArgumentIndices());
 	}
 
-	virtual double evaluate(double * const * const variables,
-	                        std::vector<Eigen::VectorXd>* gradient,
-	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	double evaluate_float(float * const * const variables,
+	                      std::vector<Eigen::VectorXf>* gradient,
+	                      std::false_type) const
 	{
-		typedef fadbad::B<fadbad::F<double>> BF;
-		const int number_of_vars = d0 + d1 + d2 + d3;
-
-		std::vector<BF> vars0(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].x().diff(i, number_of_vars);
-		}
-
-		std::vector<BF> vars1(d1);
-		const int offset1 = d0;
-		for (int i = 0; i < d1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].x().diff(offset1 + i, number_of_vars);
-		}
-
-		std::vector<BF> vars2(d2);
-		const int offset2 = d0 + d1;
-		for (int i = 0; i < d2; ++i) {
-			vars2[i] = variables[2][i];
-			vars2[i].x().diff(offset2 + i, number_of_vars);
-		}
-
-		std::vector<BF> vars3(d3);
-		const int offset3 = d0 + d1 + d2;
-		for (int i = 0; i < d3; ++i) {
-			vars3[i] = variables[3][i];
-			vars3[i].x().diff(offset3 + i, number_of_vars);
-		}
-
-		BF f = functor(vars0.data(), vars1.data(), vars2.data(), vars3.data());
-		f.diff(0, 1);
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = vars0[i].d(0).x();
-
-			// D0 and D0
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[0][0](i, j) = vars0[i].d(0).d(j);
-			}
-
-			// D0 and D1
-			for (int j = 0; j < d1; ++j) {
-				(*hessian)[0][1](i, j) = vars0[i].d(0).d(offset1 + j);
-			}
-
-			// D0 and D2
-			for (int j = 0; j < d2; ++j) {
-				(*hessian)[0][2](i, j) = vars0[i].d(0).d(offset2 + j);
-			}
-
-			// D0 and D3
-			for (int j = 0; j < d3; ++j) {
-				(*hessian)[0][3](i, j) = vars0[i].d(0).d(offset3 + j);
-			}
-		}
-
-		for (int i = 0; i < d1; ++i) {
-			(*gradient)[1](i) = vars1[i].d(0).x();
-
-			// D1 and D0
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[1][0](i, j) = vars1[i].d(0).d(j);
-			}
-
-			// D1 and D1
-			for (int j = 0; j < d1; ++j) {
-				(*hessian)[1][1](i, j) = vars1[i].d(0).d(offset1 + j);
-			}
-
-			// D1 and D2
-			for (int j = 0; j < d2; ++j) {
-				(*hessian)[1][2](i, j) = vars1[i].d(0).d(offset2 + j);
-			}
-
-			// D1 and D2
-			for (int j = 0; j < d3; ++j) {
-				(*hessian)[1][3](i, j) = vars1[i].d(0).d(offset3 + j);
-			}
-		}
-
-		for (int i = 0; i < d2; ++i) {
-			(*gradient)[2](i) = vars2[i].d(0).x();
-
-			// D2 and D0
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[2][0](i, j) = vars2[i].d(0).d(j);
-			}
-
-			// D2 and D1
-			for (int j = 0; j < d1; ++j) {
-				(*hessian)[2][1](i, j) = vars2[i].d(0).d(offset1 + j);
-			}
-
-			// D2 and D2
-			for (int j = 0; j < d2; ++j) {
-				(*hessian)[2][2](i, j) = vars2[i].d(0).d(offset2 + j);
-			}
-
-			// D2 and D3
-			for (int j = 0; j < d3; ++j) {
-				(*hessian)[2][3](i, j) = vars2[i].d(0).d(offset3 + j);
-			}
-		}
-
-		for (int i = 0; i < d3; ++i) {
-			(*gradient)[3](i) = vars3[i].d(0).x();
-
-			// D3 and D0
-			for (int j = 0; j < d0; ++j) {
-				(*hessian)[3][0](i, j) = vars3[i].d(0).d(j);
-			}
-
-			// D3 and D1
-			for (int j = 0; j < d1; ++j) {
-				(*hessian)[3][1](i, j) = vars3[i].d(0).d(offset1 + j);
-			}
-
-			// D3 and D2
-			for (int j = 0; j < d2; ++j) {
-				(*hessian)[3][2](i, j) = vars3[i].d(0).d(offset2 + j);
-			}
-
-			// D3 and D3
-			for (int j = 0; j < d3; ++j) {
-				(*hessian)[3][3](i, j) = vars3[i].d(0).d(offset3 + j);
-			}
-		}
-
-		return f.x().x();
+		return Term::evaluate_float(variables, gradient);
 	}
-
-protected:
-	const int d0, d1, d2, d3;
-	Functor functor;
 };
 
 }  // namespace spii
@@ -0,0 +1,644 @@
+#ifndef SPII_DYNAMIC_DUAL_H
+#define SPII_DYNAMIC_DUAL_H
+// This header defines DynamicDual, a forward-mode dual number whose
+// number of derivatives is given at runtime. It is used by the
+// dynamic versions of AutoDiffTerm to compute gradients.
+//
+// A few derivatives are stored in the number itself. Larger arrays
+// are taken from DynamicArena, a per-thread bump allocator. Arrays
+// freed during an evaluation are reused by the next number of the
+// same size and the whole arena is reset when the outermost
+// DynamicArenaScope ends, so no allocations are made once the arena
+// has grown to the size of the largest function.
+//
+// A DynamicDual may not outlive the DynamicArenaScope it was created
+// in.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace spii {
+
+class DynamicArena
+{
+public:
+	// The arena of the calling thread.
+	static DynamicArena& thread_arena()
+	{
+		static thread_local DynamicArena arena;
+		return arena;
+	}
+
+	DynamicArena()
+		: current_block(0), offset(0), chunk_size(0), depth(0)
+	{ }
+
+	void* allocate(std::size_t bytes)
+	{
+		bytes = (bytes + alignment - 1) / alignment * alignment;
+
+		if (bytes == chunk_size && !free_chunks.empty()) {
+			void* chunk = free_chunks.back();
+			free_chunks.pop_back();
+			return chunk;
+		}
+
+		while (current_block < blocks.size() && offset + bytes > block_sizes[current_block]) {
+			current_block++;
+			offset = 0;
+		}
+		if (current_block == blocks.size()) {
+			std::size_t size = minimum_block_size;
+			if (!block_sizes.empty()) {
+				size = 2 * block_sizes.back();
+			}
+			size = std::max(size, bytes);
+			blocks.emplace_back(new char[size]);
+			block_sizes.push_back(size);
+		}
+
+		void* chunk = blocks[current_block].get() + offset;
+		offset += bytes;
+		return chunk;
+	}
+
+	void deallocate(void* chunk, std::size_t bytes)
+	{
+		bytes = (bytes + alignment - 1) / alignment * alignment;
+		// Almost all arrays freed in an evaluation have the same size,
+		// namely the number of variables of the term. Freed arrays of
+		// that size are kept in a list; other arrays are not reused
+		// until the arena is reset.
+		if (chunk_size == 0) {
+			chunk_size = bytes;
+		}
+		if (bytes == chunk_size) {
+			free_chunks.push_back(chunk);
+		}
+	}
+
+	void begin_scope()
+	{
+		depth++;
+	}
+
+	// Makes all memory available again when the outermost scope ends.
+	void end_scope()
+	{
+		if (--depth == 0) {
+			current_block = 0;
+			offset = 0;
+			chunk_size = 0;
+			free_chunks.clear();
+		}
+	}
+
+private:
+	DynamicArena(const DynamicArena&);
+	DynamicArena& operator = (const DynamicArena&);
+
+	static const std::size_t alignment = alignof(std::max_align_t);
+	static const std::size_t minimum_block_size = 64 * 1024;
+
+	std::vector<std::unique_ptr<char[]>> blocks;
+	std::vector<std::size_t> block_sizes;
+	std::size_t current_block;
+	std::size_t offset;
+
+	std::size_t chunk_size;
+	std::vector<void*> free_chunks;
+
+	int depth;
+};
+
+// Resets the arena of the calling thread when the outermost scope
+// goes out of scope, also if the function throws. Scopes may be
+// nested.
+class DynamicArenaScope
+{
+public:
+	DynamicArenaScope()
+		: arena(DynamicArena::thread_arena())
+	{
+		arena.begin_scope();
+	}
+
+	~DynamicArenaScope()
+	{
+		arena.end_scope();
+	}
+
+	DynamicArena& arena;
+
+private:
+	DynamicArenaScope(const DynamicArenaScope&);
+	DynamicArenaScope& operator = (const DynamicArenaScope&);
+};
+
+template<typename T>
+class DynamicDual
+{
+public:
+	// Numbers with at most this many derivatives do not use the arena.
+	static const int local_size = 4;
+
+	// Constants have no derivatives. They behave as if all their
+	// derivatives were zero.
+	DynamicDual()
+		: value(0), n(0), derivatives(nullptr)
+	{ }
+
+	DynamicDual(const T& value_)
+		: value(value_), n(0), derivatives(nullptr)
+	{ }
+
+	// Creates the dual number for variable number index out of size
+	// variables.
+	DynamicDual(const T& value_, int index, int size)
+		: value(value_)
+	{
+		allocate(size);
+		for (int i = 0; i < n; ++i) {
+			derivatives[i] = 0;
+		}
+		derivatives[index] = 1;
+	}
+
+	DynamicDual(const DynamicDual& other)
+		: value(other.value)
+	{
+		allocate(other.n);
+		copy_derivatives(other);
+	}
+
+	DynamicDual(DynamicDual&& other)
+		: value(other.value)
+	{
+		steal(other);
+	}
+
+	~DynamicDual()
+	{
+		release();
+	}
+
+	DynamicDual& operator = (const DynamicDual& other)
+	{
+		if (this != &other) {
+			if (n != other.n) {
+				release();
+				allocate(other.n);
+			}
+			value = other.value;
+			copy_derivatives(other);
+		}
+		return *this;
+	}
+
+	DynamicDual& operator = (DynamicDual&& other)
+	{
+		if (this != &other) {
+			release();
+			value = other.value;
+			steal(other);
+		}
+		return *this;
+	}
+
+	T& x()
+	{
+		return value;
+	}
+
+	const T& x() const
+	{
+		return value;
+	}
+
+	T d(int i) const
+	{
+		return i < n ? derivatives[i] : T(0);
+	}
+
+	int size() const
+	{
+		return n;
+	}
+
+	DynamicDual& operator += (const DynamicDual& rhs)
+	{
+		if (n == rhs.n) {
+			value += rhs.value;
+			for (int i = 0; i < n; ++i) {
+				derivatives[i] += rhs.derivatives[i];
+			}
+			return *this;
+		}
+		return *this = *this + rhs;
+	}
+
+	DynamicDual& operator -= (const DynamicDual& rhs)
+	{
+		if (n == rhs.n) {
+			value -= rhs.value;
+			for (int i = 0; i < n; ++i) {
+				derivatives[i] -= rhs.derivatives[i];
+			}
+			return *this;
+		}
+		return *this = *this - rhs;
+	}
+
+	DynamicDual& operator *= (const DynamicDual& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	DynamicDual& operator /= (const DynamicDual& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	DynamicDual& operator += (const T& rhs)
+	{
+		value += rhs;
+		return *this;
+	}
+
+	DynamicDual& operator -= (const T& rhs)
+	{
+		value -= rhs;
+		return *this;
+	}
+
+	DynamicDual& operator *= (const T& rhs)
+	{
+		value *= rhs;
+		for (int i = 0; i < n; ++i) {
+			derivatives[i] *= rhs;
+		}
+		return *this;
+	}
+
+	DynamicDual& operator /= (const T& rhs)
+	{
+		return *this *= T(1) / rhs;
+	}
+
+	//
+	// As for Dual, the operators and functions below are friends
+	// defined in the class so that the other argument may be
+	// implicitly converted, e.g. pow(x, 2) or 2 * x.
+	//
+
+	friend DynamicDual operator + (const DynamicDual& arg)
+	{
+		return arg;
+	}
+
+	friend DynamicDual operator - (const DynamicDual& arg)
+	{
+		return chain(arg, -arg.value, T(-1));
+	}
+
+	friend DynamicDual operator + (const DynamicDual& lhs, const DynamicDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value + rhs.value, T(1), T(1));
+	}
+
+	friend DynamicDual operator - (const DynamicDual& lhs, const DynamicDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value - rhs.value, T(1), T(-1));
+	}
+
+	friend DynamicDual operator * (const DynamicDual& lhs, const DynamicDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value * rhs.value, rhs.value, lhs.value);
+	}
+
+	friend DynamicDual operator / (const DynamicDual& lhs, const DynamicDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs.value * inverse;
+		return chain(lhs, rhs, value, inverse, -value * inverse);
+	}
+
+	friend DynamicDual operator + (const DynamicDual& lhs, const T& rhs)
+	{
+		DynamicDual result(lhs);
+		result.value += rhs;
+		return result;
+	}
+
+	friend DynamicDual operator + (const T& lhs, const DynamicDual& rhs)
+	{
+		return rhs + lhs;
+	}
+
+	friend DynamicDual operator - (const DynamicDual& lhs, const T& rhs)
+	{
+		DynamicDual result(lhs);
+		result.value -= rhs;
+		return result;
+	}
+
+	friend DynamicDual operator - (const T& lhs, const DynamicDual& rhs)
+	{
+		return chain(rhs, lhs - rhs.value, T(-1));
+	}
+
+	friend DynamicDual operator * (const DynamicDual& lhs, const T& rhs)
+	{
+		return chain(lhs, lhs.value * rhs, rhs);
+	}
+
+	friend DynamicDual operator * (const T& lhs, const DynamicDual& rhs)
+	{
+		return chain(rhs, lhs * rhs.value, lhs);
+	}
+
+	friend DynamicDual operator / (const DynamicDual& lhs, const T& rhs)
+	{
+		T inverse = T(1) / rhs;
+		return chain(lhs, lhs.value * inverse, inverse);
+	}
+
+	friend DynamicDual operator / (const T& lhs, const DynamicDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs * inverse;
+		return chain(rhs, value, -value * inverse);
+	}
+
+	#define SPII_DYNAMIC_DUAL_COMPARISON(op)                                        \
+		friend bool operator op (const DynamicDual& lhs, const DynamicDual& rhs)    \
+		{                                                                           \
+			return lhs.value op rhs.value;                                          \
+		}                                                                           \
+		friend bool operator op (const DynamicDual& lhs, const T& rhs)              \
+		{                                                                           \
+			return lhs.value op rhs;                                                \
+		}                                                                           \
+		friend bool operator op (const T& lhs, const DynamicDual& rhs)              \
+		{                                                                           \
+			return lhs op rhs.value;                                                \
+		}
+	SPII_DYNAMIC_DUAL_COMPARISON(==)
+	SPII_DYNAMIC_DUAL_COMPARISON(!=)
+	SPII_DYNAMIC_DUAL_COMPARISON(<)
+	SPII_DYNAMIC_DUAL_COMPARISON(<=)
+	SPII_DYNAMIC_DUAL_COMPARISON(>)
+	SPII_DYNAMIC_DUAL_COMPARISON(>=)
+	#undef SPII_DYNAMIC_DUAL_COMPARISON
+
+	friend DynamicDual abs(const DynamicDual& arg)
+	{
+		return arg.value < 0 ? -arg : arg;
+	}
+
+	friend DynamicDual fabs(const DynamicDual& arg)
+	{
+		return abs(arg);
+	}
+
+	friend DynamicDual sqr(const DynamicDual& arg)
+	{
+		return chain(arg, arg.value * arg.value, 2 * arg.value);
+	}
+
+	friend DynamicDual sqrt(const DynamicDual& arg)
+	{
+		using std::sqrt;
+		T value = sqrt(arg.value);
+		return chain(arg, value, T(0.5) / value);
+	}
+
+	friend DynamicDual exp(const DynamicDual& arg)
+	{
+		using std::exp;
+		T value = exp(arg.value);
+		return chain(arg, value, value);
+	}
+
+	friend DynamicDual log(const DynamicDual& arg)
+	{
+		using std::log;
+		return chain(arg, log(arg.value), T(1) / arg.value);
+	}
+
+	friend DynamicDual log10(const DynamicDual& arg)
+	{
+		using std::log;
+		using std::log10;
+		return chain(arg, log10(arg.value), T(1) / (arg.value * log(T(10))));
+	}
+
+	friend DynamicDual sin(const DynamicDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		return chain(arg, sin(arg.value), cos(arg.value));
+	}
+
+	friend DynamicDual cos(const DynamicDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		return chain(arg, cos(arg.value), -sin(arg.value));
+	}
+
+	friend DynamicDual tan(const DynamicDual& arg)
+	{
+		using std::tan;
+		T value = tan(arg.value);
+		return chain(arg, value, 1 + value * value);
+	}
+
+	friend DynamicDual asin(const DynamicDual& arg)
+	{
+		using std::asin;
+		using std::sqrt;
+		return chain(arg, asin(arg.value), T(1) / sqrt(1 - arg.value * arg.value));
+	}
+
+	friend DynamicDual acos(const DynamicDual& arg)
+	{
+		using std::acos;
+		using std::sqrt;
+		return chain(arg, acos(arg.value), T(-1) / sqrt(1 - arg.value * arg.value));
+	}
+
+	friend DynamicDual atan(const DynamicDual& arg)
+	{
+		using std::atan;
+		return chain(arg, atan(arg.value), T(1) / (1 + arg.value * arg.value));
+	}
+
+	friend DynamicDual sinh(const DynamicDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		return chain(arg, sinh(arg.value), cosh(arg.value));
+	}
+
+	friend DynamicDual cosh(const DynamicDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		return chain(arg, cosh(arg.value), sinh(arg.value));
+	}
+
+	friend DynamicDual tanh(const DynamicDual& arg)
+	{
+		using std::tanh;
+		T value = tanh(arg.value);
+		return chain(arg, value, 1 - value * value);
+	}
+
+	friend DynamicDual pow(const DynamicDual& base, const T& exponent)
+	{
+		using std::pow;
+		return chain(base, pow(base.value, exponent), exponent * pow(base.value, exponent - 1));
+	}
+
+	friend DynamicDual pow(const T& base, const DynamicDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base, exponent.value);
+		return chain(exponent, value, value * log(base));
+	}
+
+	friend DynamicDual pow(const DynamicDual& base, const DynamicDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base.value, exponent.value);
+		return chain(base, exponent, value,
+		             exponent.value * pow(base.value, exponent.value - 1),
+		             value * log(base.value));
+	}
+
+	friend DynamicDual atan2(const DynamicDual& y, const DynamicDual& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y.value * y.value);
+		return chain(y, x, atan2(y.value, x.value), x.value * inverse, -y.value * inverse);
+	}
+
+	friend DynamicDual atan2(const DynamicDual& y, const T& x)
+	{
+		using std::atan2;
+		return chain(y, atan2(y.value, x), x / (x * x + y.value * y.value));
+	}
+
+	friend DynamicDual atan2(const T& y, const DynamicDual& x)
+	{
+		using std::atan2;
+		return chain(x, atan2(y, x.value), -y / (x.value * x.value + y * y));
+	}
+
+private:
+	// Returns f(arg), given f(arg.x()) and f'(arg.x()).
+	static DynamicDual chain(const DynamicDual& arg, const T& value, const T& derivative)
+	{
+		DynamicDual result(value, arg.n);
+		for (int i = 0; i < arg.n; ++i) {
+			result.derivatives[i] = derivative * arg.derivatives[i];
+		}
+		return result;
+	}
+
+	// Returns f(a, b), given f and its partial derivatives evaluated
+	// at (a.x(), b.x()).
+	static DynamicDual chain(const DynamicDual& a,
+	                         const DynamicDual& b,
+	                         const T& value,
+	                         const T& da,
+	                         const T& db)
+	{
+		if (a.n == b.n) {
+			DynamicDual result(value, a.n);
+			for (int i = 0; i < a.n; ++i) {
+				result.derivatives[i] = da * a.derivatives[i] + db * b.derivatives[i];
+			}
+			return result;
+		}
+		else if (a.n == 0) {
+			return chain(b, value, db);
+		}
+		else if (b.n == 0) {
+			return chain(a, value, da);
+		}
+
+		DynamicDual result(value, std::max(a.n, b.n));
+		for (int i = 0; i < result.n; ++i) {
+			result.derivatives[i] = da * a.d(i) + db * b.d(i);
+		}
+		return result;
+	}
+
+	// Creates a number whose size derivatives are set later.
+	DynamicDual(const T& value_, int size)
+		: value(value_)
+	{
+		allocate(size);
+	}
+
+	void allocate(int size)
+	{
+		n = size;
+		if (n == 0) {
+			derivatives = nullptr;
+		}
+		else if (n <= local_size) {
+			derivatives = local;
+		}
+		else {
+			void* chunk = DynamicArena::thread_arena().allocate(n * sizeof(T));
+			derivatives = static_cast<T*>(chunk);
+		}
+	}
+
+	void release()
+	{
+		if (n > local_size) {
+			DynamicArena::thread_arena().deallocate(derivatives, n * sizeof(T));
+		}
+	}
+
+	void copy_derivatives(const DynamicDual& other)
+	{
+		for (int i = 0; i < n; ++i) {
+			derivatives[i] = other.derivatives[i];
+		}
+	}
+
+	// Takes the derivatives of other, which becomes a constant.
+	void steal(DynamicDual& other)
+	{
+		if (other.n <= local_size) {
+			allocate(other.n);
+			copy_derivatives(other);
+		}
+		else {
+			n = other.n;
+			derivatives = other.derivatives;
+		}
+		other.n = 0;
+		other.derivatives = nullptr;
+	}
+
+	T value;
+	int n;
+	T* derivatives;
+	T local[local_size];
+};
+
+}  // namespace spii
+
+#endif
@@ -0,0 +1,593 @@
+#ifndef SPII_DYNAMIC_HYPER_DUAL_H
+#define SPII_DYNAMIC_HYPER_DUAL_H
+// This header defines DynamicHyperDual, the second-order counterpart
+// of DynamicDual (see hyper_dual.h). The number of variables is given
+// at runtime. It is used by the dynamic versions of AutoDiffTerm to
+// compute Hessians.
+//
+// The first derivatives and the packed upper triangle of the second
+// derivatives are stored in one array from the DynamicArena of the
+// calling thread. All arrays of an evaluation have the same size, so
+// freed arrays are always reused and no allocations are made once
+// the arena has grown.
+//
+// All numbers with derivatives in an expression have to have the same
+// number of variables. A DynamicHyperDual may not outlive the
+// DynamicArenaScope it was created in.
+//
+
+#include <cmath>
+
+#include <spii/dynamic_dual.h>
+
+namespace spii {
+
+template<typename T>
+class DynamicHyperDual
+{
+public:
+	// Constants have no derivatives. They behave as if all their
+	// derivatives were zero.
+	DynamicHyperDual()
+		: value(0), n(0), data(nullptr)
+	{ }
+
+	DynamicHyperDual(const T& value_)
+		: value(value_), n(0), data(nullptr)
+	{ }
+
+	// Creates the number for variable number index out of size
+	// variables.
+	DynamicHyperDual(const T& value_, int index, int size)
+		: value(value_)
+	{
+		allocate(size);
+		for (int k = 0; k < storage_size(); ++k) {
+			data[k] = 0;
+		}
+		data[index] = 1;
+	}
+
+	DynamicHyperDual(const DynamicHyperDual& other)
+		: value(other.value)
+	{
+		allocate(other.n);
+		copy_derivatives(other);
+	}
+
+	DynamicHyperDual(DynamicHyperDual&& other)
+		: value(other.value), n(other.n), data(other.data)
+	{
+		other.n = 0;
+		other.data = nullptr;
+	}
+
+	~DynamicHyperDual()
+	{
+		release();
+	}
+
+	DynamicHyperDual& operator = (const DynamicHyperDual& other)
+	{
+		if (this != &other) {
+			if (n != other.n) {
+				release();
+				allocate(other.n);
+			}
+			value = other.value;
+			copy_derivatives(other);
+		}
+		return *this;
+	}
+
+	DynamicHyperDual& operator = (DynamicHyperDual&& other)
+	{
+		if (this != &other) {
+			release();
+			value = other.value;
+			n = other.n;
+			data = other.data;
+			other.n = 0;
+			other.data = nullptr;
+		}
+		return *this;
+	}
+
+	T& x()
+	{
+		return value;
+	}
+
+	const T& x() const
+	{
+		return value;
+	}
+
+	// First derivative with respect to variable i.
+	T d(int i) const
+	{
+		return i < n ? data[i] : T(0);
+	}
+
+	// Second derivative with respect to variables i and j.
+	T h(int i, int j) const
+	{
+		if (i > j) {
+			int tmp = i;
+			i = j;
+			j = tmp;
+		}
+		if (j >= n) {
+			return T(0);
+		}
+		return data[n + i * n - i * (i - 1) / 2 + (j - i)];
+	}
+
+	int size() const
+	{
+		return n;
+	}
+
+	DynamicHyperDual& operator += (const DynamicHyperDual& rhs)
+	{
+		if (n == rhs.n) {
+			value += rhs.value;
+			for (int k = 0; k < storage_size(); ++k) {
+				data[k] += rhs.data[k];
+			}
+			return *this;
+		}
+		return *this = *this + rhs;
+	}
+
+	DynamicHyperDual& operator -= (const DynamicHyperDual& rhs)
+	{
+		if (n == rhs.n) {
+			value -= rhs.value;
+			for (int k = 0; k < storage_size(); ++k) {
+				data[k] -= rhs.data[k];
+			}
+			return *this;
+		}
+		return *this = *this - rhs;
+	}
+
+	DynamicHyperDual& operator *= (const DynamicHyperDual& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	DynamicHyperDual& operator /= (const DynamicHyperDual& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	DynamicHyperDual& operator += (const T& rhs)
+	{
+		value += rhs;
+		return *this;
+	}
+
+	DynamicHyperDual& operator -= (const T& rhs)
+	{
+		value -= rhs;
+		return *this;
+	}
+
+	DynamicHyperDual& operator *= (const T& rhs)
+	{
+		value *= rhs;
+		for (int k = 0; k < storage_size(); ++k) {
+			data[k] *= rhs;
+		}
+		return *this;
+	}
+
+	DynamicHyperDual& operator /= (const T& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	//
+	// As for Dual, the operators and functions below are friends
+	// defined in the class so that the other argument may be
+	// implicitly converted, e.g. pow(x, 2) or 2 * x.
+	//
+
+	friend DynamicHyperDual operator + (const DynamicHyperDual& arg)
+	{
+		return arg;
+	}
+
+	friend DynamicHyperDual operator - (const DynamicHyperDual& arg)
+	{
+		return chain(arg, -arg.value, T(-1), T(0));
+	}
+
+	friend DynamicHyperDual operator + (const DynamicHyperDual& lhs, const DynamicHyperDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value + rhs.value, T(1), T(1), T(0), T(0), T(0));
+	}
+
+	friend DynamicHyperDual operator - (const DynamicHyperDual& lhs, const DynamicHyperDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value - rhs.value, T(1), T(-1), T(0), T(0), T(0));
+	}
+
+	friend DynamicHyperDual operator * (const DynamicHyperDual& lhs, const DynamicHyperDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value * rhs.value, rhs.value, lhs.value, T(0), T(1), T(0));
+	}
+
+	// As for HyperDual, the value is divided and not multiplied by
+	// the inverse.
+	friend DynamicHyperDual operator / (const DynamicHyperDual& lhs, const DynamicHyperDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs.value / rhs.value;
+		T inverse2 = inverse * inverse;
+		return chain(lhs, rhs, value,
+		             inverse, -value * inverse,
+		             T(0), -inverse2, 2 * value * inverse2);
+	}
+
+	friend DynamicHyperDual operator + (const DynamicHyperDual& lhs, const T& rhs)
+	{
+		DynamicHyperDual result(lhs);
+		result.value += rhs;
+		return result;
+	}
+
+	friend DynamicHyperDual operator + (const T& lhs, const DynamicHyperDual& rhs)
+	{
+		return rhs + lhs;
+	}
+
+	friend DynamicHyperDual operator - (const DynamicHyperDual& lhs, const T& rhs)
+	{
+		DynamicHyperDual result(lhs);
+		result.value -= rhs;
+		return result;
+	}
+
+	friend DynamicHyperDual operator - (const T& lhs, const DynamicHyperDual& rhs)
+	{
+		return chain(rhs, lhs - rhs.value, T(-1), T(0));
+	}
+
+	friend DynamicHyperDual operator * (const DynamicHyperDual& lhs, const T& rhs)
+	{
+		return chain(lhs, lhs.value * rhs, rhs, T(0));
+	}
+
+	friend DynamicHyperDual operator * (const T& lhs, const DynamicHyperDual& rhs)
+	{
+		return chain(rhs, lhs * rhs.value, lhs, T(0));
+	}
+
+	friend DynamicHyperDual operator / (const DynamicHyperDual& lhs, const T& rhs)
+	{
+		T inverse = T(1) / rhs;
+		return chain(lhs, lhs.value / rhs, inverse, T(0));
+	}
+
+	friend DynamicHyperDual operator / (const T& lhs, const DynamicHyperDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs / rhs.value;
+		return chain(rhs, value, -value * inverse, 2 * value * inverse * inverse);
+	}
+
+	#define SPII_DYNAMIC_HYPER_DUAL_COMPARISON(op)                                        \
+		friend bool operator op (const DynamicHyperDual& lhs, const DynamicHyperDual& rhs) \
+		{                                                                                  \
+			return lhs.value op rhs.value;                                                 \
+		}                                                                                  \
+		friend bool operator op (const DynamicHyperDual& lhs, const T& rhs)                \
+		{                                                                                  \
+			return lhs.value op rhs;                                                       \
+		}                                                                                  \
+		friend bool operator op (const T& lhs, const DynamicHyperDual& rhs)                \
+		{                                                                                  \
+			return lhs op rhs.value;                                                       \
+		}
+	SPII_DYNAMIC_HYPER_DUAL_COMPARISON(==)
+	SPII_DYNAMIC_HYPER_DUAL_COMPARISON(!=)
+	SPII_DYNAMIC_HYPER_DUAL_COMPARISON(<)
+	SPII_DYNAMIC_HYPER_DUAL_COMPARISON(<=)
+	SPII_DYNAMIC_HYPER_DUAL_COMPARISON(>)
+	SPII_DYNAMIC_HYPER_DUAL_COMPARISON(>=)
+	#undef SPII_DYNAMIC_HYPER_DUAL_COMPARISON
+
+	friend DynamicHyperDual abs(const DynamicHyperDual& arg)
+	{
+		return arg.value < 0 ? -arg : arg;
+	}
+
+	friend DynamicHyperDual fabs(const DynamicHyperDual& arg)
+	{
+		return abs(arg);
+	}
+
+	friend DynamicHyperDual sqr(const DynamicHyperDual& arg)
+	{
+		return chain(arg, arg.value * arg.value, 2 * arg.value, T(2));
+	}
+
+	friend DynamicHyperDual sqrt(const DynamicHyperDual& arg)
+	{
+		using std::sqrt;
+		T value = sqrt(arg.value);
+		T derivative = T(0.5) / value;
+		return chain(arg, value, derivative, -derivative / (2 * arg.value));
+	}
+
+	friend DynamicHyperDual exp(const DynamicHyperDual& arg)
+	{
+		using std::exp;
+		T value = exp(arg.value);
+		return chain(arg, value, value, value);
+	}
+
+	friend DynamicHyperDual log(const DynamicHyperDual& arg)
+	{
+		using std::log;
+		T inverse = T(1) / arg.value;
+		return chain(arg, log(arg.value), inverse, -inverse * inverse);
+	}
+
+	friend DynamicHyperDual log10(const DynamicHyperDual& arg)
+	{
+		using std::log;
+		using std::log10;
+		T inverse = T(1) / (arg.value * log(T(10)));
+		return chain(arg, log10(arg.value), inverse, -inverse / arg.value);
+	}
+
+	friend DynamicHyperDual sin(const DynamicHyperDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		T value = sin(arg.value);
+		return chain(arg, value, cos(arg.value), -value);
+	}
+
+	friend DynamicHyperDual cos(const DynamicHyperDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		T value = cos(arg.value);
+		return chain(arg, value, -sin(arg.value), -value);
+	}
+
+	friend DynamicHyperDual tan(const DynamicHyperDual& arg)
+	{
+		using std::tan;
+		T value = tan(arg.value);
+		T derivative = 1 + value * value;
+		return chain(arg, value, derivative, 2 * value * derivative);
+	}
+
+	friend DynamicHyperDual asin(const DynamicHyperDual& arg)
+	{
+		using std::asin;
+		using std::sqrt;
+		T derivative = T(1) / sqrt(1 - arg.value * arg.value);
+		return chain(arg, asin(arg.value), derivative,
+		             arg.value * derivative * derivative * derivative);
+	}
+
+	friend DynamicHyperDual acos(const DynamicHyperDual& arg)
+	{
+		using std::acos;
+		using std::sqrt;
+		T derivative = T(-1) / sqrt(1 - arg.value * arg.value);
+		return chain(arg, acos(arg.value), derivative,
+		             arg.value * derivative * derivative * derivative);
+	}
+
+	friend DynamicHyperDual atan(const DynamicHyperDual& arg)
+	{
+		using std::atan;
+		T derivative = T(1) / (1 + arg.value * arg.value);
+		return chain(arg, atan(arg.value), derivative,
+		             -2 * arg.value * derivative * derivative);
+	}
+
+	friend DynamicHyperDual sinh(const DynamicHyperDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		T value = sinh(arg.value);
+		return chain(arg, value, cosh(arg.value), value);
+	}
+
+	friend DynamicHyperDual cosh(const DynamicHyperDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		T value = cosh(arg.value);
+		return chain(arg, value, sinh(arg.value), value);
+	}
+
+	friend DynamicHyperDual tanh(const DynamicHyperDual& arg)
+	{
+		using std::tanh;
+		T value = tanh(arg.value);
+		T derivative = 1 - value * value;
+		return chain(arg, value, derivative, -2 * value * derivative);
+	}
+
+	friend DynamicHyperDual pow(const DynamicHyperDual& base, const T& exponent)
+	{
+		using std::pow;
+		T value = pow(base.value, exponent);
+		T derivative = exponent * pow(base.value, exponent - 1);
+		T derivative2 = exponent * (exponent - 1) * pow(base.value, exponent - 2);
+		return chain(base, value, derivative, derivative2);
+	}
+
+	friend DynamicHyperDual pow(const T& base, const DynamicHyperDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base, exponent.value);
+		T log_base = log(base);
+		return chain(exponent, value, value * log_base, value * log_base * log_base);
+	}
+
+	friend DynamicHyperDual pow(const DynamicHyperDual& base, const DynamicHyperDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T a = base.value;
+		T b = exponent.value;
+		T value = pow(a, b);
+		T log_a = log(a);
+		T power1 = pow(a, b - 1);
+		return chain(base, exponent, value,
+		             b * power1, value * log_a,
+		             b * (b - 1) * pow(a, b - 2), power1 * (1 + b * log_a), value * log_a * log_a);
+	}
+
+	friend DynamicHyperDual atan2(const DynamicHyperDual& y, const DynamicHyperDual& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y.value * y.value);
+		T inverse2 = inverse * inverse;
+		T xy = x.value * y.value;
+		return chain(y, x, atan2(y.value, x.value),
+		             x.value * inverse, -y.value * inverse,
+		             -2 * xy * inverse2,
+		             (y.value * y.value - x.value * x.value) * inverse2,
+		             2 * xy * inverse2);
+	}
+
+	friend DynamicHyperDual atan2(const DynamicHyperDual& y, const T& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x * x + y.value * y.value);
+		return chain(y, atan2(y.value, x), x * inverse, -2 * x * y.value * inverse * inverse);
+	}
+
+	friend DynamicHyperDual atan2(const T& y, const DynamicHyperDual& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y * y);
+		return chain(x, atan2(y, x.value), -y * inverse, 2 * x.value * y * inverse * inverse);
+	}
+
+private:
+	// Returns f(arg), given f, f' and f'' evaluated at arg.x().
+	static DynamicHyperDual chain(const DynamicHyperDual& arg,
+	                              const T& value,
+	                              const T& derivative,
+	                              const T& derivative2)
+	{
+		DynamicHyperDual result(value, arg.n);
+		const int n = arg.n;
+		const T* gradient = arg.data;
+		const T* hessian = arg.data + n;
+		T* result_hessian = result.data + n;
+		for (int i = 0; i < n; ++i) {
+			result.data[i] = derivative * gradient[i];
+		}
+		int k = 0;
+		for (int i = 0; i < n; ++i) {
+			const T scaled_i = derivative2 * gradient[i];
+			for (int j = i; j < n; ++j, ++k) {
+				result_hessian[k] = derivative * hessian[k] + scaled_i * gradient[j];
+			}
+		}
+		return result;
+	}
+
+	// Returns f(a, b), given f and its first and second partial
+	// derivatives evaluated at (a.x(), b.x()).
+	static DynamicHyperDual chain(const DynamicHyperDual& a,
+	                              const DynamicHyperDual& b,
+	                              const T& value,
+	                              const T& da,
+	                              const T& db,
+	                              const T& daa,
+	                              const T& dab,
+	                              const T& dbb)
+	{
+		if (a.n == 0) {
+			return chain(b, value, db, dbb);
+		}
+		else if (b.n == 0) {
+			return chain(a, value, da, daa);
+		}
+
+		DynamicHyperDual result(value, a.n);
+		const int n = a.n;
+		const T* a_gradient = a.data;
+		const T* b_gradient = b.data;
+		const T* a_hessian = a.data + n;
+		const T* b_hessian = b.data + n;
+		T* result_hessian = result.data + n;
+		for (int i = 0; i < n; ++i) {
+			result.data[i] = da * a_gradient[i] + db * b_gradient[i];
+		}
+		int k = 0;
+		for (int i = 0; i < n; ++i) {
+			const T a_i = daa * a_gradient[i] + dab * b_gradient[i];
+			const T b_i = dab * a_gradient[i] + dbb * b_gradient[i];
+			for (int j = i; j < n; ++j, ++k) {
+				result_hessian[k] = da * a_hessian[k] + db * b_hessian[k]
+				                  + a_i * a_gradient[j] + b_i * b_gradient[j];
+			}
+		}
+		return result;
+	}
+
+	// Creates a number whose derivatives are set later.
+	DynamicHyperDual(const T& value_, int size)
+		: value(value_)
+	{
+		allocate(size);
+	}
+
+	// Number of first and second derivatives.
+	int storage_size() const
+	{
+		return n + n * (n + 1) / 2;
+	}
+
+	void allocate(int size)
+	{
+		n = size;
+		if (n == 0) {
+			data = nullptr;
+		}
+		else {
+			void* chunk = DynamicArena::thread_arena().allocate(storage_size() * sizeof(T));
+			data = static_cast<T*>(chunk);
+		}
+	}
+
+	void release()
+	{
+		if (n > 0) {
+			DynamicArena::thread_arena().deallocate(data, storage_size() * sizeof(T));
+		}
+	}
+
+	void copy_derivatives(const DynamicHyperDual& other)
+	{
+		for (int k = 0; k < storage_size(); ++k) {
+			data[k] = other.data[k];
+		}
+	}
+
+	T value;
+	int n;
+	// The first derivatives followed by the upper triangle of the
+	// second derivatives, packed row by row.
+	T* data;
+};
+
+}  // namespace spii
+
+#endif
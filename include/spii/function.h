@@ -12,9 +12,11 @@
 //
 
 #include <cstddef>
+#include <iosfwd>
 #include <map>
 #include <memory>
 #include <set>
+#include <string>
 using std::size_t;
 
 #include <Eigen/SparseCore>
@@ -22,6 +24,7 @@ using std::size_t;
 #include <spii/spii.h>
 #include <spii/auto_diff_change_of_variables.h>
 #include <spii/change_of_variables.h>
+#include <spii/manifold.h>
 #include <spii/interval.h>
 #include <spii/term.h>
 #include <spii/term_factory.h>
@@ -43,14 +46,56 @@ namespace spii {
 //  solvers and terms will see identical values.
 //
 
+// Identifies a term added to a Function. A handle remains valid
+// until its term is removed.
+typedef std::size_t TermHandle;
+
+// Working memory in bytes, broken down by what it is used for.
+struct MemoryUsage
+{
+	std::map<std::string, std::size_t> bytes;
+
+	void add(const std::string& category, std::size_t category_bytes)
+	{
+		bytes[category] += category_bytes;
+	}
+
+	void add(const MemoryUsage& usage)
+	{
+		for (const auto& category: usage.bytes) {
+			add(category.first, category.second);
+		}
+	}
+
+	std::size_t total() const
+	{
+		std::size_t total_bytes = 0;
+		for (const auto& category: bytes) {
+			total_bytes += category.second;
+		}
+		return total_bytes;
+	}
+};
+
+SPII_API std::ostream& operator<<(std::ostream& out, const MemoryUsage& usage);
+
 struct AddedTerm
 {
 	// The Term provided by the users.
 	std::shared_ptr<const Term> term;
+	// Whether the term is currently part of the function. Inactive
+	// terms are not evaluated.
+	bool is_active;
 	// The variables for which the Term should be evaluated.
 	std::vector<size_t> added_variables_indices;
 	// Temporary storage for a point.
 	mutable std::vector<double*> temp_variables;
+	// Temporary storage for a point in single precision. Empty if
+	// the term does not support single precision.
+	mutable std::vector<float*> temp_variables_float;
+	// Temporary storage for the direction of a Hessian-vector
+	// product.
+	mutable std::vector<const double*> temp_directions;
 };
 
 template<typename T>
@@ -69,15 +114,48 @@ private:
 	const T* end_pointer;
 };
 
+class FunctionView;
+
 class SPII_API Function
 {
 friend class Solver;
+friend class FunctionView;
 public:
 	// Specifies whether the function should be prepared to compute
 	// the Hessian matrix, which is is not needed for L-BFGS. This
 	// setting only affects the amount of temporary space allocated.
 	bool hessian_is_enabled = true;
 
+	// Specifies whether values and gradients should be computed with
+	// the terms evaluated in single precision (float variables and
+	// derivatives). The terms are still summed in double precision,
+	// and Hessians are always computed in double precision. Terms
+	// without single-precision support are evaluated as usual;
+	// AutoDiffTerm only supports it if its functor asks for it (see
+	// supports_single_precision).
+	//
+	// Mutable, since solvers may switch precision while solving
+	// (see LBFGSSolver::mixed_precision). They restore it afterwards
+	// with SettingsScope.
+	mutable bool single_precision = false;
+
+	// Specifies whether Hessians should be computed with the
+	// Gauss–Newton approximation of every term instead (see
+	// Term::evaluate_gauss_newton). For residual terms, this is J^T J
+	// and only needs first derivatives. Terms without an
+	// approximation contribute their exact Hessian. Finite-difference
+	// derivatives always give the exact Hessian.
+	//
+	// Residual terms that only implement evaluate_residuals (see
+	// ResidualTerm) have no exact Hessian. Evaluating their Hessians
+	// throws with this flag off, and Hessian-vector products, which
+	// always use exact Hessians, throw as well.
+	//
+	// Mutable, since solvers may switch it while solving (see
+	// LevenbergMarquardtSolver). They restore it afterwards with
+	// SettingsScope.
+	mutable bool gauss_newton_hessian = false;
+
 	Function();
 	~Function();
 	// Copying may be expensive for large functions.
@@ -97,20 +175,35 @@ public:
 	//
 	// Adding the same term twice with different variables is safe
 	// (and a good thing to do).
-	void add_term(std::shared_ptr<const Term> term, const std::vector<double*>& arguments);
+	//
+	// Returns a handle which can be used to remove or deactivate the
+	// term. Adding a term does not reallocate the temporary storage
+	// of the function unless the term is larger than all previous
+	// terms.
+	TermHandle add_term(std::shared_ptr<const Term> term, const std::vector<double*>& arguments);
 
 	template<typename... PointerToDouble>
-	void add_term(std::shared_ptr<const Term> term, PointerToDouble... args)
+	TermHandle add_term(std::shared_ptr<const Term> term, PointerToDouble... args)
 	{
-		add_term(term, {args...});
+		return add_term(term, {args...});
 	}
 
 	template<typename MyTerm, typename... PointerToDouble>
-	void add_term(PointerToDouble... args)
+	TermHandle add_term(PointerToDouble... args)
 	{
-		add_term(std::make_shared<MyTerm>(), {args...});
+		return add_term(std::make_shared<MyTerm>(), {args...});
 	}
 
+	// Removes a term from the function in constant time. The order of
+	// the remaining terms may change. Variables are not removed, even
+	// if they are no longer used by any term.
+	void remove_term(TermHandle handle);
+
+	// Deactivates or reactivates a term. Inactive terms remain in the
+	// function but are not evaluated.
+	void set_term_active(TermHandle handle, bool is_active);
+	bool is_term_active(TermHandle handle) const;
+
 	// Returns the current number of terms contained in the function.
 	size_t get_number_of_terms() const;
 
@@ -124,6 +217,9 @@ public:
 	// member function.
 	const BeginEndProvider<AddedTerm> terms() const;
 
+	// Returns the handle of the term at a position in terms().
+	TermHandle get_term_handle(size_t position) const;
+
 	// Adds a variable to the function. This function is called by add_term
 	// if the variable needs to be added.
 	void add_variable(double* variable, int dimension);
@@ -151,6 +247,16 @@ public:
 		);
 	}
 
+	// Adds a variable living on a manifold (see manifold.h). The
+	// solver only sees the tangent space of the manifold.
+	template<typename Manifold, typename... Args>
+	void add_variable_on_manifold(double* variable,
+	                              int dimension,
+	                              Args&&... args)
+	{
+		add_variable_with_change<ManifoldChange<Manifold>>(variable, dimension, std::forward<Args>(args)...);
+	}
+
 	// Returns the global index of a variable. This index is used for
 	// indexing in gradients and Eigen::VectorXd. For normal use, this
 	// index is not needed. Use it when e.g. examining the gradient or
@@ -171,10 +277,105 @@ public:
 	// (each variable contains of one or several scalars.)
 	size_t get_number_of_scalars() const;
 
+	// Splits the function into independent sub-functions. Two terms
+	// are in the same component if they are connected through
+	// non-constant variables. The components share the terms and the
+	// user-provided variables of this function, and the sum of their
+	// values is the value of this function. Inactive terms and
+	// variables not used by any active term are not included.
+	std::vector<Function> get_connected_components() const;
+
 	// Sets the number of threads the Function should use when evaluating.
 	// Default: number of cores available.
+	//
+	// Every thread evaluates a contiguous block of terms, and first
+	// touches the storage it writes to: its gradient and Hessian
+	// buffers, the pointer tables of its terms and the local copies
+	// of a block of variables. On NUMA machines, this places the
+	// storage on the node of the thread writing it, provided threads
+	// are pinned (e.g. with OMP_PROC_BIND=close or OMP_PLACES=cores).
+	// With close binding, neighbouring blocks of terms run on the same
+	// node.
 	void set_number_of_threads(int num);
 
+	// Makes evaluation results bit-for-bit reproducible, independently
+	// of the number of threads. The terms are split into fixed-size
+	// chunks whose values are summed with a fixed pairwise tree, and
+	// gradient and Hessian contributions are summed in term order.
+	// Requires extra storage for the derivatives of every term.
+	// Default: false.
+	void set_deterministic_evaluation(bool deterministic);
+
+	// Computes gradients and Hessians with finite differences of the
+	// term values instead of the derivatives of the terms, e.g. when
+	// the terms call code that can not be differentiated. Only
+	// Term::evaluate without derivatives is called.
+	//
+	// The scalars are colored so that no term contains two scalars of
+	// the same color (a Curtis–Powell–Reid coloring). All scalars of
+	// a color are perturbed at once, and the derivatives of each term
+	// are recovered from the values of the terms containing them. A
+	// gradient then needs 2c perturbed evaluations and a Hessian
+	// O(c^2), where the number of colors c is usually the largest
+	// number of scalars in a term, independently of the total number
+	// of scalars. The Hessian has the same sparsity pattern as with
+	// exact derivatives.
+	// Default: false.
+	void set_finite_difference_derivatives(bool finite_differences);
+
+	// How the Hessian is stored during evaluation.
+	enum HessianStorage {NO_HESSIAN, DENSE_HESSIAN, SPARSE_HESSIAN};
+
+	// Returns the working memory currently allocated by the function.
+	MemoryUsage memory_usage() const;
+
+	// Estimates the working memory needed for evaluation with the
+	// current settings, without allocating anything. The returned
+	// Hessian and gradient themselves are not included.
+	MemoryUsage estimate_memory_usage(HessianStorage hessian_storage) const;
+
+	// Whether the function can be evaluated within the budget (in
+	// bytes) by fit_to_memory_budget. Nothing is changed.
+	bool fits_memory_budget(std::size_t budget,
+	                        HessianStorage hessian_storage) const;
+
+	// Changes the number of threads to the largest number (at most
+	// the current number) and the reduction strategy for which the
+	// estimated memory usage is within the budget (in bytes).
+	// Deterministic evaluation, which stores derivatives per term
+	// instead of one gradient and Hessian per thread, is turned on if
+	// it allows more threads, but never turned off. Returns false if
+	// nothing fits, in which case the smallest configuration is used.
+	bool fit_to_memory_budget(std::size_t budget,
+	                          HessianStorage hessian_storage);
+
+	// Restores the number of threads, the reduction strategy,
+	// single_precision and gauss_newton_hessian of a function when it
+	// goes out of scope. Solvers use it to fit the function being
+	// solved to their memory budget (see Solver::memory_budget) and to
+	// switch precision or Hessians only while solving.
+	class SPII_API SettingsScope
+	{
+	public:
+		SettingsScope(const Function& function);
+		~SettingsScope();
+
+		// Calls fit_to_memory_budget on the function. The previous
+		// settings are restored at the end of the scope.
+		bool fit_to_memory_budget(std::size_t budget,
+		                          HessianStorage hessian_storage);
+
+	private:
+		SettingsScope(const SettingsScope&);
+		SettingsScope& operator = (const SettingsScope&);
+
+		const Function& function;
+		const int number_of_threads;
+		const bool deterministic;
+		const bool single_precision;
+		const bool gauss_newton_hessian;
+	};
+
 	// Evaluation using the data in the user-provided space.
 	double evaluate() const;
 
@@ -198,10 +399,46 @@ public:
 
 	Interval<double> evaluate(const std::vector<Interval<double>>& x) const;
 
+	// Evaluate the function and compute the gradient and the product
+	// of the Hessian with v at the point x. Every term multiplies its
+	// own Hessian with v (see Term::evaluate_hessian_vector) and the
+	// products are added like the gradient, so the Hessian is never
+	// formed and the memory used is O(n). Hessian computation does
+	// not need to be enabled.
+	double evaluate_hessian_vector(const Eigen::VectorXd& x,
+	                               const Eigen::VectorXd& v,
+	                               Eigen::VectorXd* gradient,
+	                               Eigen::VectorXd* hessian_vector) const;
+
+	// Same as above, without the gradient.
+	double evaluate_hessian_vector(const Eigen::VectorXd& x,
+	                               const Eigen::VectorXd& v,
+	                               Eigen::VectorXd* hessian_vector) const;
+
+	// Prepares products of the Hessian at x with many directions,
+	// e.g. in conjugate gradients. x is copied to the terms and the
+	// derivatives of the changes of variables are computed once
+	// instead of for every product.
+	void set_hessian_vector_point(const Eigen::VectorXd& x) const;
+
+	// The product of the Hessian at the point of the last call to
+	// set_hessian_vector_point with v. Neither the value nor the
+	// gradient is computed. Evaluating the function or changing it
+	// in between requires set_hessian_vector_point to be called again.
+	void evaluate_hessian_vector(const Eigen::VectorXd& v,
+	                             Eigen::VectorXd* hessian_vector) const;
+
 	// Copies variables from a global vector x to the storage
 	// provided by the user.
 	void copy_global_to_user(const Eigen::VectorXd& x) const;
 
+	// Moves the base points of the changes of variables that have one
+	// (e.g. variables on manifolds, see manifold.h) to the point x,
+	// which is updated to the same point in the new coordinates.
+	// Returns false if no variable has a base point. Derivatives
+	// computed before are with respect to the old coordinates.
+	bool recenter(Eigen::VectorXd* x) const;
+
 	// Copies variables from a the storage provided by the user
 	// to a global vector x.
 	void copy_user_to_global(Eigen::VectorXd* x) const;
@@ -227,6 +464,11 @@ public:
 
 private:
 
+	// Adds the given terms of another function and the variables they
+	// use, with the same settings. The terms are shared. The function
+	// must be empty. Used by FunctionView.
+	void add_term_subset(const Function& parent, const std::vector<TermHandle>& term_handles);
+
 	// Present here because it is called by a templated function above.
 	void add_variable_internal(double* variable,
 	                           int dimension,
@@ -0,0 +1,60 @@
+#ifndef SPII_FUNCTION_VIEW_H
+#define SPII_FUNCTION_VIEW_H
+// This header defines FunctionView, a function consisting of a
+// subset of the terms of another function. It is useful for e.g.
+// cross-validation, where many functions are made of subsets of
+// the terms of a large function.
+//
+//		std::vector<bool> training(function.get_number_of_terms());
+//		...
+//		FunctionView training_view(function, training);
+//		solver.solve(training_view.get_function(), &results);
+//
+
+#include <vector>
+
+#include <spii/function.h>
+
+namespace spii {
+
+// The function of the view shares the term objects and the
+// user-provided variables with the parent, and only contains the
+// variables used by its terms, numbered compactly in the same order
+// as in the parent. It can be evaluated and solved like any other.
+// The constant of the parent is not included.
+//
+// The view is not updated when the parent changes.
+class SPII_API FunctionView
+{
+public:
+	// Creates a view of the given terms of the parent.
+	FunctionView(const Function& parent, const std::vector<TermHandle>& term_handles);
+
+	// Creates a view of the terms for which term_mask is true, in the
+	// order of Function::terms.
+	FunctionView(const Function& parent, const std::vector<bool>& term_mask);
+
+	Function& get_function()
+	{
+		return function;
+	}
+
+	const Function& get_function() const
+	{
+		return function;
+	}
+
+	// The handle in the parent of every term of the view.
+	const std::vector<TermHandle>& get_term_handles() const
+	{
+		return term_handles;
+	}
+
+private:
+	Function function;
+	std::vector<TermHandle> term_handles;
+};
+
+}  // namespace spii
+
+#endif
@@ -0,0 +1,504 @@
+#ifndef SPII_HYPER_DUAL_H
+#define SPII_HYPER_DUAL_H
+// This header defines HyperDual, a number carrying its value, first
+// derivatives and second derivatives with respect to N variables
+// (a second-order truncated Taylor expansion). It is used by
+// AutoDiffTerm to compute Hessians.
+//
+// Since the Hessian is symmetric, only its upper triangle is stored
+// and propagated, packed row by row. This is about half the work of
+// nesting two first-order dual numbers, which computes every second
+// derivative twice.
+//
+// Every function f of one argument a is applied as
+//
+//   f(a).d(i)    = f'(a) a.d(i)
+//   f(a).h(i, j) = f'(a) a.h(i, j) + f''(a) a.d(i) a.d(j),
+//
+// with a similar formula for functions of two arguments.
+//
+
+#include <cmath>
+
+namespace spii {
+
+template<typename T, int N>
+class HyperDual
+{
+	static_assert(N > 0, "HyperDual: Need at least one derivative.");
+public:
+	// Number of stored second derivatives.
+	static const int hessian_size = N * (N + 1) / 2;
+
+	HyperDual()
+		: value(0), gradient(), hessian()
+	{ }
+
+	HyperDual(const T& value_)
+		: value(value_), gradient(), hessian()
+	{ }
+
+	// Creates the number for a variable; its derivative with respect
+	// to itself is 1.
+	HyperDual(const T& value_, int index)
+		: value(value_), gradient(), hessian()
+	{
+		gradient[index] = 1;
+	}
+
+	T& x()
+	{
+		return value;
+	}
+
+	const T& x() const
+	{
+		return value;
+	}
+
+	// First derivative with respect to variable i.
+	const T& d(int i) const
+	{
+		return gradient[i];
+	}
+
+	// Second derivative with respect to variables i and j.
+	const T& h(int i, int j) const
+	{
+		if (i > j) {
+			int tmp = i;
+			i = j;
+			j = tmp;
+		}
+		// Rows 0, ..., i - 1 contain N + (N - 1) + ... + (N - i + 1)
+		// elements.
+		return hessian[i * N - i * (i - 1) / 2 + (j - i)];
+	}
+
+	int size() const
+	{
+		return N;
+	}
+
+	HyperDual& operator += (const HyperDual& rhs)
+	{
+		return *this = *this + rhs;
+	}
+
+	HyperDual& operator -= (const HyperDual& rhs)
+	{
+		return *this = *this - rhs;
+	}
+
+	HyperDual& operator *= (const HyperDual& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	HyperDual& operator /= (const HyperDual& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	HyperDual& operator += (const T& rhs)
+	{
+		value += rhs;
+		return *this;
+	}
+
+	HyperDual& operator -= (const T& rhs)
+	{
+		value -= rhs;
+		return *this;
+	}
+
+	HyperDual& operator *= (const T& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	HyperDual& operator /= (const T& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	//
+	// As for Dual, the operators and functions below are friends
+	// defined in the class so that the other argument may be
+	// implicitly converted, e.g. pow(x, 2) or 2 * x.
+	//
+
+	friend HyperDual operator + (const HyperDual& arg)
+	{
+		return arg;
+	}
+
+	friend HyperDual operator - (const HyperDual& arg)
+	{
+		return chain(arg, -arg.value, T(-1), T(0));
+	}
+
+	friend HyperDual operator + (const HyperDual& lhs, const HyperDual& rhs)
+	{
+		HyperDual result(lhs.value + rhs.value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.gradient[i] = lhs.gradient[i] + rhs.gradient[i];
+		}
+		for (int k = 0; k < hessian_size; ++k) {
+			result.hessian[k] = lhs.hessian[k] + rhs.hessian[k];
+		}
+		return result;
+	}
+
+	friend HyperDual operator - (const HyperDual& lhs, const HyperDual& rhs)
+	{
+		HyperDual result(lhs.value - rhs.value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.gradient[i] = lhs.gradient[i] - rhs.gradient[i];
+		}
+		for (int k = 0; k < hessian_size; ++k) {
+			result.hessian[k] = lhs.hessian[k] - rhs.hessian[k];
+		}
+		return result;
+	}
+
+	friend HyperDual operator * (const HyperDual& lhs, const HyperDual& rhs)
+	{
+		HyperDual result(lhs.value * rhs.value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.gradient[i] = rhs.value * lhs.gradient[i] + lhs.value * rhs.gradient[i];
+		}
+		int k = 0;
+		for (int i = 0; i < N; ++i) {
+			const T lhs_i = lhs.gradient[i];
+			const T rhs_i = rhs.gradient[i];
+			for (int j = i; j < N; ++j, ++k) {
+				result.hessian[k] = rhs.value * lhs.hessian[k] + lhs.value * rhs.hessian[k]
+				                  + lhs_i * rhs.gradient[j] + rhs_i * lhs.gradient[j];
+			}
+		}
+		return result;
+	}
+
+	// The value is divided and not multiplied by the inverse, so that
+	// it is exactly the value computed without derivatives. Newton's
+	// method compares it to values from Function::evaluate.
+	friend HyperDual operator / (const HyperDual& lhs, const HyperDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs.value / rhs.value;
+		T inverse2 = inverse * inverse;
+		return chain(lhs, rhs, value,
+		             inverse, -value * inverse,
+		             T(0), -inverse2, 2 * value * inverse2);
+	}
+
+	friend HyperDual operator + (const HyperDual& lhs, const T& rhs)
+	{
+		HyperDual result(lhs);
+		result.value += rhs;
+		return result;
+	}
+
+	friend HyperDual operator + (const T& lhs, const HyperDual& rhs)
+	{
+		return rhs + lhs;
+	}
+
+	friend HyperDual operator - (const HyperDual& lhs, const T& rhs)
+	{
+		HyperDual result(lhs);
+		result.value -= rhs;
+		return result;
+	}
+
+	friend HyperDual operator - (const T& lhs, const HyperDual& rhs)
+	{
+		return chain(rhs, lhs - rhs.value, T(-1), T(0));
+	}
+
+	friend HyperDual operator * (const HyperDual& lhs, const T& rhs)
+	{
+		return chain(lhs, lhs.value * rhs, rhs, T(0));
+	}
+
+	friend HyperDual operator * (const T& lhs, const HyperDual& rhs)
+	{
+		return chain(rhs, lhs * rhs.value, lhs, T(0));
+	}
+
+	friend HyperDual operator / (const HyperDual& lhs, const T& rhs)
+	{
+		T inverse = T(1) / rhs;
+		return chain(lhs, lhs.value / rhs, inverse, T(0));
+	}
+
+	friend HyperDual operator / (const T& lhs, const HyperDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs / rhs.value;
+		return chain(rhs, value, -value * inverse, 2 * value * inverse * inverse);
+	}
+
+	#define SPII_HYPER_DUAL_COMPARISON(op)                                     \
+		friend bool operator op (const HyperDual& lhs, const HyperDual& rhs)   \
+		{                                                                      \
+			return lhs.value op rhs.value;                                     \
+		}                                                                      \
+		friend bool operator op (const HyperDual& lhs, const T& rhs)           \
+		{                                                                      \
+			return lhs.value op rhs;                                           \
+		}                                                                      \
+		friend bool operator op (const T& lhs, const HyperDual& rhs)           \
+		{                                                                      \
+			return lhs op rhs.value;                                           \
+		}
+	SPII_HYPER_DUAL_COMPARISON(==)
+	SPII_HYPER_DUAL_COMPARISON(!=)
+	SPII_HYPER_DUAL_COMPARISON(<)
+	SPII_HYPER_DUAL_COMPARISON(<=)
+	SPII_HYPER_DUAL_COMPARISON(>)
+	SPII_HYPER_DUAL_COMPARISON(>=)
+	#undef SPII_HYPER_DUAL_COMPARISON
+
+	friend HyperDual abs(const HyperDual& arg)
+	{
+		return arg.value < 0 ? -arg : arg;
+	}
+
+	friend HyperDual fabs(const HyperDual& arg)
+	{
+		return abs(arg);
+	}
+
+	friend HyperDual sqr(const HyperDual& arg)
+	{
+		return chain(arg, arg.value * arg.value, 2 * arg.value, T(2));
+	}
+
+	friend HyperDual sqrt(const HyperDual& arg)
+	{
+		using std::sqrt;
+		T value = sqrt(arg.value);
+		T derivative = T(0.5) / value;
+		return chain(arg, value, derivative, -derivative / (2 * arg.value));
+	}
+
+	friend HyperDual exp(const HyperDual& arg)
+	{
+		using std::exp;
+		T value = exp(arg.value);
+		return chain(arg, value, value, value);
+	}
+
+	friend HyperDual log(const HyperDual& arg)
+	{
+		using std::log;
+		T inverse = T(1) / arg.value;
+		return chain(arg, log(arg.value), inverse, -inverse * inverse);
+	}
+
+	friend HyperDual log10(const HyperDual& arg)
+	{
+		using std::log;
+		using std::log10;
+		T inverse = T(1) / (arg.value * log(T(10)));
+		return chain(arg, log10(arg.value), inverse, -inverse / arg.value);
+	}
+
+	friend HyperDual sin(const HyperDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		T value = sin(arg.value);
+		return chain(arg, value, cos(arg.value), -value);
+	}
+
+	friend HyperDual cos(const HyperDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		T value = cos(arg.value);
+		return chain(arg, value, -sin(arg.value), -value);
+	}
+
+	friend HyperDual tan(const HyperDual& arg)
+	{
+		using std::tan;
+		T value = tan(arg.value);
+		T derivative = 1 + value * value;
+		return chain(arg, value, derivative, 2 * value * derivative);
+	}
+
+	friend HyperDual asin(const HyperDual& arg)
+	{
+		using std::asin;
+		using std::sqrt;
+		T derivative = T(1) / sqrt(1 - arg.value * arg.value);
+		return chain(arg, asin(arg.value), derivative,
+		             arg.value * derivative * derivative * derivative);
+	}
+
+	friend HyperDual acos(const HyperDual& arg)
+	{
+		using std::acos;
+		using std::sqrt;
+		T derivative = T(-1) / sqrt(1 - arg.value * arg.value);
+		return chain(arg, acos(arg.value), derivative,
+		             arg.value * derivative * derivative * derivative);
+	}
+
+	friend HyperDual atan(const HyperDual& arg)
+	{
+		using std::atan;
+		T derivative = T(1) / (1 + arg.value * arg.value);
+		return chain(arg, atan(arg.value), derivative,
+		             -2 * arg.value * derivative * derivative);
+	}
+
+	friend HyperDual sinh(const HyperDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		T value = sinh(arg.value);
+		return chain(arg, value, cosh(arg.value), value);
+	}
+
+	friend HyperDual cosh(const HyperDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		T value = cosh(arg.value);
+		return chain(arg, value, sinh(arg.value), value);
+	}
+
+	friend HyperDual tanh(const HyperDual& arg)
+	{
+		using std::tanh;
+		T value = tanh(arg.value);
+		T derivative = 1 - value * value;
+		return chain(arg, value, derivative, -2 * value * derivative);
+	}
+
+	friend HyperDual pow(const HyperDual& base, const T& exponent)
+	{
+		using std::pow;
+		T value = pow(base.value, exponent);
+		T derivative = exponent * pow(base.value, exponent - 1);
+		T derivative2 = exponent * (exponent - 1) * pow(base.value, exponent - 2);
+		return chain(base, value, derivative, derivative2);
+	}
+
+	friend HyperDual pow(const T& base, const HyperDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base, exponent.value);
+		T log_base = log(base);
+		return chain(exponent, value, value * log_base, value * log_base * log_base);
+	}
+
+	friend HyperDual pow(const HyperDual& base, const HyperDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T a = base.value;
+		T b = exponent.value;
+		T value = pow(a, b);
+		T log_a = log(a);
+		T power1 = pow(a, b - 1);
+		return chain(base, exponent, value,
+		             b * power1, value * log_a,
+		             b * (b - 1) * pow(a, b - 2), power1 * (1 + b * log_a), value * log_a * log_a);
+	}
+
+	friend HyperDual atan2(const HyperDual& y, const HyperDual& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y.value * y.value);
+		T inverse2 = inverse * inverse;
+		T xy = x.value * y.value;
+		return chain(y, x, atan2(y.value, x.value),
+		             x.value * inverse, -y.value * inverse,
+		             -2 * xy * inverse2,
+		             (y.value * y.value - x.value * x.value) * inverse2,
+		             2 * xy * inverse2);
+	}
+
+	friend HyperDual atan2(const HyperDual& y, const T& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x * x + y.value * y.value);
+		return chain(y, atan2(y.value, x), x * inverse, -2 * x * y.value * inverse * inverse);
+	}
+
+	friend HyperDual atan2(const T& y, const HyperDual& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y * y);
+		return chain(x, atan2(y, x.value), -y * inverse, 2 * x.value * y * inverse * inverse);
+	}
+
+private:
+	// Tag for constructing a number whose derivatives are set later.
+	struct no_derivatives { };
+
+	HyperDual(const T& value_, no_derivatives)
+		: value(value_)
+	{ }
+
+	// Returns f(arg), given f, f' and f'' evaluated at arg.x().
+	static HyperDual chain(const HyperDual& arg,
+	                       const T& value,
+	                       const T& derivative,
+	                       const T& derivative2)
+	{
+		HyperDual result(value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.gradient[i] = derivative * arg.gradient[i];
+		}
+		int k = 0;
+		for (int i = 0; i < N; ++i) {
+			const T scaled_i = derivative2 * arg.gradient[i];
+			for (int j = i; j < N; ++j, ++k) {
+				result.hessian[k] = derivative * arg.hessian[k] + scaled_i * arg.gradient[j];
+			}
+		}
+		return result;
+	}
+
+	// Returns f(a, b), given f and its first and second partial
+	// derivatives evaluated at (a.x(), b.x()).
+	static HyperDual chain(const HyperDual& a,
+	                       const HyperDual& b,
+	                       const T& value,
+	                       const T& da,
+	                       const T& db,
+	                       const T& daa,
+	                       const T& dab,
+	                       const T& dbb)
+	{
+		HyperDual result(value, no_derivatives());
+		for (int i = 0; i < N; ++i) {
+			result.gradient[i] = da * a.gradient[i] + db * b.gradient[i];
+		}
+		int k = 0;
+		for (int i = 0; i < N; ++i) {
+			const T a_i = daa * a.gradient[i] + dab * b.gradient[i];
+			const T b_i = dab * a.gradient[i] + dbb * b.gradient[i];
+			for (int j = i; j < N; ++j, ++k) {
+				result.hessian[k] = da * a.hessian[k] + db * b.hessian[k]
+				                  + a_i * a.gradient[j] + b_i * b.gradient[j];
+			}
+		}
+		return result;
+	}
+
+	T value;
+	T gradient[N];
+	T hessian[hessian_size];
+};
+
+}  // namespace spii
+
+#endif
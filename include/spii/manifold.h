@@ -0,0 +1,231 @@
+#ifndef SPII_MANIFOLD_H
+#define SPII_MANIFOLD_H
+// This header defines variables living on a manifold, e.g. rotations
+// stored as unit quaternions:
+//
+//		double q[4] = {1, 0, 0, 0};
+//		function.add_variable_on_manifold<QuaternionManifold>(q, 4);
+//
+// The solver only sees the tangent space of the manifold, so the
+// quaternion above has three solver variables instead of four. This
+// removes the gauge freedom of the stored representation, which
+// otherwise makes the Hessian singular.
+//
+// A manifold is a class with
+//
+//		int ambient_dimension() const;
+//		int tangent_dimension() const;
+//		template<typename R>
+//		void plus(const double* x, const R* delta, R* x_plus_delta) const;
+//
+// where plus moves x in the direction delta of the tangent space at x
+// and plus(x, 0) = x. ManifoldChange turns a manifold into a change
+// of variables (see transformations.h) with x = plus(x0, t), where
+// the base point x0 is the value of the variable when the solver
+// starts. The derivatives of plus are computed with automatic
+// differentiation.
+//
+// The parametrization is only valid near x0 (e.g. for rotations of
+// less than 180 degrees). NewtonSolver and LevenbergMarquardtSolver
+// therefore move x0 to the current point after every step (see
+// Function::recenter), so their steps are taken in the tangent space
+// at the current point. The other solvers keep x0 during the solve,
+// since the history they store (e.g. of L-BFGS) is expressed in its
+// coordinates.
+//
+
+#include <cmath>
+#include <utility>
+#include <vector>
+
+namespace spii {
+
+// Unit quaternions (w, x, y, z) representing rotations. A tangent
+// vector delta is a rotation vector, applied to the left:
+//
+//		plus(q, delta) = exp(delta / 2) * q.
+//
+class QuaternionManifold
+{
+public:
+	int ambient_dimension() const
+	{
+		return 4;
+	}
+
+	int tangent_dimension() const
+	{
+		return 3;
+	}
+
+	template<typename R>
+	void plus(const double* q, const R* delta, R* q_plus_delta) const
+	{
+		R w, v[3];
+		exponential(delta, &w, v);
+
+		// (w, v) * q.
+		q_plus_delta[0] = w * q[0] - v[0] * q[1] - v[1] * q[2] - v[2] * q[3];
+		q_plus_delta[1] = w * q[1] + v[0] * q[0] + v[1] * q[3] - v[2] * q[2];
+		q_plus_delta[2] = w * q[2] - v[0] * q[3] + v[1] * q[0] + v[2] * q[1];
+		q_plus_delta[3] = w * q[3] + v[0] * q[2] - v[1] * q[1] + v[2] * q[0];
+	}
+
+private:
+	// The quaternion (w, v) rotating by the rotation vector delta.
+	template<typename R>
+	static void exponential(const R* delta, R* w, R* v)
+	{
+		using std::cos;
+		using std::sin;
+		using std::sqrt;
+
+		R theta2 = delta[0] * delta[0] + delta[1] * delta[1] + delta[2] * delta[2];
+		R scale;
+		// Near zero, the square root does not have finite derivatives.
+		// The Taylor expansions have correct first and second
+		// derivatives.
+		if (theta2 < 1e-8) {
+			*w = 1.0 - theta2 / 8.0;
+			scale = 0.5 - theta2 / 48.0;
+		}
+		else {
+			R theta = sqrt(theta2);
+			*w = cos(theta / 2.0);
+			scale = sin(theta / 2.0) / theta;
+		}
+		for (int i = 0; i < 3; ++i) {
+			v[i] = scale * delta[i];
+		}
+	}
+};
+
+// Unit vectors of the given dimension n. The tangent space at x is
+// spanned by the first n - 1 columns of the Householder reflection
+// mapping the last unit vector to x (up to sign), and
+//
+//		plus(x, delta) = cos(|delta|) x + sin(|delta|) / |delta| v,
+//
+// where v is delta expressed in this basis.
+class UnitVectorManifold
+{
+public:
+	UnitVectorManifold(int dimension_)
+		: dimension(dimension_)
+	{ }
+
+	int ambient_dimension() const
+	{
+		return dimension;
+	}
+
+	int tangent_dimension() const
+	{
+		return dimension - 1;
+	}
+
+	template<typename R>
+	void plus(const double* x, const R* delta, R* x_plus_delta) const
+	{
+		using std::cos;
+		using std::sin;
+		using std::sqrt;
+
+		const int n = dimension;
+		// The Householder vector u = x + sign(x_n) e_n.
+		const double sign = x[n - 1] >= 0 ? 1.0 : -1.0;
+		double u_norm2 = 0;
+		for (int i = 0; i < n; ++i) {
+			double u_i = x[i] + (i == n - 1 ? sign : 0.0);
+			u_norm2 += u_i * u_i;
+		}
+
+		R u_delta = 0.0;
+		R theta2 = 0.0;
+		for (int k = 0; k < n - 1; ++k) {
+			u_delta += x[k] * delta[k];
+			theta2 += delta[k] * delta[k];
+		}
+
+		R cos_theta, sin_theta_over_theta;
+		// See QuaternionManifold.
+		if (theta2 < 1e-8) {
+			cos_theta = 1.0 - theta2 / 2.0;
+			sin_theta_over_theta = 1.0 - theta2 / 6.0;
+		}
+		else {
+			R theta = sqrt(theta2);
+			cos_theta = cos(theta);
+			sin_theta_over_theta = sin(theta) / theta;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			double u_i = x[i] + (i == n - 1 ? sign : 0.0);
+			// Component i of the tangent vector, (H delta)_i.
+			R v_i = (-2.0 * u_i / u_norm2) * u_delta;
+			if (i < n - 1) {
+				v_i += delta[i];
+			}
+			x_plus_delta[i] = cos_theta * x[i] + sin_theta_over_theta * v_i;
+		}
+	}
+
+private:
+	int dimension;
+};
+
+// Change of variables (see transformations.h) x = plus(x0, t) for a
+// manifold. The base point x0 is set by x_to_t, which Function calls
+// when the solver copies the user's variables to its own vector, and
+// moved to plus(x0, t) by recenter.
+template<typename Manifold>
+class ManifoldChange
+{
+public:
+	template<typename... Args>
+	ManifoldChange(Args&&... args)
+		: manifold(std::forward<Args>(args)...),
+		  base(manifold.ambient_dimension(), 0.0)
+	{ }
+
+	template<typename R>
+	void t_to_x(R* x, const R* t) const
+	{
+		manifold.plus(base.data(), t, x);
+	}
+
+	void x_to_t(double* t, const double* x) const
+	{
+		for (int i = 0; i < x_dimension(); ++i) {
+			base[i] = x[i];
+		}
+		for (int i = 0; i < t_dimension(); ++i) {
+			t[i] = 0;
+		}
+	}
+
+	void recenter(double* t) const
+	{
+		std::vector<double> x(x_dimension());
+		t_to_x(x.data(), t);
+		x_to_t(t, x.data());
+	}
+
+	int x_dimension() const
+	{
+		return manifold.ambient_dimension();
+	}
+
+	int t_dimension() const
+	{
+		return manifold.tangent_dimension();
+	}
+
+private:
+	Manifold manifold;
+	mutable std::vector<double> base;
+};
+
+}  // namespace spii
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef SPII_MAPPED_FILE_H
+#define SPII_MAPPED_FILE_H
+// This header defines classes for read-only, memory-mapped access
+// to term data stored in files. This allows functions with more
+// data than fits in memory to be evaluated; the operating system
+// reads the data from disk as it is accessed.
+//
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <type_traits>
+
+#include <spii/spii.h>
+
+namespace spii {
+
+class SPII_API MappedFile
+{
+public:
+	// Maps the entire file read-only into memory.
+	MappedFile(const std::string& filename);
+	~MappedFile();
+
+	std::size_t size() const;
+	const char* data() const;
+
+	// Advises the operating system that the given byte range will
+	// be accessed soon. The data is read from disk in the background.
+	void will_need(std::size_t offset, std::size_t length) const;
+
+	// Advises the operating system that the given byte range will not
+	// be accessed again soon. The memory used for it may be released.
+	void dont_need(std::size_t offset, std::size_t length) const;
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator = (const MappedFile&);
+
+	class Implementation;
+	Implementation* impl;
+};
+
+// A memory-mapped file consisting of fixed-size records.
+//
+//		struct Observation
+//		{
+//			double t;
+//			double y;
+//		};
+//
+//		RecordFile<Observation>::write("data.bin", observations, n);
+//		RecordFile<Observation> file("data.bin");
+//		for (std::size_t i = 0; i < file.number_of_records(); ++i) {
+//			file.records()[i].y ...
+//		}
+//
+// Files are not portable between platforms with different record
+// layouts.
+template<typename Record>
+class RecordFile
+{
+	static_assert(std::is_pod<Record>::value, "RecordFile: Record needs to be a POD type.");
+public:
+	typedef Record RecordType;
+
+	RecordFile(const std::string& filename)
+		: file(filename)
+	{
+		check(file.size() % sizeof(Record) == 0,
+		      "RecordFile: Size of ", filename, " is not a multiple of the record size.");
+	}
+
+	std::size_t number_of_records() const
+	{
+		return file.size() / sizeof(Record);
+	}
+
+	const Record* records() const
+	{
+		return reinterpret_cast<const Record*>(file.data());
+	}
+
+	void will_need(std::size_t first_record, std::size_t number_of_records) const
+	{
+		file.will_need(first_record * sizeof(Record), number_of_records * sizeof(Record));
+	}
+
+	void dont_need(std::size_t first_record, std::size_t number_of_records) const
+	{
+		file.dont_need(first_record * sizeof(Record), number_of_records * sizeof(Record));
+	}
+
+	static void write(const std::string& filename,
+	                  const Record* records,
+	                  std::size_t number_of_records)
+	{
+		std::ofstream fout(filename, std::ios::binary);
+		check(fout.good(), "RecordFile: Could not open ", filename, " for writing.");
+		fout.write(reinterpret_cast<const char*>(records), number_of_records * sizeof(Record));
+		check(fout.good(), "RecordFile: Could not write to ", filename, ".");
+	}
+
+private:
+	MappedFile file;
+};
+
+}  // namespace spii
+
+#endif
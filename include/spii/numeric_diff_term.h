@@ -0,0 +1,376 @@
+#ifndef SPII_NUMERIC_DIFF_TERM_H
+#define SPII_NUMERIC_DIFF_TERM_H
+// This header defines NumericDiffTerm, a term whose derivatives are
+// computed with finite differences:
+//
+//		auto term = std::make_shared<NumericDiffTerm<Functor, 3, 2>>(arg1, arg2, ...);
+//		term->method = NumericDiffMethod::Richardson;
+//
+// The functor only needs to be callable with doubles,
+//
+//		double operator()(const double* x, const double* y) const;
+//
+// so it may call code that cannot be templated for AutoDiffTerm.
+//
+// The steps are relative to the magnitude of each scalar. All points
+// needed for the derivatives are collected first and then evaluated
+// in one batch, in parallel if parallel is set. Hessians are computed
+// from differences of finite-difference gradients and need O(n^2)
+// evaluations of the functor, where n is the number of scalars.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <exception>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <spii/auto_diff_term.h>
+#include <spii/term.h>
+
+namespace spii {
+
+enum class NumericDiffMethod
+{
+	Forward,    // (f(x + h) - f(x)) / h. n + 1 evaluations.
+	Central,    // (f(x + h) - f(x - h)) / 2h. 2n + 1 evaluations.
+	Richardson  // Central differences with shrinking steps,
+	            // extrapolated to h = 0. 8n + 1 evaluations.
+};
+
+// Finite differences of a function with k values at a point x with n
+// scalars. The function is evaluated at the points given by points,
+// of which the first is always x itself, and derivative computes the
+// derivatives from the values at these points.
+class FiniteDifferences
+{
+public:
+	// Number of central differences extrapolated by Richardson. The
+	// step is halved for each of them.
+	static const int richardson_levels = 4;
+
+	FiniteDifferences(NumericDiffMethod method_, double relative_step_)
+		: method(method_),
+		  relative_step(relative_step_)
+	{ }
+
+	// A step suitable for the method. Hessians are differences of
+	// finite-difference gradients and need larger steps.
+	static double default_relative_step(NumericDiffMethod method, bool hessian)
+	{
+		const double eps = std::numeric_limits<double>::epsilon();
+		switch (method) {
+			case NumericDiffMethod::Forward:
+				return hessian ? std::cbrt(eps) : std::sqrt(eps);
+			case NumericDiffMethod::Central:
+				return hessian ? std::pow(eps, 0.25) : std::cbrt(eps);
+			default:
+				return 1e-2;
+		}
+	}
+
+	int number_of_points(int n) const
+	{
+		return 1 + n * perturbations_per_scalar();
+	}
+
+	// Writes number_of_points(n) points with n scalars each.
+	void points(const double* x, int n, double* points) const
+	{
+		std::copy(x, x + n, points);
+		double* point = points + n;
+		for (int level = 0; level < levels(); ++level) {
+			for (int i = 0; i < n; ++i) {
+				for (int side = 0; side < sides(); ++side) {
+					std::copy(x, x + n, point);
+					point[i] = perturbed(x[i], side, level);
+					point += n;
+				}
+			}
+		}
+	}
+
+	// values holds the k values of the function at each point and
+	// the derivative of value c with respect to scalar i is written
+	// to derivative[i * k + c].
+	void derivative(const double* x, int n,
+	                const double* values, int k,
+	                double* derivative) const
+	{
+		for (int i = 0; i < n; ++i) {
+			for (int c = 0; c < k; ++c) {
+				double differences[richardson_levels];
+				for (int level = 0; level < levels(); ++level) {
+					const int point = 1 + sides() * (level * n + i);
+					if (method == NumericDiffMethod::Forward) {
+						differences[level] = (values[point * k + c] - values[c])
+						                   / (perturbed(x[i], 0, level) - x[i]);
+					}
+					else {
+						differences[level] = (values[point * k + c] - values[(point + 1) * k + c])
+						                   / (perturbed(x[i], 0, level) - perturbed(x[i], 1, level));
+					}
+				}
+				derivative[i * k + c] = method == NumericDiffMethod::Richardson ?
+				                        extrapolate(differences) : differences[0];
+			}
+		}
+	}
+
+private:
+	int levels() const
+	{
+		return method == NumericDiffMethod::Richardson ? richardson_levels : 1;
+	}
+
+	int sides() const
+	{
+		return method == NumericDiffMethod::Forward ? 1 : 2;
+	}
+
+	int perturbations_per_scalar() const
+	{
+		return levels() * sides();
+	}
+
+	// x + h (side 0) or x - h (side 1). The step is rounded so that
+	// the difference of the points is exactly representable.
+	double perturbed(double x, int side, int level) const
+	{
+		double h = relative_step * std::max(std::abs(x), 1.0) / double(1 << level);
+		h = (x + h) - x;
+		return side == 0 ? x + h : x - h;
+	}
+
+	// Ridders' extrapolation of central differences with halved
+	// steps. The error of a central difference is a series in h^2, so
+	// each column of the tableau removes one more term. The entry
+	// with the smallest estimated error is returned; the extrapolation
+	// stops when round-off makes higher orders worse.
+	static double extrapolate(const double* differences)
+	{
+		double tableau[richardson_levels][richardson_levels];
+		double best = differences[0];
+		double best_error = std::numeric_limits<double>::infinity();
+		for (int level = 0; level < richardson_levels; ++level) {
+			tableau[0][level] = differences[level];
+			double factor = 1.0;
+			for (int j = 1; j <= level; ++j) {
+				factor *= 4.0;
+				tableau[j][level] = (factor * tableau[j - 1][level] - tableau[j - 1][level - 1])
+				                  / (factor - 1.0);
+				double error = std::max(std::abs(tableau[j][level] - tableau[j - 1][level]),
+				                        std::abs(tableau[j][level] - tableau[j - 1][level - 1]));
+				if (error <= best_error) {
+					best_error = error;
+					best = tableau[j][level];
+				}
+			}
+			if (level > 0 &&
+			    std::abs(tableau[level][level] - tableau[level - 1][level - 1]) >= 2 * best_error) {
+				break;
+			}
+		}
+		return best;
+	}
+
+	NumericDiffMethod method;
+	double relative_step;
+};
+
+template<typename Functor, int... D>
+class NumericDiffTerm
+	: public SizedTerm<D...>
+{
+	static const int number_of_scalars = IntSum<D...>::value;
+
+public:
+	template<typename... Args>
+	NumericDiffTerm(Args&&... args)
+		: functor(std::forward<Args>(args)...)
+	{ }
+
+	NumericDiffMethod method = NumericDiffMethod::Central;
+
+	// The step for scalar x is relative_step * max(|x|, 1). Zero
+	// selects FiniteDifferences::default_relative_step.
+	double relative_step = 0;
+
+	// Evaluates the points of a batch in parallel. The functor has to
+	// be thread-safe. Function already evaluates terms in parallel, so
+	// this is mostly useful for a few expensive terms.
+	bool parallel = false;
+
+	virtual void read(std::istream& in) override
+	{
+		call_read_if_exists(in, this->functor);
+	}
+
+	virtual void write(std::ostream& out) const override
+	{
+		call_write_if_exists(out, this->functor);
+	}
+
+	virtual double evaluate(double * const * const variables) const override
+	{
+		DoubleFunctorCaller<Functor, D...> caller;
+		return caller.call(this->functor, variables);
+	}
+
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient) const override
+	{
+		const int n = number_of_scalars;
+		std::vector<double> x(n);
+		gather(variables, x.data());
+
+		FiniteDifferences differences(method, step(false));
+		const int m = differences.number_of_points(n);
+		std::vector<double> points(m * n);
+		differences.points(x.data(), n, points.data());
+
+		std::vector<double> values(m);
+		evaluate_points(&points, &values);
+
+		std::vector<double> g(n);
+		differences.derivative(x.data(), n, values.data(), 1, g.data());
+		scatter(g.data(), gradient);
+		return values[0];
+	}
+
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		const int n = number_of_scalars;
+		std::vector<double> x(n);
+		gather(variables, x.data());
+
+		// The batch starts with the points for the gradient, followed
+		// by the points for the gradient at every point of the outer
+		// differences for the Hessian.
+		FiniteDifferences gradient_differences(method, step(false));
+		FiniteDifferences hessian_differences(method, step(true));
+		const int m_gradient = gradient_differences.number_of_points(n);
+		const int m_hessian = hessian_differences.number_of_points(n);
+		std::vector<double> outer(m_hessian * n);
+		hessian_differences.points(x.data(), n, outer.data());
+
+		std::vector<double> points((m_gradient + m_hessian * m_hessian) * n);
+		gradient_differences.points(x.data(), n, points.data());
+		for (int p = 0; p < m_hessian; ++p) {
+			hessian_differences.points(&outer[p * n], n, &points[(m_gradient + p * m_hessian) * n]);
+		}
+
+		std::vector<double> values(points.size() / n);
+		evaluate_points(&points, &values);
+
+		std::vector<double> g(n);
+		gradient_differences.derivative(x.data(), n, values.data(), 1, g.data());
+		scatter(g.data(), gradient);
+
+		std::vector<double> outer_gradients(m_hessian * n);
+		for (int p = 0; p < m_hessian; ++p) {
+			hessian_differences.derivative(&outer[p * n], n,
+			                               &values[m_gradient + p * m_hessian], 1,
+			                               &outer_gradients[p * n]);
+		}
+		std::vector<double> h(n * n);
+		hessian_differences.derivative(x.data(), n, outer_gradients.data(), n, h.data());
+
+		const int dimensions[] = {D...};
+		const int number_of_variables = sizeof...(D);
+		int offset0 = 0;
+		for (int var0 = 0; var0 < number_of_variables; ++var0) {
+			int offset1 = 0;
+			for (int var1 = 0; var1 < number_of_variables; ++var1) {
+				auto& block = (*hessian)[var0][var1];
+				for (int i = 0; i < dimensions[var0]; ++i) {
+					for (int j = 0; j < dimensions[var1]; ++j) {
+						const int row = offset0 + i;
+						const int col = offset1 + j;
+						block(i, j) = 0.5 * (h[row * n + col] + h[col * n + row]);
+					}
+				}
+				offset1 += dimensions[var1];
+			}
+			offset0 += dimensions[var0];
+		}
+
+		return values[0];
+	}
+
+protected:
+	Functor functor;
+
+private:
+	double step(bool hessian) const
+	{
+		if (relative_step > 0) {
+			return relative_step;
+		}
+		return FiniteDifferences::default_relative_step(method, hessian);
+	}
+
+	void gather(double * const * const variables, double* x) const
+	{
+		const int dimensions[] = {D...};
+		for (int var = 0; var < int(sizeof...(D)); ++var) {
+			x = std::copy(variables[var], variables[var] + dimensions[var], x);
+		}
+	}
+
+	void scatter(const double* x, std::vector<Eigen::VectorXd>* gradient) const
+	{
+		const int dimensions[] = {D...};
+		for (int var = 0; var < int(sizeof...(D)); ++var) {
+			for (int i = 0; i < dimensions[var]; ++i) {
+				(*gradient)[var](i) = *x++;
+			}
+		}
+	}
+
+	double evaluate_point(double* x) const
+	{
+		const int dimensions[] = {D...};
+		double* arguments[sizeof...(D)];
+		for (int var = 0; var < int(sizeof...(D)); ++var) {
+			arguments[var] = x;
+			x += dimensions[var];
+		}
+		DoubleFunctorCaller<Functor, D...> caller;
+		return caller.call(this->functor, arguments);
+	}
+
+	void evaluate_points(std::vector<double>* points, std::vector<double>* values) const
+	{
+		const std::ptrdiff_t m = values->size();
+		std::exception_ptr error;
+
+		#ifdef USE_OPENMP
+			#pragma omp parallel for schedule(static) if(parallel)
+		#endif
+		for (std::ptrdiff_t p = 0; p < m; ++p) {
+			// Exceptions may not leave an OpenMP loop.
+			try {
+				(*values)[p] = evaluate_point(points->data() + p * number_of_scalars);
+			}
+			catch (...) {
+				#ifdef USE_OPENMP
+					#pragma omp critical
+				#endif
+				error = std::current_exception();
+			}
+		}
+
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+}  // namespace spii
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef SPII_PACKET_H
+#define SPII_PACKET_H
+// This header defines Packet, a number holding W values that are
+// always operated on together. It is used by BatchedAutoDiffTerm to
+// evaluate W terms of the same type at once, one in every lane.
+//
+// As for Dual, every operation is a loop of fixed length over the
+// lanes, which the compiler vectorizes for the instruction set it is
+// targeting. Dual and HyperDual numbers of packets compute the
+// derivatives of all lanes at once.
+//
+// A comparison of packets is only defined if it has the same outcome
+// in every lane, i.e. if all terms take the same branch. Otherwise
+// PacketDivergence is thrown and the terms have to be evaluated one
+// at a time.
+//
+// The data members of the functors differ between the lanes. They
+// have to be converted with SPII_PARAMETER (see parameter.h), which
+// gives a packet of the member of every functor set by PacketLanes.
+//
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include <spii/dual.h>
+#include <spii/hyper_dual.h>
+#include <spii/parameter.h>
+
+namespace spii {
+
+// Thrown when the lanes of a packet cannot be treated alike.
+class PacketDivergence
+	: public std::runtime_error
+{
+public:
+	PacketDivergence(const char* message)
+		: std::runtime_error(message)
+	{ }
+};
+
+template<typename T, int W>
+class Packet
+{
+	static_assert(W > 0, "Packet: Need at least one lane.");
+public:
+	// As for double, the lanes are only zero-initialized by Packet()
+	// and not by a declaration without initializer.
+	Packet() = default;
+
+	// Creates a packet with value in every lane.
+	Packet(const T& value)
+	{
+		for (int l = 0; l < W; ++l) {
+			lanes[l] = value;
+		}
+	}
+
+	T& operator[](int l)
+	{
+		return lanes[l];
+	}
+
+	const T& operator[](int l) const
+	{
+		return lanes[l];
+	}
+
+	int size() const
+	{
+		return W;
+	}
+
+	#define SPII_PACKET_ASSIGNMENT(op)                                   \
+		Packet& operator op (const Packet& rhs)                          \
+		{                                                                \
+			for (int l = 0; l < W; ++l) {                                \
+				lanes[l] op rhs.lanes[l];                                \
+			}                                                            \
+			return *this;                                                \
+		}
+	SPII_PACKET_ASSIGNMENT(+=)
+	SPII_PACKET_ASSIGNMENT(-=)
+	SPII_PACKET_ASSIGNMENT(*=)
+	SPII_PACKET_ASSIGNMENT(/=)
+	#undef SPII_PACKET_ASSIGNMENT
+
+	//
+	// As for Dual, the operators and functions below are friends
+	// defined in the class so that the other argument may be
+	// implicitly converted, e.g. pow(x, 2) or 2 * x.
+	//
+
+	friend Packet operator + (const Packet& arg)
+	{
+		return arg;
+	}
+
+	friend Packet operator - (const Packet& arg)
+	{
+		Packet result;
+		for (int l = 0; l < W; ++l) {
+			result.lanes[l] = -arg.lanes[l];
+		}
+		return result;
+	}
+
+	#define SPII_PACKET_OPERATOR(op)                                     \
+		friend Packet operator op (const Packet& lhs, const Packet& rhs) \
+		{                                                                \
+			Packet result;                                               \
+			for (int l = 0; l < W; ++l) {                                \
+				result.lanes[l] = lhs.lanes[l] op rhs.lanes[l];          \
+			}                                                            \
+			return result;                                               \
+		}
+	SPII_PACKET_OPERATOR(+)
+	SPII_PACKET_OPERATOR(-)
+	SPII_PACKET_OPERATOR(*)
+	SPII_PACKET_OPERATOR(/)
+	#undef SPII_PACKET_OPERATOR
+
+	#define SPII_PACKET_COMPARISON(op)                                   \
+		friend bool operator op (const Packet& lhs, const Packet& rhs)   \
+		{                                                                \
+			bool outcome = lhs.lanes[0] op rhs.lanes[0];                 \
+			for (int l = 1; l < W; ++l) {                                \
+				if ((lhs.lanes[l] op rhs.lanes[l]) != outcome) {         \
+					throw PacketDivergence("Packet: Comparison differs " \
+					                       "between lanes.");            \
+				}                                                        \
+			}                                                            \
+			return outcome;                                              \
+		}
+	SPII_PACKET_COMPARISON(==)
+	SPII_PACKET_COMPARISON(!=)
+	SPII_PACKET_COMPARISON(<)
+	SPII_PACKET_COMPARISON(<=)
+	SPII_PACKET_COMPARISON(>)
+	SPII_PACKET_COMPARISON(>=)
+	#undef SPII_PACKET_COMPARISON
+
+	friend Packet sqr(const Packet& arg)
+	{
+		return arg * arg;
+	}
+
+	#define SPII_PACKET_FUNCTION(function)                               \
+		friend Packet function(const Packet& arg)                        \
+		{                                                                \
+			using std::function;                                         \
+			Packet result;                                               \
+			for (int l = 0; l < W; ++l) {                                \
+				result.lanes[l] = function(arg.lanes[l]);                \
+			}                                                            \
+			return result;                                               \
+		}
+	SPII_PACKET_FUNCTION(abs)
+	SPII_PACKET_FUNCTION(fabs)
+	SPII_PACKET_FUNCTION(sqrt)
+	SPII_PACKET_FUNCTION(exp)
+	SPII_PACKET_FUNCTION(log)
+	SPII_PACKET_FUNCTION(log10)
+	SPII_PACKET_FUNCTION(sin)
+	SPII_PACKET_FUNCTION(cos)
+	SPII_PACKET_FUNCTION(tan)
+	SPII_PACKET_FUNCTION(asin)
+	SPII_PACKET_FUNCTION(acos)
+	SPII_PACKET_FUNCTION(atan)
+	SPII_PACKET_FUNCTION(sinh)
+	SPII_PACKET_FUNCTION(cosh)
+	SPII_PACKET_FUNCTION(tanh)
+	#undef SPII_PACKET_FUNCTION
+
+	#define SPII_PACKET_FUNCTION2(function)                              \
+		friend Packet function(const Packet& lhs, const Packet& rhs)     \
+		{                                                                \
+			using std::function;                                         \
+			Packet result;                                               \
+			for (int l = 0; l < W; ++l) {                                \
+				result.lanes[l] = function(lhs.lanes[l], rhs.lanes[l]);  \
+			}                                                            \
+			return result;                                               \
+		}
+	SPII_PACKET_FUNCTION2(pow)
+	SPII_PACKET_FUNCTION2(atan2)
+	#undef SPII_PACKET_FUNCTION2
+
+private:
+	T lanes[W];
+};
+
+// Sets the functors whose data members SPII_PARAMETER loads into
+// Packet<double, W> in this thread during its lifetime. The functor
+// of lane l is functors[l].
+template<int W>
+class PacketLanes
+{
+public:
+	template<typename Functor>
+	PacketLanes(const Functor* const* functors)
+		: previous(current()),
+		  functor_size(sizeof(Functor))
+	{
+		for (int l = 0; l < W; ++l) {
+			objects[l] = reinterpret_cast<const char*>(functors[l]);
+		}
+		current() = this;
+	}
+
+	~PacketLanes()
+	{
+		current() = previous;
+	}
+
+	// The lanes set for this thread, or null.
+	static const PacketLanes* get()
+	{
+		return current();
+	}
+
+	// Loads member, which has to be a data member of the functor of
+	// the first lane, from the functors of all lanes.
+	Packet<double, W> gather(const double& member) const
+	{
+		auto address = reinterpret_cast<std::uintptr_t>(&member);
+		auto begin = reinterpret_cast<std::uintptr_t>(objects[0]);
+		if (address < begin || address + sizeof(double) > begin + functor_size) {
+			throw PacketDivergence("PacketLanes: Parameter is not a data member of the functor.");
+		}
+		const std::size_t offset = address - begin;
+
+		Packet<double, W> result;
+		for (int l = 0; l < W; ++l) {
+			std::memcpy(&result[l], objects[l] + offset, sizeof(double));
+		}
+		return result;
+	}
+
+private:
+	PacketLanes(const PacketLanes&);
+	PacketLanes& operator = (const PacketLanes&);
+
+	static const PacketLanes*& current()
+	{
+		static thread_local const PacketLanes* lanes = nullptr;
+		return lanes;
+	}
+
+	const PacketLanes* previous;
+	const char* objects[W];
+	std::size_t functor_size;
+};
+
+template<int W>
+struct Parameter<Packet<double, W>>
+{
+	static Packet<double, W> get(const double& member, const char* name)
+	{
+		auto lanes = PacketLanes<W>::get();
+		if (!lanes) {
+			return Packet<double, W>(member);
+		}
+		return lanes->gather(member);
+	}
+};
+
+template<int W, int N>
+struct Parameter<Dual<Packet<double, W>, N>>
+{
+	static Dual<Packet<double, W>, N> get(const double& member, const char* name)
+	{
+		return Dual<Packet<double, W>, N>(Parameter<Packet<double, W>>::get(member, name));
+	}
+};
+
+template<int W, int N>
+struct Parameter<HyperDual<Packet<double, W>, N>>
+{
+	static HyperDual<Packet<double, W>, N> get(const double& member, const char* name)
+	{
+		return HyperDual<Packet<double, W>, N>(Parameter<Packet<double, W>>::get(member, name));
+	}
+};
+
+}  // namespace spii
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SPII_PARAMETER_H
+#define SPII_PARAMETER_H
+// This header defines SPII_PARAMETER, which marks the data members
+// of a functor that differ between terms of the same type:
+//
+//		T r0 = predicted_x - SPII_PARAMETER(T, observed_x);
+//
+// For ordinary number types, the member is just converted to T. Other
+// number types specialize Parameter: a Traced member is recorded as a
+// parameter of the trace (see trace.h) and a Packet member holds the
+// member of every term in the packet (see packet.h).
+//
+
+namespace spii {
+
+template<typename T>
+struct Parameter
+{
+	static T get(const double& member, const char* name)
+	{
+		return T(member);
+	}
+};
+
+template<typename T>
+T parameter(const double& member, const char* name)
+{
+	return Parameter<T>::get(member, name);
+}
+
+}  // namespace spii
+
+// Converts a data member of a functor to T.
+#define SPII_PARAMETER(T, member) ::spii::parameter<T>(member, #member)
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef SPII_RECORD_TERM_H
+#define SPII_RECORD_TERM_H
+// This header defines RecordTerm, which sums a functor over a range
+// of records stored in a memory-mapped file. Problems with billions
+// of data points (e.g. observations in a least-squares fit) can then
+// be solved without keeping the data in memory, or even creating one
+// Term object per data point.
+//
+//		struct Residual
+//		{
+//			template<typename R>
+//			R operator()(const Observation& obs, const R* x) const
+//			{
+//				R d = obs.y - x[0] * obs.t;
+//				return d * d;
+//			}
+//		};
+//
+//		auto file = std::make_shared<RecordFile<Observation>>("data.bin");
+//		add_record_terms<1>(&function, Residual(), file, 100000, x);
+//
+// Every term covers its own range of records, so the Function
+// evaluates the ranges in parallel.
+//
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <spii/auto_diff_term.h>
+#include <spii/function.h>
+#include <spii/mapped_file.h>
+
+namespace spii {
+
+// Binds a record to a functor, creating a functor of the variables
+// only.
+template<typename Functor, typename Record>
+class RecordFunctor
+{
+public:
+	RecordFunctor(const Functor& functor_, const Record& record_)
+		: functor(functor_), record(record_)
+	{ }
+
+	template<typename... R>
+	auto operator()(const R*... x) const -> decltype(std::declval<Functor>()(std::declval<Record>(), x...))
+	{
+		return functor(record, x...);
+	}
+
+private:
+	const Functor& functor;
+	const Record& record;
+};
+
+template<typename Functor, typename Record, int... D>
+class RecordTerm :
+	public SizedTerm<D...>
+{
+public:
+	// Number of records read before the next block is prefetched and
+	// the previous one is released.
+	static const std::size_t block_size = 16384;
+
+	RecordTerm(const Functor& functor_,
+	           std::shared_ptr<const RecordFile<Record>> file_,
+	           std::size_t begin_,
+	           std::size_t end_)
+		: functor(functor_), file(file_), begin(begin_), end(end_)
+	{
+		check(begin <= end && end <= file->number_of_records(),
+		      "RecordTerm: Invalid record range.");
+	}
+
+	virtual double evaluate(double * const * const variables) const override
+	{
+		double value = 0;
+		for_each_record([&](const Record& record)
+		{
+			RecordAutoDiffTerm record_term(functor, record);
+			value += record_term.evaluate(variables);
+		});
+		return value;
+	}
+
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient) const override
+	{
+		std::vector<Eigen::VectorXd> record_gradient;
+		for (int var = 0; var < this->number_of_variables(); ++var) {
+			(*gradient)[var].setZero();
+			record_gradient.emplace_back(this->variable_dimension(var));
+		}
+
+		double value = 0;
+		for_each_record([&](const Record& record)
+		{
+			RecordAutoDiffTerm record_term(functor, record);
+			value += record_term.evaluate(variables, &record_gradient);
+			for (int var = 0; var < this->number_of_variables(); ++var) {
+				(*gradient)[var] += record_gradient[var];
+			}
+		});
+		return value;
+	}
+
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		std::vector<Eigen::VectorXd> record_gradient;
+		std::vector<std::vector<Eigen::MatrixXd>> record_hessian(this->number_of_variables());
+		for (int var0 = 0; var0 < this->number_of_variables(); ++var0) {
+			(*gradient)[var0].setZero();
+			record_gradient.emplace_back(this->variable_dimension(var0));
+			for (int var1 = 0; var1 < this->number_of_variables(); ++var1) {
+				(*hessian)[var0][var1].setZero();
+				record_hessian[var0].emplace_back(this->variable_dimension(var0),
+				                                  this->variable_dimension(var1));
+			}
+		}
+
+		double value = 0;
+		for_each_record([&](const Record& record)
+		{
+			RecordAutoDiffTerm record_term(functor, record);
+			value += record_term.evaluate(variables, &record_gradient, &record_hessian);
+			for (int var0 = 0; var0 < this->number_of_variables(); ++var0) {
+				(*gradient)[var0] += record_gradient[var0];
+				for (int var1 = 0; var1 < this->number_of_variables(); ++var1) {
+					(*hessian)[var0][var1] += record_hessian[var0][var1];
+				}
+			}
+		});
+		return value;
+	}
+
+private:
+	typedef AutoDiffTerm<RecordFunctor<Functor, Record>, D...> RecordAutoDiffTerm;
+
+	// Calls the callback for every record in the range. The next
+	// block is prefetched while the current one is processed and
+	// every processed block is released, which keeps the memory
+	// used independent of the size of the file.
+	template<typename Callback>
+	void for_each_record(Callback callback) const
+	{
+		auto records = file->records();
+		for (auto block_begin = begin; block_begin < end; block_begin += block_size) {
+			auto block_end = std::min(end, block_begin + block_size);
+			if (block_end < end) {
+				file->will_need(block_end, std::min(end - block_end, std::size_t(block_size)));
+			}
+			for (auto i = block_begin; i < block_end; ++i) {
+				callback(records[i]);
+			}
+			file->dont_need(block_begin, block_end - block_begin);
+		}
+	}
+
+	Functor functor;
+	std::shared_ptr<const RecordFile<Record>> file;
+	std::size_t begin, end;
+};
+
+// Adds terms summing the functor over all records in the file,
+// each term covering at most records_per_term records. Returns
+// the handles of the added terms.
+template<int... D, typename Functor, typename File, typename... PointerToDouble>
+std::vector<TermHandle> add_record_terms(Function* function,
+                                         const Functor& functor,
+                                         std::shared_ptr<File> file,
+                                         std::size_t records_per_term,
+                                         PointerToDouble... args)
+{
+	check(records_per_term > 0, "add_record_terms: records_per_term must be positive.");
+	std::vector<TermHandle> handles;
+	auto n = file->number_of_records();
+	for (std::size_t begin = 0; begin < n; begin += records_per_term) {
+		auto end = std::min(n, begin + records_per_term);
+		typedef typename File::RecordType Record;
+		auto term = std::make_shared<RecordTerm<Functor, Record, D...>>(functor, file, begin, end);
+		handles.push_back(function->add_term(term, args...));
+	}
+	return handles;
+}
+
+}  // namespace spii
+
+#endif
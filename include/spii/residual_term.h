@@ -0,0 +1,295 @@
+#ifndef SPII_RESIDUAL_TERM_H
+#define SPII_RESIDUAL_TERM_H
+// This header defines terms for nonlinear least squares. A residual
+// term computes a vector of residuals r and their Jacobian J. Its
+// value is
+//
+//		0.5 * ||r||^2 = 0.5 * (r[0]^2 + r[1]^2 + ...)
+//
+// with gradient J^T r. The Gauss–Newton approximation of its Hessian,
+// J^T J, only needs first derivatives (see
+// Term::evaluate_gauss_newton and LevenbergMarquardtSolver).
+//
+// AutoDiffResidualTerm computes the Jacobian of a functor with
+// forward-mode dual numbers:
+//
+//		auto term = std::make_shared<AutoDiffResidualTerm<Functor, 2, 9, 3>>(arg1, arg2, ...);
+//
+// where 2 is the number of residuals and 9 and 3 the dimensions of
+// the variables. The functor writes the residuals to its last
+// argument:
+//
+//		template<typename R>
+//		void operator()(const R* camera, const R* point, R* residuals) const;
+//
+
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include <spii/auto_diff_term.h>
+#include <spii/term.h>
+
+namespace spii {
+
+class SPII_API ResidualTerm
+	: public Term
+{
+public:
+	virtual int number_of_residuals() const = 0;
+
+	// Computes the residuals and, if jacobian is not null, their
+	// derivatives. (*jacobian)[var] is resized to have one row per
+	// residual and one column per scalar of variable var.
+	virtual void evaluate_residuals(double * const * const variables,
+	                                double* residuals,
+	                                std::vector<Eigen::MatrixXd>* jacobian) const = 0;
+
+	virtual double evaluate(double * const * const variables) const override;
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient) const override;
+
+	// The exact Hessian needs second derivatives of the residuals,
+	// so this throws unless a derived class implements it. Solvers
+	// using the Gauss–Newton approximation (see
+	// Function::gauss_newton_hessian) only need evaluate_residuals.
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override;
+
+	// The gradient J^T r and J^T J.
+	virtual double evaluate_gauss_newton(double * const * const variables,
+	                                     std::vector<Eigen::VectorXd>* gradient,
+	                                     std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override;
+};
+
+// Calls a residual functor and returns 0.5 * ||r||^2, so that the
+// functor can be differentiated like the functor of an AutoDiffTerm.
+template<typename Functor, int M>
+struct SquaredNormFunctor
+{
+	static const bool single_precision = supports_single_precision<Functor>::value;
+
+	const Functor& functor;
+
+	template<typename First, typename... Rest>
+	typename std::decay<decltype(std::declval<const First&>()[0])>::type
+		operator()(const First& first, const Rest&... rest) const
+	{
+		typedef typename std::decay<decltype(first[0])>::type R;
+		R residuals[M];
+		functor(first, rest..., residuals);
+		R value = residuals[0] * residuals[0];
+		for (int k = 1; k < M; ++k) {
+			value += residuals[k] * residuals[k];
+		}
+		return 0.5 * value;
+	}
+};
+
+// Calls a residual functor, which writes its residuals to residuals.
+template<typename Functor, typename R>
+struct ResidualsFunctor
+{
+	const Functor& functor;
+	R* residuals;
+
+	template<typename... T>
+	R operator()(const T&... arguments) const
+	{
+		functor(arguments..., residuals);
+		return R(0.0);
+	}
+};
+
+template<typename Functor, int M, int... D>
+class AutoDiffResidualTerm
+	: public ResidualTerm
+{
+	static_assert(M >= 1, "The number of residuals must be positive.");
+	static const int number_of_scalars = IntSum<D...>::value;
+
+public:
+	template<typename... Args>
+	AutoDiffResidualTerm(Args&&... args)
+		: functor(std::forward<Args>(args)...)
+	{ }
+
+	virtual int number_of_variables() const override
+	{
+		return sizeof...(D);
+	}
+
+	virtual int variable_dimension(int var) const override
+	{
+		return IntElements<D...>::get_position(var);
+	}
+
+	virtual int number_of_residuals() const override
+	{
+		return M;
+	}
+
+	virtual void read(std::istream& in) override
+	{
+		call_read_if_exists(in, this->functor);
+	}
+
+	virtual void write(std::ostream& out) const override
+	{
+		call_write_if_exists(out, this->functor);
+	}
+
+	virtual void evaluate_residuals(double * const * const variables,
+	                                double* residuals,
+	                                std::vector<Eigen::MatrixXd>* jacobian) const override
+	{
+		if (! jacobian) {
+			ResidualsFunctor<Functor, double> residuals_functor{this->functor, residuals};
+			DoubleFunctorCaller<ResidualsFunctor<Functor, double>, D...> caller;
+			caller.call(residuals_functor, variables);
+			return;
+		}
+
+		Jacobian J;
+		evaluate_jacobian(variables, residuals, &J);
+
+		const int dimensions[] = {D...};
+		int offset = 0;
+		for (int var = 0; var < int(sizeof...(D)); ++var) {
+			(*jacobian)[var] = J.middleCols(offset, dimensions[var]);
+			offset += dimensions[var];
+		}
+	}
+
+	virtual double evaluate(double * const * const variables) const override
+	{
+		SquaredNormFunctor<Functor, M> squared_norm{this->functor};
+		DoubleFunctorCaller<SquaredNormFunctor<Functor, M>, D...> caller;
+		return caller.call(squared_norm, variables);
+	}
+
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient) const override
+	{
+		SquaredNormFunctor<Functor, M> squared_norm{this->functor};
+		return evaluate_functor_gradient<SquaredNormFunctor<Functor, M>, D...>(squared_norm,
+		                                                                        variables,
+		                                                                        gradient);
+	}
+
+	// The exact Hessian, including the second derivatives of the
+	// residuals.
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		SquaredNormFunctor<Functor, M> squared_norm{this->functor};
+		return evaluate_functor_hessian<SquaredNormFunctor<Functor, M>, D...>(squared_norm,
+		                                                                       variables,
+		                                                                       gradient,
+		                                                                       hessian);
+	}
+
+	virtual double evaluate_gauss_newton(double * const * const variables,
+	                                     std::vector<Eigen::VectorXd>* gradient,
+	                                     std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		Eigen::Matrix<double, M, 1> r;
+		Jacobian J;
+		evaluate_jacobian(variables, r.data(), &J);
+
+		const Eigen::Matrix<double, number_of_scalars, 1> g = J.transpose() * r;
+		const Eigen::Matrix<double, number_of_scalars, number_of_scalars> JTJ = J.transpose() * J;
+
+		// The gradient and Hessian storage may be larger than the
+		// variables.
+		const int dimensions[] = {D...};
+		const int number_of_variables = sizeof...(D);
+		int offset0 = 0;
+		for (int var0 = 0; var0 < number_of_variables; ++var0) {
+			for (int i = 0; i < dimensions[var0]; ++i) {
+				(*gradient)[var0](i) = g(offset0 + i);
+			}
+
+			int offset1 = 0;
+			for (int var1 = 0; var1 < number_of_variables; ++var1) {
+				auto& block = (*hessian)[var0][var1];
+				for (int i = 0; i < dimensions[var0]; ++i) {
+					for (int j = 0; j < dimensions[var1]; ++j) {
+						block(i, j) = JTJ(offset0 + i, offset1 + j);
+					}
+				}
+				offset1 += dimensions[var1];
+			}
+			offset0 += dimensions[var0];
+		}
+
+		return 0.5 * r.squaredNorm();
+	}
+
+	virtual double evaluate_hessian_vector(double * const * const variables,
+	                                       const double * const * const direction,
+	                                       std::vector<Eigen::VectorXd>* gradient,
+	                                       std::vector<Eigen::VectorXd>* hessian_vector) const override
+	{
+		SquaredNormFunctor<Functor, M> squared_norm{this->functor};
+		return evaluate_functor_hessian_vector<SquaredNormFunctor<Functor, M>, D...>(
+			squared_norm, variables, direction, gradient, hessian_vector);
+	}
+
+	// As for AutoDiffTerm, the functor has to declare
+	// single_precision (see supports_single_precision).
+	virtual bool has_single_precision() const override
+	{
+		return SinglePrecision::value;
+	}
+
+	virtual double evaluate_float(float * const * const variables) const override
+	{
+		SquaredNormFunctor<Functor, M> squared_norm{this->functor};
+		return evaluate_functor_float<SquaredNormFunctor<Functor, M>, D...>(
+			squared_norm, variables, nullptr, SinglePrecision());
+	}
+
+	virtual double evaluate_float(float * const * const variables,
+	                              std::vector<Eigen::VectorXf>* gradient) const override
+	{
+		SquaredNormFunctor<Functor, M> squared_norm{this->functor};
+		return evaluate_functor_float<SquaredNormFunctor<Functor, M>, D...>(
+			squared_norm, variables, gradient, SinglePrecision());
+	}
+
+protected:
+	Functor functor;
+
+private:
+	typedef Eigen::Matrix<double, M, number_of_scalars> Jacobian;
+	typedef std::integral_constant<bool, supports_single_precision<Functor>::value> SinglePrecision;
+
+	// Computes the residuals and their Jacobian with respect to all
+	// scalars with forward-mode dual numbers.
+	void evaluate_jacobian(double * const * const variables,
+	                       double* residuals,
+	                       Jacobian* J) const
+	{
+		typedef Dual<double, number_of_scalars> DualType;
+		DualType dual_residuals[M];
+		ResidualsFunctor<Functor, DualType> residuals_functor{this->functor, dual_residuals};
+		DualFunctorCaller<ResidualsFunctor<Functor, DualType>, DualType, D...> caller;
+		caller.call(residuals_functor, variables);
+
+		for (int k = 0; k < M; ++k) {
+			residuals[k] = dual_residuals[k].x();
+			for (int j = 0; j < number_of_scalars; ++j) {
+				(*J)(k, j) = dual_residuals[k].d(j);
+			}
+		}
+	}
+};
+
+}  // namespace spii
+
+#endif
@@ -0,0 +1,544 @@
+#ifndef SPII_REVERSE_H
+#define SPII_REVERSE_H
+// This header defines Reverse, a number recording the operations
+// performed on it on a tape. Sweeping the tape backwards gives the
+// derivatives of the result with respect to all variables at a cost
+// that is a small multiple of evaluating the function, regardless
+// of the number of variables. AutoDiffTerm uses it for the gradients
+// of terms with many variables.
+//
+// Every thread has its own tape. The tape is truncated, not freed,
+// after each evaluation, so its memory is reused and no allocations
+// are made once it has grown to the size of the largest function.
+//
+// The recorded numbers may themselves be dual numbers. Reverse<Dual<
+// double, 1>> computes the gradient and, in the inner derivative, its
+// directional derivative, i.e. a Hessian-vector product (see
+// evaluate_functor_hessian_vector).
+//
+
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace spii {
+
+// Zero adjoints need not be propagated. Nested numbers are always
+// propagated, since their derivatives may be non-zero.
+inline bool is_zero_adjoint(double x)
+{
+	return x == 0;
+}
+inline bool is_zero_adjoint(float x)
+{
+	return x == 0;
+}
+template<typename T>
+bool is_zero_adjoint(const T& x)
+{
+	return false;
+}
+
+template<typename T>
+class ReverseTape
+{
+public:
+	// A node in the computational graph has at most two parents.
+	// The partial derivatives of the node with respect to its parents
+	// are stored in the node. Parents that are not on the tape have
+	// index -1.
+	struct Node
+	{
+		int parents[2];
+		T partials[2];
+	};
+
+	// The tape of the calling thread.
+	static ReverseTape& thread_tape()
+	{
+		static thread_local ReverseTape tape;
+		return tape;
+	}
+
+	std::size_t size() const
+	{
+		return nodes.size();
+	}
+
+	int push(int parent0, const T& partial0, int parent1 = -1, const T& partial1 = T(0))
+	{
+		Node node;
+		node.parents[0] = parent0;
+		node.parents[1] = parent1;
+		node.partials[0] = partial0;
+		node.partials[1] = partial1;
+		nodes.push_back(node);
+		return static_cast<int>(nodes.size() - 1);
+	}
+
+	// Computes the derivatives of node output with respect to all
+	// nodes from begin to output. adjoints[i] is set to the derivative
+	// with respect to node begin + i.
+	const std::vector<T>& sweep(std::size_t begin, int output)
+	{
+		adjoints.assign(nodes.size() - begin, T(0));
+		if (output < 0) {
+			return adjoints;
+		}
+		adjoints[output - begin] = 1;
+		for (std::ptrdiff_t k = output; k >= std::ptrdiff_t(begin); --k) {
+			const T adjoint = adjoints[k - begin];
+			if (is_zero_adjoint(adjoint)) {
+				continue;
+			}
+			const Node& node = nodes[k];
+			for (int p = 0; p < 2; ++p) {
+				if (node.parents[p] >= 0) {
+					adjoints[node.parents[p] - begin] += node.partials[p] * adjoint;
+				}
+			}
+		}
+		return adjoints;
+	}
+
+	// Removes all nodes after the first size nodes. The memory is
+	// kept for the next evaluation.
+	void truncate(std::size_t size)
+	{
+		nodes.resize(size);
+	}
+
+private:
+	std::vector<Node> nodes;
+	std::vector<T> adjoints;
+};
+
+// Truncates the tape of the calling thread to its current size when
+// it goes out of scope. Evaluations may then be nested and are cleaned
+// up even if the function throws.
+template<typename T>
+class ReverseTapeScope
+{
+public:
+	ReverseTapeScope()
+		: tape(ReverseTape<T>::thread_tape()), begin(tape.size())
+	{ }
+
+	~ReverseTapeScope()
+	{
+		tape.truncate(begin);
+	}
+
+	ReverseTape<T>& tape;
+	const std::size_t begin;
+
+private:
+	ReverseTapeScope(const ReverseTapeScope&);
+	ReverseTapeScope& operator = (const ReverseTapeScope&);
+};
+
+template<typename T>
+class Reverse
+{
+	// Arithmetic constants of another type than T (see Dual).
+	template<typename S>
+	using EnableIfConstant = typename std::enable_if<std::is_arithmetic<S>::value &&
+	                                                 ! std::is_same<S, T>::value, int>::type;
+public:
+	Reverse()
+		: value(0), index(-1)
+	{ }
+
+	Reverse(const T& value_)
+		: value(value_), index(-1)
+	{ }
+
+	// Allows e.g. R r = 0 for R = Reverse<Dual<double, 1>>, which
+	// would otherwise need two implicit conversions.
+	template<typename S, EnableIfConstant<S> = 0>
+	Reverse(const S& value_)
+		: value(value_), index(-1)
+	{ }
+
+	// Creates a new variable on the tape of the calling thread. The
+	// index argument is only there for compatibility with the other
+	// dual numbers; variables are numbered in the order they are
+	// created.
+	Reverse(const T& value_, int)
+		: value(value_), index(ReverseTape<T>::thread_tape().push(-1, T(0)))
+	{ }
+
+	T& x()
+	{
+		return value;
+	}
+
+	const T& x() const
+	{
+		return value;
+	}
+
+	// Position on the tape, or -1 for constants.
+	int tape_index() const
+	{
+		return index;
+	}
+
+	Reverse& operator += (const Reverse& rhs)
+	{
+		return *this = *this + rhs;
+	}
+
+	Reverse& operator -= (const Reverse& rhs)
+	{
+		return *this = *this - rhs;
+	}
+
+	Reverse& operator *= (const Reverse& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	Reverse& operator /= (const Reverse& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	Reverse& operator += (const T& rhs)
+	{
+		value += rhs;
+		return *this;
+	}
+
+	Reverse& operator -= (const T& rhs)
+	{
+		value -= rhs;
+		return *this;
+	}
+
+	Reverse& operator *= (const T& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	Reverse& operator /= (const T& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	//
+	// As for Dual, the operators and functions below are friends
+	// defined in the class so that the other argument may be
+	// implicitly converted, e.g. pow(x, 2) or 2 * x.
+	//
+
+	friend Reverse operator + (const Reverse& arg)
+	{
+		return arg;
+	}
+
+	friend Reverse operator - (const Reverse& arg)
+	{
+		return chain(arg, -arg.value, T(-1));
+	}
+
+	friend Reverse operator + (const Reverse& lhs, const Reverse& rhs)
+	{
+		return chain(lhs, rhs, lhs.value + rhs.value, T(1), T(1));
+	}
+
+	friend Reverse operator - (const Reverse& lhs, const Reverse& rhs)
+	{
+		return chain(lhs, rhs, lhs.value - rhs.value, T(1), T(-1));
+	}
+
+	friend Reverse operator * (const Reverse& lhs, const Reverse& rhs)
+	{
+		return chain(lhs, rhs, lhs.value * rhs.value, rhs.value, lhs.value);
+	}
+
+	friend Reverse operator / (const Reverse& lhs, const Reverse& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs.value * inverse;
+		return chain(lhs, rhs, value, inverse, -value * inverse);
+	}
+
+	// Adding a constant does not change any derivatives, so the
+	// result can share the node of its argument.
+
+	friend Reverse operator + (const Reverse& lhs, const T& rhs)
+	{
+		return Reverse(lhs.value + rhs, lhs.index, 0);
+	}
+
+	friend Reverse operator + (const T& lhs, const Reverse& rhs)
+	{
+		return Reverse(lhs + rhs.value, rhs.index, 0);
+	}
+
+	friend Reverse operator - (const Reverse& lhs, const T& rhs)
+	{
+		return Reverse(lhs.value - rhs, lhs.index, 0);
+	}
+
+	friend Reverse operator - (const T& lhs, const Reverse& rhs)
+	{
+		return chain(rhs, lhs - rhs.value, T(-1));
+	}
+
+	friend Reverse operator * (const Reverse& lhs, const T& rhs)
+	{
+		return chain(lhs, lhs.value * rhs, rhs);
+	}
+
+	friend Reverse operator * (const T& lhs, const Reverse& rhs)
+	{
+		return chain(rhs, lhs * rhs.value, lhs);
+	}
+
+	friend Reverse operator / (const Reverse& lhs, const T& rhs)
+	{
+		T inverse = T(1) / rhs;
+		return chain(lhs, lhs.value * inverse, inverse);
+	}
+
+	friend Reverse operator / (const T& lhs, const Reverse& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs * inverse;
+		return chain(rhs, value, -value * inverse);
+	}
+
+	#define SPII_REVERSE_COMPARISON(op)                                    \
+		friend bool operator op (const Reverse& lhs, const Reverse& rhs)   \
+		{                                                                  \
+			return lhs.value op rhs.value;                                 \
+		}                                                                  \
+		friend bool operator op (const Reverse& lhs, const T& rhs)         \
+		{                                                                  \
+			return lhs.value op rhs;                                       \
+		}                                                                  \
+		friend bool operator op (const T& lhs, const Reverse& rhs)         \
+		{                                                                  \
+			return lhs op rhs.value;                                       \
+		}
+	SPII_REVERSE_COMPARISON(==)
+	SPII_REVERSE_COMPARISON(!=)
+	SPII_REVERSE_COMPARISON(<)
+	SPII_REVERSE_COMPARISON(<=)
+	SPII_REVERSE_COMPARISON(>)
+	SPII_REVERSE_COMPARISON(>=)
+	#undef SPII_REVERSE_COMPARISON
+
+	#define SPII_REVERSE_CONSTANT_FUNCTION(result, name)                 \
+		template<typename S, EnableIfConstant<S> = 0>                    \
+		friend result name (const Reverse& lhs, const S& rhs)            \
+		{                                                                \
+			return name(lhs, T(rhs));                                    \
+		}                                                                \
+		template<typename S, EnableIfConstant<S> = 0>                    \
+		friend result name (const S& lhs, const Reverse& rhs)            \
+		{                                                                \
+			return name(T(lhs), rhs);                                    \
+		}
+	SPII_REVERSE_CONSTANT_FUNCTION(Reverse, operator +)
+	SPII_REVERSE_CONSTANT_FUNCTION(Reverse, operator -)
+	SPII_REVERSE_CONSTANT_FUNCTION(Reverse, operator *)
+	SPII_REVERSE_CONSTANT_FUNCTION(Reverse, operator /)
+	SPII_REVERSE_CONSTANT_FUNCTION(bool, operator ==)
+	SPII_REVERSE_CONSTANT_FUNCTION(bool, operator !=)
+	SPII_REVERSE_CONSTANT_FUNCTION(bool, operator <)
+	SPII_REVERSE_CONSTANT_FUNCTION(bool, operator <=)
+	SPII_REVERSE_CONSTANT_FUNCTION(bool, operator >)
+	SPII_REVERSE_CONSTANT_FUNCTION(bool, operator >=)
+	SPII_REVERSE_CONSTANT_FUNCTION(Reverse, pow)
+	SPII_REVERSE_CONSTANT_FUNCTION(Reverse, atan2)
+	#undef SPII_REVERSE_CONSTANT_FUNCTION
+
+	friend Reverse abs(const Reverse& arg)
+	{
+		return arg.value < 0 ? -arg : arg;
+	}
+
+	friend Reverse fabs(const Reverse& arg)
+	{
+		return abs(arg);
+	}
+
+	friend Reverse sqr(const Reverse& arg)
+	{
+		return chain(arg, arg.value * arg.value, 2 * arg.value);
+	}
+
+	friend Reverse sqrt(const Reverse& arg)
+	{
+		using std::sqrt;
+		T value = sqrt(arg.value);
+		return chain(arg, value, T(0.5) / value);
+	}
+
+	friend Reverse exp(const Reverse& arg)
+	{
+		using std::exp;
+		T value = exp(arg.value);
+		return chain(arg, value, value);
+	}
+
+	friend Reverse log(const Reverse& arg)
+	{
+		using std::log;
+		return chain(arg, log(arg.value), T(1) / arg.value);
+	}
+
+	friend Reverse log10(const Reverse& arg)
+	{
+		using std::log;
+		using std::log10;
+		return chain(arg, log10(arg.value), T(1) / (arg.value * log(T(10))));
+	}
+
+	friend Reverse sin(const Reverse& arg)
+	{
+		using std::sin;
+		using std::cos;
+		return chain(arg, sin(arg.value), cos(arg.value));
+	}
+
+	friend Reverse cos(const Reverse& arg)
+	{
+		using std::sin;
+		using std::cos;
+		return chain(arg, cos(arg.value), -sin(arg.value));
+	}
+
+	friend Reverse tan(const Reverse& arg)
+	{
+		using std::tan;
+		T value = tan(arg.value);
+		return chain(arg, value, 1 + value * value);
+	}
+
+	friend Reverse asin(const Reverse& arg)
+	{
+		using std::asin;
+		using std::sqrt;
+		return chain(arg, asin(arg.value), T(1) / sqrt(1 - arg.value * arg.value));
+	}
+
+	friend Reverse acos(const Reverse& arg)
+	{
+		using std::acos;
+		using std::sqrt;
+		return chain(arg, acos(arg.value), T(-1) / sqrt(1 - arg.value * arg.value));
+	}
+
+	friend Reverse atan(const Reverse& arg)
+	{
+		using std::atan;
+		return chain(arg, atan(arg.value), T(1) / (1 + arg.value * arg.value));
+	}
+
+	friend Reverse sinh(const Reverse& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		return chain(arg, sinh(arg.value), cosh(arg.value));
+	}
+
+	friend Reverse cosh(const Reverse& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		return chain(arg, cosh(arg.value), sinh(arg.value));
+	}
+
+	friend Reverse tanh(const Reverse& arg)
+	{
+		using std::tanh;
+		T value = tanh(arg.value);
+		return chain(arg, value, 1 - value * value);
+	}
+
+	friend Reverse pow(const Reverse& base, const T& exponent)
+	{
+		using std::pow;
+		return chain(base, pow(base.value, exponent), exponent * pow(base.value, exponent - 1));
+	}
+
+	friend Reverse pow(const T& base, const Reverse& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base, exponent.value);
+		return chain(exponent, value, value * log(base));
+	}
+
+	friend Reverse pow(const Reverse& base, const Reverse& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base.value, exponent.value);
+		return chain(base, exponent, value,
+		             exponent.value * pow(base.value, exponent.value - 1),
+		             value * log(base.value));
+	}
+
+	friend Reverse atan2(const Reverse& y, const Reverse& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y.value * y.value);
+		return chain(y, x, atan2(y.value, x.value), x.value * inverse, -y.value * inverse);
+	}
+
+	friend Reverse atan2(const Reverse& y, const T& x)
+	{
+		using std::atan2;
+		return chain(y, atan2(y.value, x), x / (x * x + y.value * y.value));
+	}
+
+	friend Reverse atan2(const T& y, const Reverse& x)
+	{
+		using std::atan2;
+		return chain(x, atan2(y, x.value), -y / (x.value * x.value + y * y));
+	}
+
+private:
+	Reverse(const T& value_, int index_, int)
+		: value(value_), index(index_)
+	{ }
+
+	// Records f(arg), given f and f' evaluated at arg.x().
+	static Reverse chain(const Reverse& arg, const T& value, const T& derivative)
+	{
+		if (arg.index < 0) {
+			return Reverse(value);
+		}
+		return Reverse(value, ReverseTape<T>::thread_tape().push(arg.index, derivative), 0);
+	}
+
+	// Records f(a, b), given f and its partial derivatives evaluated
+	// at (a.x(), b.x()).
+	static Reverse chain(const Reverse& a,
+	                     const Reverse& b,
+	                     const T& value,
+	                     const T& da,
+	                     const T& db)
+	{
+		if (a.index < 0) {
+			return chain(b, value, db);
+		}
+		else if (b.index < 0) {
+			return chain(a, value, da);
+		}
+		return Reverse(value, ReverseTape<T>::thread_tape().push(a.index, da, b.index, db), 0);
+	}
+
+	T value;
+	int index;
+};
+
+}  // namespace spii
+
+#endif
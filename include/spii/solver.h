@@ -11,6 +11,7 @@
 #include <functional>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <spii/spii.h>
 #include <spii/function.h>
@@ -97,6 +98,26 @@ public:
 
 	virtual void solve(const Function& function, SolverResults* results) const = 0;
 
+	// Solves the connected components of the function (see
+	// Function::get_connected_components) independently and in
+	// parallel. Every component gets its own iterations and line
+	// searches. The results of each component are stored in
+	// component_results (if not nullptr). results holds the exit
+	// condition of the first component that did not converge (or
+	// of the first component if all converged) and the sum of
+	// the times spent on each component.
+	//
+	// The log and callback functions may be called concurrently
+	// from several threads. The memory budget applies to each
+	// component separately.
+	void solve_components(const Function& function,
+	                      SolverResults* results,
+	                      std::vector<SolverResults>* component_results = nullptr) const;
+
+	// Estimates the working memory needed to solve, including the
+	// evaluation of the function.
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const;
+
 	// Function called every time the solver emits a log message.
 	// Default: print to std::cerr.
 	std::function<void(const std::string& log_message)> log_function;
@@ -144,8 +165,28 @@ public:
 	//
 	double line_search_c2 = 0.9;
 
+	// Maximum working memory (in bytes) to use while solving,
+	// including the evaluation of the function. Solvers reduce the
+	// memory of their own data structures (e.g. the L-BFGS history
+	// size or the Hessian storage) and call
+	// Function::fit_to_memory_budget once with what remains.
+	//
+	// The function being solved may use fewer threads or
+	// deterministic evaluation while solving. Its settings are
+	// restored afterwards.
+	// Default: 0 (no limit).
+	std::size_t memory_budget = 0;
+
 protected:
 
+	// Fits the function to what remains of the memory budget after
+	// the memory used by the solver, until function_settings goes
+	// out of scope. Logs a message if it does not fit.
+	void apply_memory_budget(const Function& function,
+	                         const MemoryUsage& solver_usage,
+	                         Function::HessianStorage hessian_storage,
+	                         Function::SettingsScope* function_settings) const;
+
 	// Computes a Newton step given a function, a gradient and a
 	// Hessian.
 	//
@@ -201,6 +242,14 @@ public:
 	} factorization_method = BKP;
 
 	virtual void solve(const Function& function, SolverResults* results) const override;
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
+
+private:
+	// Whether the Hessian should be stored as a sparse matrix,
+	// according to sparsity_mode and memory_budget.
+	bool use_sparse_hessian(const Function& function) const;
+	// The memory used by the solver itself.
+	MemoryUsage solver_memory_usage(const Function& function, bool use_sparsity) const;
 };
 
 // L-BFGS. Requires only first-order derivatives
@@ -217,7 +266,106 @@ public:
 	// value, L-BFGS will discard its history and restart.
 	double lbfgs_restart_tolerance = 1e-6;
 
+	// If true, the terms are evaluated in single precision (see
+	// Function::single_precision) during the first iterations. The
+	// solver switches to double precision when ||g|| / ||g0|| is
+	// less than mixed_precision_tolerance, or when it would otherwise
+	// have terminated.
+	bool mixed_precision = false;
+	double mixed_precision_tolerance = 1e-4;
+
+	virtual void solve(const Function& function, SolverResults* results) const override;
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
+
+private:
+	// The memory used by the solver itself.
+	MemoryUsage solver_memory_usage(const Function& function, int history_size) const;
+};
+
+// Truncated Newton (Newton-CG). Each Newton system is solved
+// inexactly with preconditioned conjugate gradients, which only
+// need products of the Hessian with vectors (see
+// Function::evaluate_hessian_vector). The Hessian is never formed,
+// so the memory used is O(n) like L-BFGS, while the convergence is
+// close to that of Newton's method.
+class SPII_API NewtonCGSolver
+	: public Solver
+{
+public:
+	// Maximum number of conjugate gradient iterations (and
+	// Hessian-vector products) per Newton iteration.
+	int maximum_cg_iterations = 100;
+
+	// The conjugate gradient iterations stop when
+	//
+	//   ||H p + g|| <= eta ||g||.
+	//
+	// The forcing term eta follows Eisenstat and Walker's second
+	// choice, eta = gamma (||g|| / ||g_prev||)^alpha, with their
+	// safeguard. It is at most maximum_forcing_term, so the systems
+	// are solved loosely far from the solution and more accurately
+	// close to it.
+	double maximum_forcing_term = 0.5;
+	double forcing_term_gamma = 0.9;
+	double forcing_term_alpha = 2.0;
+
+	// The preconditioner of the conjugate gradients, built from the
+	// steps and gradient changes of the previous iterations. DIAGONAL
+	// uses a diagonal quasi-Newton approximation of the Hessian and
+	// LBFGS the L-BFGS approximation of the inverse Hessian with
+	// lbfgs_history_size pairs.
+	// Default: LBFGS.
+	enum {NONE, DIAGONAL, LBFGS} preconditioner = LBFGS;
+	int lbfgs_history_size = 10;
+
+	virtual void solve(const Function& function, SolverResults* results) const override;
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
+
+private:
+	// The memory used by the solver itself.
+	MemoryUsage solver_memory_usage(const Function& function) const;
+};
+
+// Levenberg–Marquardt for nonlinear least squares. Each iteration
+// solves
+//
+//   (H + lambda D) p = -g,
+//
+// where H is the Gauss–Newton approximation of the Hessian (see
+// Function::gauss_newton_hessian), which is J^T J for residual terms
+// (see residual_term.h), and D is the diagonal of H. The step is
+// accepted if the function decreases; the damping lambda is then
+// decreased depending on how well the decrease was predicted.
+// Otherwise, lambda is increased and the system solved again. Other
+// terms than residual terms contribute their exact Hessians.
+class SPII_API LevenbergMarquardtSolver
+	: public Solver
+{
+public:
+	// Mode of operation. How the Hessian is stored.
+	// Default: AUTO.
+	enum {DENSE, SPARSE, AUTO} sparsity_mode = AUTO;
+
+	// The damping lambda of the first iteration and the range it
+	// is kept within. The solver terminates if a step can not be
+	// found with lambda less than maximum_damping.
+	double initial_damping = 1e-4;
+	double minimum_damping = 1e-16;
+	double maximum_damping = 1e16;
+
+	// The elements of D are at least this large, so that scalars
+	// with no curvature are damped as well.
+	double minimum_diagonal = 1e-6;
+
 	virtual void solve(const Function& function, SolverResults* results) const override;
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
+
+private:
+	// Whether the Hessian should be stored as a sparse matrix,
+	// according to sparsity_mode and memory_budget.
+	bool use_sparse_hessian(const Function& function) const;
+	// The memory used by the solver itself.
+	MemoryUsage solver_memory_usage(const Function& function, bool use_sparsity) const;
 };
 
 // Nelder-Mead requires no derivatives. It generally
@@ -238,6 +386,7 @@ public:
 	double length_tolerance = 1e-12;
 
 	virtual void solve(const Function& function, SolverResults* results) const override;
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
 };
 
 // For most problems, there is no reason to choose
@@ -0,0 +1,1112 @@
+#ifndef SPII_SPARSE_DUAL_H
+#define SPII_SPARSE_DUAL_H
+// This header defines SparseDual and SparseHyperDual, forward-mode
+// dual numbers storing only their nonzero derivatives. AutoDiffTerm
+// computes the Hessians of terms with many variables with
+// SparseHyperDual if every intermediate number only depends on a few
+// of them, e.g. for a sum of functions of neighbouring variables.
+//
+// The nonzero derivatives are kept sorted by variable index, so the
+// derivatives of e.g. a product are computed by merging the lists of
+// its arguments. The lists are allocated from the DynamicArena of the
+// calling thread (see dynamic_dual.h) and never changed afterwards,
+// so copying a number only copies pointers. A sparse number may not
+// outlive the DynamicArenaScope it was created in.
+//
+// An entry of a list costs several times more than an element of the
+// fixed arrays of Dual and HyperDual, so the sparse numbers are only
+// faster when most derivatives are zero. SparsityProbe measures this
+// for a functor.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include <spii/dynamic_dual.h>
+
+namespace spii {
+
+// Measures the fraction of nonzero derivatives of the SparseDual
+// numbers computed in this thread during its lifetime.
+class SparsityProbe
+{
+public:
+	SparsityProbe()
+		: numbers(0), nonzeros(0), previous(current())
+	{
+		current() = this;
+	}
+
+	~SparsityProbe()
+	{
+		current() = previous;
+	}
+
+	// Records a computed number with the given number of nonzero
+	// derivatives.
+	static void record(int number_of_nonzeros)
+	{
+		if (SparsityProbe* probe = current()) {
+			probe->numbers++;
+			probe->nonzeros += number_of_nonzeros;
+		}
+	}
+
+	// Average fraction of nonzero derivatives with respect to the
+	// given number of variables.
+	double density(int number_of_variables) const
+	{
+		if (numbers == 0 || number_of_variables == 0) {
+			return 0;
+		}
+		return double(nonzeros) / (double(numbers) * number_of_variables);
+	}
+
+	std::size_t numbers;
+	std::size_t nonzeros;
+
+private:
+	SparsityProbe(const SparsityProbe&);
+	SparsityProbe& operator = (const SparsityProbe&);
+
+	static SparsityProbe*& current()
+	{
+		static thread_local SparsityProbe* probe = nullptr;
+		return probe;
+	}
+
+	SparsityProbe* previous;
+};
+
+// Immutable list of nonzero entries sorted by key, allocated from the
+// arena of the calling thread.
+template<typename Key, typename T>
+class SparseList
+{
+public:
+	SparseList()
+		: keys(nullptr), values(nullptr), n(0)
+	{ }
+
+	// The list with the single entry (key, value).
+	SparseList(Key key, const T& value)
+	{
+		Key* new_keys;
+		T* new_values;
+		allocate(1, &new_keys, &new_values);
+		new_keys[0] = key;
+		new_values[0] = value;
+		keys = new_keys;
+		values = new_values;
+		n = 1;
+	}
+
+	int size() const
+	{
+		return n;
+	}
+
+	Key key(int k) const
+	{
+		return keys[k];
+	}
+
+	const T& value(int k) const
+	{
+		return values[k];
+	}
+
+	// The value with the given key, or zero.
+	T find(Key key) const
+	{
+		const Key* position = std::lower_bound(keys, keys + n, key);
+		if (position == keys + n || *position != key) {
+			return T(0);
+		}
+		return values[position - keys];
+	}
+
+	// Returns a * x.
+	static SparseList scaled(const T& a, const SparseList& x)
+	{
+		if (a == T(1) || x.n == 0) {
+			return x;
+		}
+		SparseList result;
+		Key* keys;
+		T* values;
+		allocate(x.n, &keys, &values);
+		for (int k = 0; k < x.n; ++k) {
+			keys[k] = x.keys[k];
+			values[k] = a * x.values[k];
+		}
+		result.set(keys, values, x.n);
+		return result;
+	}
+
+	// Returns a * x + b * y.
+	static SparseList combined(const T& a, const SparseList& x,
+	                           const T& b, const SparseList& y)
+	{
+		if (y.n == 0) {
+			return scaled(a, x);
+		}
+		if (x.n == 0) {
+			return scaled(b, y);
+		}
+
+		SparseList result;
+		Key* keys;
+		T* values;
+		allocate(x.n + y.n, &keys, &values);
+		int kx = 0, ky = 0, k = 0;
+		while (kx < x.n && ky < y.n) {
+			if (x.keys[kx] < y.keys[ky]) {
+				keys[k] = x.keys[kx];
+				values[k++] = a * x.values[kx++];
+			}
+			else if (y.keys[ky] < x.keys[kx]) {
+				keys[k] = y.keys[ky];
+				values[k++] = b * y.values[ky++];
+			}
+			else {
+				keys[k] = x.keys[kx];
+				values[k++] = a * x.values[kx++] + b * y.values[ky++];
+			}
+		}
+		for (; kx < x.n; ++kx, ++k) {
+			keys[k] = x.keys[kx];
+			values[k] = a * x.values[kx];
+		}
+		for (; ky < y.n; ++ky, ++k) {
+			keys[k] = y.keys[ky];
+			values[k] = b * y.values[ky];
+		}
+		result.set(keys, values, k);
+		return result;
+	}
+
+	// Allocates room for size entries.
+	static void allocate(int size, Key** keys, T** values)
+	{
+		auto& arena = DynamicArena::thread_arena();
+		*keys = static_cast<Key*>(arena.allocate(size * sizeof(Key)));
+		*values = static_cast<T*>(arena.allocate(size * sizeof(T)));
+	}
+
+	// Sets the entries to the first size allocated entries, which
+	// have to be sorted by key.
+	void set(const Key* keys_, const T* values_, int size)
+	{
+		keys = keys_;
+		values = values_;
+		n = size;
+	}
+
+private:
+	const Key* keys;
+	const T* values;
+	int n;
+};
+
+template<typename T>
+class SparseDual
+{
+public:
+	SparseDual()
+		: value(0)
+	{ }
+
+	SparseDual(const T& value_)
+		: value(value_)
+	{ }
+
+	// Creates the number for a variable; its derivative with respect
+	// to itself is 1.
+	SparseDual(const T& value_, int index)
+		: value(value_), gradient(index, T(1))
+	{ }
+
+	T& x()
+	{
+		return value;
+	}
+
+	const T& x() const
+	{
+		return value;
+	}
+
+	// Derivative with respect to variable i.
+	T d(int i) const
+	{
+		return gradient.find(i);
+	}
+
+	// Number of stored derivatives and the variable and value of
+	// stored derivative k.
+	int nonzeros() const
+	{
+		return gradient.size();
+	}
+
+	int nonzero_index(int k) const
+	{
+		return gradient.key(k);
+	}
+
+	const T& nonzero_derivative(int k) const
+	{
+		return gradient.value(k);
+	}
+
+	SparseDual& operator += (const SparseDual& rhs)
+	{
+		return *this = *this + rhs;
+	}
+
+	SparseDual& operator -= (const SparseDual& rhs)
+	{
+		return *this = *this - rhs;
+	}
+
+	SparseDual& operator *= (const SparseDual& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	SparseDual& operator /= (const SparseDual& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	SparseDual& operator += (const T& rhs)
+	{
+		value += rhs;
+		return *this;
+	}
+
+	SparseDual& operator -= (const T& rhs)
+	{
+		value -= rhs;
+		return *this;
+	}
+
+	SparseDual& operator *= (const T& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	SparseDual& operator /= (const T& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	//
+	// As for Dual, the operators and functions below are friends
+	// defined in the class so that the other argument may be
+	// implicitly converted, e.g. pow(x, 2) or 2 * x.
+	//
+
+	friend SparseDual operator + (const SparseDual& arg)
+	{
+		return arg;
+	}
+
+	friend SparseDual operator - (const SparseDual& arg)
+	{
+		return chain(arg, -arg.value, T(-1));
+	}
+
+	friend SparseDual operator + (const SparseDual& lhs, const SparseDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value + rhs.value, T(1), T(1));
+	}
+
+	friend SparseDual operator - (const SparseDual& lhs, const SparseDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value - rhs.value, T(1), T(-1));
+	}
+
+	friend SparseDual operator * (const SparseDual& lhs, const SparseDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value * rhs.value, rhs.value, lhs.value);
+	}
+
+	friend SparseDual operator / (const SparseDual& lhs, const SparseDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs.value * inverse;
+		return chain(lhs, rhs, value, inverse, -value * inverse);
+	}
+
+	friend SparseDual operator + (const SparseDual& lhs, const T& rhs)
+	{
+		return chain(lhs, lhs.value + rhs, T(1));
+	}
+
+	friend SparseDual operator + (const T& lhs, const SparseDual& rhs)
+	{
+		return chain(rhs, lhs + rhs.value, T(1));
+	}
+
+	friend SparseDual operator - (const SparseDual& lhs, const T& rhs)
+	{
+		return chain(lhs, lhs.value - rhs, T(1));
+	}
+
+	friend SparseDual operator - (const T& lhs, const SparseDual& rhs)
+	{
+		return chain(rhs, lhs - rhs.value, T(-1));
+	}
+
+	friend SparseDual operator * (const SparseDual& lhs, const T& rhs)
+	{
+		return chain(lhs, lhs.value * rhs, rhs);
+	}
+
+	friend SparseDual operator * (const T& lhs, const SparseDual& rhs)
+	{
+		return chain(rhs, lhs * rhs.value, lhs);
+	}
+
+	friend SparseDual operator / (const SparseDual& lhs, const T& rhs)
+	{
+		T inverse = T(1) / rhs;
+		return chain(lhs, lhs.value * inverse, inverse);
+	}
+
+	friend SparseDual operator / (const T& lhs, const SparseDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs * inverse;
+		return chain(rhs, value, -value * inverse);
+	}
+
+	#define SPII_SPARSE_DUAL_COMPARISON(op)                                    \
+		friend bool operator op (const SparseDual& lhs, const SparseDual& rhs) \
+		{                                                                      \
+			return lhs.value op rhs.value;                                     \
+		}                                                                      \
+		friend bool operator op (const SparseDual& lhs, const T& rhs)          \
+		{                                                                      \
+			return lhs.value op rhs;                                           \
+		}                                                                      \
+		friend bool operator op (const T& lhs, const SparseDual& rhs)          \
+		{                                                                      \
+			return lhs op rhs.value;                                           \
+		}
+	SPII_SPARSE_DUAL_COMPARISON(==)
+	SPII_SPARSE_DUAL_COMPARISON(!=)
+	SPII_SPARSE_DUAL_COMPARISON(<)
+	SPII_SPARSE_DUAL_COMPARISON(<=)
+	SPII_SPARSE_DUAL_COMPARISON(>)
+	SPII_SPARSE_DUAL_COMPARISON(>=)
+	#undef SPII_SPARSE_DUAL_COMPARISON
+
+	friend SparseDual abs(const SparseDual& arg)
+	{
+		return arg.value < 0 ? -arg : arg;
+	}
+
+	friend SparseDual fabs(const SparseDual& arg)
+	{
+		return abs(arg);
+	}
+
+	friend SparseDual sqr(const SparseDual& arg)
+	{
+		return chain(arg, arg.value * arg.value, 2 * arg.value);
+	}
+
+	friend SparseDual sqrt(const SparseDual& arg)
+	{
+		using std::sqrt;
+		T value = sqrt(arg.value);
+		return chain(arg, value, T(0.5) / value);
+	}
+
+	friend SparseDual exp(const SparseDual& arg)
+	{
+		using std::exp;
+		T value = exp(arg.value);
+		return chain(arg, value, value);
+	}
+
+	friend SparseDual log(const SparseDual& arg)
+	{
+		using std::log;
+		return chain(arg, log(arg.value), T(1) / arg.value);
+	}
+
+	friend SparseDual log10(const SparseDual& arg)
+	{
+		using std::log;
+		using std::log10;
+		return chain(arg, log10(arg.value), T(1) / (arg.value * log(T(10))));
+	}
+
+	friend SparseDual sin(const SparseDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		return chain(arg, sin(arg.value), cos(arg.value));
+	}
+
+	friend SparseDual cos(const SparseDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		return chain(arg, cos(arg.value), -sin(arg.value));
+	}
+
+	friend SparseDual tan(const SparseDual& arg)
+	{
+		using std::tan;
+		T value = tan(arg.value);
+		return chain(arg, value, 1 + value * value);
+	}
+
+	friend SparseDual asin(const SparseDual& arg)
+	{
+		using std::asin;
+		using std::sqrt;
+		return chain(arg, asin(arg.value), T(1) / sqrt(1 - arg.value * arg.value));
+	}
+
+	friend SparseDual acos(const SparseDual& arg)
+	{
+		using std::acos;
+		using std::sqrt;
+		return chain(arg, acos(arg.value), T(-1) / sqrt(1 - arg.value * arg.value));
+	}
+
+	friend SparseDual atan(const SparseDual& arg)
+	{
+		using std::atan;
+		return chain(arg, atan(arg.value), T(1) / (1 + arg.value * arg.value));
+	}
+
+	friend SparseDual sinh(const SparseDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		return chain(arg, sinh(arg.value), cosh(arg.value));
+	}
+
+	friend SparseDual cosh(const SparseDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		return chain(arg, cosh(arg.value), sinh(arg.value));
+	}
+
+	friend SparseDual tanh(const SparseDual& arg)
+	{
+		using std::tanh;
+		T value = tanh(arg.value);
+		return chain(arg, value, 1 - value * value);
+	}
+
+	friend SparseDual pow(const SparseDual& base, const T& exponent)
+	{
+		using std::pow;
+		return chain(base, pow(base.value, exponent),
+		             exponent * pow(base.value, exponent - 1));
+	}
+
+	friend SparseDual pow(const T& base, const SparseDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base, exponent.value);
+		return chain(exponent, value, value * log(base));
+	}
+
+	friend SparseDual pow(const SparseDual& base, const SparseDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base.value, exponent.value);
+		return chain(base, exponent, value,
+		             exponent.value * pow(base.value, exponent.value - 1),
+		             value * log(base.value));
+	}
+
+	friend SparseDual atan2(const SparseDual& y, const SparseDual& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y.value * y.value);
+		return chain(y, x, atan2(y.value, x.value), x.value * inverse, -y.value * inverse);
+	}
+
+	friend SparseDual atan2(const SparseDual& y, const T& x)
+	{
+		using std::atan2;
+		return chain(y, atan2(y.value, x), x / (x * x + y.value * y.value));
+	}
+
+	friend SparseDual atan2(const T& y, const SparseDual& x)
+	{
+		using std::atan2;
+		return chain(x, atan2(y, x.value), -y / (x.value * x.value + y * y));
+	}
+
+private:
+	typedef SparseList<int, T> Gradient;
+
+	SparseDual(const T& value_, const Gradient& gradient_)
+		: value(value_), gradient(gradient_)
+	{
+		SparsityProbe::record(gradient.size());
+	}
+
+	// Returns f(arg), given f and f' evaluated at arg.x().
+	static SparseDual chain(const SparseDual& arg,
+	                        const T& value,
+	                        const T& derivative)
+	{
+		return SparseDual(value, Gradient::scaled(derivative, arg.gradient));
+	}
+
+	// Returns f(a, b), given f and its partial derivatives evaluated
+	// at (a.x(), b.x()).
+	static SparseDual chain(const SparseDual& a,
+	                        const SparseDual& b,
+	                        const T& value,
+	                        const T& da,
+	                        const T& db)
+	{
+		return SparseDual(value, Gradient::combined(da, a.gradient, db, b.gradient));
+	}
+
+	T value;
+	Gradient gradient;
+};
+
+// The upper triangle of the Hessian is stored with the key
+// (i << 32) | j for i <= j, which sorts the entries row by row.
+template<typename T>
+class SparseHyperDual
+{
+public:
+	SparseHyperDual()
+		: value(0)
+	{ }
+
+	SparseHyperDual(const T& value_)
+		: value(value_)
+	{ }
+
+	// Creates the number for a variable; its derivative with respect
+	// to itself is 1.
+	SparseHyperDual(const T& value_, int index)
+		: value(value_), gradient(index, T(1))
+	{ }
+
+	T& x()
+	{
+		return value;
+	}
+
+	const T& x() const
+	{
+		return value;
+	}
+
+	// First derivative with respect to variable i.
+	T d(int i) const
+	{
+		return gradient.find(i);
+	}
+
+	// Second derivative with respect to variables i and j.
+	T h(int i, int j) const
+	{
+		return hessian.find(key(std::min(i, j), std::max(i, j)));
+	}
+
+	// Number of stored first derivatives and the variable and value
+	// of stored derivative k.
+	int nonzeros() const
+	{
+		return gradient.size();
+	}
+
+	int nonzero_index(int k) const
+	{
+		return gradient.key(k);
+	}
+
+	const T& nonzero_derivative(int k) const
+	{
+		return gradient.value(k);
+	}
+
+	// Number of stored second derivatives in the upper triangle and
+	// the variables i <= j and value of stored derivative k.
+	int hessian_nonzeros() const
+	{
+		return hessian.size();
+	}
+
+	int hessian_row(int k) const
+	{
+		return int(hessian.key(k) >> 32);
+	}
+
+	int hessian_column(int k) const
+	{
+		return int(hessian.key(k) & 0xffffffff);
+	}
+
+	const T& hessian_derivative(int k) const
+	{
+		return hessian.value(k);
+	}
+
+	SparseHyperDual& operator += (const SparseHyperDual& rhs)
+	{
+		return *this = *this + rhs;
+	}
+
+	SparseHyperDual& operator -= (const SparseHyperDual& rhs)
+	{
+		return *this = *this - rhs;
+	}
+
+	SparseHyperDual& operator *= (const SparseHyperDual& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	SparseHyperDual& operator /= (const SparseHyperDual& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	SparseHyperDual& operator += (const T& rhs)
+	{
+		value += rhs;
+		return *this;
+	}
+
+	SparseHyperDual& operator -= (const T& rhs)
+	{
+		value -= rhs;
+		return *this;
+	}
+
+	SparseHyperDual& operator *= (const T& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	SparseHyperDual& operator /= (const T& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	//
+	// As for Dual, the operators and functions below are friends
+	// defined in the class so that the other argument may be
+	// implicitly converted, e.g. pow(x, 2) or 2 * x.
+	//
+
+	friend SparseHyperDual operator + (const SparseHyperDual& arg)
+	{
+		return arg;
+	}
+
+	friend SparseHyperDual operator - (const SparseHyperDual& arg)
+	{
+		return chain(arg, -arg.value, T(-1), T(0));
+	}
+
+	friend SparseHyperDual operator + (const SparseHyperDual& lhs, const SparseHyperDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value + rhs.value, T(1), T(1), T(0), T(0), T(0));
+	}
+
+	friend SparseHyperDual operator - (const SparseHyperDual& lhs, const SparseHyperDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value - rhs.value, T(1), T(-1), T(0), T(0), T(0));
+	}
+
+	friend SparseHyperDual operator * (const SparseHyperDual& lhs, const SparseHyperDual& rhs)
+	{
+		return chain(lhs, rhs, lhs.value * rhs.value, rhs.value, lhs.value, T(0), T(1), T(0));
+	}
+
+	friend SparseHyperDual operator / (const SparseHyperDual& lhs, const SparseHyperDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs.value * inverse;
+		T inverse2 = inverse * inverse;
+		return chain(lhs, rhs, value,
+		             inverse, -value * inverse,
+		             T(0), -inverse2, 2 * value * inverse2);
+	}
+
+	friend SparseHyperDual operator + (const SparseHyperDual& lhs, const T& rhs)
+	{
+		SparseHyperDual result(lhs);
+		result.value += rhs;
+		return result;
+	}
+
+	friend SparseHyperDual operator + (const T& lhs, const SparseHyperDual& rhs)
+	{
+		return rhs + lhs;
+	}
+
+	friend SparseHyperDual operator - (const SparseHyperDual& lhs, const T& rhs)
+	{
+		SparseHyperDual result(lhs);
+		result.value -= rhs;
+		return result;
+	}
+
+	friend SparseHyperDual operator - (const T& lhs, const SparseHyperDual& rhs)
+	{
+		return chain(rhs, lhs - rhs.value, T(-1), T(0));
+	}
+
+	friend SparseHyperDual operator * (const SparseHyperDual& lhs, const T& rhs)
+	{
+		return chain(lhs, lhs.value * rhs, rhs, T(0));
+	}
+
+	friend SparseHyperDual operator * (const T& lhs, const SparseHyperDual& rhs)
+	{
+		return chain(rhs, lhs * rhs.value, lhs, T(0));
+	}
+
+	friend SparseHyperDual operator / (const SparseHyperDual& lhs, const T& rhs)
+	{
+		T inverse = T(1) / rhs;
+		return chain(lhs, lhs.value * inverse, inverse, T(0));
+	}
+
+	friend SparseHyperDual operator / (const T& lhs, const SparseHyperDual& rhs)
+	{
+		T inverse = T(1) / rhs.value;
+		T value = lhs * inverse;
+		return chain(rhs, value, -value * inverse, 2 * value * inverse * inverse);
+	}
+
+	#define SPII_SPARSE_HYPER_DUAL_COMPARISON(op)                                        \
+		friend bool operator op (const SparseHyperDual& lhs, const SparseHyperDual& rhs) \
+		{                                                                                \
+			return lhs.value op rhs.value;                                               \
+		}                                                                                \
+		friend bool operator op (const SparseHyperDual& lhs, const T& rhs)               \
+		{                                                                                \
+			return lhs.value op rhs;                                                     \
+		}                                                                                \
+		friend bool operator op (const T& lhs, const SparseHyperDual& rhs)               \
+		{                                                                                \
+			return lhs op rhs.value;                                                     \
+		}
+	SPII_SPARSE_HYPER_DUAL_COMPARISON(==)
+	SPII_SPARSE_HYPER_DUAL_COMPARISON(!=)
+	SPII_SPARSE_HYPER_DUAL_COMPARISON(<)
+	SPII_SPARSE_HYPER_DUAL_COMPARISON(<=)
+	SPII_SPARSE_HYPER_DUAL_COMPARISON(>)
+	SPII_SPARSE_HYPER_DUAL_COMPARISON(>=)
+	#undef SPII_SPARSE_HYPER_DUAL_COMPARISON
+
+	friend SparseHyperDual abs(const SparseHyperDual& arg)
+	{
+		return arg.value < 0 ? -arg : arg;
+	}
+
+	friend SparseHyperDual fabs(const SparseHyperDual& arg)
+	{
+		return abs(arg);
+	}
+
+	friend SparseHyperDual sqr(const SparseHyperDual& arg)
+	{
+		return chain(arg, arg.value * arg.value, 2 * arg.value, T(2));
+	}
+
+	friend SparseHyperDual sqrt(const SparseHyperDual& arg)
+	{
+		using std::sqrt;
+		T value = sqrt(arg.value);
+		T derivative = T(0.5) / value;
+		return chain(arg, value, derivative, -derivative / (2 * arg.value));
+	}
+
+	friend SparseHyperDual exp(const SparseHyperDual& arg)
+	{
+		using std::exp;
+		T value = exp(arg.value);
+		return chain(arg, value, value, value);
+	}
+
+	friend SparseHyperDual log(const SparseHyperDual& arg)
+	{
+		using std::log;
+		T inverse = T(1) / arg.value;
+		return chain(arg, log(arg.value), inverse, -inverse * inverse);
+	}
+
+	friend SparseHyperDual log10(const SparseHyperDual& arg)
+	{
+		using std::log;
+		using std::log10;
+		T inverse = T(1) / (arg.value * log(T(10)));
+		return chain(arg, log10(arg.value), inverse, -inverse / arg.value);
+	}
+
+	friend SparseHyperDual sin(const SparseHyperDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		T value = sin(arg.value);
+		return chain(arg, value, cos(arg.value), -value);
+	}
+
+	friend SparseHyperDual cos(const SparseHyperDual& arg)
+	{
+		using std::sin;
+		using std::cos;
+		T value = cos(arg.value);
+		return chain(arg, value, -sin(arg.value), -value);
+	}
+
+	friend SparseHyperDual tan(const SparseHyperDual& arg)
+	{
+		using std::tan;
+		T value = tan(arg.value);
+		T derivative = 1 + value * value;
+		return chain(arg, value, derivative, 2 * value * derivative);
+	}
+
+	friend SparseHyperDual asin(const SparseHyperDual& arg)
+	{
+		using std::asin;
+		using std::sqrt;
+		T derivative = T(1) / sqrt(1 - arg.value * arg.value);
+		return chain(arg, asin(arg.value), derivative,
+		             arg.value * derivative * derivative * derivative);
+	}
+
+	friend SparseHyperDual acos(const SparseHyperDual& arg)
+	{
+		using std::acos;
+		using std::sqrt;
+		T derivative = T(-1) / sqrt(1 - arg.value * arg.value);
+		return chain(arg, acos(arg.value), derivative,
+		             arg.value * derivative * derivative * derivative);
+	}
+
+	friend SparseHyperDual atan(const SparseHyperDual& arg)
+	{
+		using std::atan;
+		T derivative = T(1) / (1 + arg.value * arg.value);
+		return chain(arg, atan(arg.value), derivative,
+		             -2 * arg.value * derivative * derivative);
+	}
+
+	friend SparseHyperDual sinh(const SparseHyperDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		T value = sinh(arg.value);
+		return chain(arg, value, cosh(arg.value), value);
+	}
+
+	friend SparseHyperDual cosh(const SparseHyperDual& arg)
+	{
+		using std::sinh;
+		using std::cosh;
+		T value = cosh(arg.value);
+		return chain(arg, value, sinh(arg.value), value);
+	}
+
+	friend SparseHyperDual tanh(const SparseHyperDual& arg)
+	{
+		using std::tanh;
+		T value = tanh(arg.value);
+		T derivative = 1 - value * value;
+		return chain(arg, value, derivative, -2 * value * derivative);
+	}
+
+	friend SparseHyperDual pow(const SparseHyperDual& base, const T& exponent)
+	{
+		using std::pow;
+		T value = pow(base.value, exponent);
+		T derivative = exponent * pow(base.value, exponent - 1);
+		T derivative2 = exponent * (exponent - 1) * pow(base.value, exponent - 2);
+		return chain(base, value, derivative, derivative2);
+	}
+
+	friend SparseHyperDual pow(const T& base, const SparseHyperDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T value = pow(base, exponent.value);
+		T log_base = log(base);
+		return chain(exponent, value, value * log_base, value * log_base * log_base);
+	}
+
+	friend SparseHyperDual pow(const SparseHyperDual& base, const SparseHyperDual& exponent)
+	{
+		using std::log;
+		using std::pow;
+		T a = base.value;
+		T b = exponent.value;
+		T value = pow(a, b);
+		T log_a = log(a);
+		T power1 = pow(a, b - 1);
+		return chain(base, exponent, value,
+		             b * power1, value * log_a,
+		             b * (b - 1) * pow(a, b - 2), power1 * (1 + b * log_a), value * log_a * log_a);
+	}
+
+	friend SparseHyperDual atan2(const SparseHyperDual& y, const SparseHyperDual& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y.value * y.value);
+		T inverse2 = inverse * inverse;
+		T xy = x.value * y.value;
+		return chain(y, x, atan2(y.value, x.value),
+		             x.value * inverse, -y.value * inverse,
+		             -2 * xy * inverse2,
+		             (y.value * y.value - x.value * x.value) * inverse2,
+		             2 * xy * inverse2);
+	}
+
+	friend SparseHyperDual atan2(const SparseHyperDual& y, const T& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x * x + y.value * y.value);
+		return chain(y, atan2(y.value, x), x * inverse, -2 * x * y.value * inverse * inverse);
+	}
+
+	friend SparseHyperDual atan2(const T& y, const SparseHyperDual& x)
+	{
+		using std::atan2;
+		T inverse = T(1) / (x.value * x.value + y * y);
+		return chain(x, atan2(y, x.value), -y * inverse, 2 * x.value * y * inverse * inverse);
+	}
+
+private:
+	typedef SparseList<int, T> Gradient;
+	typedef SparseList<std::int64_t, T> Hessian;
+
+	static std::int64_t key(int i, int j)
+	{
+		return (std::int64_t(i) << 32) | std::int64_t(j);
+	}
+
+	SparseHyperDual(const T& value_, const Gradient& gradient_, const Hessian& hessian_)
+		: value(value_), gradient(gradient_), hessian(hessian_)
+	{ }
+
+	// Returns the upper triangle of
+	//
+	//   A a' + B b',  A = daa a + dab b,  B = dab a + dbb b,
+	//
+	// the part of the Hessian of f(a, b) given by the first
+	// derivatives of a and b.
+	static Hessian outer(const Gradient& a,
+	                     const Gradient& b,
+	                     const T& daa,
+	                     const T& dab,
+	                     const T& dbb)
+	{
+		if ((daa == T(0) && dab == T(0) && dbb == T(0)) || (a.size() == 0 && b.size() == 0)) {
+			return Hessian();
+		}
+
+		// The union of the variables of a and b with the derivatives
+		// of both.
+		auto& arena = DynamicArena::thread_arena();
+		const int capacity = a.size() + b.size();
+		int* indices = static_cast<int*>(arena.allocate(capacity * sizeof(int)));
+		T* a_values = static_cast<T*>(arena.allocate(capacity * sizeof(T)));
+		T* b_values = static_cast<T*>(arena.allocate(capacity * sizeof(T)));
+		int ka = 0, kb = 0, n = 0;
+		while (ka < a.size() || kb < b.size()) {
+			if (kb == b.size() || (ka < a.size() && a.key(ka) < b.key(kb))) {
+				indices[n] = a.key(ka);
+				a_values[n] = a.value(ka++);
+				b_values[n++] = T(0);
+			}
+			else if (ka == a.size() || b.key(kb) < a.key(ka)) {
+				indices[n] = b.key(kb);
+				a_values[n] = T(0);
+				b_values[n++] = b.value(kb++);
+			}
+			else {
+				indices[n] = a.key(ka);
+				a_values[n] = a.value(ka++);
+				b_values[n++] = b.value(kb++);
+			}
+		}
+
+		std::int64_t* keys;
+		T* values;
+		Hessian::allocate(n * (n + 1) / 2, &keys, &values);
+		int k = 0;
+		for (int p = 0; p < n; ++p) {
+			const T a_p = daa * a_values[p] + dab * b_values[p];
+			const T b_p = dab * a_values[p] + dbb * b_values[p];
+			for (int q = p; q < n; ++q) {
+				T value = a_p * a_values[q] + b_p * b_values[q];
+				// Skip the products that are zero because the
+				// variables only occur in different arguments.
+				if (value != T(0)) {
+					keys[k] = key(indices[p], indices[q]);
+					values[k++] = value;
+				}
+			}
+		}
+		Hessian result;
+		result.set(keys, values, k);
+		return result;
+	}
+
+	// Returns f(arg), given f, f' and f'' evaluated at arg.x().
+	static SparseHyperDual chain(const SparseHyperDual& arg,
+	                             const T& value,
+	                             const T& derivative,
+	                             const T& derivative2)
+	{
+		return SparseHyperDual(value,
+		                       Gradient::scaled(derivative, arg.gradient),
+		                       Hessian::combined(derivative, arg.hessian,
+		                                         T(1), outer(arg.gradient, Gradient(), derivative2, T(0), T(0))));
+	}
+
+	// Returns f(a, b), given f and its first and second partial
+	// derivatives evaluated at (a.x(), b.x()).
+	static SparseHyperDual chain(const SparseHyperDual& a,
+	                             const SparseHyperDual& b,
+	                             const T& value,
+	                             const T& da,
+	                             const T& db,
+	                             const T& daa,
+	                             const T& dab,
+	                             const T& dbb)
+	{
+		return SparseHyperDual(value,
+		                       Gradient::combined(da, a.gradient, db, b.gradient),
+		                       Hessian::combined(T(1), Hessian::combined(da, a.hessian, db, b.hessian),
+		                                         T(1), outer(a.gradient, b.gradient, daa, dab, dbb)));
+	}
+
+	T value;
+	Gradient gradient;
+	Hessian hessian;
+};
+
+}  // namespace spii
+
+#endif
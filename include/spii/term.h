@@ -35,6 +35,47 @@ public:
 	// This function only needs to be implemented if interval arithmetic is
 	// desired.
 	virtual Interval<double> evaluate_interval(const Interval<double> * const * const variables) const;
+
+	// Single-precision evaluation. The evaluate_float functions only
+	// need to be implemented if has_single_precision returns true.
+	// Otherwise, Function uses the double versions above even when
+	// single precision is requested.
+	virtual bool has_single_precision() const;
+	virtual double evaluate_float(float * const * const variables) const;
+	virtual double evaluate_float(float * const * const variables,
+	                              std::vector<Eigen::VectorXf>* gradient) const;
+
+	// Batched evaluation. Where possible, Function evaluates
+	// batch_size() consecutive terms of the same type with a single
+	// call to evaluate_batch of the first of them (terms[0] == this).
+	// Term l is evaluated at variables[l]; its value is stored in
+	// values[l] and, if gradients (or hessians) is not null, its
+	// derivatives in gradients[l] (and hessians[l]). By default, the
+	// terms are evaluated one at a time.
+	virtual int batch_size() const;
+	virtual void evaluate_batch(const Term* const* terms,
+	                            double * const * const * variables,
+	                            double* values,
+	                            std::vector<Eigen::VectorXd>* gradients,
+	                            std::vector< std::vector<Eigen::MatrixXd> >* hessians) const;
+
+	// Computes the gradient and the product of the Hessian with a
+	// direction, given like the variables, without forming the
+	// Hessian. By default, the Hessian is computed and multiplied
+	// with the direction.
+	virtual double evaluate_hessian_vector(double * const * const variables,
+	                                       const double * const * const direction,
+	                                       std::vector<Eigen::VectorXd>* gradient,
+	                                       std::vector<Eigen::VectorXd>* hessian_vector) const;
+
+	// Computes the gradient and a Gauss–Newton approximation of the
+	// Hessian, which is used when Function::gauss_newton_hessian is
+	// set. Residual terms return J^T J (see residual_term.h). By
+	// default, the exact Hessian is computed.
+	virtual double evaluate_gauss_newton(double * const * const variables,
+	                                     std::vector<Eigen::VectorXd>* gradient,
+	                                     std::vector< std::vector<Eigen::MatrixXd> >* hessian) const;
+
 	// Overload these if input/output is required.
 	virtual void read(std::istream& in);
 	virtual void write(std::ostream& out) const;
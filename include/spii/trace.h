@@ -0,0 +1,464 @@
+#ifndef SPII_TRACE_H
+#define SPII_TRACE_H
+// This header defines Trace, a linear list of the operations performed
+// by a function, and Traced, the number type used to record it.
+//
+// A functor is traced by calling it once with Traced numbers. While
+// recording, identical operations are only stored once (common
+// subexpression elimination), operations on constants are computed
+// immediately (constant folding), and operations that do not
+// contribute to the result are removed when the trace is finished
+// (dead-code elimination).
+//
+// The outcome of every comparison of traced numbers is stored as a
+// guard. Replaying the trace for other variables is only valid if all
+// guards have the same outcome, i.e. if the functor would have taken
+// the same branches; otherwise the functor has to be traced again.
+// Control flow that does not go through comparisons of Traced numbers
+// (e.g. converting a Traced to a double) is not supported.
+//
+// Data members of a functor are recorded as constants, unless they
+// are converted with SPII_PARAMETER:
+//
+//		T r0 = predicted_x - SPII_PARAMETER(T, observed_x);
+//
+// Parameters are constants when the trace is replayed, but remain
+// variables in code generated from the trace (see code_generation.h).
+//
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <spii/parameter.h>
+#include <spii/spii.h>
+
+namespace spii {
+
+class SPII_API Trace
+{
+public:
+	enum Opcode : unsigned char
+	{
+		Variable,     // The variable number is Operation::constant.
+		Constant,
+		Parameter,    // The parameter number is Operation::constant.
+		// Binary operations.
+		Add,
+		Subtract,
+		Multiply,
+		Divide,
+		Pow,
+		Atan2,
+		// Unary operations.
+		Negate,
+		PowConstant,  // The exponent is Operation::constant.
+		Abs,
+		Sqrt,
+		Exp,
+		Log,
+		Log10,
+		Sin,
+		Cos,
+		Tan,
+		Asin,
+		Acos,
+		Atan,
+		Sinh,
+		Cosh,
+		Tanh,
+		Sign          // -1 for negative numbers, otherwise 1.
+	};
+
+	enum Comparison : unsigned char
+	{
+		Equal,
+		NotEqual,
+		Less,
+		LessEqual,
+		Greater,
+		GreaterEqual
+	};
+
+	struct Operation
+	{
+		Opcode opcode;
+		int arguments[2];
+		double constant;
+	};
+
+	struct Guard
+	{
+		Comparison comparison;
+		int arguments[2];
+		bool outcome;
+	};
+
+	// Creates a trace whose first operations are the variables.
+	Trace(int number_of_variables);
+
+	int number_of_variables() const
+	{
+		return n;
+	}
+
+	int number_of_parameters() const
+	{
+		return static_cast<int>(parameter_names.size());
+	}
+
+	// Number of operations, including the variables.
+	std::size_t size() const
+	{
+		return operations.size();
+	}
+
+	// The operations computing the outputs of a finished trace.
+	const std::vector<int>& get_outputs() const
+	{
+		return outputs;
+	}
+
+	const std::vector<Operation>& get_operations() const
+	{
+		return operations;
+	}
+
+	const std::vector<Guard>& get_guards() const
+	{
+		return guards;
+	}
+
+	const std::vector<std::string>& get_parameter_names() const
+	{
+		return parameter_names;
+	}
+
+	const std::vector<double>& get_parameter_values() const
+	{
+		return parameter_values;
+	}
+
+	//
+	// Recording. Every function returns the index of the operation
+	// computing the result.
+	//
+
+	int constant(double value);
+	int parameter(const std::string& name, double value);
+	int record(Opcode opcode, int argument0, int argument1 = -1, double constant = 0);
+	void guard(Comparison comparison, int argument0, int argument1, bool outcome);
+
+	// Records the derivatives of an operation with a reverse sweep.
+	// Returns the operations computing the partial derivatives with
+	// respect to the variables. Calling this again for a partial
+	// derivative records the second derivatives.
+	std::vector<int> differentiate(int output);
+
+	// Removes all operations not needed to compute the outputs or to
+	// check the guards. Variables and parameters are always kept and
+	// come first, in order. The trace may not be recorded to
+	// afterwards. Replaying computes the first output.
+	void finish(int output);
+	void finish(const std::vector<int>& outputs);
+
+	// The trace SPII_PARAMETER records to in this thread, or null.
+	static Trace* recording();
+
+	// Sets the trace SPII_PARAMETER records to during its lifetime.
+	class SPII_API Recording
+	{
+	public:
+		Recording(Trace* trace);
+		~Recording();
+	private:
+		Recording(const Recording&);
+		Recording& operator = (const Recording&);
+		Trace* previous;
+	};
+
+	// Whether other records the same operations and guards, i.e.
+	// whether the traces only differ in the values of their
+	// parameters.
+	bool has_same_operations(const Trace& other) const;
+
+	//
+	// Replaying. All functions return false, without computing
+	// anything, if a guard does not hold for x. The parameters have
+	// the values they were recorded with, unless other values are
+	// given.
+	//
+
+	bool evaluate(const double* x, double* value) const;
+	bool evaluate(const double* x, const double* parameters, double* value) const;
+	bool gradient(const double* x, double* value, double* gradient) const;
+	bool gradient(const double* x, const double* parameters, double* value, double* gradient) const;
+
+	// Computes the gradient and the product of the Hessian and v with
+	// one forward and one reverse sweep.
+	bool hessian_vector(const double* x,
+	                    const double* v,
+	                    double* value,
+	                    double* gradient,
+	                    double* hessian_times_v) const;
+	bool hessian_vector(const double* x,
+	                    const double* parameters,
+	                    const double* v,
+	                    double* value,
+	                    double* gradient,
+	                    double* hessian_times_v) const;
+
+	// Evaluates an operation for the values of its arguments.
+	static double apply(const Operation& operation, double x, double y);
+
+private:
+	struct OperationHash
+	{
+		std::size_t operator()(const Operation& operation) const;
+	};
+	struct OperationEqual
+	{
+		bool operator()(const Operation& lhs, const Operation& rhs) const;
+	};
+
+	bool is_constant(int index) const
+	{
+		return operations[index].opcode == Constant;
+	}
+
+	int add(const Operation& operation);
+	void record_partials(int index, int partials[2]);
+	bool forward(const double* x,
+	             const double* parameters,
+	             std::vector<double>* values,
+	             std::vector<double>* partials) const;
+
+	int n;
+	int output;
+	std::vector<int> outputs;
+	std::vector<Operation> operations;
+	std::vector<Guard> guards;
+	std::vector<std::string> parameter_names;
+	std::vector<double> parameter_values;
+	std::vector<int> parameter_indices;
+	std::unordered_map<Operation, int, OperationHash, OperationEqual> operation_indices;
+};
+
+// A number recording the operations performed on it. Operations on
+// numbers without a trace (constants) are not recorded.
+class Traced
+{
+public:
+	Traced()
+		: value(0), trace(nullptr), index(-1)
+	{ }
+
+	Traced(double value_)
+		: value(value_), trace(nullptr), index(-1)
+	{ }
+
+	// The number computed by operation index of trace.
+	Traced(double value_, Trace* trace_, int index_)
+		: value(value_), trace(trace_), index(index_)
+	{ }
+
+	double x() const
+	{
+		return value;
+	}
+
+	// The operation computing this number, or -1 for constants.
+	int trace_index() const
+	{
+		return index;
+	}
+
+	Traced& operator += (const Traced& rhs)
+	{
+		return *this = *this + rhs;
+	}
+
+	Traced& operator -= (const Traced& rhs)
+	{
+		return *this = *this - rhs;
+	}
+
+	Traced& operator *= (const Traced& rhs)
+	{
+		return *this = *this * rhs;
+	}
+
+	Traced& operator /= (const Traced& rhs)
+	{
+		return *this = *this / rhs;
+	}
+
+	//
+	// As for Dual, the operators and functions below are friends
+	// defined in the class so that the other argument may be
+	// implicitly converted, e.g. pow(x, 2) or 2 * x.
+	//
+
+	friend Traced operator + (const Traced& arg)
+	{
+		return arg;
+	}
+
+	friend Traced operator - (const Traced& arg)
+	{
+		return unary(Trace::Negate, arg, -arg.value);
+	}
+
+	friend Traced operator + (const Traced& lhs, const Traced& rhs)
+	{
+		return binary(Trace::Add, lhs, rhs, lhs.value + rhs.value);
+	}
+
+	friend Traced operator - (const Traced& lhs, const Traced& rhs)
+	{
+		return binary(Trace::Subtract, lhs, rhs, lhs.value - rhs.value);
+	}
+
+	friend Traced operator * (const Traced& lhs, const Traced& rhs)
+	{
+		return binary(Trace::Multiply, lhs, rhs, lhs.value * rhs.value);
+	}
+
+	friend Traced operator / (const Traced& lhs, const Traced& rhs)
+	{
+		return binary(Trace::Divide, lhs, rhs, lhs.value / rhs.value);
+	}
+
+	#define SPII_TRACED_COMPARISON(op, comparison)                          \
+		friend bool operator op (const Traced& lhs, const Traced& rhs)      \
+		{                                                                   \
+			bool outcome = lhs.value op rhs.value;                          \
+			Trace* trace = lhs.trace ? lhs.trace : rhs.trace;               \
+			if (trace) {                                                    \
+				trace->guard(Trace::comparison,                             \
+				             lhs.operation(trace),                          \
+				             rhs.operation(trace),                          \
+				             outcome);                                      \
+			}                                                               \
+			return outcome;                                                 \
+		}
+	SPII_TRACED_COMPARISON(==, Equal)
+	SPII_TRACED_COMPARISON(!=, NotEqual)
+	SPII_TRACED_COMPARISON(<, Less)
+	SPII_TRACED_COMPARISON(<=, LessEqual)
+	SPII_TRACED_COMPARISON(>, Greater)
+	SPII_TRACED_COMPARISON(>=, GreaterEqual)
+	#undef SPII_TRACED_COMPARISON
+
+	friend Traced abs(const Traced& arg)
+	{
+		return unary(Trace::Abs, arg, std::abs(arg.value));
+	}
+
+	friend Traced fabs(const Traced& arg)
+	{
+		return abs(arg);
+	}
+
+	friend Traced sqr(const Traced& arg)
+	{
+		return arg * arg;
+	}
+
+	#define SPII_TRACED_FUNCTION(function, opcode)                         \
+		friend Traced function(const Traced& arg)                          \
+		{                                                                  \
+			return unary(Trace::opcode, arg, std::function(arg.value));    \
+		}
+	SPII_TRACED_FUNCTION(sqrt, Sqrt)
+	SPII_TRACED_FUNCTION(exp, Exp)
+	SPII_TRACED_FUNCTION(log, Log)
+	SPII_TRACED_FUNCTION(log10, Log10)
+	SPII_TRACED_FUNCTION(sin, Sin)
+	SPII_TRACED_FUNCTION(cos, Cos)
+	SPII_TRACED_FUNCTION(tan, Tan)
+	SPII_TRACED_FUNCTION(asin, Asin)
+	SPII_TRACED_FUNCTION(acos, Acos)
+	SPII_TRACED_FUNCTION(atan, Atan)
+	SPII_TRACED_FUNCTION(sinh, Sinh)
+	SPII_TRACED_FUNCTION(cosh, Cosh)
+	SPII_TRACED_FUNCTION(tanh, Tanh)
+	#undef SPII_TRACED_FUNCTION
+
+	friend Traced pow(const Traced& base, double exponent)
+	{
+		return unary(Trace::PowConstant, base, std::pow(base.value, exponent), exponent);
+	}
+
+	friend Traced pow(double base, const Traced& exponent)
+	{
+		if (!exponent.trace) {
+			return Traced(std::pow(base, exponent.value));
+		}
+		return exp(std::log(base) * exponent);
+	}
+
+	friend Traced pow(const Traced& base, const Traced& exponent)
+	{
+		if (!exponent.trace) {
+			return pow(base, exponent.value);
+		}
+		return binary(Trace::Pow, base, exponent, std::pow(base.value, exponent.value));
+	}
+
+	friend Traced atan2(const Traced& y, const Traced& x)
+	{
+		return binary(Trace::Atan2, y, x, std::atan2(y.value, x.value));
+	}
+
+private:
+	// The index of this number in trace, recording it as a constant
+	// if needed.
+	int operation(Trace* trace_) const
+	{
+		return trace ? index : trace_->constant(value);
+	}
+
+	static Traced unary(Trace::Opcode opcode, const Traced& arg, double value, double constant = 0)
+	{
+		if (!arg.trace) {
+			return Traced(value);
+		}
+		return Traced(value, arg.trace, arg.trace->record(opcode, arg.index, -1, constant));
+	}
+
+	static Traced binary(Trace::Opcode opcode, const Traced& lhs, const Traced& rhs, double value)
+	{
+		Trace* trace = lhs.trace ? lhs.trace : rhs.trace;
+		if (!trace) {
+			return Traced(value);
+		}
+		int index = trace->record(opcode, lhs.operation(trace), rhs.operation(trace));
+		return Traced(value, trace, index);
+	}
+
+	double value;
+	Trace* trace;
+	int index;
+};
+
+// When tracing, a member converted with SPII_PARAMETER is recorded as
+// a parameter instead of as a constant.
+template<>
+struct Parameter<Traced>
+{
+	static Traced get(const double& member, const char* name)
+	{
+		Trace* trace = Trace::recording();
+		if (!trace) {
+			return Traced(member);
+		}
+		return Traced(member, trace, trace->parameter(name, member));
+	}
+};
+
+}  // namespace spii
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef SPII_TRACED_TERM_H
+#define SPII_TRACED_TERM_H
+// This header defines TracedTerm, a drop-in replacement for
+// AutoDiffTerm that records the operations of its functor once and
+// replays the recording to compute derivatives.
+//
+//		auto term = std::make_shared<TracedTerm<Functor, 9, 3>>(arg1, arg2, ...);
+//
+// The first derivative evaluation traces the functor (see trace.h).
+// The gradient is then computed by a reverse sweep over the
+// simplified trace and the Hessian by one Hessian-vector product per
+// variable, without calling the functor again. If a comparison in
+// the functor has a different outcome for new variables, the functor
+// is traced again.
+//
+// The replay is interpreted and is usually slower than AutoDiffTerm;
+// the trace is mainly useful for code generation (see
+// code_generation.h). Terms of the same type share one trace if
+// their functors only differ in members converted with
+// SPII_PARAMETER; each term then only stores its parameter values.
+// Other data members are constants in the trace, so terms whose
+// members differ get traces of their own.
+//
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <spii/auto_diff_term.h>
+#include <spii/term.h>
+#include <spii/trace.h>
+
+namespace spii {
+
+// Calls functor(arguments[0], arguments[1], ...).
+template<typename Functor, std::size_t... I>
+Traced call_traced(const Functor& functor, Traced* const* arguments, std::index_sequence<I...>)
+{
+	return functor(arguments[I]...);
+}
+
+// Records functor(x) in trace, which has to have the variables of
+// the functor. Returns the operation computing the result.
+template<int... D, typename Functor>
+int record_functor(Trace* trace, const Functor& functor, const double* x)
+{
+	static const int number_of_scalars = IntSum<D...>::value;
+	check(trace->number_of_variables() == number_of_scalars,
+	      "record_functor: Wrong number of variables.");
+
+	Traced traced_x[number_of_scalars];
+	for (int i = 0; i < number_of_scalars; ++i) {
+		traced_x[i] = Traced(x[i], trace, i);
+	}
+
+	const int dimensions[] = {D...};
+	Traced* arguments[sizeof...(D)];
+	int offset = 0;
+	for (int var = 0; var < int(sizeof...(D)); ++var) {
+		arguments[var] = traced_x + offset;
+		offset += dimensions[var];
+	}
+
+	Trace::Recording recording(trace);
+	Traced f = call_traced(functor, arguments, std::make_index_sequence<sizeof...(D)>());
+	int output = f.trace_index();
+	if (output < 0) {
+		output = trace->constant(f.x());
+	}
+	return output;
+}
+
+template<typename Functor, int... D>
+class TracedTerm
+	: public SizedTerm<D...>
+{
+	static const int number_of_scalars = IntSum<D...>::value;
+
+public:
+	template<typename... Args>
+	TracedTerm(Args&&... args)
+		: functor(std::forward<Args>(args)...)
+	{ }
+
+	virtual void read(std::istream& in) override
+	{
+		call_read_if_exists(in, functor);
+		std::atomic_store(&replay, std::shared_ptr<const Replay>());
+	}
+
+	virtual void write(std::ostream& out) const override
+	{
+		call_write_if_exists(out, functor);
+	}
+
+	virtual double evaluate(double * const * const variables) const override
+	{
+		DoubleFunctorCaller<Functor, D...> caller;
+		return caller.call(functor, variables);
+	}
+
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient) const override
+	{
+		double x[number_of_scalars];
+		double g[number_of_scalars];
+		flatten(variables, x);
+
+		double value;
+		auto current = std::atomic_load(&replay);
+		if (!current || !current->trace->gradient(x, current->parameters.data(), &value, g)) {
+			current = record(x);
+			current->trace->gradient(x, current->parameters.data(), &value, g);
+		}
+
+		unflatten(g, gradient);
+		return value;
+	}
+
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		double x[number_of_scalars];
+		double g[number_of_scalars];
+		double v[number_of_scalars] = {0};
+		double hv[number_of_scalars];
+		flatten(variables, x);
+
+		double value;
+		auto current = std::atomic_load(&replay);
+		if (!current || !current->trace->evaluate(x, current->parameters.data(), &value)) {
+			current = record(x);
+		}
+
+		// Column k of the Hessian is the product with unit vector k.
+		const int dimensions[] = {D...};
+		int k = 0;
+		for (int var1 = 0; var1 < int(sizeof...(D)); ++var1) {
+			for (int j = 0; j < dimensions[var1]; ++j, ++k) {
+				v[k] = 1;
+				current->trace->hessian_vector(x, current->parameters.data(), v, &value, g, hv);
+				v[k] = 0;
+
+				int offset0 = 0;
+				for (int var0 = 0; var0 < int(sizeof...(D)); ++var0) {
+					for (int i = 0; i < dimensions[var0]; ++i) {
+						(*hessian)[var0][var1](i, j) = hv[offset0 + i];
+					}
+					offset0 += dimensions[var0];
+				}
+			}
+		}
+		unflatten(g, gradient);
+
+		return value;
+	}
+
+	virtual double evaluate_hessian_vector(double * const * const variables,
+	                                       const double * const * const direction,
+	                                       std::vector<Eigen::VectorXd>* gradient,
+	                                       std::vector<Eigen::VectorXd>* hessian_vector) const override
+	{
+		double x[number_of_scalars];
+		double v[number_of_scalars];
+		double g[number_of_scalars];
+		double hv[number_of_scalars];
+		flatten(variables, x);
+		flatten(direction, v);
+
+		double value;
+		auto current = std::atomic_load(&replay);
+		if (!current || !current->trace->hessian_vector(x, current->parameters.data(), v, &value, g, hv)) {
+			current = record(x);
+			current->trace->hessian_vector(x, current->parameters.data(), v, &value, g, hv);
+		}
+
+		unflatten(g, gradient);
+		unflatten(hv, hessian_vector);
+		return value;
+	}
+
+	// The trace replayed for this term, or null if the functor has
+	// not been traced yet. The trace may be shared with other terms of
+	// this type, in which case its parameter values are those of the
+	// term that recorded it.
+	std::shared_ptr<const Trace> get_trace() const
+	{
+		auto current = std::atomic_load(&replay);
+		return current ? current->trace : nullptr;
+	}
+
+protected:
+	Functor functor;
+
+private:
+	static void flatten(const double * const * const variables, double* x)
+	{
+		const int dimensions[] = {D...};
+		for (int var = 0; var < int(sizeof...(D)); ++var) {
+			for (int i = 0; i < dimensions[var]; ++i) {
+				*x++ = variables[var][i];
+			}
+		}
+	}
+
+	static void unflatten(const double* g, std::vector<Eigen::VectorXd>* gradient)
+	{
+		const int dimensions[] = {D...};
+		for (int var = 0; var < int(sizeof...(D)); ++var) {
+			for (int i = 0; i < dimensions[var]; ++i) {
+				(*gradient)[var](i) = *g++;
+			}
+		}
+	}
+
+	// A trace and the values of its parameters for this term.
+	struct Replay
+	{
+		std::shared_ptr<const Trace> trace;
+		std::vector<double> parameters;
+	};
+
+	// The trace shared by the terms of this type.
+	static std::shared_ptr<const Trace>& shared_trace()
+	{
+		static std::shared_ptr<const Trace> trace;
+		return trace;
+	}
+
+	// Traces the functor at x. The term uses the shared trace if the
+	// new trace has the same operations, otherwise its own trace,
+	// which becomes the shared trace if there is none yet. Several
+	// threads may evaluate terms at the same time; they all use a
+	// complete trace and the last one recorded is kept.
+	std::shared_ptr<const Replay> record(const double* x) const
+	{
+		auto new_trace = std::make_shared<Trace>(number_of_scalars);
+		new_trace->finish(record_functor<D...>(new_trace.get(), functor, x));
+
+		auto new_replay = std::make_shared<Replay>();
+		new_replay->parameters = new_trace->get_parameter_values();
+		auto shared = std::atomic_load(&shared_trace());
+		if (shared && shared->has_same_operations(*new_trace)) {
+			new_replay->trace = shared;
+		}
+		else {
+			new_replay->trace = new_trace;
+			if (!shared) {
+				std::atomic_store(&shared_trace(), new_replay->trace);
+			}
+		}
+
+		std::shared_ptr<const Replay> finished_replay = new_replay;
+		std::atomic_store(&replay, finished_replay);
+		return finished_replay;
+	}
+
+	mutable std::shared_ptr<const Replay> replay;
+};
+
+}  // namespace spii
+
+#endif
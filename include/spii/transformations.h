@@ -2,6 +2,7 @@
 #ifndef SPII_TRANSFORMATIONS_H
 #define SPII_TRANSFORMATIONS_H
 
+#include <algorithm>
 #include <cmath>
 #include <stdexcept>
 
@@ -41,6 +42,22 @@ public:
 		}
 	}
 
+	void jacobian(double* dx_dt, const double* t) const
+	{
+		std::fill(dx_dt, dx_dt + dimension * dimension, 0.0);
+		for (int i = 0; i < dimension; ++i) {
+			dx_dt[i * dimension + i] = 2 * t[i];
+		}
+	}
+
+	void second_derivatives(double* d2x_dt2, const double* t) const
+	{
+		std::fill(d2x_dt2, d2x_dt2 + dimension * dimension * dimension, 0.0);
+		for (int i = 0; i < dimension; ++i) {
+			d2x_dt2[(i * dimension + i) * dimension + i] = 2;
+		}
+	}
+
 	int x_dimension() const
 	{
 		return dimension;
@@ -88,6 +105,17 @@ public:
 		t[0] = tan(((x[0] - a) / (b - a) - 0.5) * 3.141592653589793);
 	}
 
+	void jacobian(double* dx_dt, const double* t) const
+	{
+		dx_dt[0] = (b - a) * 0.318309886183791 / (1 + t[0] * t[0]);
+	}
+
+	void second_derivatives(double* d2x_dt2, const double* t) const
+	{
+		double s = 1 + t[0] * t[0];
+		d2x_dt2[0] = -2 * t[0] * (b - a) * 0.318309886183791 / (s * s);
+	}
+
 	int x_dimension() const
 	{
 		return 1;
@@ -142,6 +170,23 @@ public:
 		}
 	}
 
+	void jacobian(double* dx_dt, const double* t) const
+	{
+		std::fill(dx_dt, dx_dt + dimension * dimension, 0.0);
+		for (int i = 0; i < dimension; ++i) {
+			dx_dt[i * dimension + i] = (b[i] - a[i]) * 0.318309886183791 / (1 + t[i] * t[i]);
+		}
+	}
+
+	void second_derivatives(double* d2x_dt2, const double* t) const
+	{
+		std::fill(d2x_dt2, d2x_dt2 + dimension * dimension * dimension, 0.0);
+		for (int i = 0; i < dimension; ++i) {
+			double s = 1 + t[i] * t[i];
+			d2x_dt2[(i * dimension + i) * dimension + i] = -2 * t[i] * (b[i] - a[i]) * 0.318309886183791 / (s * s);
+		}
+	}
+
 	int x_dimension() const
 	{
 		return dimension;
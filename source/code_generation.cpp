@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <sstream>
+
+#include <spii/code_generation.h>
+
+namespace spii {
+
+namespace {
+
+bool is_identifier(const std::string& name)
+{
+	if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) {
+		return false;
+	}
+	for (char c : name) {
+		if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_') {
+			return false;
+		}
+	}
+	return true;
+}
+
+// A C++ expression for a constant.
+std::string literal(double value)
+{
+	if (std::isnan(value)) {
+		return "std::numeric_limits<double>::quiet_NaN()";
+	}
+	if (std::isinf(value)) {
+		return value > 0 ? "std::numeric_limits<double>::infinity()"
+		                 : "(-std::numeric_limits<double>::infinity())";
+	}
+	std::ostringstream out;
+	out.precision(std::numeric_limits<double>::max_digits10);
+	out << value;
+	std::string text = out.str();
+	if (text.find_first_of(".e") == std::string::npos) {
+		text += ".0";
+	}
+	if (value < 0) {
+		text = "(" + text + ")";
+	}
+	return text;
+}
+
+// Writes the operations of a trace as statements.
+class TraceWriter
+{
+public:
+	TraceWriter(const Trace& trace_, const std::vector<int>& dimensions)
+		: trace(trace_)
+	{
+		std::vector<std::string> variables;
+		for (int var = 0; var < int(dimensions.size()); ++var) {
+			for (int i = 0; i < dimensions[var]; ++i) {
+				variables.push_back("variables[" + to_string(var) + "][" + to_string(i) + "]");
+			}
+		}
+
+		const auto& operations = trace.get_operations();
+		for (std::size_t k = 0; k < operations.size(); ++k) {
+			const auto& operation = operations[k];
+			int number = static_cast<int>(operation.constant);
+			switch (operation.opcode) {
+				case Trace::Variable:
+					names.push_back(variables.at(number));
+					break;
+				case Trace::Constant:
+					names.push_back(literal(operation.constant));
+					break;
+				case Trace::Parameter:
+					names.push_back(trace.get_parameter_names().at(number));
+					break;
+				default:
+					names.push_back("t" + to_string(k));
+					break;
+			}
+		}
+	}
+
+	const std::string& name(int index) const
+	{
+		return names[index];
+	}
+
+	// Writes one statement per operation, followed by a check that
+	// the guards hold.
+	void write(std::ostream& out, const std::string& class_name) const
+	{
+		const auto& operations = trace.get_operations();
+		for (std::size_t k = 0; k < operations.size(); ++k) {
+			const auto& operation = operations[k];
+			if (operation.opcode == Trace::Variable ||
+			    operation.opcode == Trace::Constant ||
+			    operation.opcode == Trace::Parameter) {
+				continue;
+			}
+			out << "\t\tconst double " << names[k] << " = " << expression(operation) << ";\n";
+		}
+
+		const auto& guards = trace.get_guards();
+		if (!guards.empty()) {
+			out << "\t\tconst bool generated_branch =\n";
+			for (std::size_t i = 0; i < guards.size(); ++i) {
+				out << "\t\t\t" << (i == 0 ? "   " : "&& ") << comparison(guards[i]) << "\n";
+			}
+			out << "\t\t\t;\n";
+			out << "\t\tspii::check(generated_branch, \"" << class_name
+			    << ": The variables are outside the region the code was generated for.\");\n";
+		}
+	}
+
+private:
+	std::string expression(const Trace::Operation& operation) const
+	{
+		const std::string& a = names[operation.arguments[0]];
+		const std::string b = operation.arguments[1] >= 0 ? names[operation.arguments[1]] : "";
+		double c = operation.constant;
+		switch (operation.opcode) {
+			case Trace::Add:      return a + " + " + b;
+			case Trace::Subtract: return a + " - " + b;
+			case Trace::Multiply: return a + " * " + b;
+			case Trace::Divide:   return a + " / " + b;
+			case Trace::Pow:      return "std::pow(" + a + ", " + b + ")";
+			case Trace::Atan2:    return "std::atan2(" + a + ", " + b + ")";
+			case Trace::Negate:   return "-" + a;
+			case Trace::PowConstant:
+				if (c == 2) {
+					return a + " * " + a;
+				}
+				if (c == -1) {
+					return "1.0 / " + a;
+				}
+				return "std::pow(" + a + ", " + literal(c) + ")";
+			case Trace::Abs:      return "std::abs(" + a + ")";
+			case Trace::Sqrt:     return "std::sqrt(" + a + ")";
+			case Trace::Exp:      return "std::exp(" + a + ")";
+			case Trace::Log:      return "std::log(" + a + ")";
+			case Trace::Log10:    return "std::log10(" + a + ")";
+			case Trace::Sin:      return "std::sin(" + a + ")";
+			case Trace::Cos:      return "std::cos(" + a + ")";
+			case Trace::Tan:      return "std::tan(" + a + ")";
+			case Trace::Asin:     return "std::asin(" + a + ")";
+			case Trace::Acos:     return "std::acos(" + a + ")";
+			case Trace::Atan:     return "std::atan(" + a + ")";
+			case Trace::Sinh:     return "std::sinh(" + a + ")";
+			case Trace::Cosh:     return "std::cosh(" + a + ")";
+			case Trace::Tanh:     return "std::tanh(" + a + ")";
+			case Trace::Sign:     return "(" + a + " < 0 ? -1.0 : 1.0)";
+			default:
+				throw std::logic_error("TraceWriter: Unexpected operation.");
+		}
+	}
+
+	std::string comparison(const Trace::Guard& guard) const
+	{
+		static const char* operators[] = {"==", "!=", "<", "<=", ">", ">="};
+		std::string text = "(" + names[guard.arguments[0]] + " "
+		                 + operators[guard.comparison] + " "
+		                 + names[guard.arguments[1]] + ")";
+		return guard.outcome ? text : "!" + text;
+	}
+
+	const Trace& trace;
+	std::vector<std::string> names;
+};
+
+}  // anonymous namespace
+
+void generate_term_code(std::ostream& out,
+                        const std::string& class_name,
+                        const std::vector<int>& dimensions,
+                        const std::function<int(Trace*)>& record,
+                        const std::vector<std::string>& parameters_)
+{
+	check(is_identifier(class_name), "generate_term_code: Invalid class name.");
+	check(!dimensions.empty(), "generate_term_code: No variables.");
+	int n = 0;
+	for (int dimension : dimensions) {
+		check(dimension >= 1, "generate_term_code: Dimensions must be positive.");
+		n += dimension;
+	}
+
+	Trace value_trace(n);
+	value_trace.finish(record(&value_trace));
+
+	Trace gradient_trace(n);
+	int f = record(&gradient_trace);
+	std::vector<int> outputs(1, f);
+	auto gradient = gradient_trace.differentiate(f);
+	outputs.insert(outputs.end(), gradient.begin(), gradient.end());
+	gradient_trace.finish(outputs);
+
+	// The Hessian is symmetric, so only the upper triangle is traced.
+	Trace hessian_trace(n);
+	f = record(&hessian_trace);
+	outputs.assign(1, f);
+	gradient = hessian_trace.differentiate(f);
+	outputs.insert(outputs.end(), gradient.begin(), gradient.end());
+	for (int i = 0; i < n; ++i) {
+		auto row = hessian_trace.differentiate(gradient[i]);
+		outputs.insert(outputs.end(), row.begin() + i, row.end());
+	}
+	hessian_trace.finish(outputs);
+
+	auto parameters = value_trace.get_parameter_names();
+	for (const auto& parameter : parameters) {
+		check(is_identifier(parameter),
+		      "generate_term_code: The parameter ", parameter, " is not a data member.");
+	}
+	if (!parameters_.empty()) {
+		auto sorted = parameters;
+		auto sorted_ = parameters_;
+		std::sort(sorted.begin(), sorted.end());
+		std::sort(sorted_.begin(), sorted_.end());
+		check(sorted == sorted_, "generate_term_code: The parameters do not match the functor.");
+		parameters = parameters_;
+	}
+
+	// The variable and index of every scalar.
+	std::vector<std::string> gradient_names;
+	for (int var = 0; var < int(dimensions.size()); ++var) {
+		for (int i = 0; i < dimensions[var]; ++i) {
+			gradient_names.push_back("(*gradient)[" + to_string(var) + "](" + to_string(i) + ")");
+		}
+	}
+	auto hessian_name = [&](int k, int l)
+	{
+		int var0 = 0, var1 = 0;
+		while (k >= dimensions[var0]) {
+			k -= dimensions[var0++];
+		}
+		while (l >= dimensions[var1]) {
+			l -= dimensions[var1++];
+		}
+		return "(*hessian)[" + to_string(var0) + "][" + to_string(var1) + "]("
+		       + to_string(k) + ", " + to_string(l) + ")";
+	};
+
+	std::string guard_name = class_name;
+	for (char& c : guard_name) {
+		c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+	}
+	std::string sizes;
+	for (int var = 0; var < int(dimensions.size()); ++var) {
+		sizes += (var > 0 ? ", " : "") + to_string(dimensions[var]);
+	}
+
+	out << "// Generated by spii::generate_term_code. Do not edit.\n";
+	out << "#ifndef SPII_GENERATED_" << guard_name << "_H\n";
+	out << "#define SPII_GENERATED_" << guard_name << "_H\n";
+	out << "\n";
+	out << "#include <cmath>\n";
+	out << "#include <iostream>\n";
+	out << "#include <limits>\n";
+	out << "#include <vector>\n";
+	out << "\n";
+	out << "#include <spii/term.h>\n";
+	out << "\n";
+	out << "class " << class_name << "\n";
+	out << "\t: public spii::SizedTerm<" << sizes << ">\n";
+	out << "{\n";
+	out << "public:\n";
+
+	// Constructors.
+	out << "\t" << class_name << "()\n";
+	for (std::size_t i = 0; i < parameters.size(); ++i) {
+		out << "\t\t" << (i == 0 ? ": " : "  ") << parameters[i] << "(0)"
+		    << (i + 1 < parameters.size() ? "," : "") << "\n";
+	}
+	out << "\t{ }\n\n";
+	if (!parameters.empty()) {
+		out << "\t" << (parameters.size() == 1 ? "explicit " : "") << class_name << "(";
+		for (std::size_t i = 0; i < parameters.size(); ++i) {
+			out << (i > 0 ? ", " : "") << "double " << parameters[i] << "_";
+		}
+		out << ")\n";
+		for (std::size_t i = 0; i < parameters.size(); ++i) {
+			out << "\t\t" << (i == 0 ? ": " : "  ") << parameters[i] << "(" << parameters[i] << "_)"
+			    << (i + 1 < parameters.size() ? "," : "") << "\n";
+		}
+		out << "\t{ }\n\n";
+
+		out << "\tvirtual void read(std::istream& in) override\n";
+		out << "\t{\n";
+		out << "\t\tin";
+		for (const auto& parameter : parameters) {
+			out << " >> " << parameter;
+		}
+		out << ";\n";
+		out << "\t}\n\n";
+
+		out << "\tvirtual void write(std::ostream& out) const override\n";
+		out << "\t{\n";
+		out << "\t\tout";
+		for (std::size_t i = 0; i < parameters.size(); ++i) {
+			out << (i > 0 ? " << ' '" : "") << " << " << parameters[i];
+		}
+		out << ";\n";
+		out << "\t}\n\n";
+	}
+
+	// Value.
+	out << "\tvirtual double evaluate(double * const * const variables) const override\n";
+	out << "\t{\n";
+	TraceWriter value_writer(value_trace, dimensions);
+	value_writer.write(out, class_name);
+	out << "\t\treturn " << value_writer.name(value_trace.get_outputs()[0]) << ";\n";
+	out << "\t}\n\n";
+
+	// Gradient.
+	out << "\tvirtual double evaluate(double * const * const variables,\n";
+	out << "\t                        std::vector<Eigen::VectorXd>* gradient) const override\n";
+	out << "\t{\n";
+	TraceWriter gradient_writer(gradient_trace, dimensions);
+	gradient_writer.write(out, class_name);
+	const auto& gradient_outputs = gradient_trace.get_outputs();
+	for (int i = 0; i < n; ++i) {
+		out << "\t\t" << gradient_names[i] << " = " << gradient_writer.name(gradient_outputs[1 + i]) << ";\n";
+	}
+	out << "\t\treturn " << gradient_writer.name(gradient_outputs[0]) << ";\n";
+	out << "\t}\n\n";
+
+	// Hessian.
+	out << "\tvirtual double evaluate(double * const * const variables,\n";
+	out << "\t                        std::vector<Eigen::VectorXd>* gradient,\n";
+	out << "\t                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override\n";
+	out << "\t{\n";
+	TraceWriter hessian_writer(hessian_trace, dimensions);
+	hessian_writer.write(out, class_name);
+	const auto& hessian_outputs = hessian_trace.get_outputs();
+	for (int i = 0; i < n; ++i) {
+		out << "\t\t" << gradient_names[i] << " = " << hessian_writer.name(hessian_outputs[1 + i]) << ";\n";
+	}
+	int output = 1 + n;
+	for (int i = 0; i < n; ++i) {
+		for (int j = i; j < n; ++j, ++output) {
+			const std::string& h = hessian_writer.name(hessian_outputs[output]);
+			out << "\t\t" << hessian_name(i, j) << " = " << h << ";\n";
+			if (j != i) {
+				out << "\t\t" << hessian_name(j, i) << " = " << h << ";\n";
+			}
+		}
+	}
+	out << "\t\treturn " << hessian_writer.name(hessian_outputs[0]) << ";\n";
+	out << "\t}\n";
+
+	if (!parameters.empty()) {
+		out << "\n";
+		out << "private:\n";
+		for (const auto& parameter : parameters) {
+			out << "\tdouble " << parameter << ";\n";
+		}
+	}
+	out << "};\n";
+	out << "\n";
+	out << "#endif\n";
+}
+
+}  // namespace spii
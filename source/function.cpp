@@ -1,11 +1,14 @@
 // Petter Strandmark 2012–2013.
 
 #include <algorithm>
+#include <cmath>
 #include <exception>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
 #include <typeinfo>
+#include <unordered_map>
 #include <unordered_set>
 
 #ifdef USE_OPENMP
@@ -27,7 +30,24 @@ struct AddedVariable
 	size_t global_index;  // Global index into a vector of all scalars.
 	bool is_constant;     // Whether this variable is (currently) constant.
 	std::shared_ptr<ChangeOfVariables> change_of_variables;
-	mutable std::vector<double>  temp_space; // Used internally during evaluation.
+	// Used internally during evaluation. Allocated by
+	// allocate_local_storage.
+	mutable std::vector<double>  temp_space;
+	// Single-precision copy of temp_space. Allocated by
+	// allocate_single_precision_storage.
+	mutable std::vector<float>   temp_space_float;
+	// The Jacobian dx/dt of the change of variables at the current
+	// point, row by row. Allocated by allocate_local_storage and
+	// computed by compute_change_jacobians.
+	mutable std::vector<double>  change_jacobian;
+	// The second derivatives of the change of variables at the
+	// current point (see ChangeOfVariables::second_derivatives).
+	// Allocated and computed by compute_change_jacobians when a
+	// Hessian is evaluated.
+	mutable std::vector<double>  change_second_derivatives;
+	// The direction of a Hessian-vector product in user space.
+	// Allocated by allocate_hessian_vector_storage.
+	mutable std::vector<double>  temp_direction;
 };
 
 struct IntPairHash
@@ -58,6 +78,136 @@ namespace
 			return true;
 		}
 	}
+
+	// Sums n values with a pairwise tree whose shape only depends
+	// on n.
+	double pairwise_sum(const double* values, std::size_t n)
+	{
+		if (n == 0) {
+			return 0.0;
+		}
+		else if (n == 1) {
+			return values[0];
+		}
+		auto half = n / 2;
+		return pairwise_sum(values, half) + pairwise_sum(values + half, n - half);
+	}
+
+	// Adds the gradient of a term with respect to the user space of
+	// a variable to the gradient with respect to its solver space.
+	void add_solver_gradient(const AddedVariable& var,
+	                         double* solver_gradient,
+	                         const double* user_gradient)
+	{
+		if (var.change_of_variables == nullptr) {
+			for (int i = 0; i < var.user_dimension; ++i) {
+				solver_gradient[i] += user_gradient[i];
+			}
+			return;
+		}
+
+		// df/dt = (dx/dt)^T df/dx.
+		const double* dx_dt = var.change_jacobian.data();
+		for (int i = 0; i < var.user_dimension; ++i) {
+			for (int j = 0; j < var.solver_dimension; ++j) {
+				solver_gradient[j] += dx_dt[i * var.solver_dimension + j] * user_gradient[i];
+			}
+		}
+	}
+
+	// Calls add(i, j, value) for the Hessian block of a term with
+	// respect to the solver spaces of var0 and var1, given the block
+	// block(i, j) with respect to their user spaces. The block is
+	//
+	//   J0^T B J1 + sum_i g_i d^2 x_i / dt^2,
+	//
+	// where the last sum is only added if var0 and var1 are the same
+	// argument of the term and user_gradient = g is the gradient of
+	// the term with respect to it. Otherwise user_gradient is null.
+	template<typename Block, typename Add>
+	void add_solver_hessian(const AddedVariable& var0,
+	                        const AddedVariable& var1,
+	                        const Block& block,
+	                        const double* user_gradient,
+	                        const Add& add)
+	{
+		if (var0.change_of_variables == nullptr && var1.change_of_variables == nullptr) {
+			for (int i = 0; i < var0.user_dimension; ++i) {
+				for (int j = 0; j < var1.user_dimension; ++j) {
+					add(i, j, block(i, j));
+				}
+			}
+			return;
+		}
+
+		auto jacobian = [](const AddedVariable& var, int i, int a)
+		{
+			if (var.change_of_variables == nullptr) {
+				return i == a ? 1.0 : 0.0;
+			}
+			return var.change_jacobian[i * var.solver_dimension + a];
+		};
+
+		// Row a of J0^T B.
+		static thread_local std::vector<double> row;
+		row.resize(var1.user_dimension);
+		for (int a = 0; a < var0.solver_dimension; ++a) {
+			for (int j = 0; j < var1.user_dimension; ++j) {
+				row[j] = 0;
+				for (int i = 0; i < var0.user_dimension; ++i) {
+					row[j] += jacobian(var0, i, a) * block(i, j);
+				}
+			}
+
+			for (int b = 0; b < var1.solver_dimension; ++b) {
+				double value = 0;
+				for (int j = 0; j < var1.user_dimension; ++j) {
+					value += row[j] * jacobian(var1, j, b);
+				}
+				if (user_gradient && var0.change_of_variables) {
+					const int n_t = var0.solver_dimension;
+					const double* d2x_dt2 = var0.change_second_derivatives.data();
+					for (int i = 0; i < var0.user_dimension; ++i) {
+						value += user_gradient[i] * d2x_dt2[(i * n_t + a) * n_t + b];
+					}
+				}
+				add(a, b, value);
+			}
+		}
+	}
+
+	// Copies a variable from a global vector x to its local storage.
+	void copy_variable_to_local(const Eigen::VectorXd& x, const AddedVariable& var)
+	{
+		if ( ! var.is_constant) {
+			if (var.change_of_variables == nullptr) {
+				for (int i = 0; i < var.user_dimension; ++i) {
+					var.temp_space[i] = x[var.global_index + i];
+				}
+			}
+			else {
+				var.change_of_variables->t_to_x(
+					&var.temp_space[0],
+					&x[var.global_index]);
+			}
+		}
+		else {
+			// This variable is constant and is therefore not
+			// present in the global vector x of variables.
+			// Copy the constant from the user space instead.
+			for (int i = 0; i < var.user_dimension; ++i) {
+				var.temp_space[i] = var.user_data[i];
+			}
+		}
+	}
+
+	// The finite-difference step for a scalar x, rounded so that
+	// x + h is exactly representable.
+	double finite_difference_step(double x, double relative_step)
+	{
+		double h = relative_step * std::max(std::abs(x), 1.0);
+		return (x + h) - x;
+	}
 }
 
 class Function::Implementation
@@ -73,6 +223,21 @@ public:
 	                Eigen::VectorXd* gradient,
 	                Eigen::SparseMatrix<double>* hessian) const;
 	Interval<double> evaluate(const std::vector<Interval<double>>& x) const;
+	double evaluate_hessian_vector(const Eigen::VectorXd& x,
+	                               const Eigen::VectorXd& v,
+	                               Eigen::VectorXd* gradient,
+	                               Eigen::VectorXd* hessian_vector) const;
+	void set_hessian_vector_point(const Eigen::VectorXd& x) const;
+	// Evaluates the product at the point set by
+	// set_hessian_vector_point. The gradient may be null.
+	double evaluate_hessian_vector(const Eigen::VectorXd& v,
+	                               Eigen::VectorXd* gradient,
+	                               Eigen::VectorXd* hessian_vector) const;
+
+	// Adds the terms at the given positions of another function and
+	// the variables they use, in the same order. The terms are shared.
+	// The function must be empty.
+	void add_terms(const Implementation& parent, const std::vector<size_t>& term_positions);
 
 	// Adds a variable to the function. All variables must be added
 	// before any terms containing them are added.
@@ -85,6 +250,10 @@ public:
 	// Copies variables from a global vector x to the Function's
 	// local storage.
 	void copy_global_to_local(const Eigen::VectorXd& x) const;
+	// Computes the Jacobians of the changes of variables at x, and
+	// their second derivatives if requested.
+	void compute_change_jacobians(const Eigen::VectorXd& x,
+	                              bool second_derivatives = false) const;
 	// Copies variables from a global vector x to the storage
 	// provided by the user.
 	void copy_global_to_user(const Eigen::VectorXd& x) const;
@@ -95,9 +264,18 @@ public:
 	// to the Function's local storage.
 	void copy_user_to_local() const;
 
+	// Copies the local storage to the single-precision local storage.
+	void copy_local_to_single_precision() const;
+
 	// Evaluates the function at the point in the local storage.
 	double evaluate_from_local_storage() const;
 
+	// Sums the term derivatives stored by a deterministic evaluation
+	// into the global gradient and (optionally) the dense Hessian.
+	void sum_term_derivatives(const Eigen::VectorXd& x,
+	                          Eigen::VectorXd* gradient,
+	                          Eigen::MatrixXd* hessian) const;
+
 	// Clears the function to the empty function.
 	void clear();
 
@@ -115,13 +293,155 @@ public:
 
 	// All terms added to the function.
 	std::vector<AddedTerm> terms;
+	// The handle of each term and the position of the term with
+	// a given handle.
+	std::vector<TermHandle> term_handles;
+	std::unordered_map<TermHandle, size_t> term_positions;
+	TermHandle next_term_handle;
+	// Returns the position of a term. Throws if the handle is
+	// invalid.
+	size_t get_term_position(TermHandle handle) const;
 
 	// Number of threads used for evaluation.
 	int number_of_threads;
 
+	// Whether evaluation should be independent of the number
+	// of threads.
+	bool deterministic;
+	// The terms are evaluated in chunks, whose values are computed
+	// sequentially. Deterministic evaluation uses chunks of
+	// term_chunk_size terms, whose values are summed with a fixed
+	// tree. Otherwise, every thread evaluates one chunk, split from
+	// the terms like schedule(static) splits a loop over them.
+	static const std::ptrdiff_t term_chunk_size = 64;
+	std::ptrdiff_t number_of_term_chunks() const
+	{
+		if (this->deterministic) {
+			return number_of_deterministic_term_chunks();
+		}
+		return this->number_of_threads;
+	}
+	std::ptrdiff_t number_of_deterministic_term_chunks() const
+	{
+		return (std::ptrdiff_t(terms.size()) + term_chunk_size - 1) / term_chunk_size;
+	}
+	// The first term of a chunk. term_chunk_begin(number_of_term_chunks())
+	// is the number of terms.
+	std::ptrdiff_t term_chunk_begin(std::ptrdiff_t chunk) const
+	{
+		const std::ptrdiff_t n = terms.size();
+		if (this->deterministic) {
+			return std::min(n, chunk * term_chunk_size);
+		}
+		const std::ptrdiff_t quotient = n / this->number_of_threads;
+		const std::ptrdiff_t remainder = n % this->number_of_threads;
+		return chunk * quotient + std::min(chunk, remainder);
+	}
+
 	// Allocates temporary storage for gradient evaluations.
 	// Should be called automatically at first evaluate()
 	void allocate_local_storage() const;
+	// Update the allocated storage after a variable or term has
+	// been added. If the existing scratch space is too small, the
+	// storage is marked for reallocation instead.
+	void add_variable_to_local_storage(size_t index) const;
+	void add_term_to_local_storage(size_t position) const;
+	// Sizes of the allocated scratch space.
+	mutable size_t allocated_max_arity;
+	mutable int allocated_max_variable_dimension;
+
+	// Estimates the working memory needed for evaluation with the
+	// given number of threads and reduction strategy.
+	MemoryUsage estimate_memory_usage(Function::HessianStorage hessian_storage,
+	                                  int number_of_threads,
+	                                  bool deterministic) const;
+	// Chooses the configuration for Function::fit_to_memory_budget
+	// without changing anything.
+	bool choose_memory_configuration(std::size_t budget,
+	                                 Function::HessianStorage hessian_storage,
+	                                 int* number_of_threads,
+	                                 bool* deterministic) const;
+	// Changes the number of threads and the reduction strategy and
+	// releases the storage allocated for the previous ones.
+	void set_memory_configuration(int number_of_threads, bool deterministic);
+
+	// Builds the tables used by interval evaluation. Called at the
+	// first interval evaluation after the terms or variables changed.
+	void allocate_interval_storage() const;
+	mutable bool interval_storage_allocated;
+	// The arguments of term i are at the global indices
+	// interval_argument_indices[interval_argument_offsets[i]], ...
+	// Pointers to them are written to the same positions in
+	// interval_arguments.
+	mutable std::vector<size_t> interval_argument_offsets;
+	mutable std::vector<size_t> interval_argument_indices;
+	mutable std::vector<const Interval<double>*> interval_arguments;
+	// The value of each chunk of terms, for deterministic evaluation.
+	mutable std::vector<Interval<double>> interval_chunk_values;
+
+	// Whether derivatives are computed with finite differences (see
+	// Function::set_finite_difference_derivatives).
+	bool finite_differences;
+	// Evaluates the function and its gradient, and the Hessian if
+	// one of dense_hessian and sparse_hessian is not null, with
+	// finite differences of the term values.
+	double evaluate_finite_differences(const Eigen::VectorXd& x,
+	                                   Eigen::VectorXd* gradient,
+	                                   Eigen::MatrixXd* dense_hessian,
+	                                   Eigen::SparseMatrix<double>* sparse_hessian) const;
+	// Evaluates the listed terms at the point in the local storage.
+	// Inactive terms have the value 0.
+	void evaluate_terms_from_local_storage(const std::vector<size_t>& term_list,
+	                                       std::vector<double>* values) const;
+	// Moves the scalars of a color in y to x + sign * h, where h is
+	// their finite-difference step, and copies their variables to the
+	// local storage.
+	void move_color(const Eigen::VectorXd& x,
+	                Eigen::VectorXd* y,
+	                int color,
+	                double sign,
+	                double relative_step) const;
+
+	// Colors the scalars for finite differences. Called at the first
+	// such evaluation after the terms or variables changed.
+	void allocate_coloring() const;
+	mutable bool coloring_allocated;
+	// The distinct non-constant scalars of term i are
+	// term_scalars[term_scalar_offsets[i]], ...
+	mutable std::vector<size_t> term_scalar_offsets;
+	mutable std::vector<size_t> term_scalars;
+	// The color of every scalar. No term contains two scalars of the
+	// same color.
+	mutable std::vector<int> scalar_colors;
+	// The scalars of every color, the variables they belong to and
+	// the terms containing them.
+	mutable std::vector<std::vector<size_t>> color_scalars;
+	mutable std::vector<std::vector<size_t>> color_variables;
+	mutable std::vector<std::vector<size_t>> color_terms;
+
+	// Allocates temporary storage for Hessian-vector products.
+	// Called at the first evaluate_hessian_vector().
+	void allocate_hessian_vector_storage() const;
+	mutable bool hessian_vector_storage_allocated;
+	mutable std::vector<std::vector<Eigen::VectorXd>>
+		thread_hessian_vector_scratch;
+	mutable std::vector<Eigen::VectorXd>
+		thread_hessian_vector_storage;
+	// Copies a direction v in solver space to the temporary storage
+	// of the variables, transformed to user space.
+	void copy_direction_to_local(const Eigen::VectorXd& v) const;
+	// Whether the local storage and the derivatives of the changes of
+	// variables hold the point of set_hessian_vector_point. Any other
+	// evaluation or change of the variables and terms resets it.
+	mutable bool hessian_vector_point_set;
+	mutable Eigen::VectorXd hessian_vector_point;
+
+	// Allocates temporary storage for single-precision evaluation.
+	// Called at the first evaluate() with single_precision set.
+	void allocate_single_precision_storage() const;
+	mutable bool single_precision_storage_allocated;
+	mutable std::vector<std::vector<Eigen::VectorXf>>
+		thread_gradient_scratch_float;
 
 	// If finalize has been called.
 	mutable bool local_storage_allocated;
@@ -136,6 +456,39 @@ public:
 	mutable std::vector<HessianStorage> thread_hessian_scratch;
 	mutable std::vector<Eigen::MatrixXd> thread_dense_hessian_storage;
 
+	// Temporary storage for evaluating several terms with one call
+	// (see Term::evaluate_batch). Lane l holds the arguments and
+	// results of the l:th term of the batch.
+	struct BatchStorage
+	{
+		std::vector<const Term*> terms;
+		std::vector<double* const*> variables;
+		std::vector<double> values;
+		std::vector<std::vector<Eigen::VectorXd>> gradients;
+		std::vector<HessianStorage> hessians;
+	};
+	mutable std::vector<BatchStorage> thread_batch_storage;
+	// The largest batch size of any term, or 1 if no term is
+	// evaluated in batches.
+	mutable int allocated_max_batch_size;
+
+	// Evaluates term i together with the following terms in thread
+	// t, if the batch size of term i allows it and all terms of the
+	// batch are active, of the same type and before end. Returns the
+	// number of terms evaluated, or 0 if term i is evaluated alone.
+	std::ptrdiff_t evaluate_batch(std::ptrdiff_t i,
+	                              std::ptrdiff_t end,
+	                              int t,
+	                              bool gradient,
+	                              bool hessian) const;
+
+	// Evaluates a term with its gradient and Hessian, or the
+	// Gauss–Newton approximation of the Hessian if requested by the
+	// interface.
+	double evaluate_term_hessian(const AddedTerm& added_term,
+	                             std::vector<Eigen::VectorXd>* gradient,
+	                             HessianStorage* hessian) const;
+
 	typedef std::vector<Eigen::Triplet<double>> SparseHessianStorage;
 	mutable std::vector<SparseHessianStorage> thread_sparse_hessian_storage;
 
@@ -143,6 +496,28 @@ public:
 	// was created.
 	mutable size_t number_of_hessian_elements;
 
+	// Storage for deterministic evaluation. Every term writes its
+	// value and derivatives to its own slots, which are summed
+	// afterwards in a fixed order.
+	mutable std::vector<double> chunk_values;
+	// Term i stores its gradient in term_gradient_storage, starting
+	// at term_gradient_offsets[i]. Its Hessian is stored row-major in
+	// term_hessian_storage, starting at term_hessian_offsets[i].
+	mutable std::vector<size_t> term_gradient_offsets;
+	mutable std::vector<double> term_gradient_storage;
+	mutable std::vector<size_t> term_hessian_offsets;
+	mutable std::vector<double> term_hessian_storage;
+	// For every variable, where it occurs among the terms, in
+	// term order.
+	struct TermArgument
+	{
+		size_t term;
+		int position;
+		// Offset of the gradient in term_gradient_storage.
+		size_t gradient_offset;
+	};
+	mutable std::vector<std::vector<TermArgument>> variable_arguments;
+
 	Function* interface;
 };
 
@@ -157,7 +532,9 @@ Function::Function(const Function& org)
 }
 
 Function::Implementation::Implementation(Function* function_interface) 
-	: interface{function_interface}
+	: deterministic{false},
+	  finite_differences{false},
+	  interface{function_interface}
 {
 	clear();
 } 
@@ -172,6 +549,9 @@ void Function::Implementation::clear()
 	constant = 0;
 
 	terms.clear();
+	term_handles.clear();
+	term_positions.clear();
+	next_term_handle = 0;
 	variables.clear();
 	variables_map.clear();
 	number_of_scalars = 0;
@@ -179,7 +559,18 @@ void Function::Implementation::clear()
 
 	thread_gradient_scratch.clear();
 	thread_gradient_storage.clear();
+	thread_batch_storage.clear();
+	thread_hessian_vector_scratch.clear();
+	thread_hessian_vector_storage.clear();
 	local_storage_allocated = false;
+	single_precision_storage_allocated = false;
+	hessian_vector_storage_allocated = false;
+	hessian_vector_point_set = false;
+	interval_storage_allocated = false;
+	coloring_allocated = false;
+	allocated_max_arity = 0;
+	allocated_max_variable_dimension = 0;
+	allocated_max_batch_size = 1;
 
 	number_of_hessian_elements = 0;
 
@@ -198,6 +589,10 @@ Function& Function::operator = (const Function& org)
 	impl->clear();
 
 	this->hessian_is_enabled = org.hessian_is_enabled;
+	this->single_precision = org.single_precision;
+	this->gauss_newton_hessian = org.gauss_newton_hessian;
+	impl->deterministic = org.impl->deterministic;
+	impl->finite_differences = org.impl->finite_differences;
 	impl->constant = org.impl->constant;
 
 	// TODO: respect global order.
@@ -221,7 +616,8 @@ Function& Function::operator = (const Function& org)
 			spii_assert(user_variables.find(index) != user_variables.end());
 			vars.push_back(user_variables[index]);
 		}
-		this->add_term(added_term.term, vars);
+		auto handle = this->add_term(added_term.term, vars);
+		this->set_term_active(handle, added_term.is_active);
 	}
 	spii_assert(org.impl->variables.size() == user_variables.size());
 
@@ -259,7 +655,8 @@ Function& Function::operator += (const Function& org)
 			spii_assert(user_variables.find(index) != user_variables.end());
 			vars.push_back(user_variables[index]);
 		}
-		this->add_term(added_term.term, vars);
+		auto handle = this->add_term(added_term.term, vars);
+		this->set_term_active(handle, added_term.is_active);
 	}
 
 	return *this;
@@ -337,12 +734,11 @@ void Function::Implementation::add_variable_internal(double* variable,
                                                     int dimension,
                                                     std::shared_ptr<ChangeOfVariables> change_of_variables)
 {
-	this->local_storage_allocated = false;
-
 	// Check if variable already exists, and if it
 	// does, that it still has the same dimensions.
 	auto itr = variables_map.find(variable);
 	if (itr != variables_map.end()) {
+		this->local_storage_allocated = false;
 		AddedVariable& var_info = variables[itr->second];
 
 		check(var_info.user_dimension == dimension,
@@ -398,13 +794,13 @@ void Function::Implementation::add_variable_internal(double* variable,
 		var_info.solver_dimension = dimension;
 	}
 
-	// Allocate local scratch spaces for evaluation.
-	// We need as much space as the dimension of x.
-	var_info.temp_space.resize(var_info.user_dimension);
 	// Give this variable a global index into a global
 	// state vector.
 	var_info.global_index = number_of_scalars;
 	number_of_scalars += var_info.solver_dimension;
+	this->coloring_allocated = false;
+
+	add_variable_to_local_storage(variables.size() - 1);
 }
 
 void Function::Implementation::set_constant(double* variable, bool is_constant)
@@ -438,6 +834,9 @@ void Function::Implementation::set_constant(double* variable, bool is_constant)
 	}
 
 	this->local_storage_allocated = false;
+	this->interval_storage_allocated = false;
+	this->coloring_allocated = false;
+	this->hessian_vector_point_set = false;
 }
 
 void Function::set_constant(double* variable, bool is_constant)
@@ -445,16 +844,15 @@ void Function::set_constant(double* variable, bool is_constant)
 	impl->set_constant(variable, is_constant);
 }
 
-void Function::add_term(std::shared_ptr<const Term> term, const std::vector<double*>& arguments)
+TermHandle Function::add_term(std::shared_ptr<const Term> term, const std::vector<double*>& arguments)
 {
-	impl->local_storage_allocated = false;
-
 	check(term->number_of_variables() == arguments.size(),
 	      "Function::add_term: incorrect number of arguments.");
 
 	impl->terms.emplace_back();
 	auto& added_term = impl->terms.back();
 	added_term.term = term;
+	added_term.is_active = true;
 	added_term.added_variables_indices.reserve(arguments.size());
 
 	try {
@@ -478,6 +876,246 @@ void Function::add_term(std::shared_ptr<const Term> term, const std::vector<doub
 		impl->terms.pop_back();
 		throw;
 	}
+
+	auto handle = impl->next_term_handle++;
+	impl->term_handles.push_back(handle);
+	impl->term_positions[handle] = impl->terms.size() - 1;
+
+	impl->add_term_to_local_storage(impl->terms.size() - 1);
+
+	return handle;
+}
+
+std::vector<Function> Function::get_connected_components() const
+{
+	// Union-find over the variables, with path halving.
+	std::vector<size_t> parent(impl->variables.size());
+	for (size_t i = 0; i < parent.size(); ++i) {
+		parent[i] = i;
+	}
+	auto find = [&parent](size_t i) -> size_t
+	{
+		while (parent[i] != i) {
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	};
+
+	// The first non-constant variable of every term, or -1 if all
+	// its variables are constant.
+	std::vector<std::ptrdiff_t> term_variable(impl->terms.size(), -1);
+	for (size_t i = 0; i < impl->terms.size(); ++i) {
+		if (! impl->terms[i].is_active) {
+			continue;
+		}
+		for (auto ind: impl->terms[i].added_variables_indices) {
+			if (impl->variables[ind].is_constant) {
+				continue;
+			}
+			if (term_variable[i] < 0) {
+				term_variable[i] = ind;
+			}
+			else {
+				parent[find(ind)] = find(term_variable[i]);
+			}
+		}
+	}
+
+	// Number the components in the order of their first term.
+	std::vector<std::ptrdiff_t> component_of_root(impl->variables.size(), -1);
+	std::vector<std::ptrdiff_t> term_component(impl->terms.size(), -1);
+	size_t number_of_components = 0;
+	for (size_t i = 0; i < impl->terms.size(); ++i) {
+		if (term_variable[i] >= 0) {
+			auto root = find(term_variable[i]);
+			if (component_of_root[root] < 0) {
+				component_of_root[root] = number_of_components++;
+			}
+			term_component[i] = component_of_root[root];
+		}
+	}
+	// Terms with only constant variables and the constant are put
+	// in the first component.
+	bool has_constant_terms = false;
+	for (size_t i = 0; i < impl->terms.size(); ++i) {
+		if (impl->terms[i].is_active && term_variable[i] < 0) {
+			term_component[i] = 0;
+			has_constant_terms = true;
+		}
+	}
+	if (number_of_components == 0 && (has_constant_terms || impl->constant != 0)) {
+		number_of_components = 1;
+	}
+
+	std::vector<Function> components(number_of_components);
+	for (auto& component: components) {
+		component.hessian_is_enabled = this->hessian_is_enabled;
+		component.single_precision = this->single_precision;
+		component.gauss_newton_hessian = this->gauss_newton_hessian;
+		component.impl->deterministic = impl->deterministic;
+		component.impl->finite_differences = impl->finite_differences;
+	}
+	if (number_of_components > 0) {
+		components[0].impl->constant = impl->constant;
+	}
+
+	std::vector<std::vector<size_t>> component_terms(number_of_components);
+	for (size_t i = 0; i < impl->terms.size(); ++i) {
+		if (term_component[i] >= 0) {
+			component_terms[term_component[i]].push_back(i);
+		}
+	}
+	for (size_t c = 0; c < number_of_components; ++c) {
+		components[c].impl->add_terms(*impl, component_terms[c]);
+	}
+
+	return components;
+}
+
+void Function::add_term_subset(const Function& parent, const std::vector<TermHandle>& term_handles)
+{
+	check(impl->terms.empty() && impl->variables.empty(),
+	      "Function::add_term_subset: function is not empty.");
+
+	this->hessian_is_enabled = parent.hessian_is_enabled;
+	this->single_precision = parent.single_precision;
+	this->gauss_newton_hessian = parent.gauss_newton_hessian;
+	impl->deterministic = parent.impl->deterministic;
+	impl->finite_differences = parent.impl->finite_differences;
+	impl->number_of_threads = parent.impl->number_of_threads;
+
+	std::vector<size_t> term_positions;
+	term_positions.reserve(term_handles.size());
+	for (auto handle: term_handles) {
+		term_positions.push_back(parent.impl->get_term_position(handle));
+	}
+	impl->add_terms(*parent.impl, term_positions);
+}
+
+void Function::Implementation::add_terms(const Implementation& parent,
+                                         const std::vector<size_t>& term_positions)
+{
+	const auto& parent_variables = parent.variables;
+	const auto& parent_terms = parent.terms;
+
+	// Find the variables used by the terms.
+	std::vector<std::ptrdiff_t> variable_index(parent_variables.size(), -1);
+	std::vector<size_t> used_variables;
+	for (auto position: term_positions) {
+		for (auto ind: parent_terms[position].added_variables_indices) {
+			if (variable_index[ind] < 0) {
+				variable_index[ind] = 0;
+				used_variables.push_back(ind);
+			}
+		}
+	}
+
+	// The variables keep their relative order and have already been
+	// checked when added to the parent.
+	std::sort(used_variables.begin(), used_variables.end(), [&parent_variables](size_t a, size_t b)
+	{
+		return parent_variables[a].global_index < parent_variables[b].global_index;
+	});
+	variables.reserve(used_variables.size());
+	for (auto ind: used_variables) {
+		const auto& parent_variable = parent_variables[ind];
+		variable_index[ind] = variables.size();
+		variables_map[parent_variable.user_data] = variables.size();
+
+		variables.emplace_back();
+		auto& variable = variables.back();
+		variable.user_data = parent_variable.user_data;
+		variable.user_dimension = parent_variable.user_dimension;
+		variable.solver_dimension = parent_variable.solver_dimension;
+		variable.is_constant = parent_variable.is_constant;
+		variable.change_of_variables = parent_variable.change_of_variables;
+	}
+
+	// Same numbering as set_constant: all non-constant variables
+	// followed by the constant ones.
+	for (auto& variable: variables) {
+		if (! variable.is_constant) {
+			variable.global_index = number_of_scalars;
+			number_of_scalars += variable.solver_dimension;
+		}
+	}
+	for (auto& variable: variables) {
+		if (variable.is_constant) {
+			variable.global_index = number_of_scalars + number_of_constants;
+			number_of_constants += variable.solver_dimension;
+		}
+	}
+
+	terms.reserve(term_positions.size());
+	term_handles.reserve(term_positions.size());
+	for (auto position: term_positions) {
+		const auto& parent_term = parent_terms[position];
+		terms.emplace_back();
+		auto& added_term = terms.back();
+		added_term.term = parent_term.term;
+		added_term.is_active = parent_term.is_active;
+		added_term.added_variables_indices.reserve(parent_term.added_variables_indices.size());
+		for (auto ind: parent_term.added_variables_indices) {
+			added_term.added_variables_indices.push_back(variable_index[ind]);
+		}
+
+		auto handle = next_term_handle++;
+		term_handles.push_back(handle);
+		this->term_positions[handle] = terms.size() - 1;
+	}
+
+	local_storage_allocated = false;
+	interval_storage_allocated = false;
+	coloring_allocated = false;
+}
+
+size_t Function::Implementation::get_term_position(TermHandle handle) const
+{
+	auto itr = term_positions.find(handle);
+	check(itr != term_positions.end(), "Function: invalid term handle.");
+	return itr->second;
+}
+
+void Function::remove_term(TermHandle handle)
+{
+	auto position = impl->get_term_position(handle);
+	auto last = impl->terms.size() - 1;
+
+	// Move the last term to the position of the removed one. Its
+	// pointers to temporary storage remain valid.
+	if (position != last) {
+		impl->terms[position] = std::move(impl->terms[last]);
+		impl->term_handles[position] = impl->term_handles[last];
+		impl->term_positions[impl->term_handles[position]] = position;
+	}
+	impl->terms.pop_back();
+	impl->term_handles.pop_back();
+	impl->term_positions.erase(handle);
+	impl->interval_storage_allocated = false;
+	impl->coloring_allocated = false;
+
+	// The storage for deterministic evaluation depends on the order
+	// of the terms.
+	if (impl->deterministic) {
+		impl->local_storage_allocated = false;
+	}
+}
+
+void Function::set_term_active(TermHandle handle, bool is_active)
+{
+	impl->terms[impl->get_term_position(handle)].is_active = is_active;
+}
+
+bool Function::is_term_active(TermHandle handle) const
+{
+	return impl->terms[impl->get_term_position(handle)].is_active;
+}
+
+TermHandle Function::get_term_handle(size_t position) const
+{
+	check(position < impl->terms.size(), "Function::get_term_handle: invalid position.");
+	return impl->term_handles[position];
 }
 
 size_t Function::get_number_of_terms() const
@@ -502,6 +1140,17 @@ void Function::set_number_of_threads(int num)
 	#endif
 }
 
+void Function::set_deterministic_evaluation(bool deterministic)
+{
+	impl->local_storage_allocated = false;
+	impl->deterministic = deterministic;
+}
+
+void Function::set_finite_difference_derivatives(bool finite_differences)
+{
+	impl->finite_differences = finite_differences;
+}
+
 void Function::Implementation::allocate_local_storage() const
 {
 	auto start_time = wall_time();
@@ -512,103 +1161,777 @@ void Function::Implementation::allocate_local_storage() const
 		max_variable_dimension = std::max(max_variable_dimension,
 		                                  itr.user_dimension);
 	}
+	int max_batch_size = 1;
 	for (const auto& term: terms) {
 		max_arity = std::max(max_arity, term.added_variables_indices.size());
+		max_batch_size = std::max(max_batch_size, term.term->batch_size());
 	}
 
-	this->thread_gradient_scratch.resize(this->number_of_threads);
-	this->thread_gradient_storage.resize(this->number_of_threads);
-	for (int t = 0; t < this->number_of_threads; ++t) {
-		this->thread_gradient_storage[t].resize(number_of_scalars + number_of_constants);
-		this->thread_gradient_scratch[t].resize(max_arity);
-		for (int var = 0; var < max_arity; ++var) {
-			this->thread_gradient_scratch[t][var].resize(max_variable_dimension);
+	// On NUMA systems, the operating system places memory on the
+	// node of the thread that first touches it, so scratch space is
+	// allocated and zeroed by the thread that will write to it.
+	//
+	// The temporary space for each variable is written by
+	// copy_global_to_local, which uses the same static schedule over
+	// the variables as this loop. It is read by the terms of any
+	// thread, so it is not placed with the terms.
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(variables.size()); ++i) {
+		// We need as much space as the dimension of x.
+		variables[i].temp_space = std::vector<double>(variables[i].user_dimension, 0.0);
+		if (variables[i].change_of_variables) {
+			variables[i].change_jacobian = std::vector<double>(
+				variables[i].user_dimension * variables[i].solver_dimension, 0.0);
 		}
 	}
 
 	// Every term should have a pointer to the local space
-	// used when evaluating.
-	for (auto& added_term: terms) {
-		for (auto ind: added_term.added_variables_indices) {
-			// Look up this variable.
-			auto& added_variable = variables[ind];
-			// Stora a pointer to temporary storage for this variable.
-			double* temp_space = &added_variable.temp_space[0];
-			added_term.temp_variables.push_back(temp_space);
+	// used when evaluating. The terms are split into the same chunks
+	// as in the evaluation loops, so every table is built by the
+	// thread that evaluates the term.
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t chunk = 0; chunk < number_of_term_chunks(); ++chunk) {
+		std::ptrdiff_t chunk_end = term_chunk_begin(chunk + 1);
+		for (std::ptrdiff_t i = term_chunk_begin(chunk); i < chunk_end; ++i) {
+			auto& added_term = terms[i];
+			std::vector<double*> temp_variables;
+			temp_variables.reserve(added_term.added_variables_indices.size());
+			for (auto ind: added_term.added_variables_indices) {
+				// Store a pointer to temporary storage for this variable.
+				temp_variables.push_back(&variables[ind].temp_space[0]);
+			}
+			added_term.temp_variables = std::move(temp_variables);
+		}
+	}
+
+	if (this->deterministic) {
+		this->chunk_values.resize(number_of_term_chunks());
+
+		this->term_gradient_offsets.resize(terms.size() + 1);
+		this->term_hessian_offsets.resize(terms.size() + 1);
+		this->variable_arguments.clear();
+		this->variable_arguments.resize(variables.size());
+		size_t gradient_size = 0;
+		size_t hessian_size = 0;
+		for (size_t i = 0; i < terms.size(); ++i) {
+			term_gradient_offsets[i] = gradient_size;
+			term_hessian_offsets[i] = hessian_size;
+
+			const auto& indices = terms[i].added_variables_indices;
+			size_t term_size = 0;
+			for (int var = 0; var < indices.size(); ++var) {
+				variable_arguments[indices[var]].push_back({i, var, gradient_size + term_size});
+				term_size += variables[indices[var]].user_dimension;
+			}
+			gradient_size += term_size;
+			hessian_size += term_size * term_size;
+		}
+		term_gradient_offsets[terms.size()] = gradient_size;
+		term_hessian_offsets[terms.size()] = hessian_size;
+
+		this->term_gradient_storage.resize(gradient_size);
+		if (interface->hessian_is_enabled) {
+			this->term_hessian_storage.resize(hessian_size);
+		}
+		else {
+			this->term_hessian_storage.clear();
 		}
 	}
+	else {
+		this->chunk_values.clear();
+		this->term_gradient_offsets.clear();
+		this->term_gradient_storage.clear();
+		this->term_hessian_offsets.clear();
+		this->term_hessian_storage.clear();
+		this->variable_arguments.clear();
+	}
 
+	this->thread_gradient_scratch.resize(this->number_of_threads);
+	this->thread_gradient_storage.resize(this->number_of_threads);
 	if (interface->hessian_is_enabled) {
 		this->thread_hessian_scratch.resize(this->number_of_threads);
-		for (int t = 0; t < this->number_of_threads; ++t) {
-			auto& hessian = this->thread_hessian_scratch[t];
-
-			hessian.resize(max_arity);
-			for (int var0 = 0; var0 < max_arity; ++var0) {
-				hessian[var0].resize(max_arity);
-				for (int var1 = 0; var1 < max_arity; ++var1) {
-					hessian[var0][var1].resize(max_variable_dimension,
-					                           max_variable_dimension);
+	}
+	this->thread_batch_storage.clear();
+	if (max_batch_size > 1) {
+		this->thread_batch_storage.resize(this->number_of_threads);
+	}
+
+	#ifdef USE_OPENMP
+		#pragma omp parallel num_threads(this->number_of_threads)
+	#endif
+	{
+		#ifdef USE_OPENMP
+			int first_thread = omp_get_thread_num();
+			int thread_step  = omp_get_num_threads();
+		#else
+			int first_thread = 0;
+			int thread_step  = 1;
+		#endif
+		// If fewer threads than requested were started, the
+		// remaining storage is allocated by the running threads.
+		for (int t = first_thread; t < this->number_of_threads; t += thread_step) {
+			this->thread_gradient_storage[t].setZero(number_of_scalars + number_of_constants);
+			this->thread_gradient_scratch[t].resize(max_arity);
+			for (int var = 0; var < max_arity; ++var) {
+				this->thread_gradient_scratch[t][var].setZero(max_variable_dimension);
+			}
+
+			if (interface->hessian_is_enabled) {
+				auto& hessian = this->thread_hessian_scratch[t];
+
+				hessian.resize(max_arity);
+				for (int var0 = 0; var0 < max_arity; ++var0) {
+					hessian[var0].resize(max_arity);
+					for (int var1 = 0; var1 < max_arity; ++var1) {
+						hessian[var0][var1].setZero(max_variable_dimension,
+						                            max_variable_dimension);
+					}
+				}
+			}
+
+			if (max_batch_size > 1) {
+				auto& batch = this->thread_batch_storage[t];
+				batch.terms.resize(max_batch_size);
+				batch.variables.resize(max_batch_size);
+				batch.values.resize(max_batch_size);
+				batch.gradients.resize(max_batch_size);
+				for (auto& gradient: batch.gradients) {
+					gradient = this->thread_gradient_scratch[t];
+				}
+				if (interface->hessian_is_enabled) {
+					batch.hessians.assign(max_batch_size, this->thread_hessian_scratch[t]);
 				}
 			}
 		}
 	}
 
+	this->allocated_max_arity = max_arity;
+	this->allocated_max_variable_dimension = max_variable_dimension;
+	this->allocated_max_batch_size = max_batch_size;
 	this->local_storage_allocated = true;
+	// The pointers to single-precision storage need to be updated.
+	this->single_precision_storage_allocated = false;
+	this->hessian_vector_storage_allocated = false;
+	this->hessian_vector_point_set = false;
 
 	interface->allocation_time += wall_time() - start_time;
 }
 
-void Function::print_timing_information(std::ostream& out) const
+void Function::Implementation::add_variable_to_local_storage(size_t index) const
 {
-	out << "----------------------------------------------------\n";
-	out << "Function evaluations without gradient : " << evaluations_without_gradient << '\n';
-	out << "Function evaluations with gradient    : " << evaluations_with_gradient << '\n';
-	out << "Function memory allocation time   : " << allocation_time << '\n';
-	out << "Function evaluate time            : " << evaluate_time << '\n';
-	out << "Function evaluate time (with g/H) : " << evaluate_with_hessian_time << '\n';
-	out << "Function write g/H time           : " << write_gradient_hessian_time << '\n';
-	out << "Function copy data time           : " << copy_time << '\n';
-	out << "----------------------------------------------------\n";
+	this->hessian_vector_point_set = false;
+	if (! this->local_storage_allocated) {
+		return;
+	}
+	// Pointers to the temporary space of the other variables remain
+	// valid, since their vectors are moved if variables grows.
+	auto& var = variables[index];
+	if (this->deterministic || var.user_dimension > this->allocated_max_variable_dimension) {
+		this->local_storage_allocated = false;
+		return;
+	}
+
+	auto start_time = wall_time();
+
+	var.temp_space = std::vector<double>(var.user_dimension, 0.0);
+	if (var.change_of_variables) {
+		var.change_jacobian = std::vector<double>(var.user_dimension * var.solver_dimension, 0.0);
+	}
+	if (this->single_precision_storage_allocated) {
+		var.temp_space_float = std::vector<float>(var.user_dimension, 0.0f);
+	}
+	if (this->hessian_vector_storage_allocated) {
+		var.temp_direction = std::vector<double>(var.user_dimension, 0.0);
+	}
+	for (auto& gradient: this->thread_gradient_storage) {
+		gradient.setZero(number_of_scalars + number_of_constants);
+	}
+	for (auto& hessian_vector: this->thread_hessian_vector_storage) {
+		hessian_vector.setZero(number_of_scalars + number_of_constants);
+	}
+
+	interface->allocation_time += wall_time() - start_time;
 }
 
-double Function::Implementation::evaluate_from_local_storage() const
+void Function::Implementation::add_term_to_local_storage(size_t position) const
 {
-	spii_assert(this->local_storage_allocated);
+	this->hessian_vector_point_set = false;
+	this->interval_storage_allocated = false;
+	this->coloring_allocated = false;
+	if (! this->local_storage_allocated) {
+		return;
+	}
+	auto& added_term = terms[position];
+	if (this->deterministic ||
+	    added_term.added_variables_indices.size() > this->allocated_max_arity ||
+	    added_term.term->batch_size() > this->allocated_max_batch_size) {
+		this->local_storage_allocated = false;
+		return;
+	}
 
-	interface->evaluations_without_gradient++;
-	double start_time = wall_time();
+	added_term.temp_variables.clear();
+	for (auto ind: added_term.added_variables_indices) {
+		added_term.temp_variables.push_back(&variables[ind].temp_space[0]);
+	}
 
-	double value = this->constant;
-	// Go through and evaluate each term.
-	// OpenMP requires a signed data type as the loop variable.
-	#ifdef USE_OPENMP
-		// Each thread needs to store a specific error.
-		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
+	added_term.temp_variables_float.clear();
+	if (this->single_precision_storage_allocated && added_term.term->has_single_precision()) {
+		for (auto ind: added_term.added_variables_indices) {
+			added_term.temp_variables_float.push_back(&variables[ind].temp_space_float[0]);
+		}
+	}
 
-		#pragma omp parallel for reduction(+ : value) num_threads(this->number_of_threads)
-	#endif
-	// For loop has to be int for OpenMP.
-	for (int i = 0; i < terms.size(); ++i) {
+	added_term.temp_directions.clear();
+	if (this->hessian_vector_storage_allocated) {
+		for (auto ind: added_term.added_variables_indices) {
+			added_term.temp_directions.push_back(&variables[ind].temp_direction[0]);
+		}
+	}
+}
+
+void Function::Implementation::allocate_single_precision_storage() const
+{
+	spii_assert(this->local_storage_allocated);
+
+	auto start_time = wall_time();
+
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(variables.size()); ++i) {
+		variables[i].temp_space_float = std::vector<float>(variables[i].user_dimension, 0.0f);
+	}
+
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(terms.size()); ++i) {
+		auto& added_term = terms[i];
+		std::vector<float*> temp_variables;
+		if (added_term.term->has_single_precision()) {
+			temp_variables.reserve(added_term.added_variables_indices.size());
+			for (auto ind: added_term.added_variables_indices) {
+				temp_variables.push_back(&variables[ind].temp_space_float[0]);
+			}
+		}
+		added_term.temp_variables_float = std::move(temp_variables);
+	}
+
+	// Same sizes as the double-precision scratch space.
+	this->thread_gradient_scratch_float.resize(this->number_of_threads);
+	for (int t = 0; t < this->number_of_threads; ++t) {
+		const auto& scratch = this->thread_gradient_scratch[t];
+		this->thread_gradient_scratch_float[t].resize(scratch.size());
+		for (int var = 0; var < scratch.size(); ++var) {
+			this->thread_gradient_scratch_float[t][var].setZero(scratch[var].size());
+		}
+	}
+
+	this->single_precision_storage_allocated = true;
+
+	interface->allocation_time += wall_time() - start_time;
+}
+
+void Function::Implementation::allocate_hessian_vector_storage() const
+{
+	spii_assert(this->local_storage_allocated);
+
+	auto start_time = wall_time();
+
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(variables.size()); ++i) {
+		variables[i].temp_direction = std::vector<double>(variables[i].user_dimension, 0.0);
+	}
+
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(terms.size()); ++i) {
+		auto& added_term = terms[i];
+		std::vector<const double*> temp_directions;
+		temp_directions.reserve(added_term.added_variables_indices.size());
+		for (auto ind: added_term.added_variables_indices) {
+			temp_directions.push_back(&variables[ind].temp_direction[0]);
+		}
+		added_term.temp_directions = std::move(temp_directions);
+	}
+
+	// Same sizes as the gradient storage.
+	this->thread_hessian_vector_scratch = this->thread_gradient_scratch;
+	this->thread_hessian_vector_storage.resize(this->number_of_threads);
+	for (int t = 0; t < this->number_of_threads; ++t) {
+		this->thread_hessian_vector_storage[t].setZero(number_of_scalars + number_of_constants);
+	}
+
+	this->hessian_vector_storage_allocated = true;
+
+	interface->allocation_time += wall_time() - start_time;
+}
+
+std::ostream& operator<<(std::ostream& out, const MemoryUsage& usage)
+{
+	for (const auto& category: usage.bytes) {
+		out << std::setw(32) << std::left << category.first << " : "
+		    << std::setw(12) << std::right << category.second << " bytes\n";
+	}
+	out << std::setw(32) << std::left << "Total" << " : "
+	    << std::setw(12) << std::right << usage.total() << " bytes\n";
+	return out;
+}
+
+MemoryUsage Function::memory_usage() const
+{
+	MemoryUsage usage;
+
+	usage.add("Variables", impl->variables.capacity() * sizeof(AddedVariable));
+	for (const auto& variable: impl->variables) {
+		usage.add("Variables", (variable.temp_space.capacity() +
+		                        variable.change_jacobian.capacity() +
+		                        variable.change_second_derivatives.capacity()) * sizeof(double));
+		usage.add("Single precision", variable.temp_space_float.capacity() * sizeof(float));
+		usage.add("Hessian-vector products", variable.temp_direction.capacity() * sizeof(double));
+	}
+
+	usage.add("Terms", impl->terms.capacity() * sizeof(AddedTerm) +
+	                   impl->term_handles.capacity() * sizeof(TermHandle));
+	for (const auto& added_term: impl->terms) {
+		usage.add("Terms", added_term.added_variables_indices.capacity() * sizeof(size_t) +
+		                   added_term.temp_variables.capacity() * sizeof(double*));
+		usage.add("Single precision", added_term.temp_variables_float.capacity() * sizeof(float*));
+		usage.add("Hessian-vector products", added_term.temp_directions.capacity() * sizeof(double*));
+	}
+
+	for (const auto& gradient: impl->thread_gradient_storage) {
+		usage.add("Thread gradients", gradient.size() * sizeof(double));
+	}
+	for (const auto& scratch: impl->thread_gradient_scratch) {
+		for (const auto& gradient: scratch) {
+			usage.add("Thread gradient scratch", gradient.size() * sizeof(double));
+		}
+	}
+	for (const auto& scratch: impl->thread_gradient_scratch_float) {
+		for (const auto& gradient: scratch) {
+			usage.add("Single precision", gradient.size() * sizeof(float));
+		}
+	}
+	for (const auto& hessian_vector: impl->thread_hessian_vector_storage) {
+		usage.add("Hessian-vector products", hessian_vector.size() * sizeof(double));
+	}
+	for (const auto& scratch: impl->thread_hessian_vector_scratch) {
+		for (const auto& hessian_vector: scratch) {
+			usage.add("Hessian-vector products", hessian_vector.size() * sizeof(double));
+		}
+	}
+	for (const auto& scratch: impl->thread_hessian_scratch) {
+		for (const auto& row: scratch) {
+			for (const auto& hessian: row) {
+				usage.add("Thread Hessian scratch", hessian.size() * sizeof(double));
+			}
+		}
+	}
+	for (const auto& batch: impl->thread_batch_storage) {
+		usage.add("Thread batch scratch",
+		          batch.terms.capacity() * sizeof(const Term*) +
+		          batch.variables.capacity() * sizeof(double* const*) +
+		          batch.values.capacity() * sizeof(double));
+		for (const auto& scratch: batch.gradients) {
+			for (const auto& gradient: scratch) {
+				usage.add("Thread batch scratch", gradient.size() * sizeof(double));
+			}
+		}
+		for (const auto& scratch: batch.hessians) {
+			for (const auto& row: scratch) {
+				for (const auto& hessian: row) {
+					usage.add("Thread batch scratch", hessian.size() * sizeof(double));
+				}
+			}
+		}
+	}
+	for (const auto& hessian: impl->thread_dense_hessian_storage) {
+		usage.add("Thread dense Hessians", hessian.size() * sizeof(double));
+	}
+	for (const auto& triplets: impl->thread_sparse_hessian_storage) {
+		usage.add("Sparse Hessian triplets", triplets.capacity() * sizeof(Eigen::Triplet<double>));
+	}
+
+	usage.add("Term derivatives",
+	          impl->chunk_values.capacity() * sizeof(double) +
+	          impl->term_gradient_offsets.capacity() * sizeof(size_t) +
+	          impl->term_gradient_storage.capacity() * sizeof(double) +
+	          impl->term_hessian_offsets.capacity() * sizeof(size_t) +
+	          impl->term_hessian_storage.capacity() * sizeof(double));
+	for (const auto& arguments: impl->variable_arguments) {
+		usage.add("Term derivatives", arguments.capacity() * sizeof(Implementation::TermArgument));
+	}
+
+	usage.add("Finite differences",
+	          (impl->term_scalar_offsets.capacity() + impl->term_scalars.capacity()) * sizeof(size_t) +
+	          impl->scalar_colors.capacity() * sizeof(int));
+	for (int c = 0; c < int(impl->color_scalars.size()); ++c) {
+		usage.add("Finite differences",
+		          (impl->color_scalars[c].capacity() +
+		           impl->color_variables[c].capacity() +
+		           impl->color_terms[c].capacity()) * sizeof(size_t));
+	}
+
+	usage.add("Interval evaluation",
+	          impl->interval_argument_offsets.capacity() * sizeof(size_t) +
+	          impl->interval_argument_indices.capacity() * sizeof(size_t) +
+	          impl->interval_arguments.capacity() * sizeof(const Interval<double>*) +
+	          impl->interval_chunk_values.capacity() * sizeof(Interval<double>));
+
+	return usage;
+}
+
+MemoryUsage Function::estimate_memory_usage(HessianStorage hessian_storage) const
+{
+	return impl->estimate_memory_usage(hessian_storage,
+	                                   impl->number_of_threads,
+	                                   impl->deterministic);
+}
+
+MemoryUsage Function::Implementation::estimate_memory_usage(Function::HessianStorage hessian_storage,
+                                                           int number_of_threads,
+                                                           bool deterministic) const
+{
+	MemoryUsage usage;
+	const bool hessian_is_enabled = interface->hessian_is_enabled;
+	const bool single_precision = interface->single_precision;
+
+	size_t max_arity = 1;
+	size_t max_variable_dimension = 1;
+	size_t user_scalars = 0;
+	for (const auto& variable: variables) {
+		max_variable_dimension = std::max(max_variable_dimension,
+		                                  size_t(variable.user_dimension));
+		user_scalars += variable.user_dimension;
+	}
+
+	size_t max_batch_size = 1;
+	size_t arguments = 0;
+	size_t gradient_size = 0;
+	size_t hessian_size = 0;
+	for (const auto& added_term: terms) {
+		const auto& indices = added_term.added_variables_indices;
+		max_arity = std::max(max_arity, indices.size());
+		max_batch_size = std::max(max_batch_size, size_t(added_term.term->batch_size()));
+		arguments += indices.size();
+		size_t term_size = 0;
+		for (auto ind: indices) {
+			term_size += variables[ind].user_dimension;
+		}
+		gradient_size += term_size;
+		hessian_size += term_size * term_size;
+	}
+
+	usage.add("Variables", variables.size() * sizeof(AddedVariable) +
+	                       user_scalars * sizeof(double));
+	usage.add("Terms", terms.size() * (sizeof(AddedTerm) + sizeof(TermHandle)) +
+	                   arguments * (sizeof(size_t) + sizeof(double*)));
+
+	size_t scratch_size = max_arity * max_variable_dimension;
+	usage.add("Thread gradients", number_of_threads * (number_of_scalars + number_of_constants) * sizeof(double));
+	usage.add("Thread gradient scratch", number_of_threads * scratch_size * sizeof(double));
+	if (hessian_is_enabled) {
+		usage.add("Thread Hessian scratch", number_of_threads * scratch_size * scratch_size * sizeof(double));
+	}
+	if (max_batch_size > 1) {
+		size_t lane_size = sizeof(const Term*) + sizeof(double* const*) + sizeof(double) +
+		                   scratch_size * sizeof(double);
+		if (hessian_is_enabled) {
+			lane_size += scratch_size * scratch_size * sizeof(double);
+		}
+		usage.add("Thread batch scratch", number_of_threads * max_batch_size * lane_size);
+	}
+	if (single_precision) {
+		usage.add("Single precision", user_scalars * sizeof(float) +
+		                              arguments * sizeof(float*) +
+		                              number_of_threads * scratch_size * sizeof(float));
+	}
+
+	if (hessian_storage == Function::DENSE_HESSIAN && ! deterministic) {
+		usage.add("Thread dense Hessians", number_of_threads * number_of_scalars * number_of_scalars * sizeof(double));
+	}
+	else if (hessian_storage == Function::SPARSE_HESSIAN) {
+		// The first thread collects the triplets of all threads.
+		size_t triplets = hessian_size + (number_of_threads - 1) * (hessian_size / number_of_threads);
+		usage.add("Sparse Hessian triplets", triplets * sizeof(Eigen::Triplet<double>));
+	}
+
+	if (deterministic) {
+		size_t term_derivatives = number_of_deterministic_term_chunks() * sizeof(double) +
+		                          2 * (terms.size() + 1) * sizeof(size_t) +
+		                          gradient_size * sizeof(double) +
+		                          arguments * sizeof(TermArgument);
+		if (hessian_is_enabled) {
+			term_derivatives += hessian_size * sizeof(double);
+		}
+		usage.add("Term derivatives", term_derivatives);
+	}
+
+	return usage;
+}
+
+bool Function::Implementation::choose_memory_configuration(std::size_t budget,
+                                                          Function::HessianStorage hessian_storage,
+                                                          int* number_of_threads,
+                                                          bool* deterministic) const
+{
+	for (int threads = this->number_of_threads; threads >= 1; --threads) {
+		for (bool det: {this->deterministic, true}) {
+			if (this->estimate_memory_usage(hessian_storage, threads, det).total() <= budget) {
+				*number_of_threads = threads;
+				*deterministic = det;
+				return true;
+			}
+		}
+	}
+
+	// Use the smallest configuration.
+	*number_of_threads = 1;
+	*deterministic = this->deterministic ||
+		this->estimate_memory_usage(hessian_storage, 1, true).total() <
+		this->estimate_memory_usage(hessian_storage, 1, false).total();
+	return false;
+}
+
+bool Function::fits_memory_budget(std::size_t budget,
+                                  HessianStorage hessian_storage) const
+{
+	int number_of_threads;
+	bool deterministic;
+	return impl->choose_memory_configuration(budget, hessian_storage,
+	                                         &number_of_threads, &deterministic);
+}
+
+bool Function::fit_to_memory_budget(std::size_t budget,
+                                    HessianStorage hessian_storage)
+{
+	int number_of_threads;
+	bool deterministic;
+	bool fits = impl->choose_memory_configuration(budget, hessian_storage,
+	                                              &number_of_threads, &deterministic);
+	impl->set_memory_configuration(number_of_threads, deterministic);
+	return fits;
+}
+
+void Function::Implementation::set_memory_configuration(int number_of_threads,
+                                                        bool deterministic)
+{
+	if (number_of_threads == this->number_of_threads && deterministic == this->deterministic) {
+		return;
+	}
+
+	this->number_of_threads = number_of_threads;
+	this->deterministic = deterministic;
+	this->local_storage_allocated = false;
+	// Release the storage allocated for the previous settings.
+	this->thread_gradient_scratch.clear();
+	this->thread_gradient_storage.clear();
+	this->thread_hessian_scratch.clear();
+	this->thread_batch_storage.clear();
+	this->thread_dense_hessian_storage.clear();
+	this->thread_sparse_hessian_storage.clear();
+	this->thread_gradient_scratch_float.clear();
+	this->thread_hessian_vector_scratch.clear();
+	this->thread_hessian_vector_storage.clear();
+}
+
+Function::SettingsScope::SettingsScope(const Function& function_in)
+	: function(function_in),
+	  number_of_threads(function_in.impl->number_of_threads),
+	  deterministic(function_in.impl->deterministic),
+	  single_precision(function_in.single_precision),
+	  gauss_newton_hessian(function_in.gauss_newton_hessian)
+{ }
+
+Function::SettingsScope::~SettingsScope()
+{
+	function.impl->set_memory_configuration(number_of_threads, deterministic);
+	function.single_precision = single_precision;
+	function.gauss_newton_hessian = gauss_newton_hessian;
+}
+
+bool Function::SettingsScope::fit_to_memory_budget(std::size_t budget,
+                                                   HessianStorage hessian_storage)
+{
+	int number_of_threads;
+	bool deterministic;
+	bool fits = function.impl->choose_memory_configuration(budget, hessian_storage,
+	                                                       &number_of_threads, &deterministic);
+	function.impl->set_memory_configuration(number_of_threads, deterministic);
+	return fits;
+}
+
+void Function::print_timing_information(std::ostream& out) const
+{
+	out << "----------------------------------------------------\n";
+	out << "Function evaluations without gradient : " << evaluations_without_gradient << '\n';
+	out << "Function evaluations with gradient    : " << evaluations_with_gradient << '\n';
+	out << "Function memory allocation time   : " << allocation_time << '\n';
+	out << "Function evaluate time            : " << evaluate_time << '\n';
+	out << "Function evaluate time (with g/H) : " << evaluate_with_hessian_time << '\n';
+	out << "Function write g/H time           : " << write_gradient_hessian_time << '\n';
+	out << "Function copy data time           : " << copy_time << '\n';
+	out << "----------------------------------------------------\n";
+}
+
+void Function::Implementation::copy_local_to_single_precision() const
+{
+	if (! this->single_precision_storage_allocated) {
+		this->allocate_single_precision_storage();
+	}
+
+	double start_time = wall_time();
+
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(variables.size()); ++i) {
+		const auto& var = variables[i];
+		for (int i = 0; i < var.user_dimension; ++i) {
+			var.temp_space_float[i] = static_cast<float>(var.temp_space[i]);
+		}
+	}
+
+	interface->copy_time += wall_time() - start_time;
+}
+
+std::ptrdiff_t Function::Implementation::evaluate_batch(std::ptrdiff_t i,
+                                                       std::ptrdiff_t end,
+                                                       int t,
+                                                       bool gradient,
+                                                       bool hessian) const
+{
+	const Term* term = terms[i].term.get();
+	const int size = term->batch_size();
+	if (size <= 1 || size > this->allocated_max_batch_size || end - i < size) {
+		return 0;
+	}
+	// Batches only compute exact Hessians.
+	if (hessian && interface->gauss_newton_hessian) {
+		return 0;
+	}
+
+	auto& batch = this->thread_batch_storage[t];
+	for (int l = 0; l < size; ++l) {
+		const auto& added_term = terms[i + l];
+		if (! added_term.is_active || typeid(*added_term.term) != typeid(*term)) {
+			return 0;
+		}
+		batch.terms[l] = added_term.term.get();
+		batch.variables[l] = &added_term.temp_variables[0];
+	}
+
+	term->evaluate_batch(&batch.terms[0],
+	                     &batch.variables[0],
+	                     &batch.values[0],
+	                     gradient ? &batch.gradients[0] : nullptr,
+	                     hessian ? &batch.hessians[0] : nullptr);
+	return size;
+}
+
+double Function::Implementation::evaluate_term_hessian(const AddedTerm& added_term,
+                                                      std::vector<Eigen::VectorXd>* gradient,
+                                                      HessianStorage* hessian) const
+{
+	if (interface->gauss_newton_hessian) {
+		return added_term.term->evaluate_gauss_newton(&added_term.temp_variables[0],
+		                                              gradient,
+		                                              hessian);
+	}
+	return added_term.term->evaluate(&added_term.temp_variables[0],
+	                                 gradient,
+	                                 hessian);
+}
+
+double Function::Implementation::evaluate_from_local_storage() const
+{
+	spii_assert(this->local_storage_allocated);
+
+	interface->evaluations_without_gradient++;
+
+	const bool single_precision = interface->single_precision;
+	if (single_precision) {
+		this->copy_local_to_single_precision();
+	}
+
+	double start_time = wall_time();
+
+	double value = 0.0;
+	// Go through and evaluate each term. The terms are processed
+	// in chunks, each of which is summed sequentially.
+	// OpenMP requires a signed data type as the loop variable.
+	#ifdef USE_OPENMP
+		// Each thread needs to store a specific error.
+		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
+
+		#pragma omp parallel for schedule(static) reduction(+ : value) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t chunk = 0; chunk < number_of_term_chunks(); ++chunk) {
 		#ifdef USE_OPENMP
 			// The thread number calling this iteration.
 			int t = omp_get_thread_num();
-			// We need to catch all exceptions before leaving
-			// the loop body.
-			try {
+		#else
+			int t = 0;
 		#endif
 
-		// Evaluate the term .
-		value += terms[i].term->evaluate(&terms[i].temp_variables[0]);
+		std::ptrdiff_t chunk_end = term_chunk_begin(chunk + 1);
+		double chunk_value = 0.0;
+		// The terms batch_begin, ..., batch_end - 1 have been evaluated
+		// together.
+		std::ptrdiff_t batch_begin = 0;
+		std::ptrdiff_t batch_end = 0;
+		for (std::ptrdiff_t i = term_chunk_begin(chunk); i < chunk_end; ++i) {
+			#ifdef USE_OPENMP
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				try {
+			#endif
+
+			if (! terms[i].is_active) {
+				continue;
+			}
 
-		#ifdef USE_OPENMP
-			// We need to catch all exceptions before leaving
-			// the loop body.
+			// Batches are evaluated in double precision.
+			if (i >= batch_end && ! single_precision) {
+				batch_begin = i;
+				batch_end = i + this->evaluate_batch(i, chunk_end, t, false, false);
 			}
-			catch (...) {
-				evaluation_errors[t] = std::current_exception();
+
+			// Evaluate the term .
+			if (i < batch_end) {
+				chunk_value += this->thread_batch_storage[t].values[i - batch_begin];
 			}
-		#endif
+			else if (single_precision && ! terms[i].temp_variables_float.empty()) {
+				chunk_value += terms[i].term->evaluate_float(&terms[i].temp_variables_float[0]);
+			}
+			else {
+				chunk_value += terms[i].term->evaluate(&terms[i].temp_variables[0]);
+			}
+
+			#ifdef USE_OPENMP
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				}
+				catch (...) {
+					evaluation_errors[t] = std::current_exception();
+				}
+			#endif
+		}
+
+		if (this->deterministic) {
+			this->chunk_values[chunk] = chunk_value;
+		}
+		else {
+			value += chunk_value;
+		}
 	}
 
 	#ifdef USE_OPENMP
@@ -623,6 +1946,11 @@ double Function::Implementation::evaluate_from_local_storage() const
 		}
 	#endif
 
+	if (this->deterministic) {
+		value = pairwise_sum(this->chunk_values.data(), this->chunk_values.size());
+	}
+	value += this->constant;
+
 	interface->evaluate_time += wall_time() - start_time;
 	return value;
 }
@@ -662,6 +1990,8 @@ void Function::create_sparse_hessian(Eigen::SparseMatrix<double>* H) const
 	std::unordered_set<std::pair<int, int>, IntPairHash> hessian_indices_set;
 	impl->number_of_hessian_elements = 0;
 
+	// Inactive terms are included, so that the pattern remains valid
+	// when they are activated again.
 	for (const auto& added_term: impl->terms) {
 		auto& indices = added_term.added_variables_indices;
 		auto& term    = added_term.term;
@@ -675,8 +2005,10 @@ void Function::create_sparse_hessian(Eigen::SparseMatrix<double>* H) const
 					if ( ! impl->variables[indices[var1]].is_constant) {
 
 						size_t global_offset1 = impl->variables[indices[var1]].global_index;
-						for (size_t i = 0; i < term->variable_dimension(var0); ++i) {
-							for (size_t j = 0; j < term->variable_dimension(var1); ++j) {
+						// The Hessian is with respect to the variables
+						// the solver sees.
+						for (int i = 0; i < impl->variables[indices[var0]].solver_dimension; ++i) {
+							for (int j = 0; j < impl->variables[indices[var1]].solver_dimension; ++j) {
 								int global_i = static_cast<int>(i + global_offset0);
 								int global_j = static_cast<int>(j + global_offset1);
 								
@@ -720,42 +2052,50 @@ void Function::create_sparse_hessian(Eigen::SparseMatrix<double>* H) const
 void Function::Implementation::copy_global_to_local(const Eigen::VectorXd& x) const
 {
 	double start_time = wall_time();
+	this->hessian_vector_point_set = false;
 
+	// Same static schedule as in allocate_local_storage, so that
+	// each thread writes to the memory it allocated.
 	#ifdef USE_OPENMP
-		#pragma omp parallel for num_threads(this->number_of_threads)
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
 	#endif
 	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(variables.size()); ++i) {
-		const auto& var = variables[i];
-
-		if ( ! var.is_constant) {
-			if (var.change_of_variables == nullptr) {
-				for (int i = 0; i < var.user_dimension; ++i) {
-					var.temp_space[i] = x[var.global_index + i];
-				}
-			}
-			else {
-				var.change_of_variables->t_to_x(
-					&var.temp_space[0],
-					&x[var.global_index]);
-			}
-		}
-		else {
-			// This variable is constant and is therefore not
-			// present in the global vector x of variables.
-			// Copy the constant from the user space instead.
-			for (int i = 0; i < var.user_dimension; ++i) {
-				var.temp_space[i] = var.user_data[i];
-			}
-		}
+		copy_variable_to_local(x, variables[i]);
 	}
 
 	interface->copy_time += wall_time() - start_time;
 }
 
-void Function::copy_user_to_global(Eigen::VectorXd* x) const
+void Function::Implementation::compute_change_jacobians(const Eigen::VectorXd& x,
+                                                        bool second_derivatives) const
 {
-	impl->copy_user_to_global(x);
-}
+	double start_time = wall_time();
+
+	// Every variable is shared by many terms, whose gradients are
+	// then transformed with the same Jacobian.
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(variables.size()); ++i) {
+		const auto& var = variables[i];
+		if ( ! var.is_constant && var.change_of_variables) {
+			var.change_of_variables->jacobian(var.change_jacobian.data(),
+			                                  &x[var.global_index]);
+			if (second_derivatives) {
+				var.change_second_derivatives.resize(var.change_jacobian.size() * var.solver_dimension);
+				var.change_of_variables->second_derivatives(var.change_second_derivatives.data(),
+				                                            &x[var.global_index]);
+			}
+		}
+	}
+
+	interface->copy_time += wall_time() - start_time;
+}
+
+void Function::copy_user_to_global(Eigen::VectorXd* x) const
+{
+	impl->copy_user_to_global(x);
+}
 
 void Function::Implementation::copy_user_to_global(Eigen::VectorXd* x) const
 {
@@ -813,9 +2153,29 @@ void Function::Implementation::copy_global_to_user(const Eigen::VectorXd& x) con
 	interface->copy_time += wall_time() - start_time;
 }
 
+bool Function::recenter(Eigen::VectorXd* x) const
+{
+	check(x->size() == impl->number_of_scalars,
+	      "Function::recenter: x has the wrong size.");
+
+	bool recentered = false;
+	for (const auto& var: impl->variables) {
+		if ( ! var.is_constant && var.change_of_variables != nullptr) {
+			if (var.change_of_variables->recenter(&(*x)[var.global_index])) {
+				recentered = true;
+			}
+		}
+	}
+	if (recentered) {
+		impl->hessian_vector_point_set = false;
+	}
+	return recentered;
+}
+
 void Function::Implementation::copy_user_to_local() const
 {
 	double start_time = wall_time();
+	this->hessian_vector_point_set = false;
 
 	for (const auto& var: variables) {
 		double* data = var.user_data;
@@ -832,6 +2192,54 @@ void Function::Implementation::copy_user_to_local() const
 	interface->copy_time += wall_time() - start_time;
 }
 
+void Function::Implementation::sum_term_derivatives(const Eigen::VectorXd& x,
+                                                    Eigen::VectorXd* gradient,
+                                                    Eigen::MatrixXd* hessian) const
+{
+	// Each variable owns its part of the gradient and its rows of the
+	// Hessian, so the variables can be processed in parallel. The
+	// contributions to each variable are always summed in term order.
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t v = 0; v < std::ptrdiff_t(variables.size()); ++v) {
+		const auto& var = variables[v];
+		if (var.is_constant) {
+			continue;
+		}
+
+		for (const auto& argument: variable_arguments[v]) {
+			const double* term_gradient = &term_gradient_storage[argument.gradient_offset];
+			add_solver_gradient(var, &(*gradient)[var.global_index], term_gradient);
+
+			if (hessian) {
+				const auto& indices = terms[argument.term].added_variables_indices;
+				auto term_begin = term_gradient_offsets[argument.term];
+				auto term_size = term_gradient_offsets[argument.term + 1] - term_begin;
+				auto row = argument.gradient_offset - term_begin;
+				const double* term_hessian = &term_hessian_storage[term_hessian_offsets[argument.term]];
+
+				size_t col = 0;
+				for (int var1 = 0; var1 < indices.size(); ++var1) {
+					const auto& other = variables[indices[var1]];
+					if ( ! other.is_constant) {
+						auto block = [=](int i, int j)
+						{
+							return term_hessian[(row + i) * term_size + col + j];
+						};
+						auto add = [&](int i, int j, double value)
+						{
+							(*hessian)(var.global_index + i, other.global_index + j) += value;
+						};
+						add_solver_hessian(var, other, block, col == row ? term_gradient : nullptr, add);
+					}
+					col += other.user_dimension;
+				}
+			}
+		}
+	}
+}
+
 double Function::evaluate(const Eigen::VectorXd& x,
                           Eigen::VectorXd* gradient) const
 {
@@ -856,37 +2264,34 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 		throw std::runtime_error("Function::evaluate: Hessian computation is not enabled.");
 	}
 
+	if (this->finite_differences) {
+		return this->evaluate_finite_differences(x, gradient, hessian, nullptr);
+	}
+
 	if (! this->local_storage_allocated) {
 		this->allocate_local_storage();
 	}
 
 	double start_time = wall_time();
 	if (hessian) {
-		#ifdef USE_OPENMP
-			thread_dense_hessian_storage.resize(this->number_of_threads);
-		#else
-			thread_dense_hessian_storage.resize(1);
-		#endif
-		for (int t = 0; t < this->number_of_threads; ++t) {
-			thread_dense_hessian_storage[t].resize(static_cast<int>(this->number_of_scalars),
-			                                       static_cast<int>(this->number_of_scalars));
-			thread_dense_hessian_storage[t].setZero();
-		}
+		thread_dense_hessian_storage.resize(this->number_of_threads);
 	}
 	interface->allocation_time += wall_time() - start_time;
 
 	// Copy values from the global vector x to the temporary storage
 	// used for evaluating the term.
 	this->copy_global_to_local(x);
+	this->compute_change_jacobians(x, hessian != nullptr);
 
-	start_time = wall_time();
-
-	// Initialize each thread's global gradient.
-	for (int t = 0; t < this->number_of_threads; ++t) {
-		this->thread_gradient_storage[t].setZero();
+	// Hessians are always computed in double precision.
+	const bool single_precision = interface->single_precision && ! hessian;
+	if (single_precision) {
+		this->copy_local_to_single_precision();
 	}
 
-	double value = this->constant;
+	start_time = wall_time();
+
+	double value = 0.0;
 
 	// Go through and evaluate each term.
 	// OpenMP requires a signed data type as the loop variable.
@@ -894,100 +2299,216 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 		// Each thread needs to store a specific error.
 		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
 
-		#pragma omp parallel for reduction(+ : value) num_threads(this->number_of_threads)
+		#pragma omp parallel num_threads(this->number_of_threads)
 	#endif
-	for (int i = 0; i < terms.size(); ++i) {
+	{
 		#ifdef USE_OPENMP
-			// The thread number calling this iteration.
+			// The thread number of this thread.
 			int t = omp_get_thread_num();
-			// We need to catch all exceptions before leaving
-			// the loop body.
-			try {
+			int thread_step = omp_get_num_threads();
 		#else
 			int t = 0;
+			int thread_step = 1;
 		#endif
 
-		if (hessian) {
-			// Evaluate the term and put its gradient and hessian
-			// into local storage.
-			value += terms[i].term->evaluate(&terms[i].temp_variables[0],
-											 &this->thread_gradient_scratch[t],
-											 &this->thread_hessian_scratch[t]);
+		// Initialize each thread's global gradient and Hessian. Every
+		// thread clears its own storage, which keeps the memory local
+		// to it. (If fewer threads than requested were started, the
+		// remaining storage is cleared as well.) Deterministic
+		// evaluation stores the derivatives per term instead.
+		for (int s = t; s < this->number_of_threads && ! this->deterministic; s += thread_step) {
+			this->thread_gradient_storage[s].setZero();
+			if (hessian) {
+				thread_dense_hessian_storage[s].setZero(static_cast<int>(this->number_of_scalars),
+				                                        static_cast<int>(this->number_of_scalars));
+			}
+		}
 
+		#ifdef USE_OPENMP
+			#pragma omp for schedule(static) reduction(+ : value)
+		#endif
+		for (std::ptrdiff_t chunk = 0; chunk < number_of_term_chunks(); ++chunk) {
+			std::ptrdiff_t chunk_end = term_chunk_begin(chunk + 1);
+			double chunk_value = 0.0;
+			// The terms batch_begin, ..., batch_end - 1 have been
+			// evaluated together.
+			std::ptrdiff_t batch_begin = 0;
+			std::ptrdiff_t batch_end = 0;
+			for (std::ptrdiff_t i = term_chunk_begin(chunk); i < chunk_end; ++i) {
+				#ifdef USE_OPENMP
+					// We need to catch all exceptions before leaving
+					// the loop body.
+					try {
+				#endif
+
+				if (! terms[i].is_active) {
+					if (this->deterministic) {
+						// Clear the term's slots.
+						std::fill(term_gradient_storage.begin() + term_gradient_offsets[i],
+						          term_gradient_storage.begin() + term_gradient_offsets[i + 1],
+						          0.0);
+						if (hessian) {
+							std::fill(term_hessian_storage.begin() + term_hessian_offsets[i],
+							          term_hessian_storage.begin() + term_hessian_offsets[i + 1],
+							          0.0);
+						}
+					}
+					continue;
+				}
 
-			const auto& term = terms[i].term;
-			const auto& indices = terms[i].added_variables_indices;
-			// Put the hessian into the global hessian.
-			for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
+				const auto& term = terms[i].term;
+				const auto& indices = terms[i].added_variables_indices;
+
+				// The derivatives of the term are computed in local
+				// storage, or in its lane of a batch.
+				auto* gradient_scratch = &this->thread_gradient_scratch[t];
+				HessianStorage* hessian_scratch = hessian ? &this->thread_hessian_scratch[t] : nullptr;
+				// Batches are evaluated in double precision.
+				if (i >= batch_end && ! single_precision) {
+					batch_begin = i;
+					batch_end = i + this->evaluate_batch(i, chunk_end, t, true, hessian != nullptr);
+				}
+
+				if (i < batch_end) {
+					auto& batch = this->thread_batch_storage[t];
+					auto lane = i - batch_begin;
+					chunk_value += batch.values[lane];
+					gradient_scratch = &batch.gradients[lane];
+					if (hessian) {
+						hessian_scratch = &batch.hessians[lane];
+					}
+				}
+				else if (hessian) {
+					// Evaluate the term and put its gradient and hessian
+					// into local storage.
+					chunk_value += this->evaluate_term_hessian(terms[i],
+					                                           gradient_scratch,
+					                                           hessian_scratch);
+				}
+				else if (single_precision && ! terms[i].temp_variables_float.empty()) {
+					// Evaluate the term in single precision and convert its
+					// gradient to local storage.
+					auto& gradient_float = this->thread_gradient_scratch_float[t];
+					chunk_value += term->evaluate_float(&terms[i].temp_variables_float[0],
+					                                    &gradient_float);
+					for (int var = 0; var < indices.size(); ++var) {
+						for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
+							(*gradient_scratch)[var][i] = gradient_float[var][i];
+						}
+					}
+				}
+				else {
+					// Evaluate the term and put its gradient into local
+					// storage.
+					chunk_value += term->evaluate(&terms[i].temp_variables[0],
+					                              gradient_scratch);
+				}
 
-				if ( ! variables[indices[var0]].is_constant) {
-					if (variables[indices[var0]].change_of_variables) {
-						throw std::runtime_error("Change of variables not supported for Hessians");
+				if (hessian) {
+					if (this->deterministic) {
+						// Store the term's Hessian in its own slot.
+						auto term_size = term_gradient_offsets[i + 1] - term_gradient_offsets[i];
+						double* term_hessian = &term_hessian_storage[term_hessian_offsets[i]];
+						size_t row = 0;
+						for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
+							size_t col = 0;
+							for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
+								const Eigen::MatrixXd& part_hessian = (*hessian_scratch)[var0][var1];
+								for (int i = 0; i < term->variable_dimension(var0); ++i) {
+									for (int j = 0; j < term->variable_dimension(var1); ++j) {
+										term_hessian[(row + i) * term_size + col + j] = part_hessian(i, j);
+									}
+								}
+								col += term->variable_dimension(var1);
+							}
+							row += term->variable_dimension(var0);
+						}
 					}
 
-					size_t global_offset0 = variables[indices[var0]].global_index;
-					for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
-						size_t global_offset1 = variables[indices[var1]].global_index;
+					// Put the hessian into the global hessian.
+					for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
 
-						if ( ! variables[indices[var1]].is_constant) {
+						if ( ! variables[indices[var0]].is_constant) {
+							if (this->deterministic) {
+								continue;
+							}
 
-							const Eigen::MatrixXd& part_hessian = this->thread_hessian_scratch[t][var0][var1];
-							for (int i = 0; i < term->variable_dimension(var0); ++i) {
-								for (int j = 0; j < term->variable_dimension(var1); ++j) {
-									thread_dense_hessian_storage[t]
-										.coeffRef(i + global_offset0, j + global_offset1)
-									+= part_hessian(i, j);
+							size_t global_offset0 = variables[indices[var0]].global_index;
+							for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
+								size_t global_offset1 = variables[indices[var1]].global_index;
+
+								if ( ! variables[indices[var1]].is_constant) {
+
+									const Eigen::MatrixXd& part_hessian = (*hessian_scratch)[var0][var1];
+									auto add = [&](int i, int j, double value)
+									{
+										thread_dense_hessian_storage[t]
+											.coeffRef(i + global_offset0, j + global_offset1)
+										+= value;
+									};
+									add_solver_hessian(variables[indices[var0]],
+									                   variables[indices[var1]],
+									                   part_hessian,
+									                   var0 == var1 ? &(*gradient_scratch)[var0][0] : nullptr,
+									                   add);
 								}
 							}
-
 						}
 					}
 				}
-			}
 
-
-		}
-		else {
-			// Evaluate the term and put its gradient into local
-			// storage.
-			value += terms[i].term->evaluate(&terms[i].temp_variables[0],
-											 &this->thread_gradient_scratch[t]);
-		}
-
-		// Put the gradient from the term into the thread's global gradient.
-		const auto& indices = terms[i].added_variables_indices;
-		for (int var = 0; var < indices.size(); ++var) {
-
-			if ( ! variables[indices[var]].is_constant) {
-				if (variables[indices[var]].change_of_variables == nullptr) {
-					// No change of variables, just copy the gradient.
-					size_t global_offset = variables[indices[var]].global_index;
-					for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
-						this->thread_gradient_storage[t][global_offset + i] +=
-							this->thread_gradient_scratch[t][var][i];
+				if (this->deterministic) {
+					// Store the term's gradient in its own slot.
+					double* term_gradient = &term_gradient_storage[term_gradient_offsets[i]];
+					for (int var = 0; var < indices.size(); ++var) {
+						for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
+							*term_gradient++ = (*gradient_scratch)[var][i];
+						}
 					}
 				}
 				else {
-					// Transform the gradient from user space to solver space.
-					size_t global_offset = variables[indices[var]].global_index;
-					if (global_offset < this->number_of_scalars) {
-						variables[indices[var]].change_of_variables->update_gradient(
-							&this->thread_gradient_storage[t][global_offset],
-							&x[global_offset],
-							&this->thread_gradient_scratch[t][var][0]);
+					// Put the gradient from the term into the thread's global gradient.
+					for (int var = 0; var < indices.size(); ++var) {
+
+						if ( ! variables[indices[var]].is_constant) {
+							if (variables[indices[var]].change_of_variables == nullptr) {
+								// No change of variables, just copy the gradient.
+								size_t global_offset = variables[indices[var]].global_index;
+								for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
+									this->thread_gradient_storage[t][global_offset + i] +=
+										(*gradient_scratch)[var][i];
+								}
+							}
+							else {
+								// Transform the gradient from user space to solver space.
+								size_t global_offset = variables[indices[var]].global_index;
+								if (global_offset < this->number_of_scalars) {
+									add_solver_gradient(variables[indices[var]],
+									                    &this->thread_gradient_storage[t][global_offset],
+									                    &(*gradient_scratch)[var][0]);
+								}
+							}
+						}
 					}
 				}
+
+				#ifdef USE_OPENMP
+					// We need to catch all exceptions before leaving
+					// the loop body.
+					}
+					catch (...) {
+						evaluation_errors[t] = std::current_exception();
+					}
+				#endif
 			}
-		}
 
-		#ifdef USE_OPENMP
-			// We need to catch all exceptions before leaving
-			// the loop body.
+			if (this->deterministic) {
+				this->chunk_values[chunk] = chunk_value;
 			}
-			catch (...) {
-				evaluation_errors[t] = std::current_exception();
+			else {
+				value += chunk_value;
 			}
-		#endif
+		}
 	}
 
 	#ifdef USE_OPENMP
@@ -1005,23 +2526,37 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 	interface->evaluate_with_hessian_time += wall_time() - start_time;
 	start_time = wall_time();
 
+	if (this->deterministic) {
+		value = pairwise_sum(this->chunk_values.data(), this->chunk_values.size());
+	}
+	value += this->constant;
+
 	// Create the global gradient.
 	if (gradient->size() != this->number_of_scalars) {
 		gradient->resize(this->number_of_scalars);
 	}
 	gradient->setZero();
-	// Sum the gradients from all different terms.
-	for (int t = 0; t < this->number_of_threads; ++t) {
-		(*gradient) += this->thread_gradient_storage[t].segment(0, this->number_of_scalars);
-	}
 
 	if (hessian) {
 		// Create the global (dense) hessian.
 		hessian->resize( static_cast<int>(this->number_of_scalars),
 						 static_cast<int>(this->number_of_scalars));
 		hessian->setZero();
+	}
+
+	if (this->deterministic) {
+		sum_term_derivatives(x, gradient, hessian);
+	}
+	else {
+		// Sum the gradients from all different terms.
 		for (int t = 0; t < this->number_of_threads; ++t) {
-			(*hessian) += this->thread_dense_hessian_storage[t];
+			(*gradient) += this->thread_gradient_storage[t].segment(0, this->number_of_scalars);
+		}
+
+		if (hessian) {
+			for (int t = 0; t < this->number_of_threads; ++t) {
+				(*hessian) += this->thread_dense_hessian_storage[t];
+			}
 		}
 	}
 
@@ -1050,6 +2585,10 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 		throw std::runtime_error("Function::evaluate: Hessian computation is not enabled.");
 	}
 
+	if (this->finite_differences) {
+		return this->evaluate_finite_differences(x, gradient, nullptr, hessian);
+	}
+
 	if (! this->local_storage_allocated) {
 		this->allocate_local_storage();
 	}
@@ -1061,8 +2600,14 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 		thread_sparse_hessian_storage.resize(1);
 	#endif
 	for (int t = 0; t < this->number_of_threads; ++t) {
-		// TODO: Most likely too much space per thread here.
-		thread_sparse_hessian_storage[t].reserve(this->number_of_hessian_elements);
+		// The first thread collects the triplets of all threads
+		// afterwards. The others only need space for their share.
+		if (t == 0) {
+			thread_sparse_hessian_storage[t].reserve(this->number_of_hessian_elements);
+		}
+		else {
+			thread_sparse_hessian_storage[t].reserve(this->number_of_hessian_elements / this->number_of_threads);
+		}
 		thread_sparse_hessian_storage[t].clear();
 	}
 	this->number_of_hessian_elements = 0;
@@ -1072,95 +2617,157 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 	// Copy values from the global vector x to the temporary storage
 	// used for evaluating the term.
 	this->copy_global_to_local(x);
+	this->compute_change_jacobians(x, true);
 
 	start_time = wall_time();
 
 	interface->write_gradient_hessian_time += wall_time() - start_time;
 	start_time = wall_time();
 
-	// Initialize each thread's global gradient.
-	for (int t = 0; t < this->number_of_threads; ++t) {
-		this->thread_gradient_storage[t].setZero();
-	}
-
-	double value = this->constant;
+	double value = 0.0;
 	// Go through and evaluate each term.
 	// OpenMP requires a signed data type as the loop variable.
 	#ifdef USE_OPENMP
 		// Each thread needs to store a specific error.
 		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
 
-		#pragma omp parallel for reduction(+ : value) num_threads(this->number_of_threads)
+		#pragma omp parallel num_threads(this->number_of_threads)
 	#endif
-	for (int i = 0; i < terms.size(); ++i) {
+	{
 		#ifdef USE_OPENMP
-			// The thread number calling this iteration.
+			// The thread number of this thread.
 			int t = omp_get_thread_num();
-			// We need to catch all exceptions before leaving
-			// the loop body.
-			try {
+			int thread_step = omp_get_num_threads();
 		#else
 			int t = 0;
+			int thread_step = 1;
 		#endif
 
-		// Evaluate the term and put its gradient and hessian
-		// into local storage.
-		value += terms[i].term->evaluate(&terms[i].temp_variables[0],
-		                                 &this->thread_gradient_scratch[t],
-		                                 &this->thread_hessian_scratch[t]);
-
-		// Put the gradient from the term into the thread's global gradient.
-		const auto& indices = terms[i].added_variables_indices;
-		for (int var = 0; var < indices.size(); ++var) {
+		// Initialize each thread's global gradient.
+		for (int s = t; s < this->number_of_threads && ! this->deterministic; s += thread_step) {
+			this->thread_gradient_storage[s].setZero();
+		}
 
-			if ( ! variables[indices[var]].is_constant) {
-				if (variables[indices[var]].change_of_variables) {
-					throw std::runtime_error("Change of variables not supported for sparse Hessian");
+		// The static schedule gives every thread a contiguous range of
+		// chunks, so concatenating the triplets of all threads lists
+		// them in term order.
+		#ifdef USE_OPENMP
+			#pragma omp for schedule(static) reduction(+ : value)
+		#endif
+		for (std::ptrdiff_t chunk = 0; chunk < number_of_term_chunks(); ++chunk) {
+			std::ptrdiff_t chunk_end = term_chunk_begin(chunk + 1);
+			double chunk_value = 0.0;
+			// The terms batch_begin, ..., batch_end - 1 have been
+			// evaluated together.
+			std::ptrdiff_t batch_begin = 0;
+			std::ptrdiff_t batch_end = 0;
+			for (std::ptrdiff_t i = term_chunk_begin(chunk); i < chunk_end; ++i) {
+				#ifdef USE_OPENMP
+					// We need to catch all exceptions before leaving
+					// the loop body.
+					try {
+				#endif
+
+				if (! terms[i].is_active) {
+					if (this->deterministic) {
+						// Clear the term's slots.
+						std::fill(term_gradient_storage.begin() + term_gradient_offsets[i],
+						          term_gradient_storage.begin() + term_gradient_offsets[i + 1],
+						          0.0);
+					}
+					continue;
 				}
 
-				size_t global_offset = variables[indices[var]].global_index;
-				for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
-					this->thread_gradient_storage[t][global_offset + i] +=
-						this->thread_gradient_scratch[t][var][i];
+				// Evaluate the term and put its gradient and hessian
+				// into local storage, or into its lane of a batch.
+				auto* gradient_scratch = &this->thread_gradient_scratch[t];
+				auto* hessian_scratch = &this->thread_hessian_scratch[t];
+				if (i >= batch_end) {
+					batch_begin = i;
+					batch_end = i + this->evaluate_batch(i, chunk_end, t, true, true);
 				}
-			}
-		}
-
-		// Put the hessian from the term into the thread's global hessian.
-		const auto& term = terms[i].term;
-		for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
-			if ( ! variables[indices[var0]].is_constant) {
 
-				size_t global_offset0 = variables[indices[var0]].global_index;
-				for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
-					if ( ! variables[indices[var1]].is_constant) {
+				if (i < batch_end) {
+					auto& batch = this->thread_batch_storage[t];
+					auto lane = i - batch_begin;
+					chunk_value += batch.values[lane];
+					gradient_scratch = &batch.gradients[lane];
+					hessian_scratch = &batch.hessians[lane];
+				}
+				else {
+					chunk_value += this->evaluate_term_hessian(terms[i],
+					                                           gradient_scratch,
+					                                           hessian_scratch);
+				}
 
-						size_t global_offset1 = variables[indices[var1]].global_index;
-						const Eigen::MatrixXd& part_hessian = this->thread_hessian_scratch[t][var0][var1];
-						for (int i = 0; i < term->variable_dimension(var0); ++i) {
-							for (int j = 0; j < term->variable_dimension(var1); ++j) {
+				// Put the gradient from the term into the thread's global
+				// gradient, or into the term's own slot.
+				const auto& indices = terms[i].added_variables_indices;
+				double* term_gradient = nullptr;
+				if (this->deterministic) {
+					term_gradient = &term_gradient_storage[term_gradient_offsets[i]];
+				}
+				for (int var = 0; var < indices.size(); ++var) {
+					if (this->deterministic) {
+						for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
+							*term_gradient++ = (*gradient_scratch)[var][i];
+						}
+					}
+					else if ( ! variables[indices[var]].is_constant) {
+						size_t global_offset = variables[indices[var]].global_index;
+						add_solver_gradient(variables[indices[var]],
+						                    &this->thread_gradient_storage[t][global_offset],
+						                    &(*gradient_scratch)[var][0]);
+					}
+				}
 
-								int global_i = static_cast<int>(i + global_offset0);
-								int global_j = static_cast<int>(j + global_offset1);
-								thread_sparse_hessian_storage[t].push_back(Eigen::Triplet<double>(global_i,
-								                                                                  global_j,
-								                                                                  part_hessian(i, j)));
+				// Put the hessian from the term into the thread's global hessian.
+				const auto& term = terms[i].term;
+				for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
+					if ( ! variables[indices[var0]].is_constant) {
+
+						size_t global_offset0 = variables[indices[var0]].global_index;
+						for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
+							if ( ! variables[indices[var1]].is_constant) {
+
+								size_t global_offset1 = variables[indices[var1]].global_index;
+								const Eigen::MatrixXd& part_hessian = (*hessian_scratch)[var0][var1];
+								auto add = [&](int i, int j, double value)
+								{
+									int global_i = static_cast<int>(i + global_offset0);
+									int global_j = static_cast<int>(j + global_offset1);
+									thread_sparse_hessian_storage[t].push_back(Eigen::Triplet<double>(global_i,
+									                                                                  global_j,
+									                                                                  value));
+								};
+								add_solver_hessian(variables[indices[var0]],
+								                   variables[indices[var1]],
+								                   part_hessian,
+								                   var0 == var1 ? &(*gradient_scratch)[var0][0] : nullptr,
+								                   add);
 							}
+
 						}
 					}
-
 				}
+
+				#ifdef USE_OPENMP
+					// We need to catch all exceptions before leaving
+					// the loop body.
+					}
+					catch (...) {
+						evaluation_errors[t] = std::current_exception();
+					}
+				#endif
 			}
-		}
 
-		#ifdef USE_OPENMP
-			// We need to catch all exceptions before leaving
-			// the loop body.
+			if (this->deterministic) {
+				this->chunk_values[chunk] = chunk_value;
 			}
-			catch (...) {
-				evaluation_errors[t] = std::current_exception();
+			else {
+				value += chunk_value;
 			}
-		#endif
+		}
 	}
 
 	#ifdef USE_OPENMP
@@ -1178,16 +2785,28 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 	interface->evaluate_with_hessian_time += wall_time() - start_time;
 	start_time = wall_time();
 
+	if (this->deterministic) {
+		value = pairwise_sum(this->chunk_values.data(), this->chunk_values.size());
+	}
+	value += this->constant;
+
 	// Create the global gradient.
 	if (gradient->size() != this->number_of_scalars) {
 		gradient->resize(this->number_of_scalars);
 	}
 	gradient->setZero();
-	// Sum the gradients from all different terms.
-	for (int t = 0; t < this->number_of_threads; ++t) {
-		(*gradient) += this->thread_gradient_storage[t].segment(0, this->number_of_scalars);
+	if (this->deterministic) {
+		sum_term_derivatives(x, gradient, nullptr);
+	}
+	else {
+		// Sum the gradients from all different terms.
+		for (int t = 0; t < this->number_of_threads; ++t) {
+			(*gradient) += this->thread_gradient_storage[t].segment(0, this->number_of_scalars);
+		}
 	}
 
+	// setFromTriplets sums duplicate entries in the order of the
+	// triplets.
 	for (int t = 1; t < thread_sparse_hessian_storage.size(); ++t) {
 		for (const auto& triple: thread_sparse_hessian_storage[t]) {
 			thread_sparse_hessian_storage[0].emplace_back(triple);
@@ -1203,30 +2822,706 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 	return value;
 }
 
+double Function::evaluate_hessian_vector(const Eigen::VectorXd& x,
+                                         const Eigen::VectorXd& v,
+                                         Eigen::VectorXd* gradient,
+                                         Eigen::VectorXd* hessian_vector) const
+{
+	return impl->evaluate_hessian_vector(x, v, gradient, hessian_vector);
+}
+
+double Function::evaluate_hessian_vector(const Eigen::VectorXd& x,
+                                         const Eigen::VectorXd& v,
+                                         Eigen::VectorXd* hessian_vector) const
+{
+	Eigen::VectorXd gradient;
+	return impl->evaluate_hessian_vector(x, v, &gradient, hessian_vector);
+}
+
+void Function::set_hessian_vector_point(const Eigen::VectorXd& x) const
+{
+	impl->set_hessian_vector_point(x);
+}
+
+void Function::evaluate_hessian_vector(const Eigen::VectorXd& v,
+                                       Eigen::VectorXd* hessian_vector) const
+{
+	impl->evaluate_hessian_vector(v, nullptr, hessian_vector);
+}
+
+void Function::Implementation::copy_direction_to_local(const Eigen::VectorXd& v) const
+{
+	double start_time = wall_time();
+
+	// Same static schedule as in allocate_local_storage.
+	#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(variables.size()); ++i) {
+		const auto& var = variables[i];
+		if (var.is_constant) {
+			std::fill(var.temp_direction.begin(), var.temp_direction.end(), 0.0);
+		}
+		else if (var.change_of_variables == nullptr) {
+			for (int k = 0; k < var.user_dimension; ++k) {
+				var.temp_direction[k] = v[var.global_index + k];
+			}
+		}
+		else {
+			// dx = (dx/dt) dt.
+			const double* dx_dt = var.change_jacobian.data();
+			for (int k = 0; k < var.user_dimension; ++k) {
+				double value = 0;
+				for (int a = 0; a < var.solver_dimension; ++a) {
+					value += dx_dt[k * var.solver_dimension + a] * v[var.global_index + a];
+				}
+				var.temp_direction[k] = value;
+			}
+		}
+	}
+
+	interface->copy_time += wall_time() - start_time;
+}
+
+double Function::Implementation::evaluate_hessian_vector(const Eigen::VectorXd& x,
+                                                         const Eigen::VectorXd& v,
+                                                         Eigen::VectorXd* gradient,
+                                                         Eigen::VectorXd* hessian_vector) const
+{
+	interface->evaluations_with_gradient++;
+	this->set_hessian_vector_point(x);
+	return this->evaluate_hessian_vector(v, gradient, hessian_vector);
+}
+
+void Function::Implementation::set_hessian_vector_point(const Eigen::VectorXd& x) const
+{
+	check(x.size() == this->number_of_scalars,
+	      "Function::set_hessian_vector_point: x has the wrong size.");
+
+	if (! this->finite_differences) {
+		if (! this->local_storage_allocated) {
+			this->allocate_local_storage();
+		}
+		if (! this->hessian_vector_storage_allocated) {
+			this->allocate_hessian_vector_storage();
+		}
+
+		this->copy_global_to_local(x);
+		this->compute_change_jacobians(x, true);
+	}
+
+	this->hessian_vector_point = x;
+	this->hessian_vector_point_set = true;
+}
+
+double Function::Implementation::evaluate_hessian_vector(const Eigen::VectorXd& v,
+                                                         Eigen::VectorXd* gradient,
+                                                         Eigen::VectorXd* hessian_vector) const
+{
+	check(this->hessian_vector_point_set,
+	      "Function::evaluate_hessian_vector: no point set with set_hessian_vector_point.");
+	check(v.size() == this->number_of_scalars,
+	      "Function::evaluate_hessian_vector: v has the wrong size.");
+
+	if (this->finite_differences) {
+		// Central differences of the finite-difference gradients.
+		const Eigen::VectorXd& x = this->hessian_vector_point;
+		double value = 0;
+		if (gradient) {
+			value = this->evaluate_finite_differences(x, gradient, nullptr, nullptr);
+		}
+		hessian_vector->setZero(this->number_of_scalars);
+		const double v_norm = v.lpNorm<Eigen::Infinity>();
+		if (v_norm > 0) {
+			const double x_norm = x.size() > 0 ? x.lpNorm<Eigen::Infinity>() : 0.0;
+			const double h = std::pow(std::numeric_limits<double>::epsilon(), 0.25)
+			               * std::max(x_norm, 1.0) / v_norm;
+			Eigen::VectorXd gradient_plus, gradient_minus;
+			this->evaluate_finite_differences(x + h * v, &gradient_plus, nullptr, nullptr);
+			this->evaluate_finite_differences(x - h * v, &gradient_minus, nullptr, nullptr);
+			*hessian_vector = (gradient_plus - gradient_minus) / (2 * h);
+		}
+		// Only the point itself is needed for further products.
+		this->hessian_vector_point_set = true;
+		return value;
+	}
+
+	this->copy_direction_to_local(v);
+
+	double start_time = wall_time();
+
+	// Deterministic evaluation adds the products of the terms in
+	// order, with a single thread.
+	const int number_of_threads = this->deterministic ? 1 : this->number_of_threads;
+	double value = 0.0;
+
+	#ifdef USE_OPENMP
+		// Each thread needs to store a specific error.
+		std::vector<std::exception_ptr> evaluation_errors(number_of_threads);
+
+		#pragma omp parallel num_threads(number_of_threads)
+	#endif
+	{
+		#ifdef USE_OPENMP
+			int t = omp_get_thread_num();
+			int thread_step = omp_get_num_threads();
+		#else
+			int t = 0;
+			int thread_step = 1;
+		#endif
+
+		for (int s = t; s < number_of_threads; s += thread_step) {
+			if (gradient) {
+				this->thread_gradient_storage[s].setZero();
+			}
+			this->thread_hessian_vector_storage[s].setZero();
+		}
+
+		#ifdef USE_OPENMP
+			#pragma omp for schedule(static) reduction(+ : value)
+		#endif
+		for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(terms.size()); ++i) {
+			#ifdef USE_OPENMP
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				try {
+			#endif
+
+			if (! terms[i].is_active) {
+				continue;
+			}
+
+			const auto& term = terms[i].term;
+			const auto& indices = terms[i].added_variables_indices;
+			auto& gradient_scratch = this->thread_gradient_scratch[t];
+			auto& hessian_vector_scratch = this->thread_hessian_vector_scratch[t];
+			value += term->evaluate_hessian_vector(&terms[i].temp_variables[0],
+			                                       &terms[i].temp_directions[0],
+			                                       &gradient_scratch,
+			                                       &hessian_vector_scratch);
+
+			// Put the derivatives into the thread's global storage,
+			// transformed from user space to solver space.
+			for (int var = 0; var < indices.size(); ++var) {
+				const auto& variable = variables[indices[var]];
+				if (variable.is_constant) {
+					continue;
+				}
+
+				const size_t global_offset = variable.global_index;
+				double* thread_hessian_vector = &this->thread_hessian_vector_storage[t][global_offset];
+				if (gradient) {
+					add_solver_gradient(variable,
+					                    &this->thread_gradient_storage[t][global_offset],
+					                    &gradient_scratch[var][0]);
+				}
+				add_solver_gradient(variable,
+				                    thread_hessian_vector,
+				                    &hessian_vector_scratch[var][0]);
+
+				if (variable.change_of_variables) {
+					// The curvature of the change of variables,
+					// sum_i g_i (d^2 x_i / dt^2) v.
+					const int n_t = variable.solver_dimension;
+					const double* d2x_dt2 = variable.change_second_derivatives.data();
+					for (int k = 0; k < variable.user_dimension; ++k) {
+						const double g = gradient_scratch[var][k];
+						for (int a = 0; a < n_t; ++a) {
+							for (int b = 0; b < n_t; ++b) {
+								thread_hessian_vector[a] +=
+									g * d2x_dt2[(k * n_t + a) * n_t + b] * v[global_offset + b];
+							}
+						}
+					}
+				}
+			}
+
+			#ifdef USE_OPENMP
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				}
+				catch (...) {
+					evaluation_errors[t] = std::current_exception();
+				}
+			#endif
+		}
+	}
+
+	#ifdef USE_OPENMP
+		// Now that we are outside the OpenMP block, we can
+		// rethrow exceptions.
+		for (const auto& error: evaluation_errors) {
+			if (error) {
+				std::rethrow_exception(error);
+			}
+		}
+	#endif
+
+	interface->evaluate_with_hessian_time += wall_time() - start_time;
+	start_time = wall_time();
+
+	value += this->constant;
+
+	hessian_vector->setZero(this->number_of_scalars);
+	for (int t = 0; t < number_of_threads; ++t) {
+		(*hessian_vector) += this->thread_hessian_vector_storage[t].segment(0, this->number_of_scalars);
+	}
+	if (gradient) {
+		gradient->setZero(this->number_of_scalars);
+		for (int t = 0; t < number_of_threads; ++t) {
+			(*gradient) += this->thread_gradient_storage[t].segment(0, this->number_of_scalars);
+		}
+	}
+
+	interface->write_gradient_hessian_time += wall_time() - start_time;
+	return value;
+}
+
+void Function::Implementation::allocate_coloring() const
+{
+	auto start_time = wall_time();
+
+	// The distinct non-constant scalars of every term. A variable may
+	// be used more than once by a term.
+	term_scalar_offsets.resize(terms.size() + 1);
+	term_scalars.clear();
+	for (size_t i = 0; i < terms.size(); ++i) {
+		term_scalar_offsets[i] = term_scalars.size();
+		for (auto var: terms[i].added_variables_indices) {
+			if ( ! variables[var].is_constant) {
+				for (int k = 0; k < variables[var].solver_dimension; ++k) {
+					term_scalars.push_back(variables[var].global_index + k);
+				}
+			}
+		}
+		auto begin = term_scalars.begin() + term_scalar_offsets[i];
+		std::sort(begin, term_scalars.end());
+		term_scalars.erase(std::unique(begin, term_scalars.end()), term_scalars.end());
+	}
+	term_scalar_offsets[terms.size()] = term_scalars.size();
+
+	// The terms containing every scalar.
+	std::vector<size_t> scalar_term_offsets(number_of_scalars + 1, 0);
+	for (auto scalar: term_scalars) {
+		scalar_term_offsets[scalar + 1]++;
+	}
+	for (size_t i = 0; i < number_of_scalars; ++i) {
+		scalar_term_offsets[i + 1] += scalar_term_offsets[i];
+	}
+	std::vector<size_t> scalar_terms(term_scalars.size());
+	std::vector<size_t> scalar_term_positions(scalar_term_offsets.begin(), scalar_term_offsets.end() - 1);
+	for (size_t i = 0; i < terms.size(); ++i) {
+		for (auto s = term_scalar_offsets[i]; s < term_scalar_offsets[i + 1]; ++s) {
+			scalar_terms[scalar_term_positions[term_scalars[s]]++] = i;
+		}
+	}
+
+	// Greedy coloring. Every scalar gets the smallest color not used
+	// by a scalar sharing a term with it. used_by[c] == i + 1 if
+	// color c is used by such a scalar.
+	scalar_colors.assign(number_of_scalars, -1);
+	std::vector<size_t> used_by;
+	for (size_t i = 0; i < number_of_scalars; ++i) {
+		for (auto t = scalar_term_offsets[i]; t < scalar_term_offsets[i + 1]; ++t) {
+			auto term = scalar_terms[t];
+			for (auto s = term_scalar_offsets[term]; s < term_scalar_offsets[term + 1]; ++s) {
+				auto color = scalar_colors[term_scalars[s]];
+				if (color >= 0) {
+					used_by[color] = i + 1;
+				}
+			}
+		}
+		int color = 0;
+		while (color < int(used_by.size()) && used_by[color] == i + 1) {
+			color++;
+		}
+		if (color == int(used_by.size())) {
+			used_by.push_back(0);
+		}
+		scalar_colors[i] = color;
+	}
+
+	const auto number_of_colors = used_by.size();
+	color_scalars.assign(number_of_colors, {});
+	color_variables.assign(number_of_colors, {});
+	color_terms.assign(number_of_colors, {});
+	for (size_t var = 0; var < variables.size(); ++var) {
+		if (variables[var].is_constant) {
+			continue;
+		}
+		for (int k = 0; k < variables[var].solver_dimension; ++k) {
+			auto scalar = variables[var].global_index + k;
+			auto color = scalar_colors[scalar];
+			color_scalars[color].push_back(scalar);
+			if (color_variables[color].empty() || color_variables[color].back() != var) {
+				color_variables[color].push_back(var);
+			}
+		}
+	}
+	for (size_t i = 0; i < terms.size(); ++i) {
+		for (auto s = term_scalar_offsets[i]; s < term_scalar_offsets[i + 1]; ++s) {
+			color_terms[scalar_colors[term_scalars[s]]].push_back(i);
+		}
+	}
+
+	this->coloring_allocated = true;
+
+	interface->allocation_time += wall_time() - start_time;
+}
+
+void Function::Implementation::evaluate_terms_from_local_storage(const std::vector<size_t>& term_list,
+                                                                 std::vector<double>* values) const
+{
+	interface->evaluations_without_gradient++;
+
+	values->resize(term_list.size());
+	const std::ptrdiff_t number_of_listed_terms = term_list.size();
+
+	#ifdef USE_OPENMP
+		// Each thread needs to store a specific error.
+		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
+
+		// Short lists are not worth starting threads for.
+		#pragma omp parallel for schedule(static) num_threads(this->number_of_threads) \
+		                         if(number_of_listed_terms >= term_chunk_size)
+	#endif
+	for (std::ptrdiff_t k = 0; k < number_of_listed_terms; ++k) {
+		#ifdef USE_OPENMP
+			// We need to catch all exceptions before leaving
+			// the loop body.
+			try {
+		#endif
+
+		const auto& added_term = terms[term_list[k]];
+		(*values)[k] = 0.0;
+		if (added_term.is_active) {
+			(*values)[k] = added_term.term->evaluate(&added_term.temp_variables[0]);
+		}
+
+		#ifdef USE_OPENMP
+			}
+			catch (...) {
+				evaluation_errors[omp_get_thread_num()] = std::current_exception();
+			}
+		#endif
+	}
+
+	#ifdef USE_OPENMP
+		// Now that we are outside the OpenMP block, we can
+		// rethrow exceptions.
+		for (const auto& error: evaluation_errors) {
+			if ( !(error == std::exception_ptr())) {
+				std::rethrow_exception(error);
+			}
+		}
+	#endif
+}
+
+void Function::Implementation::move_color(const Eigen::VectorXd& x,
+                                          Eigen::VectorXd* y,
+                                          int color,
+                                          double sign,
+                                          double relative_step) const
+{
+	for (auto i: color_scalars[color]) {
+		(*y)[i] = x[i] + sign * finite_difference_step(x[i], relative_step);
+	}
+	for (auto var: color_variables[color]) {
+		copy_variable_to_local(*y, variables[var]);
+	}
+}
+
+double Function::Implementation::evaluate_finite_differences(const Eigen::VectorXd& x,
+                                                             Eigen::VectorXd* gradient,
+                                                             Eigen::MatrixXd* dense_hessian,
+                                                             Eigen::SparseMatrix<double>* sparse_hessian) const
+{
+	if (! this->local_storage_allocated) {
+		this->allocate_local_storage();
+	}
+	if (! this->coloring_allocated) {
+		this->allocate_coloring();
+	}
+
+	double start_time = wall_time();
+
+	const auto n = this->number_of_scalars;
+	const int number_of_colors = static_cast<int>(color_scalars.size());
+	const double eps = std::numeric_limits<double>::epsilon();
+	// Central differences of values and second differences need
+	// different steps.
+	const double gradient_step = std::cbrt(eps);
+	const double hessian_step = std::pow(eps, 0.25);
+
+	// The scalar of a color in a term.
+	auto term_scalar = [this](size_t term, int color) -> size_t
+	{
+		for (auto s = term_scalar_offsets[term]; s < term_scalar_offsets[term + 1]; ++s) {
+			if (scalar_colors[term_scalars[s]] == color) {
+				return term_scalars[s];
+			}
+		}
+		spii_assert(false);
+		return 0;
+	};
+
+	// The point being evaluated. Only the moved scalars differ from
+	// x, and only their variables are copied to the local storage.
+	Eigen::VectorXd y = x;
+	this->copy_global_to_local(x);
+
+	std::vector<size_t> all_terms(terms.size());
+	for (size_t i = 0; i < terms.size(); ++i) {
+		all_terms[i] = i;
+	}
+	std::vector<double> center;
+	this->evaluate_terms_from_local_storage(all_terms, &center);
+	// Summed in term order, so the value does not depend on the
+	// number of threads.
+	double value = this->constant;
+	for (auto term_value: center) {
+		value += term_value;
+	}
+
+	std::vector<double> plus, minus;
+	if (gradient) {
+		gradient->resize(n);
+		gradient->setZero();
+		for (int c = 0; c < number_of_colors; ++c) {
+			move_color(x, &y, c, 1.0, gradient_step);
+			this->evaluate_terms_from_local_storage(color_terms[c], &plus);
+			move_color(x, &y, c, -1.0, gradient_step);
+			this->evaluate_terms_from_local_storage(color_terms[c], &minus);
+			move_color(x, &y, c, 0.0, gradient_step);
+
+			for (size_t k = 0; k < color_terms[c].size(); ++k) {
+				auto i = term_scalar(color_terms[c][k], c);
+				double h = finite_difference_step(x[i], gradient_step);
+				(*gradient)[i] += (plus[k] - minus[k]) / (2.0 * h);
+			}
+		}
+	}
+
+	if (!dense_hessian && !sparse_hessian) {
+		interface->evaluate_time += wall_time() - start_time;
+		return value;
+	}
+
+	SparseHessianStorage triplets;
+	if (dense_hessian) {
+		dense_hessian->resize(n, n);
+		dense_hessian->setZero();
+	}
+	auto add = [&](size_t i, size_t j, double h_ij)
+	{
+		if (dense_hessian) {
+			(*dense_hessian)(i, j) += h_ij;
+			if (i != j) {
+				(*dense_hessian)(j, i) += h_ij;
+			}
+		}
+		else {
+			triplets.emplace_back(int(i), int(j), h_ij);
+			if (i != j) {
+				triplets.emplace_back(int(j), int(i), h_ij);
+			}
+		}
+	};
+
+	// For every color b > a, the terms containing both colors and
+	// their scalars of colors a and b.
+	struct ColorPair
+	{
+		std::vector<size_t> terms;
+		std::vector<std::pair<size_t, size_t>> scalars;
+	};
+	std::vector<ColorPair> pairs(number_of_colors);
+	std::vector<double> plus_plus, plus_minus, minus_plus, minus_minus;
+
+	for (int a = 0; a < number_of_colors; ++a) {
+		// The diagonal from second differences.
+		move_color(x, &y, a, 1.0, hessian_step);
+		this->evaluate_terms_from_local_storage(color_terms[a], &plus);
+		move_color(x, &y, a, -1.0, hessian_step);
+		this->evaluate_terms_from_local_storage(color_terms[a], &minus);
+		move_color(x, &y, a, 0.0, hessian_step);
+
+		for (auto& pair: pairs) {
+			pair.terms.clear();
+			pair.scalars.clear();
+		}
+		for (size_t k = 0; k < color_terms[a].size(); ++k) {
+			auto term = color_terms[a][k];
+			auto i = term_scalar(term, a);
+			double h = finite_difference_step(x[i], hessian_step);
+			add(i, i, (plus[k] - 2.0 * center[term] + minus[k]) / (h * h));
+
+			for (auto s = term_scalar_offsets[term]; s < term_scalar_offsets[term + 1]; ++s) {
+				auto j = term_scalars[s];
+				auto b = scalar_colors[j];
+				if (b > a) {
+					pairs[b].terms.push_back(term);
+					pairs[b].scalars.emplace_back(i, j);
+				}
+			}
+		}
+
+		// The off-diagonal elements from mixed differences of the
+		// colors sharing a term.
+		for (int b = a + 1; b < number_of_colors; ++b) {
+			const auto& pair = pairs[b];
+			if (pair.terms.empty()) {
+				continue;
+			}
+
+			move_color(x, &y, a, 1.0, hessian_step);
+			move_color(x, &y, b, 1.0, hessian_step);
+			this->evaluate_terms_from_local_storage(pair.terms, &plus_plus);
+			move_color(x, &y, b, -1.0, hessian_step);
+			this->evaluate_terms_from_local_storage(pair.terms, &plus_minus);
+			move_color(x, &y, a, -1.0, hessian_step);
+			this->evaluate_terms_from_local_storage(pair.terms, &minus_minus);
+			move_color(x, &y, b, 1.0, hessian_step);
+			this->evaluate_terms_from_local_storage(pair.terms, &minus_plus);
+			move_color(x, &y, a, 0.0, hessian_step);
+			move_color(x, &y, b, 0.0, hessian_step);
+
+			for (size_t k = 0; k < pair.terms.size(); ++k) {
+				auto i = pair.scalars[k].first;
+				auto j = pair.scalars[k].second;
+				double h_i = finite_difference_step(x[i], hessian_step);
+				double h_j = finite_difference_step(x[j], hessian_step);
+				add(i, j, (plus_plus[k] - plus_minus[k] - minus_plus[k] + minus_minus[k])
+				          / (4.0 * h_i * h_j));
+			}
+		}
+	}
+
+	if (sparse_hessian) {
+		sparse_hessian->resize(int(n), int(n));
+		sparse_hessian->setFromTriplets(triplets.begin(), triplets.end());
+	}
+
+	interface->evaluate_with_hessian_time += wall_time() - start_time;
+	return value;
+}
+
 Interval<double> Function::evaluate(const std::vector<Interval<double>>& x) const
 {
 	return impl->evaluate(x);
 }
 
+void Function::Implementation::allocate_interval_storage() const
+{
+	auto start_time = wall_time();
+
+	interval_argument_offsets.resize(terms.size() + 1);
+	interval_argument_indices.clear();
+	for (size_t i = 0; i < terms.size(); ++i) {
+		interval_argument_offsets[i] = interval_argument_indices.size();
+		for (auto var: terms[i].added_variables_indices) {
+			interval_argument_indices.push_back(variables[var].global_index);
+		}
+	}
+	interval_argument_offsets[terms.size()] = interval_argument_indices.size();
+	interval_arguments.resize(interval_argument_indices.size());
+	interval_chunk_values.resize(number_of_deterministic_term_chunks());
+
+	this->interval_storage_allocated = true;
+
+	interface->allocation_time += wall_time() - start_time;
+}
+
 Interval<double>  Function::Implementation::evaluate(const std::vector<Interval<double>>& x) const
 {
 	interface->evaluations_without_gradient++;
+
+	if (! this->interval_storage_allocated) {
+		this->allocate_interval_storage();
+	}
+
 	double start_time = wall_time();
 
-	std::vector<const Interval<double> *> scratch_space;
+	// The lower and upper bounds are summed separately.
+	double lower = 0.0;
+	double upper = 0.0;
+	// Go through and evaluate each term. The terms are processed
+	// in chunks, each of which is summed sequentially.
+	// OpenMP requires a signed data type as the loop variable.
+	#ifdef USE_OPENMP
+		// Each thread needs to store a specific error.
+		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
 
-	Interval<double> value = this->constant;
-	// Go through and evaluate each term.
-	for (int i = 0; i < terms.size(); ++i) {
-		// Evaluate the term.
-		scratch_space.clear();
-		for (auto var: terms[i].added_variables_indices) {
-			auto global_index = variables[var].global_index;
-			scratch_space.push_back(&x[global_index]);
+		#pragma omp parallel for schedule(static) reduction(+ : lower, upper) num_threads(this->number_of_threads)
+	#endif
+	for (std::ptrdiff_t chunk = 0; chunk < number_of_term_chunks(); ++chunk) {
+		#ifdef USE_OPENMP
+			// The thread number calling this iteration.
+			int t = omp_get_thread_num();
+		#endif
+
+		std::ptrdiff_t chunk_end = term_chunk_begin(chunk + 1);
+		Interval<double> chunk_value(0.0);
+		for (std::ptrdiff_t i = term_chunk_begin(chunk); i < chunk_end; ++i) {
+			#ifdef USE_OPENMP
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				try {
+			#endif
+
+			if (! terms[i].is_active) {
+				continue;
+			}
+
+			// Point the term's arguments to x and evaluate it.
+			auto begin = interval_argument_offsets[i];
+			auto end = interval_argument_offsets[i + 1];
+			for (auto a = begin; a < end; ++a) {
+				interval_arguments[a] = &x[interval_argument_indices[a]];
+			}
+			chunk_value += terms[i].term->evaluate_interval(interval_arguments.data() + begin);
+
+			#ifdef USE_OPENMP
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				}
+				catch (...) {
+					evaluation_errors[t] = std::current_exception();
+				}
+			#endif
+		}
+
+		if (this->deterministic) {
+			this->interval_chunk_values[chunk] = chunk_value;
+		}
+		else {
+			lower += chunk_value.get_lower();
+			upper += chunk_value.get_upper();
+		}
+	}
+
+	#ifdef USE_OPENMP
+		// Now that we are outside the OpenMP block, we can
+		// rethrow exceptions.
+		for (auto itr = evaluation_errors.begin(); itr != evaluation_errors.end(); ++itr) {
+			// VS 2010 does not have conversion to bool or
+			// operator !=.
+			if ( !(*itr == std::exception_ptr())) {
+				std::rethrow_exception(*itr);
+			}
+		}
+	#endif
+
+	if (this->deterministic) {
+		for (const auto& chunk_value: this->interval_chunk_values) {
+			lower += chunk_value.get_lower();
+			upper += chunk_value.get_upper();
 		}
-		value += terms[i].term->evaluate_interval(&scratch_space[0]);
 	}
 
+	Interval<double> value = this->constant;
+	value += Interval<double>(lower, upper);
+
 	interface->evaluate_time += wall_time() - start_time;
 	return value;
 }
@@ -1319,17 +3614,17 @@ void Function::read_from_stream(std::istream& in, std::vector<double>* user_spac
 		                    "Files can not be shared between compilers.");
 	}
 
-	unsigned number_of_terms;
+	std::size_t number_of_terms;
 	read_and_check(number_of_terms);
-	unsigned number_of_variables;
+	std::size_t number_of_variables;
 	read_and_check(number_of_variables);
-	unsigned number_of_scalars;
+	std::size_t number_of_scalars;
 	read_and_check(number_of_scalars);
 	read_and_check(impl->constant);
 
 	user_space->resize(number_of_scalars);
-	int current_var = 0;
-	for (unsigned i = 0; i < number_of_variables; ++i) {
+	std::size_t current_var = 0;
+	for (std::size_t i = 0; i < number_of_variables; ++i) {
 		int variable_dimension;
 		read_and_check(variable_dimension);
 		this->add_variable(&user_space->at(current_var), variable_dimension);
@@ -1339,19 +3634,19 @@ void Function::read_from_stream(std::istream& in, std::vector<double>* user_spac
 		throw runtime_error("Function::read_from_stream: Not enough variables in stream.");
 	}
 
-	for (unsigned i = 0; i < number_of_scalars; ++i) {
+	for (std::size_t i = 0; i < number_of_scalars; ++i) {
 		read_and_check(user_space->at(i));
 	}
 
-	for (unsigned i = 0; i < number_of_terms; ++i) {
+	for (std::size_t i = 0; i < number_of_terms; ++i) {
 		std::string term_name;
 		read_and_check(term_name);
-		unsigned term_vars;
+		std::size_t term_vars;
 		read_and_check(term_vars);
 
 		std::vector<double*> arguments;
-		for (unsigned i = 0; i < term_vars; ++i) {
-			int offset;
+		for (std::size_t i = 0; i < term_vars; ++i) {
+			std::size_t offset;
 			read_and_check(offset);
 			arguments.push_back(&user_space->at(offset));
 		}
@@ -1363,4 +3658,4 @@ void Function::read_from_stream(std::istream& in, std::vector<double>* user_spac
 	#undef read_and_check
 }
 
-}  // namespace spii
\ No newline at end of file
+}  // namespace spii
@@ -0,0 +1,23 @@
+#include <spii/function_view.h>
+
+namespace spii {
+
+FunctionView::FunctionView(const Function& parent, const std::vector<TermHandle>& term_handles_)
+	: term_handles(term_handles_)
+{
+	function.add_term_subset(parent, term_handles);
+}
+
+FunctionView::FunctionView(const Function& parent, const std::vector<bool>& term_mask)
+{
+	check(term_mask.size() == parent.get_number_of_terms(),
+	      "FunctionView: the mask does not match the number of terms.");
+	for (size_t i = 0; i < term_mask.size(); ++i) {
+		if (term_mask[i]) {
+			term_handles.push_back(parent.get_term_handle(i));
+		}
+	}
+	function.add_term_subset(parent, term_handles);
+}
+
+}  // namespace spii
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include <spii/mapped_file.h>
+
+namespace spii {
+
+class MappedFile::Implementation
+{
+public:
+	const char* data = nullptr;
+	std::size_t size = 0;
+
+	#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+	#else
+		int file = -1;
+		std::size_t page_size = 4096;
+	#endif
+
+	void close();
+};
+
+void MappedFile::Implementation::close()
+{
+	#ifdef _WIN32
+		if (data != nullptr) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping != nullptr) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+	#else
+		if (data != nullptr) {
+			munmap(const_cast<char*>(data), size);
+		}
+		if (file >= 0) {
+			::close(file);
+		}
+	#endif
+}
+
+MappedFile::MappedFile(const std::string& filename)
+	: impl(new Implementation)
+{
+	try {
+		#ifdef _WIN32
+			impl->file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+			                         nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			check(impl->file != INVALID_HANDLE_VALUE, "MappedFile: Could not open ", filename, ".");
+			LARGE_INTEGER file_size;
+			check(GetFileSizeEx(impl->file, &file_size) != 0, "MappedFile: Could not get size of ", filename, ".");
+			impl->size = static_cast<std::size_t>(file_size.QuadPart);
+			if (impl->size > 0) {
+				impl->mapping = CreateFileMappingA(impl->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				check(impl->mapping != nullptr, "MappedFile: Could not map ", filename, ".");
+				impl->data = static_cast<const char*>(MapViewOfFile(impl->mapping, FILE_MAP_READ, 0, 0, 0));
+				check(impl->data != nullptr, "MappedFile: Could not map ", filename, ".");
+			}
+		#else
+			impl->page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+			impl->file = open(filename.c_str(), O_RDONLY);
+			check(impl->file >= 0, "MappedFile: Could not open ", filename, ".");
+			struct stat file_status;
+			check(fstat(impl->file, &file_status) == 0, "MappedFile: Could not get size of ", filename, ".");
+			impl->size = static_cast<std::size_t>(file_status.st_size);
+			if (impl->size > 0) {
+				void* data = mmap(nullptr, impl->size, PROT_READ, MAP_SHARED, impl->file, 0);
+				check(data != MAP_FAILED, "MappedFile: Could not map ", filename, ".");
+				impl->data = static_cast<const char*>(data);
+			}
+		#endif
+	}
+	catch (...) {
+		impl->close();
+		delete impl;
+		throw;
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	impl->close();
+	delete impl;
+}
+
+std::size_t MappedFile::size() const
+{
+	return impl->size;
+}
+
+const char* MappedFile::data() const
+{
+	return impl->data;
+}
+
+void MappedFile::will_need(std::size_t offset, std::size_t length) const
+{
+	#ifndef _WIN32
+		if (offset >= impl->size || length == 0) {
+			return;
+		}
+		length = std::min(length, impl->size - offset);
+		// madvise requires a page-aligned address.
+		auto begin = offset - offset % impl->page_size;
+		madvise(const_cast<char*>(impl->data) + begin, offset + length - begin, MADV_WILLNEED);
+	#endif
+}
+
+void MappedFile::dont_need(std::size_t offset, std::size_t length) const
+{
+	#ifndef _WIN32
+		if (offset >= impl->size || length == 0) {
+			return;
+		}
+		length = std::min(length, impl->size - offset);
+		// Only release pages entirely within the range, since the
+		// pages at the boundaries may still be used by someone else.
+		auto begin = (offset + impl->page_size - 1) / impl->page_size * impl->page_size;
+		auto end = (offset + length) / impl->page_size * impl->page_size;
+		if (offset + length == impl->size) {
+			end = begin < impl->size ? impl->size : begin;
+		}
+		if (begin < end) {
+			madvise(const_cast<char*>(impl->data) + begin, end - begin, MADV_DONTNEED);
+		}
+	#endif
+}
+
+}  // namespace spii
@@ -0,0 +1,58 @@
+#include <stdexcept>
+
+#include <spii/residual_term.h>
+
+namespace spii
+{
+
+double ResidualTerm::evaluate(double * const * const variables) const
+{
+	Eigen::VectorXd r(number_of_residuals());
+	evaluate_residuals(variables, r.data(), nullptr);
+	return 0.5 * r.squaredNorm();
+}
+
+double ResidualTerm::evaluate(double * const * const variables,
+                              std::vector<Eigen::VectorXd>* gradient) const
+{
+	Eigen::VectorXd r(number_of_residuals());
+	std::vector<Eigen::MatrixXd> jacobian(number_of_variables());
+	evaluate_residuals(variables, r.data(), &jacobian);
+
+	// The vectors may be longer than the variables.
+	for (int var = 0; var < number_of_variables(); ++var) {
+		(*gradient)[var].head(variable_dimension(var)) = jacobian[var].transpose() * r;
+	}
+	return 0.5 * r.squaredNorm();
+}
+
+double ResidualTerm::evaluate(double * const * const variables,
+                              std::vector<Eigen::VectorXd>* gradient,
+                              std::vector< std::vector<Eigen::MatrixXd> >* hessian) const
+{
+	throw std::runtime_error("ResidualTerm: the exact Hessian is not implemented. "
+	                         "Use Function::gauss_newton_hessian for J^T J.");
+}
+
+double ResidualTerm::evaluate_gauss_newton(double * const * const variables,
+                                           std::vector<Eigen::VectorXd>* gradient,
+                                           std::vector< std::vector<Eigen::MatrixXd> >* hessian) const
+{
+	Eigen::VectorXd r(number_of_residuals());
+	std::vector<Eigen::MatrixXd> jacobian(number_of_variables());
+	evaluate_residuals(variables, r.data(), &jacobian);
+
+	// The vectors and matrices may be larger than the variables.
+	for (int var0 = 0; var0 < number_of_variables(); ++var0) {
+		const int dim0 = variable_dimension(var0);
+		(*gradient)[var0].head(dim0) = jacobian[var0].transpose() * r;
+		for (int var1 = 0; var1 < number_of_variables(); ++var1) {
+			const int dim1 = variable_dimension(var1);
+			(*hessian)[var0][var1].topLeftCorner(dim0, dim1) =
+				jacobian[var0].transpose() * jacobian[var1];
+		}
+	}
+	return 0.5 * r.squaredNorm();
+}
+
+}  // namespace spii
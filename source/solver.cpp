@@ -1,7 +1,12 @@
 // Petter Strandmark 2012–2013.
 
+#include <exception>
 #include <stdexcept>
 
+#ifdef USE_OPENMP
+	#include <omp.h>
+#endif
+
 #include <spii/solver.h>
 
 namespace spii {
@@ -51,6 +56,116 @@ Solver::Solver()
 Solver::~Solver()
 { }
 
+void Solver::solve_components(const Function& function,
+                              SolverResults* results,
+                              std::vector<SolverResults>* component_results) const
+{
+	double start_time = wall_time();
+
+	auto components = function.get_connected_components();
+	std::vector<SolverResults> all_results(components.size());
+
+	// The components are solved in parallel, so every component
+	// is evaluated by a single thread.
+	if (components.size() > 1) {
+		for (auto& component: components) {
+			component.set_number_of_threads(1);
+		}
+	}
+
+	#ifdef USE_OPENMP
+		// Each thread needs to store a specific error.
+		std::vector<std::exception_ptr> solve_errors(omp_get_max_threads());
+
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+	for (std::ptrdiff_t c = 0; c < std::ptrdiff_t(components.size()); ++c) {
+		#ifdef USE_OPENMP
+			// We need to catch all exceptions before leaving
+			// the loop body.
+			try {
+		#endif
+
+		this->solve(components[c], &all_results[c]);
+
+		#ifdef USE_OPENMP
+			}
+			catch (...) {
+				solve_errors[omp_get_thread_num()] = std::current_exception();
+			}
+		#endif
+	}
+
+	#ifdef USE_OPENMP
+		for (const auto& error: solve_errors) {
+			if ( !(error == std::exception_ptr())) {
+				std::rethrow_exception(error);
+			}
+		}
+	#endif
+
+	if (all_results.empty()) {
+		results->exit_condition = SolverResults::FUNCTION_TOLERANCE;
+	}
+	else {
+		results->exit_condition = all_results[0].exit_condition;
+		results->optimum_lower = 0;
+		results->optimum_upper = 0;
+	}
+	for (const auto& component: all_results) {
+		if ( ! component.exit_success() && results->exit_success()) {
+			results->exit_condition = component.exit_condition;
+		}
+		results->startup_time              += component.startup_time;
+		results->function_evaluation_time  += component.function_evaluation_time;
+		results->stopping_criteria_time    += component.stopping_criteria_time;
+		results->matrix_factorization_time += component.matrix_factorization_time;
+		results->lbfgs_update_time         += component.lbfgs_update_time;
+		results->linear_solver_time        += component.linear_solver_time;
+		results->backtracking_time         += component.backtracking_time;
+		results->log_time                  += component.log_time;
+		results->optimum_lower             += component.optimum_lower;
+		results->optimum_upper             += component.optimum_upper;
+	}
+	results->total_time += wall_time() - start_time;
+
+	if (component_results) {
+		*component_results = std::move(all_results);
+	}
+}
+
+MemoryUsage Solver::estimate_memory_usage(const Function& function) const
+{
+	auto usage = function.estimate_memory_usage(Function::NO_HESSIAN);
+	// The current point, the gradient, the search direction and
+	// scratch space for the line search.
+	usage.add("Solver vectors", 5 * function.get_number_of_scalars() * sizeof(double));
+	return usage;
+}
+
+void Solver::apply_memory_budget(const Function& function,
+                                 const MemoryUsage& solver_usage,
+                                 Function::HessianStorage hessian_storage,
+                                 Function::SettingsScope* function_settings) const
+{
+	if (this->memory_budget == 0) {
+		return;
+	}
+
+	auto solver_bytes = solver_usage.total();
+	std::size_t function_budget = 0;
+	if (solver_bytes < this->memory_budget) {
+		function_budget = this->memory_budget - solver_bytes;
+	}
+
+	if (! function_settings->fit_to_memory_budget(function_budget, hessian_storage) &&
+	    this->log_function) {
+		auto needed = solver_bytes + function.estimate_memory_usage(hessian_storage).total();
+		this->log_function(to_string("Memory budget of ", this->memory_budget,
+		                             " bytes is too small; ", needed, " bytes are needed."));
+	}
+}
+
 
 }  // namespace spii
 
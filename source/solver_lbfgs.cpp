@@ -11,6 +11,23 @@
 
 namespace spii {
 
+MemoryUsage LBFGSSolver::solver_memory_usage(const Function& function, int history_size) const
+{
+	MemoryUsage usage;
+	auto n = function.get_number_of_scalars();
+	// x, g, x2, q, r, x_prev, s_tmp, y_tmp and the line search.
+	usage.add("Solver vectors", 10 * n * sizeof(double));
+	usage.add("L-BFGS history", history_size * (2 * n + 2) * sizeof(double));
+	return usage;
+}
+
+MemoryUsage LBFGSSolver::estimate_memory_usage(const Function& function) const
+{
+	auto usage = solver_memory_usage(function, this->lbfgs_history_size);
+	usage.add(function.estimate_memory_usage(Function::NO_HESSIAN));
+	return usage;
+}
+
 void LBFGSSolver::solve(const Function& function,
                         SolverResults* results) const
 {
@@ -31,6 +48,30 @@ void LBFGSSolver::solve(const Function& function,
 	double normg  = std::numeric_limits<double>::quiet_NaN();
 	double normdx = std::numeric_limits<double>::quiet_NaN();
 
+	// Fit the solver and the function in the memory budget. The
+	// function may use fewer threads before the history is shortened.
+	// Only the chosen configuration is applied to the function.
+	Function::SettingsScope function_settings(function);
+	int history_size = this->lbfgs_history_size;
+	if (this->memory_budget > 0) {
+		while (history_size > 1) {
+			auto solver_bytes = solver_memory_usage(function, history_size).total();
+			if (solver_bytes <= this->memory_budget &&
+			    function.fits_memory_budget(this->memory_budget - solver_bytes, Function::NO_HESSIAN)) {
+				break;
+			}
+			history_size--;
+		}
+		if (history_size < this->lbfgs_history_size && this->log_function) {
+			this->log_function(to_string("Using L-BFGS history size ", history_size,
+			                             " to fit the memory budget."));
+		}
+		this->apply_memory_budget(function,
+		                          solver_memory_usage(function, history_size),
+		                          Function::NO_HESSIAN,
+		                          &function_settings);
+	}
+
 	Eigen::VectorXd x, g;
 
 	// Copy the user state to the current point.
@@ -38,11 +79,11 @@ void LBFGSSolver::solve(const Function& function,
 	Eigen::VectorXd x2(n);
 
 	// L-BFGS history.
-	std::vector<Eigen::VectorXd>  s_data(this->lbfgs_history_size),
-	                              y_data(this->lbfgs_history_size);
-	std::vector<Eigen::VectorXd*> s(this->lbfgs_history_size),
-	                              y(this->lbfgs_history_size);
-	for (int h = 0; h < this->lbfgs_history_size; ++h) {
+	std::vector<Eigen::VectorXd>  s_data(history_size),
+	                              y_data(history_size);
+	std::vector<Eigen::VectorXd*> s(history_size),
+	                              y(history_size);
+	for (int h = 0; h < history_size; ++h) {
 		s_data[h].resize(function.get_number_of_scalars());
 		s_data[h].setZero();
 		y_data[h].resize(function.get_number_of_scalars());
@@ -51,10 +92,10 @@ void LBFGSSolver::solve(const Function& function,
 		y[h] = &y_data[h];
 	}
 
-	Eigen::VectorXd rho(this->lbfgs_history_size);
+	Eigen::VectorXd rho(history_size);
 	rho.setZero();
 
-	Eigen::VectorXd alpha(this->lbfgs_history_size);
+	Eigen::VectorXd alpha(history_size);
 	alpha.setZero();
 	Eigen::VectorXd q(n);
 	Eigen::VectorXd r(n);
@@ -64,6 +105,38 @@ void LBFGSSolver::solve(const Function& function,
 
 	CheckExitConditionsCache exit_condition_cache;
 
+	// Removes all pairs from the L-BFGS history.
+	auto clear_history = [&]()
+	{
+		for (int h = 0; h < history_size; ++h) {
+			(*s[h]).setZero();
+			(*y[h]).setZero();
+		}
+		rho.setZero();
+		alpha.setZero();
+	};
+
+	// Evaluate in single precision until close to convergence. The
+	// precision is restored by function_settings.
+	if (this->mixed_precision) {
+		function.single_precision = true;
+	}
+	// Switches to double precision and discards the history, which
+	// was computed from single-precision gradients. Returns false if
+	// there was nothing to switch.
+	auto switch_to_double_precision = [&]() -> bool
+	{
+		if (! this->mixed_precision || ! function.single_precision) {
+			return false;
+		}
+		function.single_precision = false;
+		clear_history();
+		if (this->log_function) {
+			this->log_function("Switching to double precision.");
+		}
+		return true;
+	};
+
 	//
 	// START MAIN ITERATION
 	//
@@ -106,9 +179,9 @@ void LBFGSSolver::solve(const Function& function,
 			double sTy = s_tmp.dot(y_tmp);
 			if (sTy > 1e-16) {
 				// Shift all pointers one step back, discarding the oldest one.
-				Eigen::VectorXd* sh = s[this->lbfgs_history_size - 1];
-				Eigen::VectorXd* yh = y[this->lbfgs_history_size - 1];
-				for (int h = this->lbfgs_history_size - 1; h >= 1; --h) {
+				Eigen::VectorXd* sh = s[history_size - 1];
+				Eigen::VectorXd* yh = y[history_size - 1];
+				for (int h = history_size - 1; h >= 1; --h) {
 					s[h]   = s[h - 1];
 					y[h]   = y[h - 1];
 					rho[h] = rho[h - 1];
@@ -129,10 +202,19 @@ void LBFGSSolver::solve(const Function& function,
 		// Test stopping criteriea
 		//
 		start_time = wall_time();
-		if (iter > 1 && this->check_exit_conditions(fval, fprev, normg,
-		                                            normg0, x.norm(), normdx,
-		                                            last_iteration_successful, 
-		                                            &exit_condition_cache, results)) {
+		bool should_exit = iter > 1 && this->check_exit_conditions(fval, fprev, normg,
+		                                                           normg0, x.norm(), normdx,
+		                                                           last_iteration_successful,
+		                                                           &exit_condition_cache, results);
+		if ((should_exit || normg / normg0 < this->mixed_precision_tolerance) &&
+		    switch_to_double_precision()) {
+			// Evaluate again at the same point in double precision,
+			// starting over with an empty history.
+			last_iteration_successful = false;
+			results->stopping_criteria_time += wall_time() - start_time;
+			continue;
+		}
+		if (should_exit) {
 			break;
 		}
 		if (iter >= this->maximum_iterations) {
@@ -178,14 +260,14 @@ void LBFGSSolver::solve(const Function& function,
 
 		q = -g;
 
-		for (int h = 0; h < this->lbfgs_history_size; ++h) {
+		for (int h = 0; h < history_size; ++h) {
 			alpha[h] = rho[h] * s[h]->dot(q);
 			q = q - alpha[h] * (*y[h]);
 		}
 
 		r = H0 * q;
 
-		for (int h = this->lbfgs_history_size - 1; h >= 0; --h) {
+		for (int h = history_size - 1; h >= 0; --h) {
 			double beta = rho[h] * y[h]->dot(r);
 			r = r + (*s[h]) * (alpha[h] - beta);
 		}
@@ -218,12 +300,7 @@ void LBFGSSolver::solve(const Function& function,
 				number_of_restarts++;
 			}
 			r = -g;
-			for (int h = 0; h < this->lbfgs_history_size; ++h) {
-				(*s[h]).setZero();
-				(*y[h]).setZero();
-			}
-			rho.setZero();
-			alpha.setZero();
+			clear_history();
 			// H0 is not used, but its value will be printed.
 			H0 = std::numeric_limits<double>::quiet_NaN();
 		}
@@ -255,7 +332,11 @@ void LBFGSSolver::solve(const Function& function,
 					iter, fval, std::fabs(fval - fprev), normg, alpha_step, H0, rho[0]);
 				this->log_function(str);
 			}
-			if (! last_iteration_successful || number_of_line_search_failures++ > 10) {
+			// The line search may also fail because of the limited
+			// precision of single-precision evaluation.
+			bool switched_precision = switch_to_double_precision();
+			if ( ! switched_precision &&
+			    (! last_iteration_successful || number_of_line_search_failures++ > 10)) {
 				// This happens quite seldom. Every time it has happened, the function
 				// was actually converged to a solution.
 				results->exit_condition = SolverResults::GRADIENT_TOLERANCE;
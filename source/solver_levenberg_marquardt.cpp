@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <memory>
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+#include <spii/spii.h>
+#include <spii/solver.h>
+
+namespace spii {
+
+bool LevenbergMarquardtSolver::use_sparse_hessian(const Function& function) const
+{
+	if (this->sparsity_mode == DENSE) {
+		return false;
+	}
+	else if (this->sparsity_mode == SPARSE) {
+		return true;
+	}
+
+	bool use_sparsity = function.get_number_of_scalars() > 50;
+	if (this->memory_budget > 0) {
+		// Use the other storage if it is needed to fit the budget.
+		auto total_memory = [&](bool sparse) -> std::size_t
+		{
+			auto usage = solver_memory_usage(function, sparse);
+			usage.add(function.estimate_memory_usage(sparse ? Function::SPARSE_HESSIAN
+			                                                : Function::DENSE_HESSIAN));
+			return usage.total();
+		};
+		if (total_memory(use_sparsity) > this->memory_budget &&
+		    total_memory(! use_sparsity) < total_memory(use_sparsity)) {
+			use_sparsity = ! use_sparsity;
+		}
+	}
+	return use_sparsity;
+}
+
+MemoryUsage LevenbergMarquardtSolver::solver_memory_usage(const Function& function,
+                                                          bool use_sparsity) const
+{
+	MemoryUsage usage;
+	std::size_t n = function.get_number_of_scalars();
+	// x, g, x2, p and the diagonals of H and D.
+	usage.add("Solver vectors", 6 * n * sizeof(double));
+
+	if (use_sparsity) {
+		// Upper bound on the number of non-zeros in H.
+		std::size_t nnz = 0;
+		if (function.get_number_of_terms() > 0) {
+			for (const auto& added_term: function.terms()) {
+				std::size_t term_size = 0;
+				for (int var = 0; var < added_term.term->number_of_variables(); ++var) {
+					term_size += added_term.term->variable_dimension(var);
+				}
+				nnz += term_size * term_size;
+			}
+		}
+		nnz = std::min(nnz, n * n);
+		std::size_t sparse_matrix = nnz * (sizeof(double) + sizeof(int)) + (n + 1) * sizeof(int);
+		usage.add("Hessian", sparse_matrix);
+		// The fill-in is not known before the factorization is
+		// analyzed. The factor is assumed to be as large as H.
+		usage.add("Factorization", sparse_matrix + 2 * n * sizeof(int));
+	}
+	else {
+		usage.add("Hessian", n * n * sizeof(double));
+		usage.add("Factorization", n * n * sizeof(double));
+	}
+	return usage;
+}
+
+MemoryUsage LevenbergMarquardtSolver::estimate_memory_usage(const Function& function) const
+{
+	bool use_sparsity = use_sparse_hessian(function);
+	auto usage = solver_memory_usage(function, use_sparsity);
+	usage.add(function.estimate_memory_usage(use_sparsity ? Function::SPARSE_HESSIAN
+	                                                      : Function::DENSE_HESSIAN));
+	return usage;
+}
+
+void LevenbergMarquardtSolver::solve(const Function& function,
+                                     SolverResults* results) const
+{
+	double global_start_time = wall_time();
+
+	// Dimension of problem.
+	size_t n = function.get_number_of_scalars();
+
+	if (n == 0) {
+		results->exit_condition = SolverResults::FUNCTION_TOLERANCE;
+		return;
+	}
+
+	check(this->minimum_damping > 0 && this->minimum_damping <= this->initial_damping &&
+	      this->initial_damping <= this->maximum_damping,
+	      "LevenbergMarquardtSolver: invalid damping range.");
+
+	bool use_sparsity = use_sparse_hessian(function);
+	Function::SettingsScope function_settings(function);
+	this->apply_memory_budget(function,
+	                          solver_memory_usage(function, use_sparsity),
+	                          use_sparsity ? Function::SPARSE_HESSIAN : Function::DENSE_HESSIAN,
+	                          &function_settings);
+
+	// The Hessians of residual terms only need the Jacobians of the
+	// residuals. The setting is restored by function_settings.
+	function.gauss_newton_hessian = true;
+
+	// Current point, gradient and Hessian.
+	double fval   = std::numeric_limits<double>::quiet_NaN();
+	double fprev  = std::numeric_limits<double>::quiet_NaN();
+	double normg0 = std::numeric_limits<double>::quiet_NaN();
+	double normg  = std::numeric_limits<double>::quiet_NaN();
+	double normdx = std::numeric_limits<double>::quiet_NaN();
+
+	Eigen::VectorXd x, g;
+	Eigen::MatrixXd H;
+	Eigen::SparseMatrix<double> sparse_H;
+	if (use_sparsity) {
+		// Create sparsity pattern for H.
+		function.create_sparse_hessian(&sparse_H);
+		if (this->log_function) {
+			double nnz = double(sparse_H.nonZeros()) / double(n * n);
+			char str[1024];
+			std::sprintf(str, "H is %dx%d with %d (%.5f%%) non-zeroes.",
+				sparse_H.rows(), sparse_H.cols(), sparse_H.nonZeros(), 100.0 * nnz);
+			this->log_function(str);
+		}
+	}
+
+	// Copy the user state to the current point.
+	function.copy_user_to_global(&x);
+	Eigen::VectorXd x2(n);
+
+	// p will store the step.
+	Eigen::VectorXd p(n);
+
+	// Dense and sparse Cholesky factorizers.
+	typedef Eigen::LLT<Eigen::MatrixXd> LLT;
+	typedef Eigen::SimplicialLLT<Eigen::SparseMatrix<double> > SparseLLT;
+	std::unique_ptr<LLT> factorization;
+	std::unique_ptr<SparseLLT> sparse_factorization;
+	if (!use_sparsity) {
+		factorization.reset(new LLT(n));
+	}
+	else {
+		sparse_factorization.reset(new SparseLLT);
+		// The sparsity pattern of H is always the same. Therefore, it is enough
+		// to analyze it once.
+		sparse_factorization->analyzePattern(sparse_H);
+	}
+
+	// The damping and the factor it is increased with after a
+	// rejected step (Nielsen's update).
+	double lambda = this->initial_damping;
+	double nu = 2.0;
+
+	CheckExitConditionsCache exit_condition_cache;
+
+	//
+	// START MAIN ITERATION
+	//
+	results->startup_time   += wall_time() - global_start_time;
+	results->exit_condition = SolverResults::INTERNAL_ERROR;
+	int iter = 0;
+	while (true) {
+
+		int log_interval = 1;
+		if (iter > 30) {
+			log_interval = 10;
+		}
+		if (iter > 200) {
+			log_interval = 100;
+		}
+		if (iter > 2000) {
+			log_interval = 1000;
+		}
+
+		//
+		// Evaluate function and derivatives.
+		//
+		double start_time = wall_time();
+		if (use_sparsity) {
+			fval = function.evaluate(x, &g, &sparse_H);
+		}
+		else {
+			fval = function.evaluate(x, &g, &H);
+		}
+
+		normg = std::max(g.maxCoeff(), -g.minCoeff());
+		if (iter == 0) {
+			normg0 = normg;
+		}
+
+		// Check for NaN.
+		if (normg != normg) {
+			results->exit_condition = SolverResults::FUNCTION_NAN;
+			break;
+		}
+
+		results->function_evaluation_time += wall_time() - start_time;
+
+		//
+		// Test stopping criteriea
+		//
+		start_time = wall_time();
+		if (this->check_exit_conditions(fval, fprev, normg,
+			                            normg0, x.norm(), normdx,
+			                            true, &exit_condition_cache, results)) {
+			break;
+		}
+		if (iter >= this->maximum_iterations) {
+			results->exit_condition = SolverResults::NO_CONVERGENCE;
+			break;
+		}
+		if (this->callback_function) {
+			CallbackInformation information;
+			information.objective_value = fval;
+			information.x = &x;
+			information.g = &g;
+			if (use_sparsity) {
+				information.H_sparse = &sparse_H;
+			}
+			else {
+				information.H_dense = &H;
+			}
+
+			if (!callback_function(information)) {
+				results->exit_condition = SolverResults::USER_ABORT;
+				break;
+			}
+		}
+		results->stopping_criteria_time += wall_time() - start_time;
+
+		//
+		// Solve the damped system, increasing the damping until the
+		// function decreases.
+		//
+		Eigen::VectorXd dH;
+		if (use_sparsity) {
+			dH = sparse_H.diagonal();
+		}
+		else {
+			dH = H.diagonal();
+		}
+		Eigen::VectorXd D = dH.cwiseMax(this->minimum_diagonal);
+
+		int factorizations = 0;
+		double rho = std::numeric_limits<double>::quiet_NaN();
+		bool step_accepted = false;
+		while (lambda <= this->maximum_damping) {
+			start_time = wall_time();
+			for (size_t i = 0; i < n; ++i) {
+				if (use_sparsity) {
+					int ii = static_cast<int>(i);
+					sparse_H.coeffRef(ii, ii) = dH(i) + lambda * D(i);
+				}
+				else {
+					H(i, i) = dH(i) + lambda * D(i);
+				}
+			}
+
+			// Attempt Cholesky factorization. It may fail if some
+			// terms contribute indefinite Hessians.
+			bool success;
+			if (use_sparsity) {
+				sparse_factorization->factorize(sparse_H);
+				success = sparse_factorization->info() == Eigen::Success;
+			}
+			else {
+				factorization->compute(H);
+				success = factorization->info() == Eigen::Success;
+			}
+			factorizations++;
+			results->matrix_factorization_time += wall_time() - start_time;
+
+			if (success) {
+				start_time = wall_time();
+				if (use_sparsity) {
+					p = sparse_factorization->solve(-g);
+				}
+				else {
+					p = factorization->solve(-g);
+				}
+				results->linear_solver_time += wall_time() - start_time;
+
+				start_time = wall_time();
+				x2 = x + p;
+				double f2 = function.evaluate(x2);
+
+				// The decrease predicted by the quadratic model with
+				// the undamped Hessian. Since (H + lambda D) p = -g, it
+				// equals 0.5 p^T (lambda D p - g).
+				double predicted = 0.5 * (lambda * p.dot(D.cwiseProduct(p)) - g.dot(p));
+				rho = (fval - f2) / predicted;
+				results->backtracking_time += wall_time() - start_time;
+
+				if (f2 == f2 && predicted > 0 && rho > 0) {
+					step_accepted = true;
+					lambda *= std::max(1.0 / 3.0, 1.0 - std::pow(2.0 * rho - 1.0, 3));
+					lambda = std::max(lambda, this->minimum_damping);
+					nu = 2.0;
+					break;
+				}
+			}
+
+			lambda *= nu;
+			nu *= 2.0;
+		}
+
+		if (! step_accepted) {
+			if (this->log_function) {
+				this->log_function("No step found with the maximum damping.");
+			}
+			// The function could not be decreased even with tiny
+			// steps. As for line search failures, the function has
+			// almost always converged when this happens.
+			results->exit_condition = SolverResults::GRADIENT_TOLERANCE;
+			break;
+		}
+
+		// Record length of this step.
+		normdx = p.norm();
+		// Update current point.
+		x.swap(x2);
+		// Take the next step in the tangent spaces at x.
+		function.recenter(&x);
+
+		//
+		// Log the results of this iteration.
+		//
+		start_time = wall_time();
+
+		if (this->log_function && iter % log_interval == 0) {
+			char str[1024];
+			if (iter == 0) {
+				this->log_function("Itr        f        max|g_i|   lambda     rho     fac");
+			}
+			std::sprintf(str, "%4d %+10.6e %9.3e %9.3e %+9.2e %3d",
+				iter, fval, normg, lambda, rho, factorizations);
+			this->log_function(str);
+		}
+		results->log_time += wall_time() - start_time;
+
+		fprev = fval;
+		iter++;
+	}
+
+	function.copy_global_to_user(x);
+	results->total_time += wall_time() - global_start_time;
+
+	if (this->log_function) {
+		char str[1024];
+		std::sprintf(str, " end %+10.6e %.3e", fval, normg);
+		this->log_function(str);
+	}
+}
+
+}  // namespace spii
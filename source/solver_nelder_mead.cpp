@@ -76,6 +76,25 @@ void initialize_simplex(const Function& function,
 	std::sort(simplex->begin(), simplex->end());
 }
 
+namespace
+{
+	MemoryUsage simplex_memory_usage(std::size_t n)
+	{
+		MemoryUsage usage;
+		// The n + 1 points of the simplex and the mean, reflection,
+		// expansion and contraction points.
+		usage.add("Simplex", (n + 5) * (n * sizeof(double) + sizeof(SimplexPoint)));
+		return usage;
+	}
+}
+
+MemoryUsage NelderMeadSolver::estimate_memory_usage(const Function& function) const
+{
+	auto usage = simplex_memory_usage(function.get_number_of_scalars());
+	usage.add(function.estimate_memory_usage(Function::NO_HESSIAN));
+	return usage;
+}
+
 void NelderMeadSolver::solve(const Function& function,
                              SolverResults* results) const
 {
@@ -89,6 +108,12 @@ void NelderMeadSolver::solve(const Function& function,
 		return;
 	}
 
+	Function::SettingsScope function_settings(function);
+	this->apply_memory_budget(function,
+	                          simplex_memory_usage(n),
+	                          Function::NO_HESSIAN,
+	                          &function_settings);
+
 	// The Nelder-Mead simplex.
 	std::vector<SimplexPoint> simplex(n + 1);
 
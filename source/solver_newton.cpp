@@ -1,5 +1,6 @@
 // Petter Strandmark 2012.
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <limits>
@@ -22,6 +23,83 @@
 
 namespace spii {
 
+bool NewtonSolver::use_sparse_hessian(const Function& function) const
+{
+	if (this->sparsity_mode == DENSE) {
+		return false;
+	}
+	else if (this->sparsity_mode == SPARSE) {
+		return true;
+	}
+
+	bool use_sparsity = function.get_number_of_scalars() > 50;
+	if (this->memory_budget > 0) {
+		// Use the other storage if it is needed to fit the budget.
+		auto total_memory = [&](bool sparse) -> std::size_t
+		{
+			auto usage = solver_memory_usage(function, sparse);
+			usage.add(function.estimate_memory_usage(sparse ? Function::SPARSE_HESSIAN
+			                                                : Function::DENSE_HESSIAN));
+			return usage.total();
+		};
+		if (total_memory(use_sparsity) > this->memory_budget &&
+		    total_memory(! use_sparsity) < total_memory(use_sparsity)) {
+			use_sparsity = ! use_sparsity;
+		}
+	}
+	return use_sparsity;
+}
+
+MemoryUsage NewtonSolver::solver_memory_usage(const Function& function, bool use_sparsity) const
+{
+	MemoryUsage usage;
+	std::size_t n = function.get_number_of_scalars();
+	// x, g, x2, p, the diagonal of H and the line search.
+	usage.add("Solver vectors", 7 * n * sizeof(double));
+
+	if (use_sparsity) {
+		// Upper bound on the number of non-zeros in H.
+		std::size_t nnz = 0;
+		if (function.get_number_of_terms() > 0) {
+			for (const auto& added_term: function.terms()) {
+				std::size_t term_size = 0;
+				for (int var = 0; var < added_term.term->number_of_variables(); ++var) {
+					term_size += added_term.term->variable_dimension(var);
+				}
+				nnz += term_size * term_size;
+			}
+		}
+		nnz = std::min(nnz, n * n);
+		std::size_t sparse_matrix = nnz * (sizeof(double) + sizeof(int)) + (n + 1) * sizeof(int);
+		usage.add("Hessian", sparse_matrix);
+		// The fill-in is not known before the factorization is
+		// analyzed. The factor is assumed to be as large as H.
+		usage.add("Factorization", sparse_matrix + 2 * n * sizeof(int));
+	}
+	else {
+		usage.add("Hessian", n * n * sizeof(double));
+		if (this->factorization_method == BKP) {
+			// Meschach matrix, two permutations and two vectors.
+			usage.add("Factorization", n * n * sizeof(double) +
+			                           2 * n * sizeof(unsigned) +
+			                           2 * n * sizeof(double));
+		}
+		else {
+			usage.add("Factorization", n * n * sizeof(double));
+		}
+	}
+	return usage;
+}
+
+MemoryUsage NewtonSolver::estimate_memory_usage(const Function& function) const
+{
+	bool use_sparsity = use_sparse_hessian(function);
+	auto usage = solver_memory_usage(function, use_sparsity);
+	usage.add(function.estimate_memory_usage(use_sparsity ? Function::SPARSE_HESSIAN
+	                                                      : Function::DENSE_HESSIAN));
+	return usage;
+}
+
 void NewtonSolver::solve(const Function& function,
                          SolverResults* results) const
 {
@@ -42,21 +120,12 @@ void NewtonSolver::solve(const Function& function,
 
 	// Determine whether to use sparse representation
 	// and matrix factorization.
-	bool use_sparsity;
-	if (this->sparsity_mode == DENSE) {
-		use_sparsity = false;
-	}
-	else if (this->sparsity_mode == SPARSE) {
-		use_sparsity = true;
-	}
-	else {
-		if (n <= 50) {
-			use_sparsity = false;
-		}
-		else {
-			use_sparsity = true;
-		}
-	}
+	bool use_sparsity = use_sparse_hessian(function);
+	Function::SettingsScope function_settings(function);
+	this->apply_memory_budget(function,
+	                          solver_memory_usage(function, use_sparsity),
+	                          use_sparsity ? Function::SPARSE_HESSIAN : Function::DENSE_HESSIAN,
+	                          &function_settings);
 
 	// Current point, gradient and Hessian.
 	double fval   = std::numeric_limits<double>::quiet_NaN();;
@@ -92,8 +161,15 @@ void NewtonSolver::solve(const Function& function,
 	typedef Eigen::SimplicialLLT<Eigen::SparseMatrix<double> > SparseLLT;
 	std::unique_ptr<LLT> factorization;
 	std::unique_ptr<SparseLLT> sparse_factorization;
+	// Storage for the BKP factorization.
+	std::unique_ptr<FactorizationCache> factorization_cache;
 	if (!use_sparsity) {
-		factorization.reset(new LLT(n));
+		if (this->factorization_method == ITERATIVE) {
+			factorization.reset(new LLT(n));
+		}
+		else {
+			factorization_cache.reset(new FactorizationCache((int)n));
+		}
 	}
 	else {
 		sparse_factorization.reset(new SparseLLT);
@@ -102,7 +178,6 @@ void NewtonSolver::solve(const Function& function,
 		sparse_factorization->analyzePattern(sparse_H);
 	}
 
-	FactorizationCache factorization_cache((int)n);
 	CheckExitConditionsCache exit_condition_cache;
 
 	//
@@ -263,7 +338,7 @@ void NewtonSolver::solve(const Function& function,
 		else {
 			// Performs a BKP block diagonal factorization, modifies it, and
 			// solvers the linear system.
-			this->BKP_dense(H, g, factorization_cache, &p, results);
+			this->BKP_dense(H, g, *factorization_cache, &p, results);
 			factorizations = 1;
 		}
 
@@ -303,6 +378,8 @@ void NewtonSolver::solve(const Function& function,
 		normdx = alpha * p.norm();
 		// Update current point.
 		x = x + alpha * p;
+		// Take the next step in the tangent spaces at x.
+		function.recenter(&x);
 
 		results->backtracking_time += wall_time() - start_time;
 
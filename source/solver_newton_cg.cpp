@@ -0,0 +1,395 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include <spii/spii.h>
+#include <spii/solver.h>
+
+namespace spii {
+
+namespace {
+
+// Preconditioner for the conjugate gradients, built from the pairs
+//
+//   s = x_new - x,  y = g_new - g
+//
+// of the previous iterations.
+class Preconditioner
+{
+public:
+	Preconditioner(int type_, int history_size_, std::size_t n)
+		: type(type_),
+		  history_size(history_size_),
+		  diagonal(Eigen::VectorXd::Ones(n))
+	{
+		if (type == NewtonCGSolver::LBFGS) {
+			s.resize(history_size);
+			y.resize(history_size);
+			rho.resize(history_size);
+			alpha.resize(history_size);
+		}
+	}
+
+	void update(const Eigen::VectorXd& s_new, const Eigen::VectorXd& y_new)
+	{
+		double sTy = s_new.dot(y_new);
+		if (sTy <= 1e-16) {
+			// The curvature condition does not hold; the pair would
+			// make the preconditioner indefinite.
+			return;
+		}
+
+		if (type == NewtonCGSolver::DIAGONAL) {
+			if (number_of_pairs == 0) {
+				diagonal.setConstant(y_new.squaredNorm() / sTy);
+			}
+			// Diagonal of the BFGS update of diag(D),
+			//
+			//   D + y y^T / s^T y - D s s^T D / s^T D s,
+			//
+			// kept positive.
+			double sDs = s_new.dot(diagonal.cwiseProduct(s_new));
+			for (int i = 0; i < diagonal.size(); ++i) {
+				double Ds = diagonal[i] * s_new[i];
+				double value = diagonal[i] + y_new[i] * y_new[i] / sTy - Ds * Ds / sDs;
+				diagonal[i] = std::max(value, 1e-8 * diagonal[i]);
+			}
+		}
+		else if (type == NewtonCGSolver::LBFGS) {
+			// The oldest pair is overwritten.
+			int h = number_of_pairs % history_size;
+			s[h] = s_new;
+			y[h] = y_new;
+			rho[h] = 1.0 / sTy;
+			H0 = sTy / y_new.squaredNorm();
+		}
+		number_of_pairs++;
+	}
+
+	// z = M^-1 r.
+	void apply(const Eigen::VectorXd& r, Eigen::VectorXd* z)
+	{
+		if (type == NewtonCGSolver::DIAGONAL) {
+			*z = r.cwiseQuotient(diagonal);
+		}
+		else if (type == NewtonCGSolver::LBFGS && number_of_pairs > 0) {
+			// Two-loop recursion, newest pair first.
+			*z = r;
+			int pairs = std::min(number_of_pairs, history_size);
+			for (int k = 0; k < pairs; ++k) {
+				int h = (number_of_pairs - 1 - k) % history_size;
+				alpha[h] = rho[h] * s[h].dot(*z);
+				*z -= alpha[h] * y[h];
+			}
+			*z *= H0;
+			for (int k = pairs - 1; k >= 0; --k) {
+				int h = (number_of_pairs - 1 - k) % history_size;
+				double beta = rho[h] * y[h].dot(*z);
+				*z += (alpha[h] - beta) * s[h];
+			}
+		}
+		else {
+			*z = r;
+		}
+	}
+
+private:
+	int type;
+	int history_size;
+	int number_of_pairs = 0;
+
+	// DIAGONAL.
+	Eigen::VectorXd diagonal;
+
+	// LBFGS.
+	std::vector<Eigen::VectorXd> s, y;
+	std::vector<double> rho, alpha;
+	double H0 = 1.0;
+};
+
+}
+
+MemoryUsage NewtonCGSolver::solver_memory_usage(const Function& function) const
+{
+	MemoryUsage usage;
+	auto n = function.get_number_of_scalars();
+	// x, g, x2, p, r, z, d, Hd, g_prev, x_prev and the line search.
+	usage.add("Solver vectors", 12 * n * sizeof(double));
+	if (this->preconditioner == DIAGONAL) {
+		usage.add("Preconditioner", n * sizeof(double));
+	}
+	else if (this->preconditioner == LBFGS) {
+		usage.add("Preconditioner", this->lbfgs_history_size * (2 * n + 2) * sizeof(double));
+	}
+	return usage;
+}
+
+MemoryUsage NewtonCGSolver::estimate_memory_usage(const Function& function) const
+{
+	auto usage = solver_memory_usage(function);
+	usage.add(function.estimate_memory_usage(Function::NO_HESSIAN));
+	return usage;
+}
+
+void NewtonCGSolver::solve(const Function& function,
+                           SolverResults* results) const
+{
+	double global_start_time = wall_time();
+
+	// Dimension of problem.
+	size_t n = function.get_number_of_scalars();
+
+	if (n == 0) {
+		results->exit_condition = SolverResults::FUNCTION_TOLERANCE;
+		return;
+	}
+
+	check(this->maximum_cg_iterations > 0, "NewtonCGSolver: maximum_cg_iterations must be positive.");
+	check(this->preconditioner != LBFGS || this->lbfgs_history_size > 0,
+	      "NewtonCGSolver: lbfgs_history_size must be positive.");
+
+	Function::SettingsScope function_settings(function);
+	this->apply_memory_budget(function,
+	                          solver_memory_usage(function),
+	                          Function::NO_HESSIAN,
+	                          &function_settings);
+
+	// Current point, gradient and Hessian.
+	double fval   = std::numeric_limits<double>::quiet_NaN();
+	double fprev  = std::numeric_limits<double>::quiet_NaN();
+	double normg0 = std::numeric_limits<double>::quiet_NaN();
+	double normg  = std::numeric_limits<double>::quiet_NaN();
+	double normdx = std::numeric_limits<double>::quiet_NaN();
+
+	Eigen::VectorXd x, g;
+
+	// Copy the user state to the current point.
+	function.copy_user_to_global(&x);
+	Eigen::VectorXd x2(n);
+
+	// p will store the search direction. r is the residual H p + g
+	// of the conjugate gradients, z the preconditioned residual and d
+	// the conjugate direction.
+	Eigen::VectorXd p(n), r(n), z(n), d(n), Hd(n);
+
+	// Needed from the previous iteration.
+	Eigen::VectorXd x_prev(n), g_prev(n);
+	double norm2_g_prev = std::numeric_limits<double>::quiet_NaN();
+	double eta = this->maximum_forcing_term;
+
+	Preconditioner preconditioner(this->preconditioner, this->lbfgs_history_size, n);
+
+	CheckExitConditionsCache exit_condition_cache;
+
+	//
+	// START MAIN ITERATION
+	//
+	results->startup_time   += wall_time() - global_start_time;
+	results->exit_condition = SolverResults::INTERNAL_ERROR;
+	int iter = 0;
+	bool last_iteration_successful = true;
+	while (true) {
+
+		//
+		// Evaluate function and derivatives.
+		//
+		double start_time = wall_time();
+		fval = function.evaluate(x, &g);
+
+		normg = std::max(g.maxCoeff(), -g.minCoeff());
+		if (iter == 0) {
+			normg0 = normg;
+		}
+
+		// Check for NaN.
+		if (normg != normg) {
+			results->exit_condition = SolverResults::FUNCTION_NAN;
+			break;
+		}
+
+		results->function_evaluation_time += wall_time() - start_time;
+
+		//
+		// Update the preconditioner and the forcing term.
+		//
+		start_time = wall_time();
+		double norm2_g = g.norm();
+		if (iter > 0 && last_iteration_successful) {
+			preconditioner.update(x - x_prev, g - g_prev);
+
+			// Eisenstat and Walker's choice 2 with safeguard.
+			double eta_prev = eta;
+			eta = this->forcing_term_gamma * std::pow(norm2_g / norm2_g_prev, this->forcing_term_alpha);
+			double safeguard = this->forcing_term_gamma * std::pow(eta_prev, this->forcing_term_alpha);
+			if (safeguard > 0.1) {
+				eta = std::max(eta, safeguard);
+			}
+			eta = std::min(eta, this->maximum_forcing_term);
+		}
+		results->lbfgs_update_time += wall_time() - start_time;
+
+		//
+		// Test stopping criteriea
+		//
+		start_time = wall_time();
+		if (this->check_exit_conditions(fval, fprev, normg,
+		                                normg0, x.norm(), normdx,
+		                                last_iteration_successful,
+		                                &exit_condition_cache, results)) {
+			break;
+		}
+		if (iter >= this->maximum_iterations) {
+			results->exit_condition = SolverResults::NO_CONVERGENCE;
+			break;
+		}
+		if (this->callback_function) {
+			CallbackInformation information;
+			information.objective_value = fval;
+			information.x = &x;
+			information.g = &g;
+
+			if (!callback_function(information)) {
+				results->exit_condition = SolverResults::USER_ABORT;
+				break;
+			}
+		}
+		results->stopping_criteria_time += wall_time() - start_time;
+
+		//
+		// Solve H p = -g with preconditioned conjugate gradients.
+		//
+		start_time = wall_time();
+		// All products in the loop are with the Hessian at x.
+		double evaluation_start_time = wall_time();
+		function.set_hessian_vector_point(x);
+		results->function_evaluation_time += wall_time() - evaluation_start_time;
+		p.setZero();
+		r = g;
+		preconditioner.apply(r, &z);
+		d = -z;
+		double rTz = r.dot(z);
+		int cg_iterations = 0;
+		bool negative_curvature = false;
+		while (cg_iterations < this->maximum_cg_iterations) {
+			evaluation_start_time = wall_time();
+			function.evaluate_hessian_vector(d, &Hd);
+			results->function_evaluation_time += wall_time() - evaluation_start_time;
+			cg_iterations++;
+
+			double dHd = d.dot(Hd);
+			double small_curvature = std::numeric_limits<double>::epsilon() * d.squaredNorm();
+			if (dHd <= small_curvature) {
+				// The Hessian is not positive definite. The current
+				// p is a descent direction; in the first iteration,
+				// the preconditioned steepest descent direction is.
+				// It is scaled as if the curvature along it were
+				// positive, which gives the line search a better
+				// starting point than the unit step.
+				negative_curvature = true;
+				if (cg_iterations == 1) {
+					p = d;
+					if (-dHd > small_curvature) {
+						p *= rTz / -dHd;
+					}
+				}
+				break;
+			}
+
+			double alpha = rTz / dHd;
+			p += alpha * d;
+			r += alpha * Hd;
+			if (r.norm() <= eta * norm2_g) {
+				break;
+			}
+
+			preconditioner.apply(r, &z);
+			double rTz_new = r.dot(z);
+			d = -z + (rTz_new / rTz) * d;
+			rTz = rTz_new;
+		}
+		results->linear_solver_time += wall_time() - start_time;
+
+		//
+		// Perform line search.
+		//
+		start_time = wall_time();
+		double alpha = this->perform_linesearch(function, x, fval, g, p, &x2, 1.0);
+
+		if (alpha <= 1e-15) {
+			// Attempt a simple steepest descent instead.
+			p = -g;
+			alpha = this->perform_linesearch(function, x, fval, g, p, &x2, 1.0);
+		}
+
+		if (alpha <= 0) {
+			if (this->log_function) {
+				this->log_function("Line search failed.");
+			}
+			if (! last_iteration_successful) {
+				// Two failures in a row. As for L-BFGS, the function
+				// has almost always converged when this happens.
+				results->exit_condition = SolverResults::GRADIENT_TOLERANCE;
+				break;
+			}
+			last_iteration_successful = false;
+		}
+		else {
+			// Record length of this step.
+			normdx = alpha * p.norm();
+			// Compute new point.
+			x_prev = x;
+			g_prev = g;
+			norm2_g_prev = norm2_g;
+			x = x + alpha * p;
+
+			last_iteration_successful = true;
+		}
+
+		results->backtracking_time += wall_time() - start_time;
+
+		//
+		// Log the results of this iteration.
+		//
+		start_time = wall_time();
+
+		int log_interval = 1;
+		if (iter > 30) {
+			log_interval = 10;
+		}
+		if (iter > 200) {
+			log_interval = 100;
+		}
+		if (iter > 2000) {
+			log_interval = 1000;
+		}
+		if (this->log_function && iter % log_interval == 0) {
+			char str[1024];
+			if (iter == 0) {
+				this->log_function("Itr        f        max|g_i|   alpha      eta     cg");
+			}
+			std::sprintf(str, "%4d %+10.6e %9.3e %9.3e %9.3e %4d%s",
+				iter, fval, normg, alpha, eta, cg_iterations,
+				negative_curvature ? " negative curvature" : "");
+			this->log_function(str);
+		}
+		results->log_time += wall_time() - start_time;
+
+		fprev = fval;
+		iter++;
+	}
+
+	function.copy_global_to_user(x);
+	results->total_time += wall_time() - global_start_time;
+
+	if (this->log_function) {
+		char str[1024];
+		std::sprintf(str, " end %+10.6e %.3e", fval, normg);
+		this->log_function(str);
+	}
+}
+
+}  // namespace spii
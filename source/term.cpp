@@ -11,6 +11,80 @@ Interval<double> Term::evaluate_interval(const Interval<double> * const * const
 	throw std::runtime_error("evaluate_interval: Not implemented.");
 };
 
+bool Term::has_single_precision() const
+{
+	return false;
+}
+
+double Term::evaluate_float(float * const * const variables) const
+{
+	throw std::runtime_error("evaluate_float: Not implemented.");
+}
+
+double Term::evaluate_float(float * const * const variables,
+                            std::vector<Eigen::VectorXf>* gradient) const
+{
+	throw std::runtime_error("evaluate_float: Not implemented.");
+}
+
+int Term::batch_size() const
+{
+	return 1;
+}
+
+void Term::evaluate_batch(const Term* const* terms,
+                          double * const * const * variables,
+                          double* values,
+                          std::vector<Eigen::VectorXd>* gradients,
+                          std::vector< std::vector<Eigen::MatrixXd> >* hessians) const
+{
+	for (int l = 0; l < batch_size(); ++l) {
+		if (hessians) {
+			values[l] = terms[l]->evaluate(variables[l], &gradients[l], &hessians[l]);
+		}
+		else if (gradients) {
+			values[l] = terms[l]->evaluate(variables[l], &gradients[l]);
+		}
+		else {
+			values[l] = terms[l]->evaluate(variables[l]);
+		}
+	}
+}
+
+double Term::evaluate_hessian_vector(double * const * const variables,
+                                     const double * const * const direction,
+                                     std::vector<Eigen::VectorXd>* gradient,
+                                     std::vector<Eigen::VectorXd>* hessian_vector) const
+{
+	std::vector< std::vector<Eigen::MatrixXd> > hessian(number_of_variables());
+	for (int var0 = 0; var0 < number_of_variables(); ++var0) {
+		hessian[var0].resize(number_of_variables());
+		for (int var1 = 0; var1 < number_of_variables(); ++var1) {
+			hessian[var0][var1].resize(variable_dimension(var0), variable_dimension(var1));
+		}
+	}
+
+	double value = evaluate(variables, gradient, &hessian);
+
+	// The vectors may be longer than the variables.
+	for (int var0 = 0; var0 < number_of_variables(); ++var0) {
+		auto hv = (*hessian_vector)[var0].head(variable_dimension(var0));
+		hv.setZero();
+		for (int var1 = 0; var1 < number_of_variables(); ++var1) {
+			Eigen::Map<const Eigen::VectorXd> v(direction[var1], variable_dimension(var1));
+			hv += hessian[var0][var1] * v;
+		}
+	}
+	return value;
+}
+
+double Term::evaluate_gauss_newton(double * const * const variables,
+                                   std::vector<Eigen::VectorXd>* gradient,
+                                   std::vector< std::vector<Eigen::MatrixXd> >* hessian) const
+{
+	return evaluate(variables, gradient, hessian);
+}
+
 void Term::read(std::istream& in)
 {
 }
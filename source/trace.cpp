@@ -0,0 +1,887 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
+
+#include <spii/trace.h>
+
+namespace spii {
+
+namespace {
+
+bool is_binary(Trace::Opcode opcode)
+{
+	return opcode >= Trace::Add && opcode <= Trace::Atan2;
+}
+
+bool is_commutative(Trace::Opcode opcode)
+{
+	return opcode == Trace::Add || opcode == Trace::Multiply;
+}
+
+// First and second partial derivatives of an operation with respect
+// to its arguments.
+struct Partials
+{
+	double a, b;
+	double aa, ab, bb;
+};
+
+// Evaluates an operation and its partial derivatives, given the
+// values x and y of its arguments. The second derivatives are only
+// computed if second_order is true. The value and the first
+// derivatives are computed together, since they often share work
+// (e.g. exp).
+double evaluate_partials(const Trace::Operation& operation,
+                         double x,
+                         double y,
+                         bool second_order,
+                         Partials* p)
+{
+	p->a = p->b = 0;
+	p->aa = p->ab = p->bb = 0;
+	double z;
+
+	switch (operation.opcode) {
+		case Trace::Variable:
+			return x;
+		case Trace::Constant:
+			return operation.constant;
+		case Trace::Parameter:
+			// The values of parameters are stored in the trace.
+			break;
+
+		case Trace::Add:
+			p->a = 1;
+			p->b = 1;
+			return x + y;
+		case Trace::Subtract:
+			p->a = 1;
+			p->b = -1;
+			return x - y;
+		case Trace::Multiply:
+			p->a = y;
+			p->b = x;
+			p->ab = 1;
+			return x * y;
+		case Trace::Divide:
+			p->a = 1 / y;
+			z = x * p->a;
+			p->b = -z * p->a;
+			if (second_order) {
+				p->ab = -p->a * p->a;
+				p->bb = -2 * p->b * p->a;
+			}
+			return z;
+		case Trace::Pow: {
+			double log_x = std::log(x);
+			z = std::pow(x, y);
+			p->a = y * std::pow(x, y - 1);
+			p->b = z * log_x;
+			if (second_order) {
+				p->aa = y * (y - 1) * std::pow(x, y - 2);
+				p->ab = std::pow(x, y - 1) * (1 + y * log_x);
+				p->bb = z * log_x * log_x;
+			}
+			return z;
+		}
+		case Trace::Atan2: {
+			// z = atan2(x, y).
+			double r = x * x + y * y;
+			p->a = y / r;
+			p->b = -x / r;
+			if (second_order) {
+				p->aa = -2 * x * y / (r * r);
+				p->ab = (x * x - y * y) / (r * r);
+				p->bb = 2 * x * y / (r * r);
+			}
+			return std::atan2(x, y);
+		}
+
+		case Trace::Negate:
+			p->a = -1;
+			return -x;
+		case Trace::PowConstant: {
+			double c = operation.constant;
+			p->a = c * std::pow(x, c - 1);
+			if (second_order) {
+				p->aa = c * (c - 1) * std::pow(x, c - 2);
+			}
+			return std::pow(x, c);
+		}
+		case Trace::Abs:
+			p->a = x < 0 ? -1 : 1;
+			return std::abs(x);
+		case Trace::Sqrt:
+			z = std::sqrt(x);
+			p->a = 0.5 / z;
+			p->aa = -0.5 * p->a / x;
+			return z;
+		case Trace::Exp:
+			z = std::exp(x);
+			p->a = z;
+			p->aa = z;
+			return z;
+		case Trace::Log:
+			p->a = 1 / x;
+			p->aa = -p->a * p->a;
+			return std::log(x);
+		case Trace::Log10:
+			p->a = 1 / (x * std::log(10.0));
+			p->aa = -p->a / x;
+			return std::log10(x);
+		case Trace::Sin:
+			z = std::sin(x);
+			p->a = std::cos(x);
+			p->aa = -z;
+			return z;
+		case Trace::Cos:
+			z = std::cos(x);
+			p->a = -std::sin(x);
+			p->aa = -z;
+			return z;
+		case Trace::Tan:
+			z = std::tan(x);
+			p->a = 1 + z * z;
+			p->aa = 2 * z * p->a;
+			return z;
+		case Trace::Asin:
+			p->a = 1 / std::sqrt(1 - x * x);
+			p->aa = x * p->a * p->a * p->a;
+			return std::asin(x);
+		case Trace::Acos:
+			p->a = -1 / std::sqrt(1 - x * x);
+			p->aa = x * p->a * p->a * p->a;
+			return std::acos(x);
+		case Trace::Atan:
+			p->a = 1 / (1 + x * x);
+			p->aa = -2 * x * p->a * p->a;
+			return std::atan(x);
+		case Trace::Sinh:
+			z = std::sinh(x);
+			p->a = std::cosh(x);
+			p->aa = z;
+			return z;
+		case Trace::Cosh:
+			z = std::cosh(x);
+			p->a = std::sinh(x);
+			p->aa = z;
+			return z;
+		case Trace::Tanh:
+			z = std::tanh(x);
+			p->a = 1 - z * z;
+			p->aa = -2 * z * p->a;
+			return z;
+		case Trace::Sign:
+			return x < 0 ? -1 : 1;
+	}
+	return std::numeric_limits<double>::quiet_NaN();
+}
+
+bool compare(Trace::Comparison comparison, double x, double y)
+{
+	switch (comparison) {
+		case Trace::Equal:        return x == y;
+		case Trace::NotEqual:     return x != y;
+		case Trace::Less:         return x < y;
+		case Trace::LessEqual:    return x <= y;
+		case Trace::Greater:      return x > y;
+		case Trace::GreaterEqual: return x >= y;
+	}
+	return false;
+}
+
+// Scratch space for replaying traces. Replaying does not call any
+// user code, so the buffers are never used recursively.
+struct ReplayBuffers
+{
+	std::vector<double> values;
+	std::vector<double> partials;
+	std::vector<double> adjoints;
+	std::vector<double> tangents;
+	std::vector<double> tangent_adjoints;
+};
+
+ReplayBuffers& thread_buffers()
+{
+	static thread_local ReplayBuffers buffers;
+	return buffers;
+}
+
+Trace*& thread_recording()
+{
+	static thread_local Trace* trace = nullptr;
+	return trace;
+}
+
+}  // anonymous namespace
+
+std::size_t Trace::OperationHash::operator()(const Operation& operation) const
+{
+	std::uint64_t bits;
+	static_assert(sizeof(bits) == sizeof(operation.constant), "Trace: Unexpected size of double.");
+	std::memcpy(&bits, &operation.constant, sizeof(bits));
+
+	std::size_t hash = std::hash<std::uint64_t>()(bits);
+	hash = hash * 31 + operation.opcode;
+	hash = hash * 31 + std::size_t(operation.arguments[0]);
+	hash = hash * 31 + std::size_t(operation.arguments[1]);
+	return hash;
+}
+
+bool Trace::OperationEqual::operator()(const Operation& lhs, const Operation& rhs) const
+{
+	// Constants are compared bitwise, so that e.g. 0.0 and -0.0 are
+	// different.
+	return lhs.opcode == rhs.opcode
+	    && lhs.arguments[0] == rhs.arguments[0]
+	    && lhs.arguments[1] == rhs.arguments[1]
+	    && std::memcmp(&lhs.constant, &rhs.constant, sizeof(double)) == 0;
+}
+
+double Trace::apply(const Operation& operation, double x, double y)
+{
+	switch (operation.opcode) {
+		case Variable:    return x;
+		case Constant:    return operation.constant;
+		case Parameter:   break;
+		case Add:         return x + y;
+		case Subtract:    return x - y;
+		case Multiply:    return x * y;
+		case Divide:      return x / y;
+		case Pow:         return std::pow(x, y);
+		case Atan2:       return std::atan2(x, y);
+		case Negate:      return -x;
+		case PowConstant: return std::pow(x, operation.constant);
+		case Abs:         return std::abs(x);
+		case Sqrt:        return std::sqrt(x);
+		case Exp:         return std::exp(x);
+		case Log:         return std::log(x);
+		case Log10:       return std::log10(x);
+		case Sin:         return std::sin(x);
+		case Cos:         return std::cos(x);
+		case Tan:         return std::tan(x);
+		case Asin:        return std::asin(x);
+		case Acos:        return std::acos(x);
+		case Atan:        return std::atan(x);
+		case Sinh:        return std::sinh(x);
+		case Cosh:        return std::cosh(x);
+		case Tanh:        return std::tanh(x);
+		case Sign:        return x < 0 ? -1 : 1;
+	}
+	return std::numeric_limits<double>::quiet_NaN();
+}
+
+Trace::Trace(int number_of_variables)
+	: n(number_of_variables), output(-1)
+{
+	check(n >= 0, "Trace: Invalid number of variables.");
+	for (int i = 0; i < n; ++i) {
+		// The constant makes the variables different operations.
+		Operation operation = {Variable, {-1, -1}, double(i)};
+		add(operation);
+	}
+}
+
+int Trace::add(const Operation& operation)
+{
+	auto itr = operation_indices.find(operation);
+	if (itr != operation_indices.end()) {
+		return itr->second;
+	}
+	int index = static_cast<int>(operations.size());
+	operations.push_back(operation);
+	operation_indices[operation] = index;
+	return index;
+}
+
+int Trace::constant(double value)
+{
+	Operation operation = {Constant, {-1, -1}, value};
+	return add(operation);
+}
+
+int Trace::parameter(const std::string& name, double value)
+{
+	check(output < 0, "Trace: The trace is finished.");
+	for (std::size_t i = 0; i < parameter_names.size(); ++i) {
+		if (parameter_names[i] == name) {
+			check(parameter_values[i] == value,
+			      "Trace: The parameter ", name, " has different values.");
+			return parameter_indices[i];
+		}
+	}
+	Operation operation = {Parameter, {-1, -1}, double(parameter_names.size())};
+	int index = add(operation);
+	parameter_names.push_back(name);
+	parameter_values.push_back(value);
+	parameter_indices.push_back(index);
+	return index;
+}
+
+int Trace::record(Opcode opcode, int argument0, int argument1, double constant_)
+{
+	check(output < 0, "Trace: The trace is finished.");
+	if (!is_binary(opcode)) {
+		argument1 = -1;
+	}
+	else if (is_commutative(opcode) && argument1 < argument0) {
+		std::swap(argument0, argument1);
+	}
+	Operation operation = {opcode, {argument0, argument1}, constant_};
+
+	// Constant folding.
+	bool constant0 = is_constant(argument0);
+	bool constant1 = argument1 >= 0 && is_constant(argument1);
+	if (constant0 && (argument1 < 0 || constant1)) {
+		double y = argument1 >= 0 ? operations[argument1].constant : 0;
+		return constant(apply(operation, operations[argument0].constant, y));
+	}
+
+	// Algebraic identities.
+	auto equals = [this](int index, double value)
+	{
+		return is_constant(index) && operations[index].constant == value;
+	};
+	auto negated = [this](int index)
+	{
+		return operations[index].opcode == Negate ? operations[index].arguments[0] : -1;
+	};
+	switch (opcode) {
+		case Add:
+			if (equals(argument0, 0)) {
+				return argument1;
+			}
+			if (equals(argument1, 0)) {
+				return argument0;
+			}
+			if (negated(argument1) >= 0) {
+				return record(Subtract, argument0, negated(argument1));
+			}
+			if (negated(argument0) >= 0) {
+				return record(Subtract, argument1, negated(argument0));
+			}
+			break;
+		case Subtract:
+			if (equals(argument0, 0)) {
+				return record(Negate, argument1);
+			}
+			if (equals(argument1, 0)) {
+				return argument0;
+			}
+			break;
+		case Multiply:
+			if (equals(argument0, 1)) {
+				return argument1;
+			}
+			if (equals(argument1, 1)) {
+				return argument0;
+			}
+			if (equals(argument0, -1)) {
+				return record(Negate, argument1);
+			}
+			if (equals(argument1, -1)) {
+				return record(Negate, argument0);
+			}
+			break;
+		case Divide:
+			if (equals(argument1, 1)) {
+				return argument0;
+			}
+			break;
+		case Negate:
+			if (operations[argument0].opcode == Negate) {
+				return operations[argument0].arguments[0];
+			}
+			break;
+		case PowConstant:
+			if (constant_ == 1) {
+				return argument0;
+			}
+			break;
+		default:
+			break;
+	}
+
+	// Common subexpression elimination.
+	return add(operation);
+}
+
+void Trace::guard(Comparison comparison, int argument0, int argument1, bool outcome)
+{
+	check(output < 0, "Trace: The trace is finished.");
+	// Comparisons of constants always have the same outcome.
+	if (is_constant(argument0) && is_constant(argument1)) {
+		return;
+	}
+	Guard guard = {comparison, {argument0, argument1}, outcome};
+	guards.push_back(guard);
+}
+
+void Trace::record_partials(int index, int partials[2])
+{
+	// Copied, since recording may reallocate operations.
+	const Operation operation = operations[index];
+	int x = operation.arguments[0];
+	int y = operation.arguments[1];
+	int& a = partials[0];
+	int& b = partials[1];
+	b = -1;
+
+	switch (operation.opcode) {
+		case Variable:
+		case Constant:
+		case Parameter:
+			a = -1;
+			break;
+
+		case Add:
+			a = constant(1);
+			b = constant(1);
+			break;
+		case Subtract:
+			a = constant(1);
+			b = constant(-1);
+			break;
+		case Multiply:
+			a = y;
+			b = x;
+			break;
+		case Divide:
+			a = record(Divide, constant(1), y);
+			b = record(Negate, record(Divide, index, y));
+			break;
+		case Pow:
+			a = record(Multiply, y, record(Pow, x, record(Subtract, y, constant(1))));
+			b = record(Multiply, index, record(Log, x));
+			break;
+		case Atan2: {
+			int r = record(Add, record(Multiply, x, x), record(Multiply, y, y));
+			a = record(Divide, y, r);
+			b = record(Negate, record(Divide, x, r));
+			break;
+		}
+
+		case Negate:
+			a = constant(-1);
+			break;
+		case PowConstant: {
+			double c = operation.constant;
+			a = record(Multiply, constant(c), record(PowConstant, x, -1, c - 1));
+			break;
+		}
+		case Abs:
+			a = record(Sign, x);
+			break;
+		case Sqrt:
+			a = record(Divide, constant(0.5), index);
+			break;
+		case Exp:
+			a = index;
+			break;
+		case Log:
+			a = record(Divide, constant(1), x);
+			break;
+		case Log10:
+			a = record(Divide, constant(1 / std::log(10.0)), x);
+			break;
+		case Sin:
+			a = record(Cos, x);
+			break;
+		case Cos:
+			a = record(Negate, record(Sin, x));
+			break;
+		case Tan:
+			a = record(Add, constant(1), record(Multiply, index, index));
+			break;
+		case Asin:
+		case Acos: {
+			int root = record(Sqrt, record(Subtract, constant(1), record(Multiply, x, x)));
+			a = record(Divide, constant(operation.opcode == Asin ? 1 : -1), root);
+			break;
+		}
+		case Atan:
+			a = record(Divide, constant(1), record(Add, constant(1), record(Multiply, x, x)));
+			break;
+		case Sinh:
+			a = record(Cosh, x);
+			break;
+		case Cosh:
+			a = record(Sinh, x);
+			break;
+		case Tanh:
+			a = record(Subtract, constant(1), record(Multiply, index, index));
+			break;
+		case Sign:
+			a = constant(0);
+			break;
+	}
+}
+
+std::vector<int> Trace::differentiate(int output_)
+{
+	check(output < 0, "Trace: The trace is finished.");
+	check(0 <= output_ && output_ < int(operations.size()), "Trace: Invalid output.");
+
+	// Only operations depending on the variables have derivatives.
+	const int size = std::max(output_ + 1, n);
+	std::vector<char> depends(size, 0);
+	for (int k = 0; k < size; ++k) {
+		const auto& operation = operations[k];
+		depends[k] = operation.opcode == Variable;
+		for (int argument : operation.arguments) {
+			if (argument >= 0 && depends[argument]) {
+				depends[k] = 1;
+			}
+		}
+	}
+
+	// The operation computing the adjoint of every operation, or -1
+	// if the adjoint is zero.
+	std::vector<int> adjoints(size, -1);
+	adjoints[output_] = constant(1);
+	for (int k = output_; k >= n; --k) {
+		if (adjoints[k] < 0 || !depends[k]) {
+			continue;
+		}
+		int partials[2];
+		record_partials(k, partials);
+		for (int i = 0; i < 2; ++i) {
+			int argument = operations[k].arguments[i];
+			if (argument < 0 || !depends[argument]) {
+				continue;
+			}
+			if (is_constant(partials[i]) && operations[partials[i]].constant == 0) {
+				continue;
+			}
+			int contribution = record(Multiply, partials[i], adjoints[k]);
+			if (adjoints[argument] < 0) {
+				adjoints[argument] = contribution;
+			}
+			else {
+				adjoints[argument] = record(Add, adjoints[argument], contribution);
+			}
+		}
+	}
+
+	std::vector<int> gradient(n);
+	for (int i = 0; i < n; ++i) {
+		gradient[i] = adjoints[i] >= 0 ? adjoints[i] : constant(0);
+	}
+	return gradient;
+}
+
+void Trace::finish(int output_)
+{
+	finish(std::vector<int>(1, output_));
+}
+
+void Trace::finish(const std::vector<int>& outputs_)
+{
+	check(output < 0, "Trace: The trace is already finished.");
+	check(!outputs_.empty(), "Trace: No outputs.");
+	for (int output_ : outputs_) {
+		check(0 <= output_ && output_ < int(operations.size()), "Trace: Invalid output.");
+	}
+
+	// Dead-code elimination. Operations are recorded after their
+	// arguments, so one backwards pass finds everything that is used.
+	std::vector<char> used(operations.size(), 0);
+	for (int i = 0; i < n; ++i) {
+		used[i] = 1;
+	}
+	for (int index : parameter_indices) {
+		used[index] = 1;
+	}
+	for (int output_ : outputs_) {
+		used[output_] = 1;
+	}
+	for (const auto& guard : guards) {
+		used[guard.arguments[0]] = 1;
+		used[guard.arguments[1]] = 1;
+	}
+	for (int k = int(operations.size()) - 1; k >= n; --k) {
+		if (used[k]) {
+			for (int argument : operations[k].arguments) {
+				if (argument >= 0) {
+					used[argument] = 1;
+				}
+			}
+		}
+	}
+
+	// Parameters have no arguments, so they can be moved to directly
+	// after the variables.
+	std::vector<int> new_index(operations.size(), -1);
+	std::vector<Operation> used_operations;
+	auto move = [&](int k)
+	{
+		Operation operation = operations[k];
+		for (int& argument : operation.arguments) {
+			if (argument >= 0) {
+				argument = new_index[argument];
+			}
+		}
+		new_index[k] = static_cast<int>(used_operations.size());
+		used_operations.push_back(operation);
+	};
+	for (int i = 0; i < n; ++i) {
+		move(i);
+	}
+	for (int index : parameter_indices) {
+		move(index);
+	}
+	for (std::size_t k = n; k < operations.size(); ++k) {
+		if (used[k] && operations[k].opcode != Parameter) {
+			move(int(k));
+		}
+	}
+
+	for (auto& guard : guards) {
+		for (int& argument : guard.arguments) {
+			argument = new_index[argument];
+		}
+	}
+	outputs.clear();
+	for (int output_ : outputs_) {
+		outputs.push_back(new_index[output_]);
+	}
+	output = outputs[0];
+	for (auto& index : parameter_indices) {
+		index = new_index[index];
+	}
+	operations.swap(used_operations);
+	operations.shrink_to_fit();
+	operation_indices.clear();
+}
+
+Trace* Trace::recording()
+{
+	return thread_recording();
+}
+
+Trace::Recording::Recording(Trace* trace)
+	: previous(thread_recording())
+{
+	thread_recording() = trace;
+}
+
+Trace::Recording::~Recording()
+{
+	thread_recording() = previous;
+}
+
+bool Trace::has_same_operations(const Trace& other) const
+{
+	if (n != other.n
+	    || outputs != other.outputs
+	    || operations.size() != other.operations.size()
+	    || guards.size() != other.guards.size()
+	    || parameter_names != other.parameter_names) {
+		return false;
+	}
+	OperationEqual equal;
+	for (std::size_t k = 0; k < operations.size(); ++k) {
+		if (!equal(operations[k], other.operations[k])) {
+			return false;
+		}
+	}
+	for (std::size_t k = 0; k < guards.size(); ++k) {
+		const auto& guard = guards[k];
+		const auto& other_guard = other.guards[k];
+		if (guard.comparison != other_guard.comparison
+		    || guard.arguments[0] != other_guard.arguments[0]
+		    || guard.arguments[1] != other_guard.arguments[1]
+		    || guard.outcome != other_guard.outcome) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Trace::forward(const double* x,
+                    const double* parameters,
+                    std::vector<double>* values_ptr,
+                    std::vector<double>* partials_ptr) const
+{
+	check(output >= 0, "Trace: The trace is not finished.");
+	auto& values = *values_ptr;
+	values.resize(operations.size());
+
+	for (int i = 0; i < n; ++i) {
+		values[i] = x[i];
+	}
+	// The parameters are stored directly after the variables.
+	const int first = n + number_of_parameters();
+	for (int i = n; i < first; ++i) {
+		values[i] = parameters[i - n];
+	}
+	if (partials_ptr) {
+		// The partial derivatives with respect to the two arguments of
+		// operation k are stored at 2k and 2k + 1.
+		auto& partials = *partials_ptr;
+		partials.resize(2 * operations.size());
+		Partials p;
+		for (std::size_t k = first; k < operations.size(); ++k) {
+			const auto& operation = operations[k];
+			double x = operation.arguments[0] >= 0 ? values[operation.arguments[0]] : 0;
+			double y = operation.arguments[1] >= 0 ? values[operation.arguments[1]] : 0;
+			values[k] = evaluate_partials(operation, x, y, false, &p);
+			partials[2 * k] = p.a;
+			partials[2 * k + 1] = p.b;
+		}
+	}
+	else {
+		for (std::size_t k = first; k < operations.size(); ++k) {
+			const auto& operation = operations[k];
+			double x = operation.arguments[0] >= 0 ? values[operation.arguments[0]] : 0;
+			double y = operation.arguments[1] >= 0 ? values[operation.arguments[1]] : 0;
+			values[k] = apply(operation, x, y);
+		}
+	}
+
+	for (const auto& guard : guards) {
+		bool outcome = compare(guard.comparison,
+		                       values[guard.arguments[0]],
+		                       values[guard.arguments[1]]);
+		if (outcome != guard.outcome) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Trace::evaluate(const double* x, double* value) const
+{
+	return evaluate(x, parameter_values.data(), value);
+}
+
+bool Trace::evaluate(const double* x, const double* parameters, double* value) const
+{
+	auto& values = thread_buffers().values;
+	if (!forward(x, parameters, &values, nullptr)) {
+		return false;
+	}
+	*value = values[output];
+	return true;
+}
+
+bool Trace::gradient(const double* x, double* value, double* gradient) const
+{
+	return this->gradient(x, parameter_values.data(), value, gradient);
+}
+
+bool Trace::gradient(const double* x, const double* parameters, double* value, double* gradient) const
+{
+	auto& buffers = thread_buffers();
+	auto& values = buffers.values;
+	auto& partials = buffers.partials;
+	auto& adjoints = buffers.adjoints;
+	if (!forward(x, parameters, &values, &partials)) {
+		return false;
+	}
+
+	adjoints.assign(operations.size(), 0.0);
+	adjoints[output] = 1;
+	for (int k = output; k >= n; --k) {
+		double adjoint = adjoints[k];
+		const auto& operation = operations[k];
+		int a = operation.arguments[0];
+		int b = operation.arguments[1];
+		if (adjoint == 0 || a < 0) {
+			continue;
+		}
+		// Adjoints of constants are accumulated as well, but never read.
+		adjoints[a] += partials[2 * k] * adjoint;
+		if (b >= 0) {
+			adjoints[b] += partials[2 * k + 1] * adjoint;
+		}
+	}
+
+	*value = values[output];
+	for (int i = 0; i < n; ++i) {
+		gradient[i] = adjoints[i];
+	}
+	return true;
+}
+
+bool Trace::hessian_vector(const double* x,
+                           const double* v,
+                           double* value,
+                           double* gradient,
+                           double* hessian_times_v) const
+{
+	return hessian_vector(x, parameter_values.data(), v, value, gradient, hessian_times_v);
+}
+
+bool Trace::hessian_vector(const double* x,
+                           const double* parameters,
+                           const double* v,
+                           double* value,
+                           double* gradient,
+                           double* hessian_times_v) const
+{
+	auto& buffers = thread_buffers();
+	auto& values = buffers.values;
+	auto& partials = buffers.partials;
+	auto& adjoints = buffers.adjoints;
+	auto& tangents = buffers.tangents;
+	auto& tangent_adjoints = buffers.tangent_adjoints;
+	if (!forward(x, parameters, &values, &partials)) {
+		return false;
+	}
+
+	// The directional derivatives in direction v.
+	tangents.assign(operations.size(), 0.0);
+	for (int i = 0; i < n; ++i) {
+		tangents[i] = v[i];
+	}
+	for (int k = n; k <= output; ++k) {
+		const auto& operation = operations[k];
+		int a = operation.arguments[0];
+		int b = operation.arguments[1];
+		if (a < 0) {
+			continue;
+		}
+		tangents[k] = partials[2 * k] * tangents[a];
+		if (b >= 0 && !is_constant(b)) {
+			tangents[k] += partials[2 * k + 1] * tangents[b];
+		}
+	}
+
+	// Reverse sweep of the adjoints and their directional derivatives.
+	adjoints.assign(operations.size(), 0.0);
+	tangent_adjoints.assign(operations.size(), 0.0);
+	adjoints[output] = 1;
+	Partials p;
+	for (int k = output; k >= n; --k) {
+		double adjoint = adjoints[k];
+		double tangent_adjoint = tangent_adjoints[k];
+		const auto& operation = operations[k];
+		int a = operation.arguments[0];
+		int b = operation.arguments[1];
+		if ((adjoint == 0 && tangent_adjoint == 0) || a < 0) {
+			continue;
+		}
+		double y = b >= 0 ? values[b] : 0;
+		evaluate_partials(operation, values[a], y, true, &p);
+
+		adjoints[a] += p.a * adjoint;
+		tangent_adjoints[a] += p.a * tangent_adjoint + p.aa * tangents[a] * adjoint;
+		if (b >= 0 && !is_constant(b)) {
+			tangent_adjoints[a] += p.ab * tangents[b] * adjoint;
+			adjoints[b] += p.b * adjoint;
+			tangent_adjoints[b] += p.b * tangent_adjoint
+			                     + (p.ab * tangents[a] + p.bb * tangents[b]) * adjoint;
+		}
+	}
+
+	*value = values[output];
+	for (int i = 0; i < n; ++i) {
+		gradient[i] = adjoints[i];
+		hessian_times_v[i] = tangent_adjoints[i];
+	}
+	return true;
+}
+
+}  // namespace spii
@@ -0,0 +1,35 @@
+//
+// Generates the code of GeneratedTerm for test_code_generation.
+//
+//		generate_test_term <output file>
+//
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <spii/code_generation.h>
+using namespace spii;
+
+#include "generated_functor.h"
+
+int main(int argc, char** argv)
+{
+	if (argc != 2) {
+		std::cerr << "Usage: " << argv[0] << " <output file>\n";
+		return 1;
+	}
+
+	try {
+		double x[3] = {1.3, 0.7, 0.4};
+		std::ofstream out(argv[1]);
+		generate_term_code<2, 1>(out, "GeneratedTerm", GeneratedFunctor(1, 0), x, {"scale", "offset"});
+		if (!out) {
+			throw std::runtime_error("Could not write the output file.");
+		}
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << '\n';
+		return 1;
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef SPII_TEST_GENERATED_FUNCTOR_H
+#define SPII_TEST_GENERATED_FUNCTOR_H
+// The functor of GeneratedTerm, which is generated by
+// generate_test_term when building the tests.
+
+#include <cmath>
+
+#include <spii/trace.h>
+
+class GeneratedFunctor
+{
+public:
+	// The members are read with SPII_PARAMETER.
+	static const bool batchable = true;
+
+	GeneratedFunctor(double scale_, double offset_)
+		: scale(scale_), offset(offset_)
+	{ }
+
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		using std::abs;
+		R a = x[0];
+		R b = x[1];
+		R c = y[0] - SPII_PARAMETER(R, offset);
+		R value = sqrt(a) * exp(b) - log(a + b) / log10(a * 3.0);
+		value += sin(a) * cos(b) + tan(b / 5.0) * c;
+		value += asin(b / 3.0) + acos(a / 4.0) + atan(a - c);
+		value += sinh(c) - cosh(a) * tanh(a * b);
+		value += pow(a, 3.0) + pow(2.0, b) + pow(a, c) * 0.5;
+		value += atan2(a, c) + abs(b - 2.0 * a) + c * c;
+		if (c > 0) {
+			value -= 2.0 / a - (1.0 - b);
+		}
+		else {
+			value += a * b * c;
+		}
+		return SPII_PARAMETER(R, scale) * value * value;
+	}
+
+private:
+	double scale;
+	double offset;
+};
+
+#endif
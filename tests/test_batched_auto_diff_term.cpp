@@ -0,0 +1,213 @@
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+#include <spii/batched_auto_diff_term.h>
+#include <spii/function.h>
+
+#include "generated_functor.h"
+
+using namespace spii;
+
+TEST_CASE("Packet/arithmetic", "")
+{
+	Packet<double, 4> x, y;
+	for (int l = 0; l < 4; ++l) {
+		x[l] = l + 1.0;
+		y[l] = 0.5 * l - 3.0;
+	}
+
+	auto z = 2 * x * y - x / y + sin(x) * pow(x, 2.0) - atan2(y, x);
+	z += abs(y);
+	for (int l = 0; l < 4; ++l) {
+		double expected = 2 * x[l] * y[l] - x[l] / y[l] + std::sin(x[l]) * std::pow(x[l], 2.0)
+		                - std::atan2(y[l], x[l]) + std::abs(y[l]);
+		CHECK(z[l] == Approx(expected));
+	}
+
+	// Comparisons need the same outcome in every lane.
+	CHECK(x > y);
+	CHECK_FALSE(x < 0.0);
+	CHECK_THROWS(x > 2.0);
+}
+
+TEST_CASE("Packet/parameters", "")
+{
+	GeneratedFunctor functors[4] = {{1.0, 2.0}, {3.0, 4.0}, {5.0, 6.0}, {7.0, 8.0}};
+	const GeneratedFunctor* lane_functors[4] = {&functors[0], &functors[1], &functors[2], &functors[3]};
+
+	struct Member
+	{
+		double value;
+	} outside = {1.5};
+
+	typedef Packet<double, 4> P;
+	// Without lanes, the member is copied to every lane.
+	CHECK(SPII_PARAMETER(P, outside.value)[3] == 1.5);
+
+	PacketLanes<4> lanes(lane_functors);
+	CHECK_THROWS(SPII_PARAMETER(P, outside.value));
+}
+
+namespace {
+
+struct Variables
+{
+	double x[4][2];
+	double y[4][1];
+	double* pointers[4][2];
+
+	Variables(double c)
+	{
+		for (int l = 0; l < 4; ++l) {
+			x[l][0] = 1.0 + 0.25 * l;
+			x[l][1] = 0.5 + 0.1 * l;
+			y[l][0] = c + l;
+			pointers[l][0] = x[l];
+			pointers[l][1] = y[l];
+		}
+	}
+};
+
+// Checks that the terms evaluated as a batch give the same results
+// as AutoDiffTerm.
+void check_batch(const Variables& variables)
+{
+	std::shared_ptr<Term> terms[4];
+	std::shared_ptr<Term> reference_terms[4];
+	const Term* term_pointers[4];
+	double* const* variable_pointers[4];
+	for (int l = 0; l < 4; ++l) {
+		terms[l] = std::make_shared<BatchedAutoDiffTerm<GeneratedFunctor, 2, 1>>(1.0 + l, 0.5 * l);
+		reference_terms[l] = std::make_shared<AutoDiffTerm<GeneratedFunctor, 2, 1>>(1.0 + l, 0.5 * l);
+		term_pointers[l] = terms[l].get();
+		variable_pointers[l] = variables.pointers[l];
+	}
+	REQUIRE(terms[0]->batch_size() == 4);
+
+	std::vector<Eigen::VectorXd> gradients[4];
+	std::vector<std::vector<Eigen::MatrixXd>> hessians[4];
+	for (int l = 0; l < 4; ++l) {
+		gradients[l] = {Eigen::VectorXd(2), Eigen::VectorXd(1)};
+		hessians[l] = {{Eigen::MatrixXd(2, 2), Eigen::MatrixXd(2, 1)},
+		               {Eigen::MatrixXd(1, 2), Eigen::MatrixXd(1, 1)}};
+	}
+	auto gradients_reference = gradients[0];
+	auto hessians_reference = hessians[0];
+
+	double values[4];
+	terms[0]->evaluate_batch(term_pointers, variable_pointers, values, nullptr, nullptr);
+	for (int l = 0; l < 4; ++l) {
+		CHECK(values[l] == Approx(reference_terms[l]->evaluate(variable_pointers[l])));
+	}
+
+	terms[0]->evaluate_batch(term_pointers, variable_pointers, values, gradients, nullptr);
+	for (int l = 0; l < 4; ++l) {
+		double value = reference_terms[l]->evaluate(variable_pointers[l], &gradients_reference);
+		CHECK(values[l] == Approx(value));
+		for (int var = 0; var < 2; ++var) {
+			CHECK((gradients[l][var] - gradients_reference[var]).norm() < 1e-12 * (1 + gradients_reference[var].norm()));
+		}
+	}
+
+	terms[0]->evaluate_batch(term_pointers, variable_pointers, values, gradients, hessians);
+	for (int l = 0; l < 4; ++l) {
+		double value = reference_terms[l]->evaluate(variable_pointers[l], &gradients_reference, &hessians_reference);
+		CHECK(values[l] == Approx(value));
+		for (int var0 = 0; var0 < 2; ++var0) {
+			CHECK((gradients[l][var0] - gradients_reference[var0]).norm() < 1e-12 * (1 + gradients_reference[var0].norm()));
+			for (int var1 = 0; var1 < 2; ++var1) {
+				const auto& reference = hessians_reference[var0][var1];
+				CHECK((hessians[l][var0][var1] - reference).norm() < 1e-12 * (1 + reference.norm()));
+			}
+		}
+	}
+}
+
+}
+
+TEST_CASE("BatchedAutoDiffTerm/evaluate_batch", "")
+{
+	// All terms take the same branch.
+	check_batch(Variables(1.0));
+	// The terms take different branches and are evaluated one at a
+	// time.
+	check_batch(Variables(-1.0));
+}
+
+namespace {
+
+// Does not declare that it is batchable.
+class UnmarkedFunctor
+{
+public:
+	UnmarkedFunctor(double scale_)
+		: scale(scale_)
+	{ }
+
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		return scale * x[0] * x[1];
+	}
+
+private:
+	double scale;
+};
+
+}
+
+TEST_CASE("BatchedAutoDiffTerm/unmarked_functor", "")
+{
+	BatchedAutoDiffTerm<UnmarkedFunctor, 2> term(2.0);
+	CHECK(term.batch_size() == 1);
+}
+
+TEST_CASE("BatchedAutoDiffTerm/function", "")
+{
+	const int n = 11;
+	double x[n][2];
+	double y[n][1];
+	for (int i = 0; i < n; ++i) {
+		x[i][0] = 1.0 + 0.1 * i;
+		x[i][1] = 0.5 + 0.03 * i;
+		y[i][0] = 2.0 - 0.2 * i;
+	}
+
+	// Terms of both types are added in the same order, so some
+	// batches are interrupted and the last one is incomplete.
+	Function f, f_reference;
+	for (int i = 0; i < n; ++i) {
+		if (i % 7 == 5) {
+			f.add_term(std::make_shared<AutoDiffTerm<GeneratedFunctor, 2, 1>>(2.0, 0.1 * i), x[i], y[i]);
+		}
+		else {
+			f.add_term(std::make_shared<BatchedAutoDiffTerm<GeneratedFunctor, 2, 1>>(2.0, 0.1 * i), x[i], y[i]);
+		}
+		f_reference.add_term(std::make_shared<AutoDiffTerm<GeneratedFunctor, 2, 1>>(2.0, 0.1 * i), x[i], y[i]);
+	}
+
+	Eigen::VectorXd point;
+	f.copy_user_to_global(&point);
+	CHECK(f.evaluate(point) == Approx(f_reference.evaluate(point)));
+
+	Eigen::VectorXd gradient, gradient_reference;
+	Eigen::MatrixXd hessian, hessian_reference;
+	CHECK(f.evaluate(point, &gradient) == Approx(f_reference.evaluate(point, &gradient_reference)));
+	CHECK((gradient - gradient_reference).norm() < 1e-10 * gradient_reference.norm());
+
+	CHECK(f.evaluate(point, &gradient, &hessian) ==
+	      Approx(f_reference.evaluate(point, &gradient_reference, &hessian_reference)));
+	CHECK((gradient - gradient_reference).norm() < 1e-10 * gradient_reference.norm());
+	CHECK((hessian - hessian_reference).norm() < 1e-10 * hessian_reference.norm());
+
+	Eigen::SparseMatrix<double> sparse_hessian;
+	f.create_sparse_hessian(&sparse_hessian);
+	f.evaluate(point, &gradient, &sparse_hessian);
+	CHECK((gradient - gradient_reference).norm() < 1e-10 * gradient_reference.norm());
+	CHECK((Eigen::MatrixXd(sparse_hessian) - hessian_reference).norm() < 1e-10 * hessian_reference.norm());
+
+	f.set_deterministic_evaluation(true);
+	CHECK(f.evaluate(point, &gradient, &hessian) ==
+	      Approx(f_reference.evaluate(point, &gradient_reference, &hessian_reference)));
+	CHECK((hessian - hessian_reference).norm() < 1e-10 * hessian_reference.norm());
+}
@@ -0,0 +1,113 @@
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+#include <sstream>
+#include <stdexcept>
+
+#include <spii/auto_diff_term.h>
+#include <spii/code_generation.h>
+#include <spii/term_factory.h>
+
+using namespace spii;
+
+#include "generated_functor.h"
+// Generated by generate_test_term.
+#include "generated_term.h"
+
+namespace {
+
+void check_terms_equal(const Term& term1, const Term& term2, double* x, double* y)
+{
+	double* variables[2] = {x, y};
+	std::vector<Eigen::VectorXd> gradient1 = {Eigen::VectorXd::Zero(2), Eigen::VectorXd::Zero(1)};
+	std::vector<Eigen::VectorXd> gradient2 = gradient1;
+	std::vector<std::vector<Eigen::MatrixXd>> hessian1(2);
+	for (int var0 = 0; var0 < 2; ++var0) {
+		for (int var1 = 0; var1 < 2; ++var1) {
+			hessian1[var0].push_back(Eigen::MatrixXd::Zero(2 - var0, 2 - var1));
+		}
+	}
+	auto hessian2 = hessian1;
+
+	double value = term1.evaluate(variables, &gradient1, &hessian1);
+	CHECK(Approx(term2.evaluate(variables)) == value);
+	CHECK(Approx(term2.evaluate(variables, &gradient2)) == value);
+	for (int var = 0; var < 2; ++var) {
+		CHECK((gradient1[var] - gradient2[var]).norm() < 1e-10);
+	}
+
+	for (auto& g : gradient2) {
+		g.setZero();
+	}
+	CHECK(Approx(term2.evaluate(variables, &gradient2, &hessian2)) == value);
+	for (int var0 = 0; var0 < 2; ++var0) {
+		CHECK((gradient1[var0] - gradient2[var0]).norm() < 1e-10);
+		for (int var1 = 0; var1 < 2; ++var1) {
+			CHECK((hessian1[var0][var1] - hessian2[var0][var1]).norm() < 1e-10);
+		}
+	}
+}
+
+}
+
+TEST_CASE("CodeGeneration/matches_auto_diff_term")
+{
+	AutoDiffTerm<GeneratedFunctor, 2, 1> auto_diff_term(2.5, -0.1);
+	GeneratedTerm generated_term(2.5, -0.1);
+	CHECK(generated_term.number_of_variables() == 2);
+	CHECK(generated_term.variable_dimension(0) == 2);
+	CHECK(generated_term.variable_dimension(1) == 1);
+
+	double x[2] = {1.3, 0.7};
+	double y[1] = {0.4};
+	check_terms_equal(auto_diff_term, generated_term, x, y);
+
+	x[0] = 1.1;
+	y[0] = 0.2;
+	check_terms_equal(auto_diff_term, generated_term, x, y);
+
+	// The functor takes another branch.
+	y[0] = -0.5;
+	double* variables[2] = {x, y};
+	CHECK_THROWS(generated_term.evaluate(variables));
+}
+
+TEST_CASE("CodeGeneration/serialization")
+{
+	GeneratedTerm term(2.5, -0.1);
+	std::stringstream stream;
+	stream << term;
+
+	TermFactory factory;
+	factory.teach_term<GeneratedTerm>();
+	auto read_term = factory.create(typeid(GeneratedTerm).name(), stream);
+
+	double x[2] = {1.3, 0.7};
+	double y[1] = {0.4};
+	check_terms_equal(term, *read_term, x, y);
+}
+
+class Product
+{
+public:
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		return x[0] * y[0] + 0.0 * x[1];
+	}
+};
+
+TEST_CASE("CodeGeneration/simplification")
+{
+	double x[3] = {1, 2, 3};
+	std::stringstream code;
+	generate_term_code<2, 1>(code, "ProductTerm", Product(), x);
+	std::string text = code.str();
+	CHECK(text.find("class ProductTerm\n\t: public spii::SizedTerm<2, 1>") != std::string::npos);
+	CHECK(text.find("(*gradient)[0](0) = variables[1][0];") != std::string::npos);
+	CHECK(text.find("(*gradient)[1](0) = variables[0][0];") != std::string::npos);
+	CHECK(text.find("(*hessian)[0][1](0, 0) = 1.0;") != std::string::npos);
+	CHECK(text.find("(*hessian)[1][0](0, 0) = 1.0;") != std::string::npos);
+	CHECK(text.find("(*hessian)[0][0](0, 0) = 0.0;") != std::string::npos);
+	CHECK_THROWS((generate_term_code<2, 1>(code, "Not a name", Product(), x)));
+}
@@ -0,0 +1,374 @@
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+#include <spii-thirdparty/fadiff.h>
+
+#include <spii/auto_diff_term.h>
+#include <spii/dual.h>
+#include <spii/dynamic_dual.h>
+#include <spii/dynamic_hyper_dual.h>
+#include <spii/hyper_dual.h>
+#include <spii/reverse.h>
+#include <spii/sparse_dual.h>
+
+using namespace spii;
+
+// Functions supported by both Dual and fadbad::F.
+class ManyFunctions
+{
+public:
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		using std::sqrt; using std::exp; using std::log; using std::sin;
+		using std::cos; using std::tan; using std::asin; using std::acos;
+		using std::atan; using std::pow;
+
+		R a = x[0];
+		R b = x[1];
+		R value = sqrt(a) * exp(b) - log(a + b) / log(a * 3.0);
+		value += sin(a) * cos(b) + tan(b / 5.0);
+		value += asin(b / 3.0) + acos(a / 4.0) + atan(a - b);
+		value += pow(a, 3) + pow(2.0, b) + pow(a, b) * 0.5;
+		value -= 2 / a - (1 - b);
+		value *= a;
+		value /= b;
+		return value;
+	}
+};
+
+// Functions only supported by Dual.
+class MoreFunctions
+{
+public:
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		using std::log10; using std::sinh; using std::cosh; using std::tanh;
+		using std::atan2; using std::abs;
+
+		R a = x[0];
+		R b = x[1];
+		R value = log10(a * 3.0) + sinh(b) - cosh(a) * tanh(a * b);
+		value += atan2(a, b) - atan2(a, 2.0) + atan2(1.5, b);
+		value += abs(b - 2 * a);
+		return value;
+	}
+};
+
+TEST_CASE("Dual/matches_fadbad")
+{
+	double x[2] = {1.3, 0.7};
+	double direction[2] = {0.3, -1.1};
+
+	Dual<double, 2> dual[2];
+	fadbad::F<double, 2> fadbad[2];
+	for (int i = 0; i < 2; ++i) {
+		// A non-trivial derivative direction in the second lane.
+		dual[i] = Dual<double, 2>(x[i], 0);
+		dual[i].d(0) = i == 0 ? 1 : 0;
+		dual[i].d(1) = direction[i];
+		fadbad[i] = x[i];
+		fadbad[i].diff(0);
+		fadbad[i].d(0) = dual[i].d(0);
+		fadbad[i].d(1) = direction[i];
+	}
+
+	ManyFunctions functor;
+	auto f = functor(dual);
+	auto g = functor(fadbad);
+
+	CHECK(Approx(f.x()) == g.x());
+	CHECK(Approx(f.x()) == functor(x));
+	CHECK(Approx(f.d(0)) == g.d(0));
+	CHECK(Approx(f.d(1)) == g.d(1));
+}
+
+TEST_CASE("Dual/matches_finite_differences")
+{
+	double x[2] = {1.3, 0.7};
+	Dual<double, 2> dual[2] = {Dual<double, 2>(x[0], 0), Dual<double, 2>(x[1], 1)};
+
+	MoreFunctions functor;
+	auto f = functor(dual);
+	CHECK(Approx(f.x()) == functor(x));
+
+	const double h = 1e-6;
+	for (int i = 0; i < 2; ++i) {
+		double x_plus[2] = {x[0], x[1]};
+		double x_minus[2] = {x[0], x[1]};
+		x_plus[i] += h;
+		x_minus[i] -= h;
+		double finite_difference = (functor(x_plus) - functor(x_minus)) / (2 * h);
+		CHECK(std::abs(f.d(i) - finite_difference) < 1e-6);
+	}
+}
+
+TEST_CASE("Dual/operators")
+{
+	Dual<float, 3> x(2.0f, 0), y(3.0f, 1), z(-1.0f, 2);
+	CHECK(x < y);
+	CHECK(y >= x);
+	CHECK(x != y);
+	CHECK(z < 0);
+	CHECK(1 > z);
+	CHECK((Dual<float, 3>(2.0f) == x));
+	CHECK(to_double(x) == 2.0);
+
+	auto f = x * y - z / x + 4;
+	CHECK(Approx(f.x()) == 10.5);
+	CHECK(Approx(f.d(0)) == 3.0 - 1.0 / 4.0);
+	CHECK(Approx(f.d(1)) == 2.0);
+	CHECK(Approx(f.d(2)) == -0.5);
+
+	auto g = abs(z) * -y;
+	CHECK(Approx(g.x()) == -3.0);
+	CHECK(Approx(g.d(1)) == -1.0);
+	CHECK(Approx(g.d(2)) == 3.0);
+}
+
+TEST_CASE("HyperDual/matches_fadbad")
+{
+	double x[2] = {1.3, 0.7};
+
+	HyperDual<double, 2> hyper_dual[2] = {HyperDual<double, 2>(x[0], 0),
+	                                      HyperDual<double, 2>(x[1], 1)};
+	fadbad::F<double, 2> fadbad[2];
+	for (int i = 0; i < 2; ++i) {
+		fadbad[i] = x[i];
+		fadbad[i].diff(i);
+	}
+	fadbad::F<double, 2> df[2];
+
+	ManyFunctions functor;
+	auto f = functor(hyper_dual);
+	auto g = differentiate_functor<ManyFunctions, fadbad::F<double, 2>, 2>(functor, fadbad, df);
+
+	CHECK(Approx(f.x()) == g.x());
+	for (int i = 0; i < 2; ++i) {
+		CHECK(Approx(f.d(i)) == df[i].x());
+		for (int j = 0; j < 2; ++j) {
+			CHECK(Approx(f.h(i, j)) == df[i].d(j));
+		}
+	}
+}
+
+TEST_CASE("HyperDual/matches_finite_differences")
+{
+	double x[2] = {1.3, 0.7};
+	HyperDual<double, 2> hyper_dual[2] = {HyperDual<double, 2>(x[0], 0),
+	                                      HyperDual<double, 2>(x[1], 1)};
+
+	MoreFunctions functor;
+	auto f = functor(hyper_dual);
+	CHECK(Approx(f.x()) == functor(x));
+
+	Dual<double, 2> dual[2] = {Dual<double, 2>(x[0], 0), Dual<double, 2>(x[1], 1)};
+	auto g = functor(dual);
+
+	// Differentiate the exact gradient numerically.
+	const double h = 1e-6;
+	for (int i = 0; i < 2; ++i) {
+		CHECK(Approx(f.d(i)) == g.d(i));
+
+		Dual<double, 2> x_plus[2] = {Dual<double, 2>(x[0], 0), Dual<double, 2>(x[1], 1)};
+		Dual<double, 2> x_minus[2] = {Dual<double, 2>(x[0], 0), Dual<double, 2>(x[1], 1)};
+		x_plus[i] += h;
+		x_minus[i] -= h;
+		auto f_plus = functor(x_plus);
+		auto f_minus = functor(x_minus);
+		for (int j = 0; j < 2; ++j) {
+			double finite_difference = (f_plus.d(j) - f_minus.d(j)) / (2 * h);
+			CHECK(std::abs(f.h(i, j) - finite_difference) < 1e-5);
+		}
+	}
+}
+
+TEST_CASE("Reverse/matches_dual")
+{
+	double x[2] = {1.3, 0.7};
+	Dual<double, 2> dual[2] = {Dual<double, 2>(x[0], 0), Dual<double, 2>(x[1], 1)};
+
+	auto& tape = ReverseTape<double>::thread_tape();
+	auto tape_size = tape.size();
+	{
+		ReverseTapeScope<double> scope;
+		Reverse<double> reverse[2] = {Reverse<double>(x[0], 0), Reverse<double>(x[1], 1)};
+
+		ManyFunctions many_functions;
+		auto f = many_functions(reverse);
+		auto g = many_functions(dual);
+		CHECK(Approx(f.x()) == g.x());
+		auto adjoints = scope.tape.sweep(scope.begin, f.tape_index());
+		CHECK(Approx(adjoints[0]) == g.d(0));
+		CHECK(Approx(adjoints[1]) == g.d(1));
+
+		MoreFunctions more_functions;
+		f = more_functions(reverse);
+		g = more_functions(dual);
+		CHECK(Approx(f.x()) == g.x());
+		adjoints = scope.tape.sweep(scope.begin, f.tape_index());
+		CHECK(Approx(adjoints[0]) == g.d(0));
+		CHECK(Approx(adjoints[1]) == g.d(1));
+
+		// Constants are not recorded.
+		Reverse<double> constant = 2.0;
+		CHECK((constant * 3.0 + 1.0).tape_index() == -1);
+		CHECK(scope.tape.sweep(scope.begin, -1)[0] == 0);
+	}
+	CHECK(tape.size() == tape_size);
+}
+
+TEST_CASE("DynamicDual/matches_dual")
+{
+	double x[2] = {1.3, 0.7};
+	Dual<double, 2> dual[2] = {Dual<double, 2>(x[0], 0), Dual<double, 2>(x[1], 1)};
+
+	// Small numbers store their derivatives locally; large ones use
+	// the arena.
+	for (int size : {2, DynamicDual<double>::local_size + 3}) {
+		DynamicArenaScope scope;
+		DynamicDual<double> dynamic_dual[2] = {DynamicDual<double>(x[0], 0, size),
+		                                       DynamicDual<double>(x[1], 1, size)};
+
+		auto f = ManyFunctions()(dynamic_dual);
+		auto g = ManyFunctions()(dual);
+		CHECK(f.size() == size);
+		CHECK(Approx(f.x()) == g.x());
+		CHECK(Approx(f.d(0)) == g.d(0));
+		CHECK(Approx(f.d(1)) == g.d(1));
+		for (int i = 2; i <= size; ++i) {
+			CHECK(f.d(i) == 0);
+		}
+
+		f = MoreFunctions()(dynamic_dual);
+		g = MoreFunctions()(dual);
+		CHECK(Approx(f.x()) == g.x());
+		CHECK(Approx(f.d(0)) == g.d(0));
+		CHECK(Approx(f.d(1)) == g.d(1));
+
+		// Constants have no derivatives.
+		DynamicDual<double> constant = 2.0;
+		CHECK((constant * 3.0 + 1.0).size() == 0);
+		CHECK((constant * dynamic_dual[1]).d(1) == 2.0);
+		CHECK(constant.d(0) == 0);
+	}
+}
+
+TEST_CASE("DynamicHyperDual/matches_hyper_dual")
+{
+	double x[2] = {1.3, 0.7};
+	HyperDual<double, 3> hyper_dual[2] = {HyperDual<double, 3>(x[0], 0),
+	                                      HyperDual<double, 3>(x[1], 1)};
+
+	DynamicArenaScope scope;
+	DynamicHyperDual<double> dynamic_hyper_dual[2] = {DynamicHyperDual<double>(x[0], 0, 3),
+	                                                  DynamicHyperDual<double>(x[1], 1, 3)};
+
+	auto f = ManyFunctions()(dynamic_hyper_dual);
+	auto g = ManyFunctions()(hyper_dual);
+	CHECK(f.size() == 3);
+	CHECK(Approx(f.x()) == g.x());
+	for (int i = 0; i < 3; ++i) {
+		CHECK(Approx(f.d(i)) == g.d(i));
+		for (int j = 0; j < 3; ++j) {
+			CHECK(Approx(f.h(i, j)) == g.h(i, j));
+		}
+	}
+
+	f = MoreFunctions()(dynamic_hyper_dual);
+	g = MoreFunctions()(hyper_dual);
+	CHECK(Approx(f.x()) == g.x());
+	for (int i = 0; i < 3; ++i) {
+		CHECK(Approx(f.d(i)) == g.d(i));
+		for (int j = 0; j < 3; ++j) {
+			CHECK(Approx(f.h(i, j)) == g.h(i, j));
+		}
+	}
+
+	// Constants have no derivatives.
+	DynamicHyperDual<double> constant = 2.0;
+	CHECK((constant * 3.0 + 1.0).size() == 0);
+	auto p = constant * dynamic_hyper_dual[0] * dynamic_hyper_dual[1];
+	CHECK(p.d(1) == 2.0 * x[0]);
+	CHECK(p.h(1, 0) == 2.0);
+	CHECK(p.h(0, 0) == 0);
+}
+
+TEST_CASE("SparseDual/matches_dual")
+{
+	// The variables have indices 0 and 2 out of 3.
+	double x[2] = {1.3, 0.7};
+	Dual<double, 3> dual[2] = {Dual<double, 3>(x[0], 0), Dual<double, 3>(x[1], 2)};
+
+	DynamicArenaScope scope;
+	SparseDual<double> sparse_dual[2] = {SparseDual<double>(x[0], 0), SparseDual<double>(x[1], 2)};
+
+	auto f = ManyFunctions()(sparse_dual);
+	auto g = ManyFunctions()(dual);
+	CHECK(Approx(f.x()) == g.x());
+	CHECK(f.nonzeros() == 2);
+	CHECK(f.nonzero_index(1) == 2);
+	for (int i = 0; i < 3; ++i) {
+		CHECK(Approx(f.d(i)) == g.d(i));
+	}
+
+	f = MoreFunctions()(sparse_dual);
+	g = MoreFunctions()(dual);
+	CHECK(Approx(f.x()) == g.x());
+	for (int i = 0; i < 3; ++i) {
+		CHECK(Approx(f.d(i)) == g.d(i));
+	}
+
+	// Constants have no derivatives.
+	SparseDual<double> constant = 2.0;
+	CHECK((constant * 3.0 + 1.0).nonzeros() == 0);
+	CHECK((constant * sparse_dual[1]).d(2) == 2.0);
+	CHECK((sparse_dual[0] + 1.0).nonzeros() == 1);
+
+	// The probe measures the fraction of nonzero derivatives.
+	SparsityProbe probe;
+	f = sparse_dual[0] * 2.0;
+	f = f * sparse_dual[1];
+	CHECK(probe.numbers == 2);
+	CHECK(probe.density(3) == Approx(0.5));
+}
+
+TEST_CASE("SparseHyperDual/matches_hyper_dual")
+{
+	double x[2] = {1.3, 0.7};
+	HyperDual<double, 3> hyper_dual[2] = {HyperDual<double, 3>(x[0], 0),
+	                                      HyperDual<double, 3>(x[1], 2)};
+
+	DynamicArenaScope scope;
+	SparseHyperDual<double> sparse_hyper_dual[2] = {SparseHyperDual<double>(x[0], 0),
+	                                                SparseHyperDual<double>(x[1], 2)};
+
+	auto f = ManyFunctions()(sparse_hyper_dual);
+	auto g = ManyFunctions()(hyper_dual);
+	CHECK(Approx(f.x()) == g.x());
+	CHECK(f.hessian_nonzeros() == 3);
+	for (int i = 0; i < 3; ++i) {
+		CHECK(Approx(f.d(i)) == g.d(i));
+		for (int j = 0; j < 3; ++j) {
+			CHECK(Approx(f.h(i, j)) == g.h(i, j));
+		}
+	}
+
+	f = MoreFunctions()(sparse_hyper_dual);
+	g = MoreFunctions()(hyper_dual);
+	CHECK(Approx(f.x()) == g.x());
+	for (int i = 0; i < 3; ++i) {
+		CHECK(Approx(f.d(i)) == g.d(i));
+		for (int j = 0; j < 3; ++j) {
+			CHECK(Approx(f.h(i, j)) == g.h(i, j));
+		}
+	}
+
+	// The product of two variables has a single second derivative.
+	auto p = sparse_hyper_dual[0] * sparse_hyper_dual[1];
+	REQUIRE(p.hessian_nonzeros() == 1);
+	CHECK(p.hessian_row(0) == 0);
+	CHECK(p.hessian_column(0) == 2);
+	CHECK(p.hessian_derivative(0) == 1.0);
+}
@@ -355,3 +355,86 @@ TEST_CASE("AutoDiffTerm/MyFunctor4")
 	CHECK(Approx(hessian[3][2](1,2)) == 0.0);
 }
 
+
+class MyFunctor5
+{
+public:
+	static const bool single_precision = true;
+
+	template<typename R>
+	R operator()(const R* const a,
+	             const R* const b,
+	             const R* const c,
+	             const R* const d,
+	             const R* const e) const
+	{
+		R value = a[0] * b[1] - exp(c[2] / e[3]);
+		for (int i = 0; i < 4; ++i) {
+			value += sin(d[0] * e[i]) + R(0.5) * e[i] * e[i];
+		}
+		return value * (b[0] + c[0] * c[1]);
+	}
+};
+
+TEST_CASE("AutoDiffTerm/MyFunctor5")
+{
+	AutoDiffTerm<MyFunctor5, Dynamic, Dynamic, Dynamic, Dynamic, Dynamic> term(1, 2, 3, 1, 4);
+	AutoDiffTerm<MyFunctor5, 1, 2, 3, 1, 4> static_term;
+	REQUIRE(term.number_of_variables() == 5);
+	CHECK(term.variable_dimension(2) == 3);
+	CHECK(term.variable_dimension(4) == 4);
+
+	double a[1] = {0.5};
+	double b[2] = {1.0, -2.0};
+	double c[3] = {0.3, 0.4, 1.5};
+	double d[1] = {2.0};
+	double e[4] = {1.1, 1.2, -0.7, 2.5};
+	double* variables[5] = {a, b, c, d, e};
+
+	std::vector<Eigen::VectorXd> gradient, static_gradient;
+	std::vector<std::vector<Eigen::MatrixXd>> hessian(5), static_hessian(5);
+	for (int var0 = 0; var0 < 5; ++var0) {
+		int d0 = term.variable_dimension(var0);
+		gradient.push_back(Eigen::VectorXd::Zero(d0));
+		static_gradient.push_back(Eigen::VectorXd::Zero(d0));
+		for (int var1 = 0; var1 < 5; ++var1) {
+			int d1 = term.variable_dimension(var1);
+			hessian[var0].push_back(Eigen::MatrixXd::Zero(d0, d1));
+			static_hessian[var0].push_back(Eigen::MatrixXd::Zero(d0, d1));
+		}
+	}
+
+	double value = static_term.evaluate(variables, &static_gradient, &static_hessian);
+	CHECK(Approx(term.evaluate(variables)) == value);
+	CHECK(Approx(term.evaluate(variables, &gradient)) == value);
+	for (int var = 0; var < 5; ++var) {
+		CHECK((gradient[var] - static_gradient[var]).norm() < 1e-12);
+	}
+
+	for (auto& g : gradient) {
+		g.setZero();
+	}
+	CHECK(Approx(term.evaluate(variables, &gradient, &hessian)) == value);
+	for (int var0 = 0; var0 < 5; ++var0) {
+		CHECK((gradient[var0] - static_gradient[var0]).norm() < 1e-12);
+		for (int var1 = 0; var1 < 5; ++var1) {
+			CHECK((hessian[var0][var1] - static_hessian[var0][var1]).norm() < 1e-10);
+		}
+	}
+
+	REQUIRE(term.has_single_precision());
+	float af[1] = {0.5f};
+	float bf[2] = {1.0f, -2.0f};
+	float cf[3] = {0.3f, 0.4f, 1.5f};
+	float df[1] = {2.0f};
+	float ef[4] = {1.1f, 1.2f, -0.7f, 2.5f};
+	float* float_variables[5] = {af, bf, cf, df, ef};
+	std::vector<Eigen::VectorXf> float_gradient;
+	for (int var = 0; var < 5; ++var) {
+		float_gradient.push_back(Eigen::VectorXf::Zero(term.variable_dimension(var)));
+	}
+	CHECK(Approx(term.evaluate_float(float_variables, &float_gradient)).epsilon(1e-4) == value);
+	for (int var = 0; var < 5; ++var) {
+		CHECK((float_gradient[var].cast<double>() - static_gradient[var]).norm() < 1e-3);
+	}
+}
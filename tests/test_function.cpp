@@ -6,6 +6,7 @@
 
 #include <spii/auto_diff_term.h>
 #include <spii/function.h>
+#include <spii/function_view.h>
 #include <spii/interval_term.h>
 #include <spii/transformations.h>
 
@@ -804,6 +805,124 @@ TEST(Function, Parametrization_2_to_1)
 	}
 }
 
+TEST(Function, Parametrization_jacobians)
+{
+	double x[2], u[2], z[2], y[1], v[1];
+	double a[2] = {-1.0, 0.5};
+	double b[2] = {2.0, 4.0};
+	Function f;
+	f.add_variable_with_change<GreaterThanZero>(x, 2, 2);
+	f.add_variable_with_change<Box>(u, 2, 2, a, b);
+	f.add_variable_with_change<Circle>(z, 2);
+	f.add_variable_with_change<IntervalConstraint>(y, 1, 1.0, 3.0);
+	f.add_variable_with_change<GreaterThanZero>(v, 1, 1);
+	f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), u);
+	f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), z);
+	f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), y, v);
+	f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), v, y);
+	EXPECT_EQ(f.get_number_of_scalars(), 7);
+
+	Eigen::VectorXd t(7);
+	t << 0.5, -1.5, 0.3, -2.0, 0.7, 0.4, 1.2;
+	Eigen::VectorXd gradient;
+	f.evaluate(t, &gradient);
+
+	// The closed-form Jacobians of the transformations and the
+	// differentiated Jacobian of Circle match finite differences.
+	for (int i = 0; i < 7; ++i) {
+		const double h = 1e-6;
+		Eigen::VectorXd t_plus = t, t_minus = t;
+		t_plus[i] += h;
+		t_minus[i] -= h;
+		double finite_difference = (f.evaluate(t_plus) - f.evaluate(t_minus)) / (2 * h);
+		EXPECT_NEAR(gradient[i], finite_difference, 1e-6);
+	}
+
+	Eigen::VectorXd deterministic_gradient;
+	f.set_deterministic_evaluation(true);
+	f.evaluate(t, &deterministic_gradient);
+	EXPECT_LT((gradient - deterministic_gradient).norm(), 1e-12);
+
+	// The default Jacobian is computed with update_gradient.
+	AutoDiffChangeOfVariables<Circle> circle(new Circle);
+	double theta = 0.7;
+	double dx_dt[2], default_dx_dt[2];
+	circle.jacobian(dx_dt, &theta);
+	circle.ChangeOfVariables::jacobian(default_dx_dt, &theta);
+	EXPECT_NEAR(dx_dt[0], -std::sin(theta), 1e-12);
+	EXPECT_NEAR(dx_dt[1], std::cos(theta), 1e-12);
+	EXPECT_NEAR(default_dx_dt[0], dx_dt[0], 1e-12);
+	EXPECT_NEAR(default_dx_dt[1], dx_dt[1], 1e-12);
+}
+
+class CrossTerm
+{
+public:
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		return x[0] * y[1] + sin(x[1] * y[0]);
+	}
+};
+
+TEST(Function, Parametrization_hessians)
+{
+	double x[2], u[2], z[2], y[1], v[1];
+	double a[2] = {-1.0, 0.5};
+	double b[2] = {2.0, 4.0};
+	Function f;
+	f.add_variable_with_change<GreaterThanZero>(x, 2, 2);
+	f.add_variable_with_change<Box>(u, 2, 2, a, b);
+	f.add_variable_with_change<Circle>(z, 2);
+	f.add_variable_with_change<IntervalConstraint>(y, 1, 1.0, 3.0);
+	f.add_variable(v, 1);
+	f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), u, z);
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), x, u);
+	f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), y, v);
+
+	Eigen::VectorXd t(6);
+	t << 0.5, -1.5, 0.3, -2.0, 0.7, 0.4;
+	Eigen::VectorXd t_full(7);
+	t_full << t, 1.2;
+	Eigen::VectorXd gradient;
+	Eigen::MatrixXd hessian;
+	f.evaluate(t_full, &gradient, &hessian);
+	EXPECT_LT((hessian - hessian.transpose()).norm(), 1e-12);
+
+	// The Hessian matches finite differences of the gradient.
+	for (int i = 0; i < 7; ++i) {
+		const double h = 1e-6;
+		Eigen::VectorXd t_plus = t_full, t_minus = t_full;
+		t_plus[i] += h;
+		t_minus[i] -= h;
+		Eigen::VectorXd gradient_plus, gradient_minus;
+		f.evaluate(t_plus, &gradient_plus);
+		f.evaluate(t_minus, &gradient_minus);
+		for (int j = 0; j < 7; ++j) {
+			EXPECT_NEAR(hessian(i, j), (gradient_plus[j] - gradient_minus[j]) / (2 * h), 1e-6);
+		}
+	}
+
+	Eigen::VectorXd sparse_gradient;
+	Eigen::SparseMatrix<double> sparse_hessian;
+	f.create_sparse_hessian(&sparse_hessian);
+	f.evaluate(t_full, &sparse_gradient, &sparse_hessian);
+	EXPECT_LT((sparse_gradient - gradient).norm(), 1e-12);
+	EXPECT_LT((Eigen::MatrixXd(sparse_hessian) - hessian).norm(), 1e-12);
+
+	f.set_deterministic_evaluation(true);
+	Eigen::VectorXd deterministic_gradient;
+	Eigen::MatrixXd deterministic_hessian;
+	f.evaluate(t_full, &deterministic_gradient, &deterministic_hessian);
+	EXPECT_LT((deterministic_gradient - gradient).norm(), 1e-12);
+	EXPECT_LT((deterministic_hessian - hessian).norm(), 1e-12);
+	f.evaluate(t_full, &sparse_gradient, &sparse_hessian);
+	EXPECT_LT((sparse_gradient - gradient).norm(), 1e-12);
+	EXPECT_LT((Eigen::MatrixXd(sparse_hessian) - hessian).norm(), 1e-12);
+}
+
 class ThrowsRuntimeError
 {
 public:
@@ -890,6 +1009,58 @@ TEST(Function, evaluate_interval)
 	EXPECT_DOUBLE_EQ(result.get_upper(), expected.get_upper());
 }
 
+TEST(Function, evaluate_interval_many_terms)
+{
+	std::vector<double> x(200, 2.0);
+	IntervalVector x_interval;
+	for (int i = 0; i < 200; ++i) {
+		x_interval.push_back(Interval<double>(1.0 + i / 200.0, 3.0));
+	}
+
+	auto term = std::make_shared<IntervalTerm<SimplePolynomial, 1>>();
+	Function f;
+	std::vector<TermHandle> handles;
+	for (int i = 0; i < 150; ++i) {
+		handles.push_back(f.add_term(term, &x[i]));
+	}
+
+	auto expected = [&](const std::vector<int>& indices) -> Interval<double>
+	{
+		Interval<double> sum(0.0);
+		for (auto i: indices) {
+			const Interval<double>* argument = &x_interval[i];
+			sum += term->evaluate_interval(&argument);
+		}
+		return sum;
+	};
+	std::vector<int> indices;
+	for (int i = 0; i < 150; ++i) {
+		indices.push_back(i);
+	}
+
+	auto result = f.evaluate(x_interval);
+	auto expected_result = expected(indices);
+	EXPECT_DOUBLE_EQ(result.get_lower(), expected_result.get_lower());
+	EXPECT_DOUBLE_EQ(result.get_upper(), expected_result.get_upper());
+
+	// Terms added and removed after the first evaluation.
+	for (int i = 150; i < 200; ++i) {
+		f.add_term(term, &x[i]);
+		indices.push_back(i);
+	}
+	f.remove_term(handles[10]);
+	indices.erase(indices.begin() + 10);
+	result = f.evaluate(x_interval);
+	expected_result = expected(indices);
+	EXPECT_DOUBLE_EQ(result.get_lower(), expected_result.get_lower());
+	EXPECT_DOUBLE_EQ(result.get_upper(), expected_result.get_upper());
+
+	f.set_deterministic_evaluation(true);
+	auto deterministic_result = f.evaluate(x_interval);
+	EXPECT_DOUBLE_EQ(deterministic_result.get_lower(), expected_result.get_lower());
+	EXPECT_DOUBLE_EQ(deterministic_result.get_upper(), expected_result.get_upper());
+}
+
 TEST_CASE("variables_overlap_1")
 {
 	Function f;
@@ -968,3 +1139,564 @@ TEST_CASE("invalid_user_data")
 	CHECK_THROWS(f.evaluate());
 	CHECK_THROWS(f.copy_user_to_global(&eigen_vector));
 }
+
+TEST(Function, deterministic_evaluation)
+{
+	std::vector<double> x(40);
+	std::vector<double> y(20);
+	for (int i = 0; i < x.size(); ++i) {
+		x[i] = 0.1 * i + 1.0;
+	}
+	for (int i = 0; i < y.size(); ++i) {
+		y[i] = 0.3 * i + 2.0;
+	}
+
+	Function f;
+	// Enough terms to give several chunks with different values.
+	for (int k = 0; k < 1000; ++k) {
+		f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), &x[2 * ((7 * k) % 20)]);
+		f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), &y[(3 * k) % 20], &y[(11 * k + 1) % 20]);
+	}
+
+	Eigen::VectorXd xg;
+	f.copy_user_to_global(&xg);
+
+	Eigen::VectorXd reference_gradient;
+	Eigen::MatrixXd reference_hessian;
+	double reference_value = f.evaluate(xg, &reference_gradient, &reference_hessian);
+
+	f.set_deterministic_evaluation(true);
+
+	Eigen::VectorXd gradient1;
+	Eigen::MatrixXd hessian1;
+	Eigen::SparseMatrix<double> sparse_hessian1;
+	f.create_sparse_hessian(&sparse_hessian1);
+	f.set_number_of_threads(1);
+	double value1 = f.evaluate(xg);
+	double value1_gradient = f.evaluate(xg, &gradient1, &hessian1);
+	f.evaluate(xg, &gradient1, &sparse_hessian1);
+
+	EXPECT_EQ(value1, value1_gradient);
+	EXPECT_LE(std::abs(value1 - reference_value), 1e-10 * std::abs(reference_value));
+	EXPECT_LE((gradient1 - reference_gradient).norm(), 1e-10 * reference_gradient.norm());
+	EXPECT_LE((hessian1 - reference_hessian).norm(), 1e-10 * reference_hessian.norm());
+
+	for (int threads = 2; threads <= 5; ++threads) {
+		f.set_number_of_threads(threads);
+
+		Eigen::VectorXd gradient;
+		Eigen::MatrixXd hessian;
+		Eigen::SparseMatrix<double> sparse_hessian;
+		f.create_sparse_hessian(&sparse_hessian);
+		EXPECT_EQ(f.evaluate(xg), value1);
+		EXPECT_EQ(f.evaluate(xg, &gradient, &hessian), value1);
+		for (int i = 0; i < gradient.size(); ++i) {
+			EXPECT_EQ(gradient[i], gradient1[i]);
+		}
+		for (int i = 0; i < hessian.rows(); ++i) {
+			for (int j = 0; j < hessian.cols(); ++j) {
+				EXPECT_EQ(hessian(i, j), hessian1(i, j));
+			}
+		}
+
+		gradient.setZero();
+		EXPECT_EQ(f.evaluate(xg, &gradient, &sparse_hessian), value1);
+		for (int i = 0; i < gradient.size(); ++i) {
+			EXPECT_EQ(gradient[i], gradient1[i]);
+		}
+		for (int i = 0; i < hessian.rows(); ++i) {
+			for (int j = 0; j < hessian.cols(); ++j) {
+				EXPECT_EQ(sparse_hessian.coeff(i, j), sparse_hessian1.coeff(i, j));
+			}
+		}
+	}
+}
+
+// Single3 with single precision.
+class Single3Float
+	: public Single3
+{
+public:
+	static const bool single_precision = true;
+};
+
+TEST(Function, single_precision)
+{
+	double x[3] = {1.0, 2.0, 3.0};
+	double y[2] = {3.0, 4.0};
+
+	// Mixed3_2 does not support single precision and is evaluated
+	// in double precision.
+	Function f;
+	f.add_term(std::make_shared<AutoDiffTerm<Single3Float, 3>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed3_2, 3, 2>>(), x, y);
+
+	Eigen::VectorXd xg;
+	f.copy_user_to_global(&xg);
+	Eigen::VectorXd reference_gradient;
+	double reference_value = f.evaluate(xg, &reference_gradient);
+
+	f.single_precision = true;
+	Eigen::VectorXd gradient;
+	double value = f.evaluate(xg, &gradient);
+	EXPECT_NEAR(value, reference_value, 1e-6 * std::abs(reference_value));
+	EXPECT_NEAR(f.evaluate(xg), value, 1e-6 * std::abs(reference_value));
+	EXPECT_NEAR(f.evaluate(), value, 1e-6 * std::abs(reference_value));
+	ASSERT_EQ(gradient.size(), reference_gradient.size());
+	for (int i = 0; i < gradient.size(); ++i) {
+		EXPECT_NEAR(gradient[i], reference_gradient[i], 1e-5 * reference_gradient.norm());
+	}
+
+	// Hessians are always computed in double precision.
+	Eigen::MatrixXd hessian;
+	EXPECT_DOUBLE_EQ(f.evaluate(xg, &gradient, &hessian), reference_value);
+}
+
+TEST(Function, connected_components)
+{
+	double x[2] = {1.0, 2.0};
+	double y[1] = {3.0};
+	double z[1] = {4.0};
+	double w[1] = {5.0};
+	double v[1] = {6.0};
+	double c[1] = {7.0};
+
+	auto term1 = std::make_shared<AutoDiffTerm<Term1, 2>>();
+	auto term2 = std::make_shared<AutoDiffTerm<Term2, 1, 1>>();
+
+	Function f;
+	f.add_term(term1, x);
+	f.add_term(term2, y, z);
+	f.add_term(term2, v, c);
+	f.add_term(term2, z, w);
+	// The constant variable c does not connect y and v.
+	f.add_term(term2, y, c);
+	f.set_constant(c, true);
+	// Inactive terms do not connect anything.
+	auto inactive = f.add_term(term2, w, v);
+	f.set_term_active(inactive, false);
+	f += 2.0;
+
+	auto components = f.get_connected_components();
+	ASSERT_EQ(components.size(), 3);
+	EXPECT_EQ(components[0].get_number_of_scalars(), 2);
+	EXPECT_EQ(components[0].get_number_of_terms(), 1);
+	EXPECT_EQ(components[1].get_number_of_scalars(), 3);
+	EXPECT_EQ(components[1].get_number_of_terms(), 3);
+	EXPECT_EQ(components[2].get_number_of_scalars(), 1);
+	EXPECT_EQ(components[2].get_number_of_variables(), 2);
+	EXPECT_EQ(components[2].get_number_of_terms(), 1);
+
+	double sum = 0;
+	for (const auto& component: components) {
+		sum += component.evaluate();
+	}
+	EXPECT_DOUBLE_EQ(sum, f.evaluate());
+
+	// Variables keep their relative order.
+	Eigen::VectorXd x1;
+	components[1].copy_user_to_global(&x1);
+	ASSERT_EQ(x1.size(), 3);
+	EXPECT_EQ(x1[0], 3.0);
+	EXPECT_EQ(x1[1], 4.0);
+	EXPECT_EQ(x1[2], 5.0);
+}
+
+TEST(FunctionView, subset_of_terms)
+{
+	std::vector<double> x(20);
+	std::vector<double> y(10);
+	for (int i = 0; i < 20; ++i) {
+		x[i] = 0.1 * i;
+	}
+	for (int i = 0; i < 10; ++i) {
+		y[i] = 1.0 + i;
+	}
+
+	auto term1 = std::make_shared<AutoDiffTerm<Term1, 2>>();
+	auto term2 = std::make_shared<AutoDiffTerm<Term2, 1, 1>>();
+
+	Function f;
+	std::vector<TermHandle> handles;
+	for (int i = 0; i < 10; ++i) {
+		handles.push_back(f.add_term(term1, &x[2*i]));
+		handles.push_back(f.add_term(term2, &y[i], &y[(i + 1) % 10]));
+	}
+	f.set_constant(&y[3], true);
+	f += 10.0;
+
+	// Every third term and the term using the constant variable,
+	// and the same terms added to a new function.
+	std::vector<bool> mask(f.get_number_of_terms());
+	Function expected;
+	for (int i = 0; i < 20; ++i) {
+		if (i % 3 != 0 && i != 5) {
+			continue;
+		}
+		mask[i] = true;
+		if (i % 2 == 0) {
+			expected.add_term(term1, &x[i]);
+		}
+		else {
+			expected.add_term(term2, &y[i / 2], &y[(i / 2 + 1) % 10]);
+		}
+	}
+	expected.set_constant(&y[3], true);
+
+	FunctionView view(f, mask);
+	const Function& view_function = view.get_function();
+	EXPECT_EQ(view.get_term_handles().size(), 8);
+	EXPECT_EQ(view_function.get_number_of_terms(), expected.get_number_of_terms());
+	EXPECT_EQ(view_function.get_number_of_variables(), expected.get_number_of_variables());
+	EXPECT_EQ(view_function.get_number_of_scalars(), expected.get_number_of_scalars());
+	EXPECT_DOUBLE_EQ(view_function.evaluate(), expected.evaluate());
+
+	Eigen::VectorXd xg, gradient, expected_gradient;
+	view_function.copy_user_to_global(&xg);
+	EXPECT_DOUBLE_EQ(view_function.evaluate(xg, &gradient), expected.evaluate(xg, &expected_gradient));
+	ASSERT_EQ(gradient.size(), expected_gradient.size());
+	for (int i = 0; i < gradient.size(); ++i) {
+		EXPECT_DOUBLE_EQ(gradient[i], expected_gradient[i]);
+	}
+
+	// Views of handles and the full mask.
+	FunctionView first_terms(f, std::vector<TermHandle>{handles[0], handles[1]});
+	EXPECT_EQ(first_terms.get_function().get_number_of_scalars(), 4);
+	FunctionView all(f, std::vector<bool>(f.get_number_of_terms(), true));
+	EXPECT_DOUBLE_EQ(all.get_function().evaluate() + 10.0, f.evaluate());
+
+	// Removing terms moves others to new positions, but their handles
+	// still refer to them.
+	f.remove_term(handles[0]);
+	FunctionView last_term(f, std::vector<TermHandle>{handles[19]});
+	EXPECT_EQ(last_term.get_function().get_number_of_terms(), 1);
+	EXPECT_DOUBLE_EQ(last_term.get_function().evaluate(), std::log(y[9]) + 3.0 * std::log(y[0]));
+
+	EXPECT_THROW(FunctionView(f, std::vector<TermHandle>{handles[0]}), std::runtime_error);
+	EXPECT_THROW(FunctionView(f, std::vector<bool>(3, true)), std::runtime_error);
+}
+
+TEST(Function, memory_usage)
+{
+	double x[3] = {1.0, 2.0, 3.0};
+	double y[2] = {3.0, 4.0};
+
+	Function f;
+	f.set_number_of_threads(4);
+	f.add_term(std::make_shared<AutoDiffTerm<Single3, 3>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed3_2, 3, 2>>(), x, y);
+
+	auto estimate = f.estimate_memory_usage(Function::DENSE_HESSIAN);
+	EXPECT_TRUE(f.estimate_memory_usage(Function::NO_HESSIAN).total() < estimate.total());
+
+	Eigen::VectorXd xg, gradient;
+	Eigen::MatrixXd hessian;
+	f.copy_user_to_global(&xg);
+	double value = f.evaluate(xg, &gradient, &hessian);
+
+	// The storage for threads is allocated as estimated.
+	auto usage = f.memory_usage();
+	EXPECT_EQ(usage.bytes["Thread gradients"], estimate.bytes["Thread gradients"]);
+	EXPECT_EQ(usage.bytes["Thread gradient scratch"], estimate.bytes["Thread gradient scratch"]);
+	EXPECT_EQ(usage.bytes["Thread Hessian scratch"], estimate.bytes["Thread Hessian scratch"]);
+	EXPECT_EQ(usage.bytes["Thread dense Hessians"], estimate.bytes["Thread dense Hessians"]);
+
+	// Checking the budget does not change the function.
+	EXPECT_TRUE( ! f.fits_memory_budget(0, Function::DENSE_HESSIAN));
+	EXPECT_EQ(f.estimate_memory_usage(Function::DENSE_HESSIAN).total(), estimate.total());
+
+	// Everything fits in the estimated memory.
+	EXPECT_TRUE(f.fits_memory_budget(estimate.total(), Function::DENSE_HESSIAN));
+	EXPECT_TRUE(f.fit_to_memory_budget(estimate.total(), Function::DENSE_HESSIAN));
+	EXPECT_EQ(f.estimate_memory_usage(Function::DENSE_HESSIAN).total(), estimate.total());
+
+	// Nothing fits in an empty budget. The smallest configuration
+	// is used instead.
+	EXPECT_TRUE( ! f.fit_to_memory_budget(0, Function::DENSE_HESSIAN));
+	EXPECT_LE(f.estimate_memory_usage(Function::DENSE_HESSIAN).total(), estimate.total());
+
+	Eigen::VectorXd gradient2;
+	Eigen::MatrixXd hessian2;
+	EXPECT_NEAR(f.evaluate(xg, &gradient2, &hessian2), value, 1e-12 * std::abs(value));
+	EXPECT_LE(f.memory_usage().total(), usage.total());
+	for (int i = 0; i < gradient.size(); ++i) {
+		EXPECT_NEAR(gradient2[i], gradient[i], 1e-12 * gradient.norm());
+		for (int j = 0; j < gradient.size(); ++j) {
+			EXPECT_NEAR(hessian2(i, j), hessian(i, j), 1e-12 * hessian.norm());
+		}
+	}
+}
+
+TEST(Function, remove_and_deactivate_terms)
+{
+	double x[2] = {1.0, 2.0};
+	double y[1] = {3.0};
+	double z[1] = {4.0};
+
+	auto term1 = std::make_shared<AutoDiffTerm<Term1, 2>>();
+	auto term2 = std::make_shared<AutoDiffTerm<Term2, 1, 1>>();
+
+	Function f;
+	auto handle1 = f.add_term(term1, x);
+	auto handle2 = f.add_term(term2, y, z);
+	auto handle3 = f.add_term(term1, x);
+	EXPECT_EQ(f.get_number_of_terms(), 3);
+
+	Function f1;
+	f1.add_term(term1, x);
+	Function f2;
+	f2.add_term(term2, y, z);
+
+	double value1 = f1.evaluate();
+	double value2 = f2.evaluate();
+	EXPECT_DOUBLE_EQ(f.evaluate(), 2 * value1 + value2);
+
+	f.set_term_active(handle1, false);
+	EXPECT_TRUE( ! f.is_term_active(handle1));
+	EXPECT_TRUE(f.is_term_active(handle3));
+	EXPECT_DOUBLE_EQ(f.evaluate(), value1 + value2);
+
+	Eigen::VectorXd xg, gradient, gradient1, gradient2;
+	f.copy_user_to_global(&xg);
+	f.evaluate(xg, &gradient);
+	f.set_term_active(handle1, true);
+	f.remove_term(handle3);
+	EXPECT_EQ(f.get_number_of_terms(), 2);
+	EXPECT_THROW(f.remove_term(handle3), std::runtime_error);
+	EXPECT_THROW(f.set_term_active(handle3, false), std::runtime_error);
+	EXPECT_DOUBLE_EQ(f.evaluate(), value1 + value2);
+	f.evaluate(xg, &gradient1);
+	for (int i = 0; i < gradient.size(); ++i) {
+		EXPECT_DOUBLE_EQ(gradient[i], gradient1[i]);
+	}
+
+	// Handles of the remaining terms are still valid.
+	f.remove_term(handle1);
+	EXPECT_DOUBLE_EQ(f.evaluate(), value2);
+	f.remove_term(handle2);
+	EXPECT_EQ(f.get_number_of_terms(), 0);
+	EXPECT_DOUBLE_EQ(f.evaluate(), 0.0);
+
+	// New terms and variables can be added after evaluation.
+	double w[2] = {1.0, 2.0};
+	f.add_term(term1, w);
+	f.add_term(term2, y, z);
+	EXPECT_DOUBLE_EQ(f.evaluate(), value1 + value2);
+	f.copy_user_to_global(&xg);
+	f.evaluate(xg, &gradient2);
+	// x is still part of the function.
+	EXPECT_EQ(gradient2.size(), 6);
+	EXPECT_EQ(gradient2[f.get_variable_global_index(x)], 0.0);
+}
+
+TEST(Function, finite_difference_derivatives)
+{
+	double x[2] = {0.5, -1.5};
+	double u[2] = {0.3, -2.0};
+	double z[2] = {0.7, 0.4};
+	double y[1] = {1.5};
+	double v[1] = {1.2};
+	double c[2] = {0.2, 0.1};
+	double a[2] = {-1.0, 0.5};
+	double b[2] = {2.0, 4.0};
+	Function f;
+	f.add_variable(x, 2);
+	f.add_variable_with_change<Box>(u, 2, 2, a, b);
+	f.add_variable_with_change<Circle>(z, 2);
+	f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), u, z);
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), x, u);
+	// The same variable twice.
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), z, z);
+	f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), y, v);
+	// Constant variables are not perturbed.
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), x, c);
+	f.set_constant(c, true);
+	f += 2.0;
+
+	Eigen::VectorXd t;
+	f.copy_user_to_global(&t);
+	Eigen::VectorXd gradient, fd_gradient;
+	Eigen::MatrixXd hessian, fd_hessian;
+	double value = f.evaluate(t, &gradient, &hessian);
+
+	f.set_finite_difference_derivatives(true);
+	EXPECT_DOUBLE_EQ(f.evaluate(t, &fd_gradient), value);
+	EXPECT_LT((fd_gradient - gradient).norm(), 1e-8);
+	EXPECT_DOUBLE_EQ(f.evaluate(t, &fd_gradient, &fd_hessian), value);
+	EXPECT_LT((fd_gradient - gradient).norm(), 1e-8);
+	EXPECT_LT((fd_hessian - hessian).norm(), 1e-6);
+	EXPECT_EQ(fd_hessian, fd_hessian.transpose());
+
+	Eigen::SparseMatrix<double> sparse_hessian;
+	f.create_sparse_hessian(&sparse_hessian);
+	EXPECT_DOUBLE_EQ(f.evaluate(t, &fd_gradient, &sparse_hessian), value);
+	EXPECT_LT((Eigen::MatrixXd(sparse_hessian) - fd_hessian).norm(), 1e-12);
+
+	// The coloring is updated when terms are added.
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), x, z);
+	f.set_finite_difference_derivatives(false);
+	f.evaluate(t, &gradient, &hessian);
+	f.set_finite_difference_derivatives(true);
+	f.evaluate(t, &fd_gradient, &fd_hessian);
+	EXPECT_LT((fd_gradient - gradient).norm(), 1e-8);
+	EXPECT_LT((fd_hessian - hessian).norm(), 1e-6);
+}
+
+TEST(Function, finite_difference_evaluation_count)
+{
+	// A chain needs two colors, independently of its length.
+	for (int n : {10, 1000}) {
+		std::vector<double> x(n, 1.0);
+		Function f;
+		for (int i = 0; i + 1 < n; ++i) {
+			f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), &x[i], &x[i + 1]);
+		}
+		f.set_finite_difference_derivatives(true);
+
+		Eigen::VectorXd t, gradient;
+		Eigen::SparseMatrix<double> hessian;
+		f.copy_user_to_global(&t);
+		f.evaluations_without_gradient = 0;
+		f.evaluate(t, &gradient);
+		// The point itself and two per color.
+		EXPECT_EQ(f.evaluations_without_gradient, 1 + 2 * 2);
+		EXPECT_NEAR(gradient[0], 1.0, 1e-8);
+		EXPECT_NEAR(gradient[1], 4.0, 1e-8);
+
+		f.create_sparse_hessian(&hessian);
+		f.evaluations_without_gradient = 0;
+		f.evaluate(t, &gradient, &hessian);
+		// Additionally two per color for the diagonal and four for
+		// the pair of colors.
+		EXPECT_EQ(f.evaluations_without_gradient, 1 + 2 * 2 + 2 * 2 + 4);
+		EXPECT_NEAR(hessian.coeff(1, 1), -4.0, 1e-6);
+		EXPECT_NEAR(hessian.coeff(0, 1), 0.0, 1e-6);
+	}
+}
+
+// A black-box term. Only its value may be used.
+class ValueOnlyTerm :
+	public SizedTerm<1, 1>
+{
+public:
+	virtual double evaluate(double * const * const variables) const
+	{
+		double d = variables[1][0] - variables[0][0] * variables[0][0];
+		return d * d;
+	}
+
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient) const
+	{
+		throw std::runtime_error("ValueOnlyTerm: no gradient.");
+	}
+
+	virtual double evaluate(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const
+	{
+		throw std::runtime_error("ValueOnlyTerm: no Hessian.");
+	}
+};
+
+TEST(Function, finite_difference_components_and_views)
+{
+	double x[4] = {0.5, -1.5, 2.0, 0.3};
+	Function f;
+	auto term = std::make_shared<ValueOnlyTerm>();
+	f.add_term(term, &x[0], &x[1]);
+	f.add_term(term, &x[2], &x[3]);
+	f.set_finite_difference_derivatives(true);
+
+	// Components and views use finite differences as well, and never
+	// call the derivatives of the terms.
+	auto check_derivatives = [](const Function& function)
+	{
+		Eigen::VectorXd t, gradient;
+		Eigen::MatrixXd hessian;
+		function.copy_user_to_global(&t);
+		function.evaluate(t, &gradient, &hessian);
+		EXPECT_NEAR(gradient[0], -4 * t[0] * (t[1] - t[0] * t[0]), 1e-6);
+		EXPECT_NEAR(gradient[1],  2 * (t[1] - t[0] * t[0]), 1e-6);
+		EXPECT_NEAR(hessian(1, 1), 2.0, 1e-4);
+	};
+
+	auto components = f.get_connected_components();
+	ASSERT_EQ(components.size(), 2);
+	for (const auto& component: components) {
+		check_derivatives(component);
+	}
+	check_derivatives(FunctionView(f, std::vector<TermHandle>{f.get_term_handle(1)}).get_function());
+}
+
+TEST(Function, hessian_vector)
+{
+	double x[2] = {0.5, -1.5};
+	double u[2] = {0.3, -2.0};
+	double z[2] = {0.7, 0.4};
+	double y[1] = {1.5};
+	double v[1] = {1.2};
+	double c[2] = {0.2, 0.1};
+	double a[2] = {-1.0, 0.5};
+	double b[2] = {2.0, 4.0};
+	Function f;
+	f.add_variable(x, 2);
+	f.add_variable_with_change<Box>(u, 2, 2, a, b);
+	f.add_variable_with_change<Circle>(z, 2);
+	f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), u, z);
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), x, u);
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), z, z);
+	f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), y, v);
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), x, c);
+	f.set_constant(c, true);
+	f += 2.0;
+
+	Eigen::VectorXd t;
+	f.copy_user_to_global(&t);
+	Eigen::VectorXd gradient;
+	Eigen::MatrixXd hessian;
+	double value = f.evaluate(t, &gradient, &hessian);
+
+	Eigen::VectorXd direction(f.get_number_of_scalars());
+	for (int i = 0; i < direction.size(); ++i) {
+		direction[i] = std::sin(i + 1.0);
+	}
+	Eigen::VectorXd reference = hessian * direction;
+
+	Eigen::VectorXd hv_gradient, hv;
+	EXPECT_DOUBLE_EQ(f.evaluate_hessian_vector(t, direction, &hv_gradient, &hv), value);
+	EXPECT_LT((hv_gradient - gradient).norm(), 1e-12);
+	EXPECT_LT((hv - reference).norm(), 1e-12);
+
+	// Several products at the same point.
+	f.set_hessian_vector_point(t);
+	for (int k = 0; k < 2; ++k) {
+		f.evaluate_hessian_vector((k + 1.0) * direction, &hv);
+		EXPECT_LT((hv - (k + 1.0) * reference).norm(), 1e-12);
+	}
+	// Other evaluations change the point.
+	f.evaluate(t);
+	EXPECT_THROW(f.evaluate_hessian_vector(direction, &hv), std::runtime_error);
+
+	// Terms added after the first product.
+	f.add_term(std::make_shared<AutoDiffTerm<CrossTerm, 2, 2>>(), x, z);
+	value = f.evaluate(t, &gradient, &hessian);
+	reference = hessian * direction;
+	EXPECT_DOUBLE_EQ(f.evaluate_hessian_vector(t, direction, &hv), value);
+	EXPECT_LT((hv - reference).norm(), 1e-12);
+
+	f.set_deterministic_evaluation(true);
+	EXPECT_DOUBLE_EQ(f.evaluate_hessian_vector(t, direction, &hv_gradient, &hv), value);
+	EXPECT_LT((hv_gradient - gradient).norm(), 1e-12);
+	EXPECT_LT((hv - reference).norm(), 1e-12);
+
+	f.set_finite_difference_derivatives(true);
+	EXPECT_DOUBLE_EQ(f.evaluate_hessian_vector(t, direction, &hv_gradient, &hv), value);
+	EXPECT_LT((hv_gradient - gradient).norm(), 1e-8);
+	EXPECT_LT((hv - reference).norm(), 1e-5);
+	f.set_hessian_vector_point(t);
+	f.evaluate_hessian_vector(direction, &hv);
+	EXPECT_LT((hv - reference).norm(), 1e-5);
+}
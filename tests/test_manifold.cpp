@@ -0,0 +1,233 @@
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+#include <cmath>
+
+#include <Eigen/Cholesky>
+
+#include <spii/auto_diff_term.h>
+#include <spii/function.h>
+#include <spii/manifold.h>
+#include <spii/solver.h>
+
+using namespace spii;
+
+TEST_CASE("QuaternionManifold/plus")
+{
+	QuaternionManifold manifold;
+	const double identity[4] = {1, 0, 0, 0};
+	const double zero[3] = {0, 0, 0};
+	double q[4];
+	manifold.plus(identity, zero, q);
+	CHECK(q[0] == 1.0);
+	CHECK(q[3] == 0.0);
+
+	// A rotation about the z axis.
+	const double theta = 0.8;
+	const double delta[3] = {0, 0, theta};
+	manifold.plus(identity, delta, q);
+	CHECK(Approx(q[0]) == std::cos(theta / 2));
+	CHECK(Approx(q[3]) == std::sin(theta / 2));
+
+	// Rotations are composed and stay unit quaternions.
+	double q2[4];
+	const double delta2[3] = {0.3, -0.2, 0.1};
+	manifold.plus(q, delta2, q2);
+	CHECK(Approx(q2[0] * q2[0] + q2[1] * q2[1] + q2[2] * q2[2] + q2[3] * q2[3]) == 1.0);
+}
+
+TEST_CASE("UnitVectorManifold/plus")
+{
+	UnitVectorManifold manifold(3);
+	CHECK(manifold.tangent_dimension() == 2);
+
+	for (double sign : {1.0, -1.0}) {
+		const double x[3] = {0.6, 0.0, sign * 0.8};
+		const double zero[2] = {0, 0};
+		double y[3];
+		manifold.plus(x, zero, y);
+		for (int i = 0; i < 3; ++i) {
+			CHECK(Approx(y[i]) == x[i]);
+		}
+
+		// Moving |delta| along the sphere.
+		const double delta[2] = {0.3, 0.4};
+		manifold.plus(x, delta, y);
+		CHECK(Approx(y[0] * y[0] + y[1] * y[1] + y[2] * y[2]) == 1.0);
+		CHECK(Approx(x[0] * y[0] + x[1] * y[1] + x[2] * y[2]) == std::cos(0.5));
+	}
+}
+
+namespace {
+
+// Squared distance between a rotated point and its target.
+struct RotatedPoint
+{
+	RotatedPoint(const double* p_, const double* target_)
+	{
+		for (int i = 0; i < 3; ++i) {
+			p[i] = p_[i];
+			target[i] = target_[i];
+		}
+	}
+
+	template<typename R>
+	R operator()(const R* q) const
+	{
+		// p' = p + w t + v x t, where t = 2 v x p.
+		R t[3];
+		t[0] = 2.0 * (q[2] * p[2] - q[3] * p[1]);
+		t[1] = 2.0 * (q[3] * p[0] - q[1] * p[2]);
+		t[2] = 2.0 * (q[1] * p[1] - q[2] * p[0]);
+		R rotated[3];
+		rotated[0] = p[0] + q[0] * t[0] + q[2] * t[2] - q[3] * t[1];
+		rotated[1] = p[1] + q[0] * t[1] + q[3] * t[0] - q[1] * t[2];
+		rotated[2] = p[2] + q[0] * t[2] + q[1] * t[1] - q[2] * t[0];
+		R value = 0.0;
+		for (int i = 0; i < 3; ++i) {
+			R d = rotated[i] - target[i];
+			value += d * d;
+		}
+		return value;
+	}
+
+	double p[3];
+	double target[3];
+};
+
+struct NegativeDot
+{
+	template<typename R>
+	R operator()(const R* x) const
+	{
+		return -(1.0 * x[0] + 2.0 * x[1] + 2.0 * x[2]);
+	}
+};
+
+// Almost opposite to the starting point of the tests.
+struct NegativeDotOpposite
+{
+	template<typename R>
+	R operator()(const R* x) const
+	{
+		return -(-1.0 * x[0] + 0.02 * x[1] + 0.01 * x[2]);
+	}
+};
+
+}
+
+TEST_CASE("Manifold/rotation")
+{
+	// The target points are rotated 90 degrees about the z axis.
+	const double points[3][3] = {{1, 0, 0}, {0, 2, 0}, {1, 1, 1}};
+	const double targets[3][3] = {{0, 1, 0}, {-2, 0, 0}, {-1, 1, 1}};
+
+	// Start 45 degrees from the solution, where the Hessian is positive
+	// definite.
+	double q[4] = {std::cos(M_PI / 8), 0, 0, std::sin(M_PI / 8)};
+	Function function;
+	function.add_variable_on_manifold<QuaternionManifold>(q, 4);
+	for (int k = 0; k < 3; ++k) {
+		function.add_term(std::make_shared<AutoDiffTerm<RotatedPoint, 4>>(points[k], targets[k]), q);
+	}
+	CHECK(function.get_number_of_scalars() == 3);
+
+	Eigen::VectorXd t;
+	Eigen::VectorXd gradient;
+	Eigen::MatrixXd hessian;
+	function.copy_user_to_global(&t);
+	CHECK(t.norm() == 0);
+	function.evaluate(t, &gradient, &hessian);
+	CHECK(hessian.llt().info() == Eigen::Success);
+
+	NewtonSolver solver;
+	solver.log_function = nullptr;
+	SolverResults results;
+	solver.solve(function, &results);
+
+	CHECK(results.exit_success());
+	CHECK(std::abs(q[0]) == Approx(std::cos(M_PI / 4)));
+	CHECK(std::abs(q[3]) == Approx(std::sin(M_PI / 4)));
+	CHECK(std::abs(q[1]) < 1e-6);
+	CHECK(std::abs(q[2]) < 1e-6);
+}
+
+TEST_CASE("Manifold/unit_vector")
+{
+	double x[3] = {1, 0, 0};
+	Function function;
+	function.add_variable_on_manifold<UnitVectorManifold>(x, 3, 3);
+	function.add_term(std::make_shared<AutoDiffTerm<NegativeDot, 3>>(), x);
+	CHECK(function.get_number_of_scalars() == 2);
+
+	NewtonSolver solver;
+	solver.log_function = nullptr;
+	SolverResults results;
+	solver.solve(function, &results);
+
+	CHECK(results.exit_success());
+	CHECK(Approx(x[0]) == 1.0 / 3.0);
+	CHECK(Approx(x[1]) == 2.0 / 3.0);
+	CHECK(Approx(x[2]) == 2.0 / 3.0);
+}
+
+TEST_CASE("Manifold/recenter")
+{
+	double q[4] = {1, 0, 0, 0};
+	double y[2] = {1, 2};
+	const double point[3] = {1, 2, 3};
+	Function function;
+	function.add_variable_on_manifold<QuaternionManifold>(q, 4);
+	function.add_variable(y, 2);
+	function.add_term(std::make_shared<AutoDiffTerm<RotatedPoint, 4>>(point, point), q);
+
+	Eigen::VectorXd t;
+	function.copy_user_to_global(&t);
+	const size_t q_index = function.get_variable_global_index(q);
+	const size_t y_index = function.get_variable_global_index(y);
+	t[q_index] = 0.3;
+	t[q_index + 1] = -0.2;
+	t[q_index + 2] = 2.5;
+	t[y_index] = 3.0;
+	double value = function.evaluate(t);
+	function.copy_global_to_user(t);
+	const double expected_q[4] = {q[0], q[1], q[2], q[3]};
+
+	// The same point in the tangent space at q.
+	CHECK(function.recenter(&t));
+	CHECK(t[q_index] == 0);
+	CHECK(t[q_index + 2] == 0);
+	CHECK(t[y_index] == 3.0);
+	CHECK(function.evaluate(t) == Approx(value));
+	function.copy_global_to_user(t);
+	for (int i = 0; i < 4; ++i) {
+		CHECK(q[i] == Approx(expected_q[i]));
+	}
+}
+
+TEST_CASE("Manifold/unit_vector_opposite")
+{
+	// The minimum is almost opposite to the starting point, far
+	// outside the tangent space there.
+	for (bool levenberg_marquardt: {false, true}) {
+		double x[3] = {1, 0, 0};
+		Function function;
+		function.add_variable_on_manifold<UnitVectorManifold>(x, 3, 3);
+		function.add_term(std::make_shared<AutoDiffTerm<NegativeDotOpposite, 3>>(), x);
+
+		NewtonSolver newton;
+		newton.log_function = nullptr;
+		LevenbergMarquardtSolver levenberg_marquardt_solver;
+		levenberg_marquardt_solver.log_function = nullptr;
+		const Solver& solver = levenberg_marquardt ? static_cast<const Solver&>(levenberg_marquardt_solver)
+		                                           : static_cast<const Solver&>(newton);
+		SolverResults results;
+		solver.solve(function, &results);
+
+		CHECK(results.exit_success());
+		const double norm = std::sqrt(1.0 + 0.02 * 0.02 + 0.01 * 0.01);
+		CHECK(Approx(x[0]) == -1.0 / norm);
+		CHECK(Approx(x[1]) == 0.02 / norm);
+		CHECK(Approx(x[2]) == 0.01 / norm);
+	}
+}
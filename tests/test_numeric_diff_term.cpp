@@ -0,0 +1,161 @@
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+#include <cmath>
+#include <stdexcept>
+
+#include <spii/auto_diff_term.h>
+#include <spii/function.h>
+#include <spii/numeric_diff_term.h>
+#include <spii/solver.h>
+
+using namespace spii;
+
+namespace {
+
+// Only callable with doubles.
+struct BlackBox
+{
+	double operator()(const double* x, const double* y) const
+	{
+		return std::exp(0.5 * x[0]) * std::sin(x[1]) + x[0] * x[1] * y[0] + std::log(1.0 + y[0] * y[0]);
+	}
+};
+
+struct Templated
+{
+	template<typename R>
+	R operator()(const R* x, const R* y) const
+	{
+		return exp(0.5 * x[0]) * sin(x[1]) + x[0] * x[1] * y[0] + log(1.0 + y[0] * y[0]);
+	}
+};
+
+struct Rosenbrock
+{
+	double operator()(const double* x) const
+	{
+		double d0 = x[1] - x[0] * x[0];
+		double d1 = 1 - x[0];
+		return 100 * d0 * d0 + d1 * d1;
+	}
+};
+
+struct Throwing
+{
+	double operator()(const double* x) const
+	{
+		if (x[0] != 1.0) {
+			throw std::runtime_error("Throwing: Perturbed.");
+		}
+		return x[0];
+	}
+};
+
+void check_derivatives(NumericDiffMethod method,
+                       bool parallel,
+                       double gradient_tolerance,
+                       double hessian_tolerance)
+{
+	double x[2] = {0.7, -1.2};
+	double y[1] = {1.5};
+	double* variables[2] = {x, y};
+
+	NumericDiffTerm<BlackBox, 2, 1> numeric;
+	numeric.method = method;
+	numeric.parallel = parallel;
+	AutoDiffTerm<Templated, 2, 1> automatic;
+
+	std::vector<Eigen::VectorXd> g(2), g_auto(2);
+	std::vector< std::vector<Eigen::MatrixXd> > H(2), H_auto(2);
+	for (int i = 0; i < 2; ++i) {
+		g[i].resize(i == 0 ? 2 : 1);
+		g_auto[i].resize(i == 0 ? 2 : 1);
+		H[i].resize(2);
+		H_auto[i].resize(2);
+		for (int j = 0; j < 2; ++j) {
+			H[i][j].resize(i == 0 ? 2 : 1, j == 0 ? 2 : 1);
+			H_auto[i][j].resize(i == 0 ? 2 : 1, j == 0 ? 2 : 1);
+		}
+	}
+
+	double value = automatic.evaluate(variables, &g_auto, &H_auto);
+	CHECK(numeric.evaluate(variables) == value);
+	CHECK(numeric.evaluate(variables, &g) == value);
+	for (int i = 0; i < 2; ++i) {
+		CHECK((g[i] - g_auto[i]).norm() < gradient_tolerance);
+	}
+
+	CHECK(numeric.evaluate(variables, &g, &H) == value);
+	for (int i = 0; i < 2; ++i) {
+		CHECK((g[i] - g_auto[i]).norm() < gradient_tolerance);
+		for (int j = 0; j < 2; ++j) {
+			CHECK((H[i][j] - H_auto[i][j]).norm() < hessian_tolerance);
+		}
+	}
+}
+
+}
+
+TEST_CASE("NumericDiffTerm/forward")
+{
+	check_derivatives(NumericDiffMethod::Forward, false, 1e-6, 1e-4);
+}
+
+TEST_CASE("NumericDiffTerm/central")
+{
+	check_derivatives(NumericDiffMethod::Central, false, 1e-9, 1e-6);
+}
+
+TEST_CASE("NumericDiffTerm/richardson")
+{
+	check_derivatives(NumericDiffMethod::Richardson, false, 1e-11, 1e-8);
+}
+
+TEST_CASE("NumericDiffTerm/parallel")
+{
+	check_derivatives(NumericDiffMethod::Central, true, 1e-9, 1e-6);
+	check_derivatives(NumericDiffMethod::Richardson, true, 1e-11, 1e-8);
+}
+
+TEST_CASE("NumericDiffTerm/exceptions")
+{
+	double x[1] = {1.0};
+	double* variables[1] = {x};
+	std::vector<Eigen::VectorXd> g(1, Eigen::VectorXd(1));
+
+	NumericDiffTerm<Throwing, 1> term;
+	term.parallel = true;
+	CHECK(term.evaluate(variables) == 1.0);
+	CHECK_THROWS(term.evaluate(variables, &g));
+}
+
+TEST_CASE("NumericDiffTerm/solvers")
+{
+	for (auto method : {NumericDiffMethod::Forward,
+	                    NumericDiffMethod::Central,
+	                    NumericDiffMethod::Richardson}) {
+		double x[2] = {-1.2, 1.0};
+		Function f;
+		auto term = std::make_shared<NumericDiffTerm<Rosenbrock, 2>>();
+		term->method = method;
+		f.add_term(term, x);
+
+		NewtonSolver newton;
+		newton.log_function = nullptr;
+		SolverResults results;
+		newton.solve(f, &results);
+		CHECK(results.exit_success());
+		CHECK(std::abs(x[0] - 1.0) < 1e-4);
+		CHECK(std::abs(x[1] - 1.0) < 1e-4);
+
+		x[0] = -1.2;
+		x[1] = 1.0;
+		LBFGSSolver lbfgs;
+		lbfgs.log_function = nullptr;
+		lbfgs.solve(f, &results);
+		CHECK(results.exit_success());
+		CHECK(std::abs(x[0] - 1.0) < 1e-4);
+		CHECK(std::abs(x[1] - 1.0) < 1e-4);
+	}
+}
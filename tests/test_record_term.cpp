@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+#include <spii/google_test_compatibility.h>
+#include <spii/record_term.h>
+
+using namespace spii;
+using namespace std;
+
+struct Observation
+{
+	double t;
+	double y;
+};
+
+struct Residual
+{
+	template<typename R>
+	R operator()(const Observation& observation, const R* x) const
+	{
+		R d = observation.y - x[0] * observation.t - x[1];
+		return d * d;
+	}
+};
+
+class RecordFileFixture
+{
+public:
+	RecordFileFixture()
+	{
+		for (int i = 0; i < 50000; ++i) {
+			Observation observation;
+			observation.t = i / 50000.0;
+			observation.y = 2.0 * observation.t + 1.0 + ((i * 7919) % 13 - 6) / 100.0;
+			observations.push_back(observation);
+		}
+		RecordFile<Observation>::write(filename, observations.data(), observations.size());
+	}
+
+	~RecordFileFixture()
+	{
+		std::remove(filename);
+	}
+
+	const char* filename = "test_record_term.bin";
+	vector<Observation> observations;
+};
+
+TEST_CASE("RecordTerm/matches_in_memory_terms")
+{
+	RecordFileFixture fixture;
+	auto file = make_shared<RecordFile<Observation>>(fixture.filename);
+	REQUIRE(file->number_of_records() == fixture.observations.size());
+
+	double x[2] = {1.5, 0.5};
+	Function f;
+	f.hessian_is_enabled = true;
+	auto handles = add_record_terms<2>(&f, Residual(), file, 7000, x);
+	CHECK(handles.size() == 8);
+	CHECK(f.get_number_of_terms() == 8);
+
+	// A single term covering all records, spanning several blocks.
+	Function g;
+	add_record_terms<2>(&g, Residual(), file, fixture.observations.size(), x);
+	CHECK(g.get_number_of_terms() == 1);
+
+	double expected_value = 0;
+	Eigen::VectorXd expected_gradient = Eigen::VectorXd::Zero(2);
+	Eigen::MatrixXd expected_hessian = Eigen::MatrixXd::Zero(2, 2);
+	for (const auto& observation: fixture.observations) {
+		double d = observation.y - x[0] * observation.t - x[1];
+		expected_value += d * d;
+		expected_gradient[0] -= 2 * d * observation.t;
+		expected_gradient[1] -= 2 * d;
+		expected_hessian(0, 0) += 2 * observation.t * observation.t;
+		expected_hessian(0, 1) += 2 * observation.t;
+		expected_hessian(1, 1) += 2;
+	}
+	expected_hessian(1, 0) = expected_hessian(0, 1);
+
+	for (const Function* function: {&f, &g}) {
+		Eigen::VectorXd xg(2), gradient;
+		Eigen::MatrixXd hessian;
+		function->copy_user_to_global(&xg);
+		EXPECT_NEAR(function->evaluate(), expected_value, 1e-8 * expected_value);
+		EXPECT_NEAR(function->evaluate(xg, &gradient, &hessian), expected_value, 1e-8 * expected_value);
+		for (int i = 0; i < 2; ++i) {
+			EXPECT_NEAR(gradient[i], expected_gradient[i], 1e-6);
+			for (int j = 0; j < 2; ++j) {
+				EXPECT_NEAR(hessian(i, j), expected_hessian(i, j), 1e-6);
+			}
+		}
+	}
+}
+
+TEST_CASE("RecordTerm/invalid_files")
+{
+	CHECK_THROWS(RecordFile<Observation>("no_such_file.bin"));
+
+	char data[3] = {1, 2, 3};
+	RecordFile<char>::write("test_record_term_odd.bin", data, 3);
+	CHECK_THROWS(RecordFile<Observation>("test_record_term_odd.bin"));
+	std::remove("test_record_term_odd.bin");
+}
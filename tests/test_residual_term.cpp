@@ -0,0 +1,293 @@
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+#include <cmath>
+#include <vector>
+
+#include <spii/auto_diff_term.h>
+#include <spii/function.h>
+#include <spii/residual_term.h>
+
+using namespace spii;
+
+namespace {
+
+// Three residuals of a point x and a scalar y.
+struct Residuals
+{
+	static const bool single_precision = true;
+
+	template<typename R>
+	void operator()(const R* x, const R* y, R* residuals) const
+	{
+		residuals[0] = x[0] * y[0] - 1.0;
+		residuals[1] = sin(x[1]) + x[0] * x[1];
+		residuals[2] = exp(0.5 * y[0]) - x[1];
+	}
+};
+
+// Half the squared norm of the residuals above.
+struct SquaredNorm
+{
+	template<typename R>
+	R operator()(const R* x, const R* y) const
+	{
+		R r[3];
+		Residuals()(x, y, r);
+		return 0.5 * (r[0] * r[0] + r[1] * r[1] + r[2] * r[2]);
+	}
+};
+
+// Uses the default implementations of ResidualTerm.
+class ManualResiduals
+	: public ResidualTerm
+{
+public:
+	virtual int number_of_variables() const override
+	{
+		return 2;
+	}
+
+	virtual int variable_dimension(int var) const override
+	{
+		return var == 0 ? 2 : 1;
+	}
+
+	virtual int number_of_residuals() const override
+	{
+		return 3;
+	}
+
+	virtual void evaluate_residuals(double * const * const variables,
+	                                double* residuals,
+	                                std::vector<Eigen::MatrixXd>* jacobian) const override
+	{
+		term.evaluate_residuals(variables, residuals, jacobian);
+	}
+
+private:
+	AutoDiffResidualTerm<Residuals, 3, 2, 1> term;
+};
+
+struct Derivatives
+{
+	Derivatives()
+		: gradient(2), hessian(2)
+	{
+		for (int i = 0; i < 2; ++i) {
+			gradient[i].resize(i == 0 ? 2 : 1);
+			hessian[i].resize(2);
+			for (int j = 0; j < 2; ++j) {
+				hessian[i][j].resize(i == 0 ? 2 : 1, j == 0 ? 2 : 1);
+			}
+		}
+	}
+
+	std::vector<Eigen::VectorXd> gradient;
+	std::vector< std::vector<Eigen::MatrixXd> > hessian;
+};
+
+}
+
+TEST_CASE("AutoDiffResidualTerm/residuals")
+{
+	double x[2] = {0.7, -1.2};
+	double y[1] = {1.5};
+	double* variables[2] = {x, y};
+
+	AutoDiffResidualTerm<Residuals, 3, 2, 1> term;
+	CHECK(term.number_of_variables() == 2);
+	CHECK(term.variable_dimension(0) == 2);
+	CHECK(term.variable_dimension(1) == 1);
+	CHECK(term.number_of_residuals() == 3);
+
+	double r[3], expected_r[3];
+	Residuals()(x, y, expected_r);
+	term.evaluate_residuals(variables, r, nullptr);
+	for (int k = 0; k < 3; ++k) {
+		CHECK(r[k] == expected_r[k]);
+	}
+
+	std::vector<Eigen::MatrixXd> jacobian(2);
+	term.evaluate_residuals(variables, r, &jacobian);
+	for (int k = 0; k < 3; ++k) {
+		CHECK(r[k] == expected_r[k]);
+	}
+	REQUIRE(jacobian[0].rows() == 3);
+	REQUIRE(jacobian[0].cols() == 2);
+	REQUIRE(jacobian[1].rows() == 3);
+	REQUIRE(jacobian[1].cols() == 1);
+	CHECK(jacobian[0](0, 0) == y[0]);
+	CHECK(jacobian[0](0, 1) == 0.0);
+	CHECK(jacobian[1](0, 0) == x[0]);
+	CHECK(std::abs(jacobian[0](1, 1) - (std::cos(x[1]) + x[0])) < 1e-14);
+	CHECK(std::abs(jacobian[1](2, 0) - 0.5 * std::exp(0.5 * y[0])) < 1e-14);
+}
+
+TEST_CASE("AutoDiffResidualTerm/derivatives")
+{
+	double x[2] = {0.7, -1.2};
+	double y[1] = {1.5};
+	double* variables[2] = {x, y};
+
+	AutoDiffResidualTerm<Residuals, 3, 2, 1> term;
+	ManualResiduals manual;
+	AutoDiffTerm<SquaredNorm, 2, 1> squared_norm;
+
+	Derivatives expected, computed;
+	double value = squared_norm.evaluate(variables, &expected.gradient, &expected.hessian);
+
+	// Value, gradient and exact Hessian.
+	CHECK(std::abs(term.evaluate(variables) - value) < 1e-14);
+	CHECK(std::abs(term.evaluate(variables, &computed.gradient) - value) < 1e-14);
+	for (int i = 0; i < 2; ++i) {
+		CHECK((computed.gradient[i] - expected.gradient[i]).norm() < 1e-12);
+	}
+	CHECK(std::abs(term.evaluate(variables, &computed.gradient, &computed.hessian) - value) < 1e-14);
+	for (int i = 0; i < 2; ++i) {
+		CHECK((computed.gradient[i] - expected.gradient[i]).norm() < 1e-12);
+		for (int j = 0; j < 2; ++j) {
+			CHECK((computed.hessian[i][j] - expected.hessian[i][j]).norm() < 1e-12);
+		}
+	}
+
+	// The Gauss–Newton approximation is J^T J.
+	double r[3];
+	std::vector<Eigen::MatrixXd> jacobian(2);
+	term.evaluate_residuals(variables, r, &jacobian);
+	CHECK(std::abs(term.evaluate_gauss_newton(variables, &computed.gradient, &computed.hessian) - value) < 1e-14);
+	for (int i = 0; i < 2; ++i) {
+		CHECK((computed.gradient[i] - expected.gradient[i]).norm() < 1e-12);
+		for (int j = 0; j < 2; ++j) {
+			Eigen::MatrixXd JTJ = jacobian[i].transpose() * jacobian[j];
+			CHECK((computed.hessian[i][j] - JTJ).norm() < 1e-12);
+		}
+	}
+
+	// The default implementations agree. They have no exact
+	// Hessian, only the Gauss–Newton approximation.
+	Derivatives manual_derivatives;
+	CHECK(std::abs(manual.evaluate(variables) - value) < 1e-14);
+	CHECK(std::abs(manual.evaluate(variables, &manual_derivatives.gradient) - value) < 1e-14);
+	for (int i = 0; i < 2; ++i) {
+		CHECK((manual_derivatives.gradient[i] - expected.gradient[i]).norm() < 1e-12);
+	}
+	CHECK_THROWS(manual.evaluate(variables, &manual_derivatives.gradient, &manual_derivatives.hessian));
+	manual.evaluate_gauss_newton(variables, &manual_derivatives.gradient, &manual_derivatives.hessian);
+	for (int i = 0; i < 2; ++i) {
+		for (int j = 0; j < 2; ++j) {
+			CHECK((manual_derivatives.hessian[i][j] - computed.hessian[i][j]).norm() < 1e-12);
+		}
+	}
+
+	// Hessian-vector products use the exact Hessian.
+	double v0[2] = {0.3, -0.4};
+	double v1[1] = {0.8};
+	const double* direction[2] = {v0, v1};
+	std::vector<Eigen::VectorXd> hv(2);
+	hv[0].resize(2);
+	hv[1].resize(1);
+	term.evaluate_hessian_vector(variables, direction, &computed.gradient, &hv);
+	for (int i = 0; i < 2; ++i) {
+		Eigen::VectorXd expected_hv = expected.hessian[i][0] * Eigen::Map<Eigen::VectorXd>(v0, 2)
+		                            + expected.hessian[i][1] * Eigen::Map<Eigen::VectorXd>(v1, 1);
+		CHECK((hv[i] - expected_hv).norm() < 1e-12);
+	}
+}
+
+TEST_CASE("AutoDiffResidualTerm/single_precision")
+{
+	float x[2] = {0.7f, -1.2f};
+	float y[1] = {1.5f};
+	float* variables[2] = {x, y};
+	double xd[2] = {0.7f, -1.2f};
+	double yd[1] = {1.5f};
+	double* variables_double[2] = {xd, yd};
+
+	AutoDiffResidualTerm<Residuals, 3, 2, 1> term;
+	CHECK(term.has_single_precision());
+
+	std::vector<Eigen::VectorXf> gradient(2);
+	gradient[0].resize(2);
+	gradient[1].resize(1);
+	Derivatives expected;
+	double value = term.evaluate(variables_double, &expected.gradient);
+	CHECK(std::abs(term.evaluate_float(variables) - value) < 1e-5);
+	CHECK(std::abs(term.evaluate_float(variables, &gradient) - value) < 1e-5);
+	for (int i = 0; i < 2; ++i) {
+		CHECK((gradient[i].cast<double>() - expected.gradient[i]).norm() < 1e-5);
+	}
+}
+
+TEST_CASE("Function/gauss_newton_hessian")
+{
+	std::vector<double> x(6);
+	double y[1] = {1.5};
+	for (int i = 0; i < 6; ++i) {
+		x[i] = 0.1 * i - 0.2;
+	}
+
+	Function f;
+	auto term = std::make_shared<AutoDiffResidualTerm<Residuals, 3, 2, 1>>();
+	for (int i = 0; i < 6; i += 2) {
+		f.add_term(term, &x[i], y);
+	}
+	f.add_term(std::make_shared<AutoDiffTerm<SquaredNorm, 2, 1>>(), &x[2], y);
+
+	Eigen::VectorXd x0;
+	f.copy_user_to_global(&x0);
+
+	// The Gauss–Newton approximation of the function, assembled
+	// from the Jacobians of the residual terms.
+	Eigen::VectorXd expected_g = Eigen::VectorXd::Zero(7);
+	Eigen::MatrixXd expected_H = Eigen::MatrixXd::Zero(7, 7);
+	{
+		Eigen::VectorXd g;
+		Eigen::MatrixXd H;
+		f.evaluate(x0, &g, &H);
+		expected_g = g;
+
+		// The last term keeps its exact Hessian.
+		double* variables[2] = {&x[2], y};
+		const size_t index[2] = {f.get_variable_global_index(&x[2]),
+		                         f.get_variable_global_index(y)};
+		Derivatives exact;
+		AutoDiffTerm<SquaredNorm, 2, 1>().evaluate(variables, &exact.gradient, &exact.hessian);
+		for (int i = 0; i < 2; ++i) {
+			for (int j = 0; j < 2; ++j) {
+				expected_H.block(index[i], index[j], i == 0 ? 2 : 1, j == 0 ? 2 : 1) += exact.hessian[i][j];
+			}
+		}
+	}
+	for (int i = 0; i < 6; i += 2) {
+		double* variables[2] = {&x[i], y};
+		double r[3];
+		std::vector<Eigen::MatrixXd> jacobian(2);
+		term->evaluate_residuals(variables, r, &jacobian);
+		Eigen::MatrixXd J = Eigen::MatrixXd::Zero(3, 7);
+		J.block(0, f.get_variable_global_index(&x[i]), 3, 2) = jacobian[0];
+		J.col(f.get_variable_global_index(y)) = jacobian[1];
+		expected_H += J.transpose() * J;
+	}
+
+	f.gauss_newton_hessian = true;
+	Eigen::VectorXd g;
+	Eigen::MatrixXd H;
+	f.evaluate(x0, &g, &H);
+	CHECK((g - expected_g).norm() < 1e-12);
+	CHECK((H - expected_H).norm() < 1e-12);
+
+	Eigen::SparseMatrix<double> sparse_H;
+	f.create_sparse_hessian(&sparse_H);
+	f.evaluate(x0, &g, &sparse_H);
+	CHECK((g - expected_g).norm() < 1e-12);
+	CHECK((Eigen::MatrixXd(sparse_H) - expected_H).norm() < 1e-12);
+
+	// Copies keep the setting.
+	Function copy = f;
+	CHECK(copy.gauss_newton_hessian);
+
+	f.gauss_newton_hessian = false;
+	f.evaluate(x0, &g, &H);
+	CHECK((H - expected_H).norm() > 1e-6);
+}
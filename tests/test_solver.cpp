@@ -3,12 +3,14 @@
 #include <cmath>
 #include <limits>
 #include <random>
+#include <stdexcept>
 
 #define CATCH_CONFIG_MAIN
 #include <catch.hpp>
 #include <spii/google_test_compatibility.h>
 
 #include <spii/auto_diff_term.h>
+#include <spii/residual_term.h>
 #include <spii/solver.h>
 #include <spii/transformations.h>
 
@@ -25,11 +27,19 @@ struct Rosenbrock
 	}
 };
 
+// Rosenbrock with single precision, for mixed-precision L-BFGS.
+struct RosenbrockFloat
+	: public Rosenbrock
+{
+	static const bool single_precision = true;
+};
+
+template<typename Functor = Rosenbrock>
 void test_method(const Solver& solver)
 {
 	Function f;
 	double x[2] = {-1.2, 1.0};
-	f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<Functor, 2>>(), x);
 
 	SolverResults results;
 	solver.solve(f, &results);
@@ -56,6 +66,309 @@ TEST(Solver, LBFGS)
 	test_method(solver);
 }
 
+TEST(Solver, LBFGS_mixed_precision)
+{
+	LBFGSSolver solver;
+	solver.log_function = nullptr;
+	solver.mixed_precision = true;
+	test_method<RosenbrockFloat>(solver);
+}
+
+TEST(Solver, LBFGS_mixed_precision_discards_history)
+{
+	Function f;
+	double x[2] = {-1.2, 1.0};
+	f.add_term(std::make_shared<AutoDiffTerm<RosenbrockFloat, 2>>(), x);
+
+	// Records the points and gradients of the first two iterations
+	// after the switch to double precision.
+	bool switched = false;
+	std::vector<Eigen::VectorXd> points, gradients;
+
+	LBFGSSolver solver;
+	solver.mixed_precision = true;
+	solver.mixed_precision_tolerance = 1e-2;
+	solver.log_function = [&](const std::string& str)
+	{
+		if (str == "Switching to double precision.") {
+			switched = true;
+		}
+	};
+	solver.callback_function = [&](const CallbackInformation& information) -> bool
+	{
+		if (switched && points.size() < 2) {
+			points.push_back(*information.x);
+			gradients.push_back(*information.g);
+		}
+		return true;
+	};
+
+	SolverResults results;
+	solver.solve(f, &results);
+	EXPECT_TRUE(results.exit_success());
+	ASSERT_EQ(points.size(), 2);
+
+	// Without any history, the first step in double precision is
+	// along the negative gradient.
+	Eigen::VectorXd step = points[1] - points[0];
+	ASSERT_GT(step.norm(), 0);
+	double cosine = -step.dot(gradients[0]) / (step.norm() * gradients[0].norm());
+	EXPECT_LT(std::fabs(cosine - 1.0), 1e-10);
+}
+
+TEST(Solver, LBFGS_mixed_precision_restores_precision)
+{
+	Function f;
+	double x[2] = {-1.2, 1.0};
+	f.add_term(std::make_shared<AutoDiffTerm<RosenbrockFloat, 2>>(), x);
+
+	LBFGSSolver solver;
+	solver.log_function = nullptr;
+	solver.mixed_precision = true;
+	SolverResults results;
+	solver.solve(f, &results);
+	EXPECT_TRUE( ! f.single_precision);
+
+	// Also when solving stops with an exception.
+	x[0] = -1.2;
+	x[1] =  1.0;
+	solver.callback_function = [](const CallbackInformation&) -> bool
+	{
+		throw std::runtime_error("Stop.");
+	};
+	EXPECT_THROW(solver.solve(f, &results), std::runtime_error);
+	EXPECT_TRUE( ! f.single_precision);
+}
+
+TEST(Solver, NEWTON_CG)
+{
+	NewtonCGSolver solver;
+	solver.log_function = nullptr;
+	for (auto preconditioner: {NewtonCGSolver::NONE,
+	                           NewtonCGSolver::DIAGONAL,
+	                           NewtonCGSolver::LBFGS}) {
+		solver.preconditioner = preconditioner;
+		test_method(solver);
+	}
+}
+
+TEST(Solver, NEWTON_CG_large)
+{
+	// The Hessian is never formed, so Newton-CG works without it.
+	const int n = 10000;
+	std::vector<double> x(n);
+	Function f;
+	f.hessian_is_enabled = false;
+	for (int i = 0; i < n; i += 2) {
+		x[i]     = -1.2;
+		x[i + 1] =  1.0;
+		f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), &x[i]);
+	}
+
+	NewtonCGSolver solver;
+	solver.log_function = nullptr;
+	SolverResults results;
+	solver.solve(f, &results);
+	EXPECT_TRUE(results.exit_success());
+	for (auto xi: x) {
+		EXPECT_LT(std::fabs(xi - 1.0), 1e-6);
+	}
+	EXPECT_EQ(solver.estimate_memory_usage(f).bytes["Hessian"], 0);
+}
+
+TEST(Solver, LEVENBERG_MARQUARDT)
+{
+	// Terms that are not residual terms use their exact Hessians.
+	LevenbergMarquardtSolver solver;
+	solver.log_function = nullptr;
+	test_method(solver);
+}
+
+// The Rosenbrock function as 0.5 * ||r||^2.
+struct RosenbrockResiduals
+{
+	template<typename R>
+	void operator()(const R* const x, R* residuals) const
+	{
+		residuals[0] = 10.0 * (x[1] - x[0]*x[0]);
+		residuals[1] = 1.0 - x[0];
+	}
+};
+
+// Residual of a curve y = a exp(b t) + c at t.
+struct ExponentialResidual
+{
+	ExponentialResidual(double t_, double y_)
+		: t(t_), y(y_)
+	{ }
+
+	template<typename R>
+	void operator()(const R* const abc, R* residuals) const
+	{
+		residuals[0] = abc[0] * exp(abc[1] * t) + abc[2] - y;
+	}
+
+	double t, y;
+};
+
+TEST(Solver, LEVENBERG_MARQUARDT_residuals)
+{
+	for (auto mode: {LevenbergMarquardtSolver::DENSE, LevenbergMarquardtSolver::SPARSE}) {
+		std::vector<double> x(200);
+		Function f;
+		for (int i = 0; i < 200; i += 2) {
+			x[i]     = -1.2;
+			x[i + 1] =  1.0;
+			f.add_term(std::make_shared<AutoDiffResidualTerm<RosenbrockResiduals, 2, 2>>(), &x[i]);
+		}
+
+		LevenbergMarquardtSolver solver;
+		solver.log_function = nullptr;
+		solver.sparsity_mode = mode;
+		SolverResults results;
+		solver.solve(f, &results);
+		EXPECT_TRUE(results.exit_success());
+		for (auto xi: x) {
+			EXPECT_LT(std::fabs(xi - 1.0), 1e-9);
+		}
+		EXPECT_TRUE(! f.gauss_newton_hessian);
+	}
+
+	double abc[3] = {1.0, 0.0, 0.0};
+	Function f;
+	for (int i = 0; i < 50; ++i) {
+		double t = 0.1 * i;
+		double y = 2.0 * std::exp(-0.7 * t) + 0.5;
+		f.add_term(std::make_shared<AutoDiffResidualTerm<ExponentialResidual, 1, 3>>(t, y), abc);
+	}
+	LevenbergMarquardtSolver solver;
+	solver.log_function = nullptr;
+	SolverResults results;
+	solver.solve(f, &results);
+	EXPECT_TRUE(results.exit_success());
+	EXPECT_LT(std::fabs(abc[0] - 2.0), 1e-6);
+	EXPECT_LT(std::fabs(abc[1] + 0.7), 1e-6);
+	EXPECT_LT(std::fabs(abc[2] - 0.5), 1e-6);
+
+	// The exact Hessians are restored also when solving stops with
+	// an exception.
+	abc[0] = 1.0;
+	abc[1] = 0.0;
+	abc[2] = 0.0;
+	solver.callback_function = [](const CallbackInformation&) -> bool
+	{
+		throw std::runtime_error("Stop.");
+	};
+	EXPECT_THROW(solver.solve(f, &results), std::runtime_error);
+	EXPECT_TRUE(! f.gauss_newton_hessian);
+}
+
+TEST(Solver, memory_budget)
+{
+	std::vector<double> x(50);
+	Function f;
+	for (int i = 0; i < 50; i += 2) {
+		x[i]     = -1.2;
+		x[i + 1] =  1.0;
+		f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), &x[i]);
+	}
+
+	LBFGSSolver lbfgs;
+	lbfgs.log_function = nullptr;
+	auto lbfgs_usage = lbfgs.estimate_memory_usage(f);
+	EXPECT_EQ(lbfgs_usage.bytes["L-BFGS history"], 10 * (2 * 50 + 2) * sizeof(double));
+
+	// A dense Hessian is used for this size, unless it does not fit.
+	NewtonSolver newton;
+	newton.log_function = nullptr;
+	EXPECT_EQ(newton.estimate_memory_usage(f).bytes["Hessian"], 50 * 50 * sizeof(double));
+	newton.memory_budget = 50 * 50 * sizeof(double);
+	auto newton_usage = newton.estimate_memory_usage(f);
+	EXPECT_LT(newton_usage.bytes["Hessian"], 50 * 50 * sizeof(double));
+
+	SolverResults results;
+	newton.solve(f, &results);
+	EXPECT_TRUE(results.exit_success());
+	for (auto xi: x) {
+		EXPECT_LT(std::fabs(xi - 1.0), 1e-9);
+	}
+	EXPECT_LE(newton.estimate_memory_usage(f).total(), newton_usage.total());
+
+	// The history is shortened to fit.
+	for (int i = 0; i < 50; i += 2) {
+		x[i]     = -1.2;
+		x[i + 1] =  1.0;
+	}
+	lbfgs.memory_budget = lbfgs_usage.total() - lbfgs_usage.bytes["L-BFGS history"] / 2;
+	lbfgs.maximum_iterations = 1000;
+	lbfgs.solve(f, &results);
+	EXPECT_TRUE(results.exit_success());
+	for (auto xi: x) {
+		EXPECT_LT(std::fabs(xi - 1.0), 1e-6);
+	}
+
+	// Checking the longer histories does not leave the function
+	// with a single thread.
+	for (int i = 0; i < 50; i += 2) {
+		x[i]     = -1.2;
+		x[i + 1] =  1.0;
+	}
+	f.set_number_of_threads(4);
+	lbfgs_usage = lbfgs.estimate_memory_usage(f);
+	lbfgs.memory_budget = lbfgs_usage.total() - lbfgs_usage.bytes["L-BFGS history"] / 2;
+	lbfgs.solve(f, &results);
+	EXPECT_TRUE(results.exit_success());
+	EXPECT_GT(f.estimate_memory_usage(Function::NO_HESSIAN).bytes["Thread gradients"],
+	          lbfgs_usage.bytes["Thread gradients"] / 4);
+
+	// The function is only fitted to the budget while solving.
+	for (int i = 0; i < 50; i += 2) {
+		x[i]     = -1.2;
+		x[i + 1] =  1.0;
+	}
+	auto function_usage = f.estimate_memory_usage(Function::DENSE_HESSIAN);
+	newton.memory_budget = 1;
+	newton.solve(f, &results);
+	EXPECT_TRUE(results.exit_success());
+	EXPECT_EQ(f.estimate_memory_usage(Function::DENSE_HESSIAN).total(), function_usage.total());
+}
+
+TEST(Solver, solve_components)
+{
+	std::vector<double> x(20);
+	Function f;
+	for (int i = 0; i < 20; i += 2) {
+		x[i]     = -1.2 - i;
+		x[i + 1] =  1.0;
+		f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), &x[i]);
+	}
+
+	NewtonSolver newton;
+	newton.log_function = nullptr;
+	LBFGSSolver lbfgs;
+	lbfgs.log_function = nullptr;
+	lbfgs.maximum_iterations = 1000;
+
+	for (const Solver* solver: std::initializer_list<const Solver*>{&newton, &lbfgs}) {
+		for (int i = 0; i < 20; i += 2) {
+			x[i]     = -1.2 - i;
+			x[i + 1] =  1.0;
+		}
+
+		SolverResults results;
+		std::vector<SolverResults> component_results;
+		solver->solve_components(f, &results, &component_results);
+		EXPECT_TRUE(results.exit_success());
+		ASSERT_EQ(component_results.size(), 10);
+		for (const auto& component: component_results) {
+			EXPECT_TRUE(component.exit_success());
+		}
+		for (auto xi: x) {
+			EXPECT_LT(std::fabs(xi - 1.0), 1e-6);
+		}
+	}
+}
+
 TEST(Solver, NELDER_MEAD)
 {
 	NelderMeadSolver solver;
@@ -601,6 +914,59 @@ TEST(Solver, BoxConstraint)
 	EXPECT_NEAR(x[1], -0.5, 1e-4);
 }
 
+TEST(Solver, NewtonBoxConstraint)
+{
+	double x[2] = {1, 1};
+	Function function;
+	double a[2] = {0.0, -0.5};
+	double b[2] = {6.0, 10.0};
+	function.add_variable_with_change<Box>(x, 2, 2, a, b);
+	function.add_term(
+		std::make_shared<AutoDiffTerm<Quadratic2, 2>>(),
+		x);
+
+	NewtonSolver solver;
+	solver.log_function = nullptr;
+	SolverResults results;
+	solver.solve(function, &results);
+
+	EXPECT_NEAR(x[0],  2.0, 1e-4);
+	EXPECT_NEAR(x[1], -0.5, 1e-4);
+}
+
+struct RosenbrockPair
+{
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		R d0 =  y[0] - x[0]*x[0];
+		R d1 =  1 - x[0];
+		return 100 * d0*d0 + d1*d1;
+	}
+};
+
+TEST(Solver, NewtonFiniteDifferences)
+{
+	// The chained Rosenbrock function.
+	std::vector<double> x(200, 0.8);
+	Function function;
+	for (int i = 0; i + 1 < x.size(); ++i) {
+		function.add_term(std::make_shared<AutoDiffTerm<RosenbrockPair, 1, 1>>(), &x[i], &x[i + 1]);
+	}
+	function.set_finite_difference_derivatives(true);
+
+	NewtonSolver solver;
+	solver.log_function = nullptr;
+	solver.sparsity_mode = NewtonSolver::SPARSE;
+	SolverResults results;
+	solver.solve(function, &results);
+
+	EXPECT_TRUE(results.exit_success());
+	for (auto value: x) {
+		EXPECT_NEAR(value, 1.0, 1e-6);
+	}
+}
+
 template<typename SolverClass>
 void test_constant_variables()
 {
@@ -686,6 +1052,16 @@ TEST(LBFGSSolver, constant_variables)
 	test_constant_variables<LBFGSSolver>();
 }
 
+TEST(NewtonCGSolver, constant_variables)
+{
+	test_constant_variables<NewtonCGSolver>();
+}
+
+TEST(LevenbergMarquardtSolver, constant_variables)
+{
+	test_constant_variables<LevenbergMarquardtSolver>();
+}
+
 template<typename SolverClass>
 void test_callback_function()
 {
@@ -717,6 +1093,16 @@ TEST(LBFGSSolver, callback_function)
 	test_callback_function<LBFGSSolver>();
 }
 
+TEST(NewtonCGSolver, callback_function)
+{
+	test_callback_function<NewtonCGSolver>();
+}
+
+TEST(LevenbergMarquardtSolver, callback_function)
+{
+	test_callback_function<LevenbergMarquardtSolver>();
+}
+
 TEST(NelderMeadSolver, callback_function)
 {
 	test_callback_function<NelderMeadSolver>();
@@ -744,6 +1130,16 @@ TEST(LBFGSSolver, empty_function_crash_bug)
 	test_empty_function_crash_bug<LBFGSSolver>();
 }
 
+TEST(NewtonCGSolver, empty_function_crash_bug)
+{
+	test_empty_function_crash_bug<NewtonCGSolver>();
+}
+
+TEST(LevenbergMarquardtSolver, empty_function_crash_bug)
+{
+	test_empty_function_crash_bug<LevenbergMarquardtSolver>();
+}
+
 TEST(NelderMeadSolver, empty_function_crash_bug)
 {
 	test_empty_function_crash_bug<NelderMeadSolver>();
@@ -280,6 +280,70 @@ TEST_CASE("AutoDiffTerm/MyFunctor2", "")
 	CHECK(Approx(hessian[0][1](0,0)) == 1.4);
 }
 
+// MyFunctor2 with single precision.
+class MyFunctor2Float
+	: public MyFunctor2
+{
+public:
+	static const bool single_precision = true;
+};
+
+TEST_CASE("AutoDiffTerm/MyFunctor2_single_precision", "")
+{
+	AutoDiffTerm<MyFunctor2, 1, 1> double_term;
+	CHECK( ! double_term.has_single_precision());
+
+	AutoDiffTerm<MyFunctor2Float, 1, 1> term;
+	CHECK(term.has_single_precision());
+
+	float x = 5.3f;
+	float y = 7.1f;
+	std::vector<float*> variables;
+	variables.push_back(&x);
+	variables.push_back(&y);
+
+	std::vector<Eigen::VectorXf> gradient;
+	gradient.push_back(Eigen::VectorXf(1));
+	gradient.push_back(Eigen::VectorXf(1));
+
+	double value  = term.evaluate_float(&variables[0], &gradient);
+	double value2 = term.evaluate_float(&variables[0]);
+	CHECK(Approx(value) == value2);
+
+	// Approx uses a tolerance suitable for single precision.
+	CHECK(Approx(value) == sin(x) + cos(y) + 1.4*x*y + 1.0);
+	CHECK(Approx(gradient[0](0)) ==  cos(x) + 1.4*y);
+	CHECK(Approx(gradient[1](0)) == -sin(y) + 1.4*x);
+}
+
+// Does not compile with float.
+class DoubleOnlyFunctor
+{
+public:
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		static_assert( ! std::is_same<R, float>::value, "DoubleOnlyFunctor: no float.");
+		return x[0] * x[0];
+	}
+};
+
+TEST_CASE("AutoDiffTerm/DoubleOnlyFunctor_single_precision", "")
+{
+	AutoDiffTerm<DoubleOnlyFunctor, 1> term;
+	CHECK( ! term.has_single_precision());
+
+	float x = 2.0f;
+	float* variables[1] = {&x};
+	std::vector<Eigen::VectorXf> gradient(1, Eigen::VectorXf(1));
+	CHECK_THROWS(term.evaluate_float(variables));
+	CHECK_THROWS(term.evaluate_float(variables, &gradient));
+
+	double xd = 2.0;
+	double* variables_double[1] = {&xd};
+	CHECK(term.evaluate(variables_double) == 4.0);
+}
+
 class MyFunctor3
 {
 public:
@@ -722,8 +786,294 @@ TEST_CASE("AutoDiffTerm/MyFunctor_1_1_1_2_2_4_4", "")
 	CHECK(gradient[6][2] == 8);
 	CHECK(gradient[6][3] == 9);
 
-	std::vector< std::vector<Eigen::MatrixXd>> empty_hessians;
-	CHECK_THROWS(term.evaluate(variables.data(), &gradient, &empty_hessians));
+	std::vector< std::vector<Eigen::MatrixXd>> hessian(7);
+	for (int i = 0; i < 7; ++i) {
+		for (int j = 0; j < 7; ++j) {
+			hessian[i].emplace_back(gradient[i].size(), gradient[j].size());
+		}
+	}
+	auto value3 = term.evaluate(variables.data(), &gradient, &hessian);
+	CHECK(value3 == f(x1, x2, x3, x4, x5, x6, x7));
+	CHECK(gradient[4][1] == 6);
+	CHECK(gradient[6][3] == 9);
+	for (int i = 0; i < 7; ++i) {
+		for (int j = 0; j < 7; ++j) {
+			CHECK(hessian[i][j].isZero());
+		}
+	}
+}
+
+class MyFunctor_1_2_1_1_2
+{
+public:
+	template<typename R>
+	R operator()(
+		const R* const x1,
+		const R* const x2,
+		const R* const x3,
+		const R* const x4,
+		const R* const x5) const
+	{
+		return x1[0] * x2[1] * x5[0] + sin(x3[0] * x4[0]) + x2[0] * x2[0] * x5[1];
+	}
+};
+
+// Tests the Hessian with more than four variables.
+TEST_CASE("AutoDiffTerm/MyFunctor_1_2_1_1_2", "")
+{
+	AutoDiffTerm<MyFunctor_1_2_1_1_2, 1, 2, 1, 1, 2> term;
+
+	double x1[1] = {1.5};
+	double x2[2] = {0.3, 2.0};
+	double x3[1] = {0.7};
+	double x4[1] = {1.1};
+	double x5[2] = {-0.4, 3.0};
+	std::vector<double*> variables = {x1, x2, x3, x4, x5};
+
+	std::vector<Eigen::VectorXd> gradient(5);
+	std::vector< std::vector<Eigen::MatrixXd>> hessian(5);
+	for (int i = 0; i < 5; ++i) {
+		gradient[i].resize(term.variable_dimension(i));
+	}
+	for (int i = 0; i < 5; ++i) {
+		for (int j = 0; j < 5; ++j) {
+			hessian[i].emplace_back(gradient[i].size(), gradient[j].size());
+		}
+	}
+
+	MyFunctor_1_2_1_1_2 f;
+	double value = term.evaluate(variables.data(), &gradient, &hessian);
+	CHECK(Approx(value) == f(x1, x2, x3, x4, x5));
+
+	CHECK(Approx(gradient[0][0]) == x2[1] * x5[0]);
+	CHECK(Approx(gradient[1][0]) == 2 * x2[0] * x5[1]);
+	CHECK(Approx(gradient[2][0]) == x4[0] * cos(x3[0] * x4[0]));
+	CHECK(Approx(gradient[4][1]) == x2[0] * x2[0]);
+
+	CHECK(Approx(hessian[0][1](0, 1)) == x5[0]);
+	CHECK(Approx(hessian[1][0](1, 0)) == x5[0]);
+	CHECK(Approx(hessian[0][4](0, 0)) == x2[1]);
+	CHECK(Approx(hessian[4][1](0, 1)) == x1[0]);
+	CHECK(Approx(hessian[1][1](0, 0)) == 2 * x5[1]);
+	CHECK(Approx(hessian[1][4](0, 1)) == 2 * x2[0]);
+	CHECK(Approx(hessian[2][2](0, 0)) == -x4[0] * x4[0] * sin(x3[0] * x4[0]));
+	CHECK(Approx(hessian[2][3](0, 0)) ==
+	      cos(x3[0] * x4[0]) - x3[0] * x4[0] * sin(x3[0] * x4[0]));
+	CHECK(hessian[0][0](0, 0) == 0);
+	CHECK(hessian[4][4].isZero());
+}
+
+class SumOfProducts
+{
+public:
+	static const bool single_precision = true;
+
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		R sum = 0;
+		for (int i = 0; i < 30; ++i) {
+			sum += x[i] * y[i] * y[i] + exp(x[i] / 10.0);
+		}
+		return sum;
+	}
+};
+
+// Terms with many variables use reverse mode for the gradient.
+TEST_CASE("AutoDiffTerm/reverse_mode_gradient")
+{
+	static_assert(60 > reverse_mode_dimension, "Term needs to use reverse mode.");
+	AutoDiffTerm<SumOfProducts, 30, 30> term;
+
+	double x[30], y[30];
+	float xf[30], yf[30];
+	for (int i = 0; i < 30; ++i) {
+		xf[i] = x[i] = i / 10.0;
+		yf[i] = y[i] = 2.0 - i / 7.0;
+	}
+	std::vector<double*> variables = {x, y};
+	std::vector<float*> variables_float = {xf, yf};
+
+	std::vector<Eigen::VectorXd> gradient(2, Eigen::VectorXd::Zero(30));
+	std::vector<Eigen::VectorXf> gradient_float(2, Eigen::VectorXf::Zero(30));
+	double value = term.evaluate(variables.data(), &gradient);
+	double value_float = term.evaluate_float(variables_float.data(), &gradient_float);
+	CHECK(Approx(value) == term.evaluate(variables.data()));
+	CHECK(Approx(value_float) == value);
+
+	for (int i = 0; i < 30; ++i) {
+		CHECK(Approx(gradient[0][i]) == y[i] * y[i] + std::exp(x[i] / 10.0) / 10.0);
+		CHECK(Approx(gradient[1][i]) == 2 * x[i] * y[i]);
+		CHECK(Approx(gradient_float[0][i]) == gradient[0][i]);
+		CHECK(Approx(gradient_float[1][i]) == gradient[1][i]);
+	}
+}
+
+// Every intermediate number depends on a few neighbouring variables.
+struct ChainOfProducts
+{
+	template<typename R>
+	R operator()(const R* x, const R* y) const
+	{
+		R value = 0;
+		for (int i = 0; i < 11; ++i) {
+			R r = x[i] * y[i] - x[i + 1];
+			value += r * r + sin(x[i]) * exp(y[i + 1] / 10.0);
+		}
+		return value;
+	}
+};
+
+// Almost every intermediate number depends on all variables.
+struct CoupledSines
+{
+	template<typename R>
+	R operator()(const R* x, const R* y) const
+	{
+		R sum = 0;
+		for (int i = 0; i < 12; ++i) {
+			sum += x[i] * y[i];
+		}
+		R value = 0;
+		for (int k = 0; k < 36; ++k) {
+			value += sin(sum * x[k % 12]) * y[(7 * k) % 12];
+		}
+		return value;
+	}
+};
+
+template<typename Functor>
+void check_sparse_mode(bool sparse)
+{
+	static_assert(24 >= sparse_mode_dimension, "Term needs to be probed.");
+	AutoDiffTerm<Functor, 12, 12> term;
+
+	double x[12], y[12];
+	for (int i = 0; i < 12; ++i) {
+		x[i] = i / 10.0;
+		y[i] = 2.0 - i / 7.0;
+	}
+	std::vector<double*> variables = {x, y};
+	CHECK((probe_functor_sparsity<Functor, 12, 12>(Functor(), variables.data()) == sparse));
+
+	std::vector<Eigen::VectorXd> gradient(2, Eigen::VectorXd(12));
+	std::vector<std::vector<Eigen::MatrixXd>> hessian(2, std::vector<Eigen::MatrixXd>(2, Eigen::MatrixXd(12, 12)));
+	auto gradient_dense = gradient;
+	auto hessian_dense = hessian;
+
+	double value = evaluate_functor_hessian<Functor, 12, 12>(Functor(), variables.data(), &gradient_dense, &hessian_dense);
+	CHECK(Approx(term.evaluate(variables.data(), &gradient, &hessian)) == value);
+	for (int var0 = 0; var0 < 2; ++var0) {
+		CHECK((gradient[var0] - gradient_dense[var0]).norm() < 1e-12 * gradient_dense[var0].norm());
+		for (int var1 = 0; var1 < 2; ++var1) {
+			const auto& reference = hessian_dense[var0][var1];
+			CHECK((hessian[var0][var1] - reference).norm() < 1e-12 * (1 + reference.norm()));
+		}
+	}
+}
+
+TEST_CASE("AutoDiffTerm/sparse_mode")
+{
+	check_sparse_mode<ChainOfProducts>(true);
+	check_sparse_mode<CoupledSines>(false);
+}
+
+TEST_CASE("AutoDiffTerm/hessian_vector")
+{
+	AutoDiffTerm<ChainOfProducts, 12, 12> term;
+
+	double x[12], y[12], dx[12], dy[12];
+	for (int i = 0; i < 12; ++i) {
+		x[i] = i / 10.0;
+		y[i] = 2.0 - i / 7.0;
+		dx[i] = std::sin(i + 1.0);
+		dy[i] = std::cos(i + 1.0);
+	}
+	std::vector<double*> variables = {x, y};
+	std::vector<const double*> direction = {dx, dy};
+	Eigen::VectorXd v(24);
+	v << Eigen::Map<Eigen::VectorXd>(dx, 12), Eigen::Map<Eigen::VectorXd>(dy, 12);
+
+	std::vector<Eigen::VectorXd> gradient(2, Eigen::VectorXd(12));
+	std::vector<std::vector<Eigen::MatrixXd>> hessian(2, std::vector<Eigen::MatrixXd>(2, Eigen::MatrixXd(12, 12)));
+	double value = term.evaluate(variables.data(), &gradient, &hessian);
+	Eigen::MatrixXd full_hessian(24, 24);
+	full_hessian << hessian[0][0], hessian[0][1], hessian[1][0], hessian[1][1];
+	Eigen::VectorXd reference = full_hessian * v;
+
+	// The vectors may be longer than the variables.
+	std::vector<Eigen::VectorXd> g(2, Eigen::VectorXd::Zero(15));
+	std::vector<Eigen::VectorXd> hv(2, Eigen::VectorXd::Zero(15));
+	CHECK(Approx(term.evaluate_hessian_vector(variables.data(), direction.data(), &g, &hv)) == value);
+	for (int var = 0; var < 2; ++var) {
+		CHECK((g[var].head(12) - gradient[var]).norm() < 1e-12 * gradient[var].norm());
+		CHECK((hv[var].head(12) - reference.segment(12 * var, 12)).norm() < 1e-12 * reference.norm());
+	}
+
+	// The default implementation forms the Hessian.
+	CHECK(Approx(term.Term::evaluate_hessian_vector(variables.data(), direction.data(), &g, &hv)) == value);
+	for (int var = 0; var < 2; ++var) {
+		CHECK((hv[var].head(12) - reference.segment(12 * var, 12)).norm() < 1e-12 * reference.norm());
+	}
+}
+
+// Terms with many variables use forward over reverse mode for
+// Hessian-vector products.
+class CoupledProducts
+{
+public:
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		R sum = 0;
+		for (int i = 0; i < 30; ++i) {
+			sum += x[i] * y[i] * y[i] + exp(x[i] / 10.0) - sin(x[(i + 1) % 30] * y[i]);
+			sum += 1.0 / (2.0 + x[i] * x[i]) + sqrt(4.0 + y[i] * y[i]) * 0.5;
+		}
+		return sum;
+	}
+};
+
+TEST_CASE("AutoDiffTerm/hessian_vector_reverse_mode")
+{
+	static_assert(60 > reverse_mode_dimension, "Term needs to use reverse mode.");
+	AutoDiffTerm<CoupledProducts, 30, 30> term;
+
+	double x[30], y[30], dx[30], dy[30];
+	for (int i = 0; i < 30; ++i) {
+		x[i] = i / 10.0;
+		y[i] = 2.0 - i / 7.0;
+		dx[i] = std::sin(i + 1.0);
+		dy[i] = std::cos(i + 1.0);
+	}
+	std::vector<double*> variables = {x, y};
+	std::vector<const double*> direction = {dx, dy};
+	Eigen::VectorXd v(60);
+	v << Eigen::Map<Eigen::VectorXd>(dx, 30), Eigen::Map<Eigen::VectorXd>(dy, 30);
+
+	std::vector<Eigen::VectorXd> gradient(2, Eigen::VectorXd(30));
+	std::vector<std::vector<Eigen::MatrixXd>> hessian(2, std::vector<Eigen::MatrixXd>(2, Eigen::MatrixXd(30, 30)));
+	double value = term.evaluate(variables.data(), &gradient, &hessian);
+	Eigen::MatrixXd full_hessian(60, 60);
+	full_hessian << hessian[0][0], hessian[0][1], hessian[1][0], hessian[1][1];
+	Eigen::VectorXd reference = full_hessian * v;
+
+	std::vector<Eigen::VectorXd> g(2, Eigen::VectorXd::Zero(30));
+	std::vector<Eigen::VectorXd> hv(2, Eigen::VectorXd::Zero(30));
+	CHECK(Approx(term.evaluate_hessian_vector(variables.data(), direction.data(), &g, &hv)) == value);
+	for (int var = 0; var < 2; ++var) {
+		CHECK((g[var] - gradient[var]).norm() < 1e-12 * gradient[var].norm());
+		CHECK((hv[var] - reference.segment(30 * var, 30)).norm() < 1e-12 * reference.norm());
+	}
+
+	// Same result as forward over forward mode.
+	std::vector<Eigen::VectorXd> hv_forward(2, Eigen::VectorXd::Zero(30));
+	evaluate_functor_hessian_vector<CoupledProducts, 30, 30>(CoupledProducts(), variables.data(),
+	                                                         direction.data(), &g, &hv_forward,
+	                                                         std::false_type());
+	for (int var = 0; var < 2; ++var) {
+		CHECK((hv[var] - hv_forward[var]).norm() < 1e-12 * hv_forward[var].norm());
+	}
 }
 
 struct DetectCopyFunctor
@@ -0,0 +1,302 @@
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+
+#include <spii/auto_diff_term.h>
+#include <spii/traced_term.h>
+
+using namespace spii;
+
+class ManyFunctions
+{
+public:
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		R a = x[0];
+		R b = x[1];
+		R c = y[0];
+		R value = sqrt(a) * exp(b) - log(a + b) / log10(a * 3.0);
+		value += sin(a) * cos(b) + tan(b / 5.0) * c;
+		value += asin(b / 3.0) + acos(a / 4.0) + atan(a - c);
+		value += sinh(c) - cosh(a) * tanh(a * b);
+		value += pow(a, 3.0) + pow(2.0, b) + pow(a, c) * 0.5;
+		value += atan2(a, c) + abs(b - 2.0 * a) + c * c;
+		value -= 2.0 / a - (1.0 - b);
+		return value * -c;
+	}
+};
+
+TEST_CASE("Trace/matches_auto_diff_term")
+{
+	AutoDiffTerm<ManyFunctions, 2, 1> auto_diff_term;
+	TracedTerm<ManyFunctions, 2, 1> traced_term;
+	CHECK(!traced_term.get_trace());
+
+	double x[2] = {1.3, 0.7};
+	double y[1] = {0.4};
+	double* variables[2] = {x, y};
+
+	std::vector<Eigen::VectorXd> gradient1 = {Eigen::VectorXd::Zero(2), Eigen::VectorXd::Zero(1)};
+	std::vector<Eigen::VectorXd> gradient2 = gradient1;
+	std::vector<std::vector<Eigen::MatrixXd>> hessian1(2);
+	for (int var0 = 0; var0 < 2; ++var0) {
+		for (int var1 = 0; var1 < 2; ++var1) {
+			hessian1[var0].push_back(Eigen::MatrixXd::Zero(2 - var0, 2 - var1));
+		}
+	}
+	auto hessian2 = hessian1;
+
+	for (int iteration = 0; iteration < 2; ++iteration) {
+		double value = auto_diff_term.evaluate(variables, &gradient1, &hessian1);
+		CHECK(Approx(traced_term.evaluate(variables)) == value);
+		CHECK(Approx(traced_term.evaluate(variables, &gradient2)) == value);
+		REQUIRE(traced_term.get_trace());
+		for (int var = 0; var < 2; ++var) {
+			CHECK((gradient1[var] - gradient2[var]).norm() < 1e-10);
+		}
+
+		for (auto& g : gradient2) {
+			g.setZero();
+		}
+		CHECK(Approx(traced_term.evaluate(variables, &gradient2, &hessian2)) == value);
+		for (int var0 = 0; var0 < 2; ++var0) {
+			CHECK((gradient1[var0] - gradient2[var0]).norm() < 1e-10);
+			for (int var1 = 0; var1 < 2; ++var1) {
+				CHECK((hessian1[var0][var1] - hessian2[var0][var1]).norm() < 1e-10);
+			}
+		}
+
+		// The trace is replayed at a different point.
+		x[0] = 1.1;
+		y[0] = -0.2;
+	}
+}
+
+class Repeated
+{
+public:
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		R unused = exp(x[0]) * 17.0;
+		R a = sin(x[0] * x[1]);
+		R b = sin(x[1] * x[0]);
+		R one = cos(R(2.0)) * cos(R(2.0)) + sin(R(2.0)) * sin(R(2.0));
+		return (a + b) * one + R(0.0) * unused;
+	}
+};
+
+TEST_CASE("Trace/simplification")
+{
+	Trace trace(2);
+	Traced x[2] = {Traced(1.5, &trace, 0), Traced(2.0, &trace, 1)};
+	Traced f = Repeated()(x);
+	trace.finish(f.trace_index());
+
+	// x0, x1, x0 * x1, sin, +, 0, * and the constant 1 (which is not
+	// necessarily exactly 1). exp(x0) * 17 is removed, but 0 * unused
+	// is kept, since unused could be infinite.
+	CHECK(trace.size() <= 11);
+	for (const auto& operation : trace.get_operations()) {
+		CHECK(operation.opcode != Trace::Cos);
+	}
+
+	double xd[2] = {1.5, 2.0};
+	double value;
+	double gradient[2];
+	REQUIRE(trace.gradient(xd, &value, gradient));
+	CHECK(Approx(value) == Repeated()(xd));
+	CHECK(Approx(gradient[0]) == 2 * 2.0 * std::cos(3.0));
+	CHECK(Approx(gradient[1]) == 2 * 1.5 * std::cos(3.0));
+}
+
+class Branching
+{
+public:
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		if (x[0] > 0.0) {
+			return x[0] * x[0];
+		}
+		else {
+			return -x[0] * x[0] * x[0];
+		}
+	}
+};
+
+TEST_CASE("Trace/branch_guards")
+{
+	TracedTerm<Branching, 1> term;
+	double x = 2.0;
+	double* variables[1] = {&x};
+	std::vector<Eigen::VectorXd> gradient = {Eigen::VectorXd::Zero(1)};
+
+	CHECK(term.evaluate(variables, &gradient) == 4.0);
+	CHECK(gradient[0](0) == 4.0);
+	auto positive_trace = term.get_trace();
+	REQUIRE(positive_trace);
+	CHECK(positive_trace->get_guards().size() == 1);
+
+	x = 3.0;
+	CHECK(term.evaluate(variables, &gradient) == 9.0);
+	CHECK(gradient[0](0) == 6.0);
+	CHECK(term.get_trace() == positive_trace);
+
+	// The guard fails and the functor is traced again.
+	x = -1.0;
+	CHECK(term.evaluate(variables, &gradient) == 1.0);
+	CHECK(gradient[0](0) == -3.0);
+	CHECK(term.get_trace() != positive_trace);
+
+	std::vector<std::vector<Eigen::MatrixXd>> hessian = {{Eigen::MatrixXd::Zero(1, 1)}};
+	x = -2.0;
+	CHECK(term.evaluate(variables, &gradient, &hessian) == 8.0);
+	CHECK(gradient[0](0) == -12.0);
+	CHECK(hessian[0][0](0, 0) == 12.0);
+}
+
+class Scaled
+{
+public:
+	Scaled(double scale_)
+		: scale(scale_)
+	{ }
+
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		return SPII_PARAMETER(R, scale) * x[0] * x[1];
+	}
+
+private:
+	double scale;
+};
+
+TEST_CASE("Trace/parameters")
+{
+	TracedTerm<Scaled, 2> traced_term(3.0);
+	double x[2] = {2.0, 5.0};
+	double* variables[1] = {x};
+	std::vector<Eigen::VectorXd> gradient = {Eigen::VectorXd::Zero(2)};
+	CHECK(traced_term.evaluate(variables, &gradient) == 30.0);
+	CHECK(gradient[0](0) == 15.0);
+	CHECK(gradient[0](1) == 6.0);
+
+	auto trace = traced_term.get_trace();
+	REQUIRE(trace);
+	REQUIRE(trace->number_of_parameters() == 1);
+	CHECK(trace->get_parameter_names()[0] == "scale");
+	CHECK(trace->get_parameter_values()[0] == 3.0);
+	CHECK(trace->get_operations()[2].opcode == Trace::Parameter);
+}
+
+class Offset
+{
+public:
+	Offset(double offset_)
+		: offset(offset_)
+	{ }
+
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		return x[0] * x[1] - offset;
+	}
+
+private:
+	double offset;
+};
+
+TEST_CASE("Trace/shared_per_type")
+{
+	TracedTerm<Scaled, 2> term1(2.0);
+	TracedTerm<Scaled, 2> term2(7.0);
+	double x[2] = {2.0, 5.0};
+	double* variables[1] = {x};
+	std::vector<Eigen::VectorXd> gradient = {Eigen::VectorXd::Zero(2)};
+
+	CHECK(term1.evaluate(variables, &gradient) == 20.0);
+	CHECK(gradient[0](0) == 10.0);
+	CHECK(term2.evaluate(variables, &gradient) == 70.0);
+	CHECK(gradient[0](0) == 35.0);
+	CHECK(gradient[0](1) == 14.0);
+	REQUIRE(term1.get_trace());
+	CHECK(term1.get_trace() == term2.get_trace());
+
+	std::vector<Eigen::VectorXd> direction_vectors = {Eigen::VectorXd::Ones(2)};
+	const double* direction[1] = {direction_vectors[0].data()};
+	std::vector<Eigen::VectorXd> hessian_vector = {Eigen::VectorXd::Zero(2)};
+	CHECK(term1.evaluate_hessian_vector(variables, direction, &gradient, &hessian_vector) == 20.0);
+	CHECK(hessian_vector[0](0) == 2.0);
+	CHECK(term2.evaluate_hessian_vector(variables, direction, &gradient, &hessian_vector) == 70.0);
+	CHECK(hessian_vector[0](0) == 7.0);
+
+	// Members not converted with SPII_PARAMETER are constants, so
+	// these terms need traces of their own.
+	TracedTerm<Offset, 2> offset1(1.0);
+	TracedTerm<Offset, 2> offset2(3.0);
+	CHECK(offset1.evaluate(variables, &gradient) == 9.0);
+	CHECK(offset2.evaluate(variables, &gradient) == 7.0);
+	REQUIRE(offset1.get_trace());
+	CHECK(offset1.get_trace() != offset2.get_trace());
+}
+
+TEST_CASE("Trace/differentiate")
+{
+	ManyFunctions functor;
+	double x[3] = {1.3, 0.7, 0.4};
+
+	Trace trace(3);
+	trace.finish(record_functor<2, 1>(&trace, functor, x));
+	double value, gradient[3];
+	REQUIRE(trace.gradient(x, &value, gradient));
+
+	// Each partial derivative is recorded and then evaluated.
+	for (int i = 0; i < 3; ++i) {
+		Trace derivative_trace(3);
+		int f = record_functor<2, 1>(&derivative_trace, functor, x);
+		derivative_trace.finish(derivative_trace.differentiate(f)[i]);
+		double derivative;
+		REQUIRE(derivative_trace.evaluate(x, &derivative));
+		CHECK(Approx(derivative) == gradient[i]);
+	}
+}
+
+TEST_CASE("Trace/hessian_vector")
+{
+	AutoDiffTerm<ManyFunctions, 2, 1> auto_diff_term;
+	TracedTerm<ManyFunctions, 2, 1> traced_term;
+
+	double x[2] = {1.3, 0.7};
+	double y[1] = {0.4};
+	double* variables[2] = {x, y};
+	const double dx[2] = {0.5, -1.0};
+	const double dy[1] = {2.0};
+	const double* direction[2] = {dx, dy};
+
+	std::vector<Eigen::VectorXd> gradient1 = {Eigen::VectorXd::Zero(2), Eigen::VectorXd::Zero(1)};
+	std::vector<Eigen::VectorXd> gradient2 = gradient1;
+	std::vector<Eigen::VectorXd> hessian_vector1 = gradient1;
+	std::vector<Eigen::VectorXd> hessian_vector2 = gradient1;
+
+	// The term without a trace and with a recorded trace.
+	for (int iteration = 0; iteration < 2; ++iteration) {
+		double value = auto_diff_term.Term::evaluate_hessian_vector(variables, direction,
+		                                                            &gradient1, &hessian_vector1);
+		CHECK(Approx(auto_diff_term.evaluate_hessian_vector(variables, direction,
+		                                                    &gradient2, &hessian_vector2)) == value);
+		for (int var = 0; var < 2; ++var) {
+			CHECK((gradient1[var] - gradient2[var]).norm() < 1e-10);
+			CHECK((hessian_vector1[var] - hessian_vector2[var]).norm() < 1e-10);
+		}
+
+		CHECK(Approx(traced_term.evaluate_hessian_vector(variables, direction,
+		                                                 &gradient2, &hessian_vector2)) == value);
+		REQUIRE(traced_term.get_trace());
+		for (int var = 0; var < 2; ++var) {
+			CHECK((gradient1[var] - gradient2[var]).norm() < 1e-10);
+			CHECK((hessian_vector1[var] - hessian_vector2[var]).norm() < 1e-10);
+		}
+	}
+}